@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "unity.h"
+
+#include "adv_parse.h"
+
+#define TEST_REPORTS                10000
+/* Replays of the trace per timing, so a run lasts long enough to measure. */
+#define TEST_REPLAYS                50
+/* Legacy advertising data */
+#define TEST_LEGACY_MAX             31
+/* Room for the few extended reports in the trace */
+#define TEST_ADV_MAX                64
+
+/* The lock service UUID, in advertising data order. */
+static const uint8_t lock_uuid[16] = {
+    0xe3, 0x1d, 0x5a, 0x25, 0x83, 0x41, 0x52, 0x86,
+    0xde, 0xef, 0x8f, 0x46, 0x00, 0x6f, 0x37, 0x1c,
+};
+
+struct test_report {
+    uint8_t len;
+    bool is_lock;
+    uint8_t data[TEST_ADV_MAX];
+};
+
+enum test_kind {
+    TEST_KIND_LOCK,
+    /* A phone or wearable: 16-bit UUIDs, a name, TX power */
+    TEST_KIND_PHONE,
+    TEST_KIND_BEACON,
+    /* Another vendor's service in a complete 128-bit list */
+    TEST_KIND_FOREIGN_UUID128,
+    /* The lock service after another UUID in an incomplete list, in an
+     * extended report
+     */
+    TEST_KIND_LOCK_LISTED_LATE,
+    /* The lock service behind the zero length that ends the data */
+    TEST_KIND_AFTER_END,
+    /* A structure running past the end of the report */
+    TEST_KIND_TRUNCATED,
+    TEST_KIND_COUNT,
+};
+
+static struct test_report trace[TEST_REPORTS];
+static uint32_t kind_counts[TEST_KIND_COUNT];
+static uint32_t rng;
+
+static uint32_t
+test_rand(uint32_t n)
+{
+    rng = rng * 1103515245 + 12345;
+    return (rng >> 16) % n;
+}
+
+static void
+put(struct test_report *r, uint8_t type, const uint8_t *val, uint8_t len)
+{
+    r->data[r->len++] = len + 1;
+    r->data[r->len++] = type;
+    memcpy(&r->data[r->len], val, len);
+    r->len += len;
+}
+
+static void
+put_random(struct test_report *r, uint8_t type, uint8_t len)
+{
+    uint8_t val[TEST_ADV_MAX];
+
+    for (int i = 0; i < len; i++) {
+        val[i] = test_rand(256);
+    }
+    put(r, type, val, len);
+}
+
+static void
+put_flags(struct test_report *r)
+{
+    static const uint8_t flags = 0x06;
+
+    put(r, ADV_TYPE_FLAGS, &flags, 1);
+}
+
+static void
+trace_build(void)
+{
+    static const uint8_t uuid16s[] = { 0x0f, 0x18, 0x0a, 0x18, 0x0d, 0x18 };
+    static const uint8_t tx_power = 0x04;
+    uint8_t val[TEST_ADV_MAX];
+
+    rng = 1;
+    memset(kind_counts, 0, sizeof(kind_counts));
+
+    for (int i = 0; i < TEST_REPORTS; i++) {
+        struct test_report *r = &trace[i];
+        /* Roughly one report in ten is from a lock. */
+        enum test_kind kind = test_rand(10) == 0 ? TEST_KIND_LOCK :
+                              1 + test_rand(TEST_KIND_COUNT - 1);
+
+        memset(r, 0, sizeof(*r));
+        kind_counts[kind]++;
+
+        switch (kind) {
+        case TEST_KIND_LOCK:
+            put_flags(r);
+            put(r, ADV_TYPE_UUID128_ALL, lock_uuid, 16);
+            /* Company ID 0xffff, then the signed status */
+            val[0] = 0xff;
+            val[1] = 0xff;
+            val[2] = 0x10;
+            for (int j = 3; j < 8; j++) {
+                val[j] = test_rand(256);
+            }
+            put(r, ADV_TYPE_MFG_DATA, val, 8);
+            r->is_lock = true;
+            break;
+
+        case TEST_KIND_PHONE:
+            put_flags(r);
+            put(r, 0x03, uuid16s, 2 * (1 + test_rand(3)));
+            put(r, 0x0a, &tx_power, 1);
+            put_random(r, ADV_TYPE_NAME_COMPLETE, 4 + test_rand(8));
+            break;
+
+        case TEST_KIND_BEACON:
+            put_flags(r);
+            /* Apple, iBeacon, 16-byte UUID, major, minor, power */
+            val[0] = 0x4c;
+            val[1] = 0x00;
+            val[2] = 0x02;
+            val[3] = 0x15;
+            for (int j = 4; j < 25; j++) {
+                val[j] = test_rand(256);
+            }
+            put(r, ADV_TYPE_MFG_DATA, val, 25);
+            break;
+
+        case TEST_KIND_FOREIGN_UUID128:
+            put_flags(r);
+            put_random(r, ADV_TYPE_UUID128_ALL, 16);
+            put_random(r, ADV_TYPE_MFG_DATA, 2 + test_rand(7));
+            break;
+
+        case TEST_KIND_LOCK_LISTED_LATE:
+            put_flags(r);
+            for (int j = 0; j < 16; j++) {
+                val[j] = test_rand(256);
+            }
+            memcpy(&val[16], lock_uuid, 16);
+            put(r, ADV_TYPE_UUID128_SOME, val, 32);
+            put_random(r, ADV_TYPE_NAME_COMPLETE, 4 + test_rand(8));
+            r->is_lock = true;
+            break;
+
+        case TEST_KIND_AFTER_END:
+            put_flags(r);
+            r->data[r->len++] = 0;
+            put(r, ADV_TYPE_UUID128_ALL, lock_uuid, 16);
+            break;
+
+        case TEST_KIND_TRUNCATED:
+            put_flags(r);
+            put_random(r, ADV_TYPE_NAME_COMPLETE, 6);
+            /* Claims more bytes than the report has left */
+            r->data[r->len++] = TEST_LEGACY_MAX;
+            r->data[r->len++] = ADV_TYPE_UUID128_ALL;
+            memcpy(&r->data[r->len], lock_uuid, TEST_LEGACY_MAX - r->len);
+            r->len = TEST_LEGACY_MAX;
+            break;
+
+        default:
+            break;
+        }
+
+        TEST_ASSERT_TRUE(r->len <= (kind == TEST_KIND_LOCK_LISTED_LATE ?
+                                    TEST_ADV_MAX : TEST_LEGACY_MAX));
+    }
+}
+
+/*
+ * What the report path did before adv_parse.h, in the manner of
+ * ble_hs_adv_parse_fields(): every structure is decoded and copied into a
+ * fields struct, malformed data rejects the report, and only then is the
+ * UUID looked for.
+ */
+struct test_fields {
+    uint8_t flags;
+    uint16_t uuids16[8];
+    uint8_t num_uuids16;
+    uint8_t uuids128[2][16];
+    uint8_t num_uuids128;
+    bool uuids128_is_complete;
+    uint8_t name[TEST_ADV_MAX];
+    uint8_t name_len;
+    int8_t tx_pwr_lvl;
+    uint8_t mfg_data[TEST_ADV_MAX];
+    uint8_t mfg_data_len;
+};
+
+static bool
+reference_is_lock(const uint8_t *data, uint8_t len)
+{
+    struct test_fields fields;
+    uint8_t off = 0;
+
+    memset(&fields, 0, sizeof(fields));
+
+    while (off < len) {
+        uint8_t field_len = data[off];
+        const uint8_t *val = &data[off + 2];
+        uint8_t val_len;
+
+        if (field_len == 0) {
+            break;
+        }
+        if (off + 1 + field_len > len) {
+            return false;
+        }
+        val_len = field_len - 1;
+
+        switch (data[off + 1]) {
+        case ADV_TYPE_FLAGS:
+            fields.flags = val[0];
+            break;
+        case 0x02:
+        case 0x03:
+            for (int i = 0; i + 2 <= val_len && fields.num_uuids16 < 8; i += 2) {
+                fields.uuids16[fields.num_uuids16++] = val[i] | val[i + 1] << 8;
+            }
+            break;
+        case ADV_TYPE_UUID128_SOME:
+        case ADV_TYPE_UUID128_ALL:
+            if (val_len % 16 != 0) {
+                return false;
+            }
+            for (int i = 0; i < val_len && fields.num_uuids128 < 2; i += 16) {
+                memcpy(fields.uuids128[fields.num_uuids128++], &val[i], 16);
+            }
+            fields.uuids128_is_complete = data[off + 1] == ADV_TYPE_UUID128_ALL;
+            break;
+        case ADV_TYPE_NAME_COMPLETE:
+            memcpy(fields.name, val, val_len);
+            fields.name_len = val_len;
+            break;
+        case 0x0a:
+            fields.tx_pwr_lvl = (int8_t)val[0];
+            break;
+        case ADV_TYPE_MFG_DATA:
+            memcpy(fields.mfg_data, val, val_len);
+            fields.mfg_data_len = val_len;
+            break;
+        default:
+            break;
+        }
+
+        off += field_len + 1;
+    }
+
+    for (int i = 0; i < fields.num_uuids128; i++) {
+        if (memcmp(fields.uuids128[i], lock_uuid, 16) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Replays the trace, returns the nanoseconds per report. */
+static double
+replay(bool (*is_lock)(const uint8_t *data, uint8_t len), uint32_t *matched)
+{
+    int64_t start;
+    uint32_t count = 0;
+
+    start = now_ns();
+    for (int n = 0; n < TEST_REPLAYS; n++) {
+        for (int i = 0; i < TEST_REPORTS; i++) {
+            count += is_lock(trace[i].data, trace[i].len);
+        }
+    }
+    *matched = count / TEST_REPLAYS;
+
+    return (double)(now_ns() - start) / ((double)TEST_REPLAYS * TEST_REPORTS);
+}
+
+static bool
+iter_is_lock(const uint8_t *data, uint8_t len)
+{
+    return adv_has_uuid128(data, len, lock_uuid);
+}
+
+void
+setUp(void)
+{
+    trace_build();
+}
+
+void
+tearDown(void)
+{
+}
+
+static void
+test_every_report_classified(void)
+{
+    char msg[64];
+
+    for (int i = 0; i < TEST_REPORTS; i++) {
+        snprintf(msg, sizeof(msg), "report %d", i);
+        TEST_ASSERT_EQUAL_MESSAGE(trace[i].is_lock,
+                                  adv_has_uuid128(trace[i].data, trace[i].len, lock_uuid), msg);
+        TEST_ASSERT_EQUAL_MESSAGE(trace[i].is_lock,
+                                  reference_is_lock(trace[i].data, trace[i].len), msg);
+    }
+
+    /* Every kind of report made it into the trace. */
+    for (int kind = 0; kind < TEST_KIND_COUNT; kind++) {
+        TEST_ASSERT_TRUE(kind_counts[kind] > 0);
+    }
+}
+
+static void
+test_malformed_data_stops_the_walk(void)
+{
+    struct adv_iter it;
+    struct adv_field field;
+    int fields = 0;
+
+    for (int i = 0; i < TEST_REPORTS; i++) {
+        adv_iter_init(&it, trace[i].data, trace[i].len);
+        while (adv_iter_next(&it, &field)) {
+            TEST_ASSERT_TRUE(field.val + field.len <= trace[i].data + trace[i].len);
+            fields++;
+        }
+        TEST_ASSERT_TRUE(it.off <= trace[i].len);
+    }
+
+    TEST_ASSERT_TRUE(fields > TEST_REPORTS);
+}
+
+static void
+test_replay_benchmark(void)
+{
+    uint32_t locks = kind_counts[TEST_KIND_LOCK] + kind_counts[TEST_KIND_LOCK_LISTED_LATE];
+    uint32_t iter_matched;
+    uint32_t ref_matched;
+    double iter_ns;
+    double ref_ns;
+
+    /* Warm the caches before either timing. */
+    replay(iter_is_lock, &iter_matched);
+
+    ref_ns = replay(reference_is_lock, &ref_matched);
+    iter_ns = replay(iter_is_lock, &iter_matched);
+
+    printf("%d reports, %lu from locks, %d replays\n", TEST_REPORTS,
+           (unsigned long)locks, TEST_REPLAYS);
+    printf("  decode all fields: %6.1f ns/report\n", ref_ns);
+    printf("  adv_parse.h:       %6.1f ns/report (%.1fx)\n", iter_ns, ref_ns / iter_ns);
+
+    TEST_ASSERT_EQUAL_UINT32(locks, iter_matched);
+    TEST_ASSERT_EQUAL_UINT32(locks, ref_matched);
+}
+
+void
+app_main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_every_report_classified);
+    RUN_TEST(test_malformed_data_stops_the_walk);
+    RUN_TEST(test_replay_benchmark);
+    exit(UNITY_END());
+}
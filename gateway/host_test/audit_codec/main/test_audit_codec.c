@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unity.h"
+
+#include "audit_codec.h"
+
+/* What audit_uplink.c seals a batch at. */
+#define TEST_BATCH_MAX              64
+#define TEST_FRAME_SIZE             (AUDIT_CODEC_HDR_MAX + TEST_BATCH_MAX * AUDIT_CODEC_EVENT_MAX)
+
+#define TEST_TRACE_EVENTS           100000
+/* One record in the lock's audit log. */
+#define TEST_RECORD_LEN             8
+
+static uint8_t buf[TEST_FRAME_SIZE];
+static uint32_t rng;
+
+static uint32_t
+test_rand(uint32_t n)
+{
+    rng = rng * 1103515245 + 12345;
+    return (rng >> 16) % n;
+}
+
+static size_t
+encode(const struct audit_event *events, uint32_t count, const uint8_t **frame)
+{
+    struct audit_encoder enc;
+
+    audit_encoder_init(&enc, buf, sizeof(buf));
+    for (uint32_t i = 0; i < count; i++) {
+        TEST_ASSERT_EQUAL(0, audit_encoder_add(&enc, &events[i]));
+    }
+
+    return audit_encoder_finish(&enc, frame);
+}
+
+static void
+assert_round_trip(const struct audit_event *events, uint32_t count)
+{
+    struct audit_decoder dec;
+    struct audit_event event;
+    const uint8_t *frame;
+    size_t len;
+
+    len = encode(events, count, &frame);
+
+    TEST_ASSERT_EQUAL(0, audit_decoder_init(&dec, frame, len));
+    TEST_ASSERT_EQUAL_UINT32(count, dec.count);
+
+    for (uint32_t i = 0; i < count; i++) {
+        TEST_ASSERT_EQUAL(1, audit_decoder_next(&dec, &event));
+        TEST_ASSERT_EQUAL_UINT32(events[i].seq, event.seq);
+        TEST_ASSERT_EQUAL_UINT32(events[i].ts, event.ts);
+        TEST_ASSERT_EQUAL_UINT16(events[i].user, event.user);
+        TEST_ASSERT_EQUAL_UINT8(events[i].source, event.source);
+        TEST_ASSERT_EQUAL_UINT8(events[i].result, event.result);
+    }
+    TEST_ASSERT_EQUAL(0, audit_decoder_next(&dec, &event));
+}
+
+void
+setUp(void)
+{
+    rng = 1;
+}
+
+void
+tearDown(void)
+{
+}
+
+static void
+test_empty_batch(void)
+{
+    assert_round_trip(NULL, 0);
+}
+
+static void
+test_edge_values(void)
+{
+    static const struct audit_event events[] = {
+        { .seq = UINT32_MAX - 1, .ts = UINT32_MAX, .user = 0xffff, .source = 0xff },
+        /* seq and ts wrap around */
+        { .seq = UINT32_MAX, .ts = 0, .user = 0, .result = 0xff },
+        { .seq = 0, .ts = 0x7fffffff, .user = 0xfffe },
+        /* A gap in seq, and the clock set back */
+        { .seq = 1000000, .ts = 5, .user = 1 },
+        { .seq = 1000001, .ts = 5 },
+    };
+
+    assert_round_trip(events, sizeof(events) / sizeof(events[0]));
+}
+
+static void
+test_malformed_frames(void)
+{
+    static const struct audit_event events[] = {
+        { .seq = 7, .ts = 1700000000, .user = 3, .source = 1 },
+        { .seq = 8, .ts = 1700000060, .user = 0xffff, .source = 2 },
+    };
+    struct audit_decoder dec;
+    struct audit_event event;
+    const uint8_t *frame;
+    uint8_t copy[TEST_FRAME_SIZE + 1];
+    size_t len;
+    int rc;
+
+    len = encode(events, 2, &frame);
+    memcpy(copy, frame, len);
+
+    /* Cut anywhere, the frame is refused before or at the cut. */
+    for (size_t cut = 0; cut < len; cut++) {
+        rc = audit_decoder_init(&dec, copy, cut);
+        while (rc == 0 || rc == 1) {
+            rc = audit_decoder_next(&dec, &event);
+            TEST_ASSERT_TRUE_MESSAGE(rc != 0, "truncated frame ended cleanly");
+        }
+    }
+
+    /* A byte after the last event */
+    copy[len] = 0;
+    TEST_ASSERT_EQUAL(0, audit_decoder_init(&dec, copy, len + 1));
+    TEST_ASSERT_EQUAL(1, audit_decoder_next(&dec, &event));
+    TEST_ASSERT_EQUAL(1, audit_decoder_next(&dec, &event));
+    TEST_ASSERT_EQUAL(-1, audit_decoder_next(&dec, &event));
+
+    /* Another version */
+    copy[0] = AUDIT_CODEC_VERSION + 1;
+    TEST_ASSERT_EQUAL(-1, audit_decoder_init(&dec, copy, len));
+
+    /* A varint running past 32 bits */
+    memset(copy, 0xff, sizeof(copy));
+    copy[0] = AUDIT_CODEC_VERSION;
+    TEST_ASSERT_EQUAL(-1, audit_decoder_init(&dec, copy, sizeof(copy)));
+}
+
+/*
+ * A synthetic lock trace: events seconds to ten minutes apart, most by a
+ * known user, now and then a record the lock lost.  Batched the way the
+ * uplink does it, every frame must decode back to its events, and the
+ * frames must come out well under the lock's 8-byte records.
+ */
+static void
+test_trace_ratio(void)
+{
+    static struct audit_event events[TEST_BATCH_MAX];
+    uint32_t seq = 1;
+    uint32_t ts = 1700000000;
+    size_t frame_bytes = 0;
+    uint32_t frames = 0;
+    uint32_t done = 0;
+
+    while (done < TEST_TRACE_EVENTS) {
+        uint32_t count = TEST_TRACE_EVENTS - done < TEST_BATCH_MAX ?
+                         TEST_TRACE_EVENTS - done : TEST_BATCH_MAX;
+        const uint8_t *frame;
+
+        for (uint32_t i = 0; i < count; i++) {
+            seq += test_rand(100) == 0 ? 2 : 1;
+            ts += test_rand(600);
+            events[i].seq = seq;
+            events[i].ts = ts;
+            events[i].user = test_rand(5) != 0 ? test_rand(20) : 0xffff;
+            events[i].source = 1 + test_rand(4);
+            events[i].result = test_rand(3);
+        }
+
+        assert_round_trip(events, count);
+        frame_bytes += encode(events, count, &frame);
+        frames++;
+        done += count;
+    }
+
+    printf("%u events in %lu frames, %lu bytes: %.2f bytes per event against %d\n",
+           TEST_TRACE_EVENTS, (unsigned long)frames, (unsigned long)frame_bytes,
+           (double)frame_bytes / TEST_TRACE_EVENTS, TEST_RECORD_LEN);
+
+    TEST_ASSERT_EQUAL_UINT32((TEST_TRACE_EVENTS + TEST_BATCH_MAX - 1) / TEST_BATCH_MAX, frames);
+    /* At least a fifth smaller than the records themselves */
+    TEST_ASSERT_LESS_THAN_UINT32(TEST_TRACE_EVENTS * TEST_RECORD_LEN * 4 / 5, frame_bytes);
+}
+
+void
+app_main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_empty_batch);
+    RUN_TEST(test_edge_values);
+    RUN_TEST(test_malformed_frames);
+    RUN_TEST(test_trace_ratio);
+    exit(UNITY_END());
+}
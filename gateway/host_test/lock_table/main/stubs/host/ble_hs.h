@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The parts of the NimBLE host API lock_table.c uses.  The connection limit
+ * is raised past the 9 links of the ESP32 controller so the table is tested
+ * at the 16 locks it is meant to scale to.
+ */
+
+#define MYNEWT_VAL(name)                MYNEWT_VAL_ ## name
+#define MYNEWT_VAL_BLE_MAX_CONNECTIONS  16
+
+#define BLE_HS_CONN_HANDLE_NONE         0xffff
+
+#define BLE_ADDR_PUBLIC                 0x00
+#define BLE_ADDR_RANDOM                 0x01
+
+typedef struct {
+    uint8_t type;
+    uint8_t val[6];
+} ble_addr_t;
+
+static inline int
+ble_addr_cmp(const ble_addr_t *a, const ble_addr_t *b)
+{
+    int type_diff = a->type - b->type;
+
+    if (type_diff != 0) {
+        return type_diff;
+    }
+
+    return memcmp(a->val, b->val, sizeof(a->val));
+}
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unity.h"
+
+#include "lock_table.h"
+
+#define TEST_LOCKS                  16
+
+/* Every lock has the same GATT layout, so the handles repeat across links. */
+#define TEST_STATE_VAL_HANDLE       0x0012
+#define TEST_STATE_CCCD_HANDLE      0x0013
+#define TEST_CMD_VAL_HANDLE         0x0015
+
+int64_t stub_now_us;
+
+static ble_addr_t
+test_addr(int lock)
+{
+    ble_addr_t addr = {
+        .type = BLE_ADDR_RANDOM,
+        .val = { lock, 0x00, 0x5a, 0x1c, 0x37, 0xc0 },
+    };
+
+    return addr;
+}
+
+static uint16_t
+test_conn(int lock, int link)
+{
+    return 1 + lock + link * TEST_LOCKS;
+}
+
+/*
+ * What the gateway does for a lock from the connect decision to a resolved
+ * lock service: the scan callback's connection count check, the attach on
+ * BLE_GAP_EVENT_LINK_ESTAB, then the handles from discovery or the cache.
+ */
+static struct lock_entry *
+test_connect(int lock, int link)
+{
+    ble_addr_t addr = test_addr(lock);
+    uint16_t conn = test_conn(lock, link);
+    struct lock_entry *entry;
+
+    if (lock_table_connected_count() >= LOCK_TABLE_SIZE) {
+        return NULL;
+    }
+
+    entry = lock_table_attach(&addr, conn);
+    if (entry != NULL) {
+        lock_table_set_handles(conn, TEST_STATE_VAL_HANDLE, TEST_STATE_CCCD_HANDLE,
+                               TEST_CMD_VAL_HANDLE);
+    }
+
+    return entry;
+}
+
+static void
+test_connect_all(void)
+{
+    for (int i = 0; i < TEST_LOCKS; i++) {
+        TEST_ASSERT_NOT_NULL(test_connect(i, 0));
+    }
+}
+
+void
+setUp(void)
+{
+    stub_now_us = 1000000;
+    lock_table_init();
+}
+
+void
+tearDown(void)
+{
+}
+
+static void
+test_sixteen_locks_connect(void)
+{
+    struct lock_entry *entries[TEST_LOCKS];
+    ble_addr_t extra = test_addr(TEST_LOCKS);
+    char id[LOCK_ID_STR_SIZE];
+
+    TEST_ASSERT_EQUAL(TEST_LOCKS, LOCK_TABLE_SIZE);
+
+    for (int i = 0; i < TEST_LOCKS; i++) {
+        ble_addr_t addr = test_addr(i);
+
+        entries[i] = test_connect(i, 0);
+        TEST_ASSERT_NOT_NULL(entries[i]);
+        TEST_ASSERT_EQUAL(i + 1, lock_table_connected_count());
+
+        for (int j = 0; j < i; j++) {
+            TEST_ASSERT_TRUE(entries[i] != entries[j]);
+        }
+
+        snprintf(id, sizeof(id), "c0371c5a00%02x", i);
+        TEST_ASSERT_EQUAL_STRING(id, entries[i]->id);
+        TEST_ASSERT_EQUAL_PTR(entries[i], lock_table_find_conn(test_conn(i, 0)));
+        TEST_ASSERT_EQUAL_PTR(entries[i], lock_table_find_addr(&addr));
+        TEST_ASSERT_EQUAL_PTR(entries[i], lock_table_find_id(id, LOCK_ID_LEN));
+    }
+
+    /* A seventeenth lock is not even tried while every link is in use. */
+    TEST_ASSERT_NULL(test_connect(TEST_LOCKS, 0));
+
+    /* Nor can it take a slot from a connected lock. */
+    TEST_ASSERT_NULL(lock_table_attach(&extra, test_conn(TEST_LOCKS, 0)));
+    TEST_ASSERT_NULL(lock_table_find_addr(&extra));
+    TEST_ASSERT_EQUAL(TEST_LOCKS, lock_table_connected_count());
+}
+
+static void
+test_state_follows_the_link(void)
+{
+    struct lock_entry snapshot;
+
+    test_connect_all();
+
+    for (int i = 0; i < TEST_LOCKS; i++) {
+        stub_now_us += 1000;
+        TEST_ASSERT_TRUE(lock_table_store_state(test_conn(i, 0), TEST_STATE_VAL_HANDLE, i & 1));
+    }
+
+    /* Another characteristic, or a link no lock is on */
+    TEST_ASSERT_FALSE(lock_table_store_state(test_conn(3, 0), TEST_CMD_VAL_HANDLE, 1));
+    TEST_ASSERT_FALSE(lock_table_store_state(test_conn(3, 1), TEST_STATE_VAL_HANDLE, 1));
+
+    for (int i = 0; i < TEST_LOCKS; i++) {
+        struct lock_entry *entry = lock_table_find_conn(test_conn(i, 0));
+
+        TEST_ASSERT_TRUE(lock_table_snapshot(entry->id, LOCK_ID_LEN, &snapshot));
+        TEST_ASSERT_TRUE(snapshot.state_valid);
+        TEST_ASSERT_EQUAL_UINT8(i & 1, snapshot.state);
+        TEST_ASSERT_EQUAL(1000000 + (i + 1) * 1000, snapshot.state_updated_us);
+        TEST_ASSERT_EQUAL_UINT16(test_conn(i, 0), snapshot.conn_handle);
+    }
+}
+
+static void
+test_reconnect_keeps_the_slot(void)
+{
+    struct lock_entry *entry;
+    struct lock_entry snapshot;
+    ble_addr_t addr = test_addr(5);
+
+    test_connect_all();
+    entry = lock_table_find_addr(&addr);
+    lock_table_store_state(test_conn(5, 0), TEST_STATE_VAL_HANDLE, 1);
+
+    lock_table_detach(test_conn(5, 0));
+    TEST_ASSERT_EQUAL(TEST_LOCKS - 1, lock_table_connected_count());
+    TEST_ASSERT_NULL(lock_table_find_conn(test_conn(5, 0)));
+
+    /* The last known state stays readable while the lock is away. */
+    TEST_ASSERT_TRUE(lock_table_snapshot(entry->id, LOCK_ID_LEN, &snapshot));
+    TEST_ASSERT_EQUAL_UINT16(BLE_HS_CONN_HANDLE_NONE, snapshot.conn_handle);
+    TEST_ASSERT_TRUE(snapshot.state_valid);
+
+    /* Back on another link: same slot, state kept, handles resolved again. */
+    lock_table_attach(&addr, test_conn(5, 1));
+    TEST_ASSERT_EQUAL_PTR(entry, lock_table_find_conn(test_conn(5, 1)));
+    TEST_ASSERT_EQUAL_UINT16(0, entry->state_val_handle);
+    TEST_ASSERT_TRUE(entry->state_valid);
+    TEST_ASSERT_EQUAL_UINT8(1, entry->state);
+    TEST_ASSERT_EQUAL(TEST_LOCKS, lock_table_connected_count());
+}
+
+static void
+test_new_lock_takes_a_disconnected_slot(void)
+{
+    ble_addr_t gone = test_addr(9);
+    ble_addr_t extra = test_addr(TEST_LOCKS);
+    struct lock_entry *entry;
+
+    test_connect_all();
+    entry = lock_table_find_addr(&gone);
+    lock_table_detach(test_conn(9, 0));
+
+    TEST_ASSERT_EQUAL_PTR(entry, test_connect(TEST_LOCKS, 0));
+    TEST_ASSERT_NULL(lock_table_find_addr(&gone));
+    TEST_ASSERT_EQUAL_PTR(entry, lock_table_find_addr(&extra));
+    TEST_ASSERT_FALSE(entry->state_valid);
+    TEST_ASSERT_EQUAL(TEST_LOCKS, lock_table_connected_count());
+
+    /* Every link drops: all sixteen slots are kept for the reconnects. */
+    for (int i = 0; i <= TEST_LOCKS; i++) {
+        lock_table_detach(test_conn(i, 0));
+    }
+    TEST_ASSERT_EQUAL(0, lock_table_connected_count());
+    for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
+        TEST_ASSERT_NOT_NULL(lock_table_get(i));
+    }
+}
+
+void
+app_main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_sixteen_locks_connect);
+    RUN_TEST(test_state_follows_the_link);
+    RUN_TEST(test_reconnect_keeps_the_slot);
+    RUN_TEST(test_new_lock_takes_a_disconnected_slot);
+    exit(UNITY_END());
+}
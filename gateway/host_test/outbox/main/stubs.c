@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "mqtt_client.h"
+
+#include "stubs.h"
+
+/* Partition */
+
+uint8_t stub_flash[STUB_PARTITION_SIZE];
+uint32_t stub_flash_bad_writes;
+uint32_t stub_flash_erases;
+size_t stub_flash_tear_at;
+
+static const esp_partition_t stub_part = {
+    .size = STUB_PARTITION_SIZE,
+    .label = "outbox",
+};
+
+void
+stub_partition_reset(void)
+{
+    memset(stub_flash, 0xff, sizeof(stub_flash));
+    stub_flash_bad_writes = 0;
+    stub_flash_erases = 0;
+    stub_flash_tear_at = 0;
+}
+
+const esp_partition_t *
+stub_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                          const char *label)
+{
+    return strcmp(label, stub_part.label) == 0 ? &stub_part : NULL;
+}
+
+esp_err_t
+stub_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t size)
+{
+    if (offset + size > part->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    memcpy(dst, &stub_flash[offset], size);
+    return ESP_OK;
+}
+
+esp_err_t
+stub_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t size)
+{
+    const uint8_t *p = src;
+
+    if (offset + size > part->size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (stub_flash_tear_at != 0) {
+        size = stub_flash_tear_at < size ? stub_flash_tear_at : size;
+        stub_flash_tear_at = 0;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        if ((stub_flash[offset + i] & p[i]) != p[i]) {
+            stub_flash_bad_writes++;
+        }
+        stub_flash[offset + i] &= p[i];
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t
+stub_partition_erase_range(const esp_partition_t *part, size_t offset, size_t size)
+{
+    if (offset + size > part->size || offset % 4096 != 0 || size % 4096 != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    memset(&stub_flash[offset], 0xff, size);
+    stub_flash_erases += size / 4096;
+    return ESP_OK;
+}
+
+/* Timer */
+
+int64_t stub_now_us;
+
+int64_t
+stub_timer_get_time(void)
+{
+    return stub_now_us;
+}
+
+/* MQTT client */
+
+struct stub_publish stub_publishes[STUB_PUBLISH_MAX];
+size_t stub_publish_count;
+bool stub_mqtt_refuse;
+static int next_msg_id = 1;
+
+int
+stub_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+                         int len, int qos, int retain)
+{
+    struct stub_publish *p;
+
+    if (stub_mqtt_refuse || stub_publish_count == STUB_PUBLISH_MAX) {
+        return -1;
+    }
+
+    p = &stub_publishes[stub_publish_count++];
+    p->msg_id = next_msg_id++;
+    p->qos = qos;
+    p->len = len < (int)sizeof(p->payload) ? len : (int)sizeof(p->payload) - 1;
+    memcpy(p->payload, data, p->len);
+    p->payload[p->len] = '\0';
+    strncpy(p->topic, topic, sizeof(p->topic) - 1);
+    p->topic[sizeof(p->topic) - 1] = '\0';
+
+    return p->msg_id;
+}
+
+void
+stub_mqtt_reset(void)
+{
+    stub_publish_count = 0;
+    stub_mqtt_refuse = false;
+}
+
+/* Queues */
+
+struct stub_queue {
+    UBaseType_t len;
+    UBaseType_t item_size;
+    UBaseType_t first;
+    UBaseType_t count;
+    uint8_t items[];
+};
+
+QueueHandle_t
+stub_queue_create(UBaseType_t len, UBaseType_t item_size)
+{
+    struct stub_queue *q = calloc(1, sizeof(*q) + len * item_size);
+
+    if (q != NULL) {
+        q->len = len;
+        q->item_size = item_size;
+    }
+    return q;
+}
+
+BaseType_t
+stub_queue_send(QueueHandle_t q, const void *item, TickType_t wait)
+{
+    if (q->count == q->len) {
+        return pdFALSE;
+    }
+
+    memcpy(&q->items[((q->first + q->count) % q->len) * q->item_size], item, q->item_size);
+    q->count++;
+    return pdTRUE;
+}
+
+BaseType_t
+stub_queue_receive(QueueHandle_t q, void *item, TickType_t wait)
+{
+    if (q->count == 0) {
+        return pdFALSE;
+    }
+
+    memcpy(item, &q->items[q->first * q->item_size], q->item_size);
+    q->first = (q->first + 1) % q->len;
+    q->count--;
+    return pdTRUE;
+}
+
+/* Tasks */
+
+struct stub_task {
+    TaskFunction_t fn;
+};
+
+static struct stub_task outbox_task_stub;
+
+BaseType_t
+stub_task_create(TaskFunction_t fn, const char *name, uint32_t stack, void *param,
+                 UBaseType_t priority, TaskHandle_t *task)
+{
+    outbox_task_stub.fn = fn;
+    *task = &outbox_task_stub;
+    return pdPASS;
+}
+
+BaseType_t
+stub_task_notify_give(TaskHandle_t task)
+{
+    return pdPASS;
+}
+
+uint32_t
+stub_task_notify_take(BaseType_t clear, TickType_t wait)
+{
+    return 0;
+}
+
+/* Metrics */
+
+uint32_t stub_publish_ms[STUB_PUBLISH_MAX];
+size_t stub_publish_ms_count;
+
+void
+stub_metrics_reset(void)
+{
+    stub_publish_ms_count = 0;
+}
+
+void
+metrics_hist_observe(enum metric_id id, uint32_t ms)
+{
+    if (id == METRIC_MQTT_PUBLISH_MS && stub_publish_ms_count < STUB_PUBLISH_MAX) {
+        stub_publish_ms[stub_publish_ms_count++] = ms;
+    }
+}
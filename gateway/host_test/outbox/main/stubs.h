@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "metrics.h"
+
+/* Every message the outbox handed to the MQTT client, in order. */
+struct stub_publish {
+    int msg_id;
+    int qos;
+    int len;
+    char topic[64];
+    char payload[200];
+};
+
+#define STUB_PUBLISH_MAX            256
+
+extern struct stub_publish stub_publishes[STUB_PUBLISH_MAX];
+extern size_t stub_publish_count;
+/* Makes esp_mqtt_client_publish() fail, as it does while disconnected. */
+extern bool stub_mqtt_refuse;
+
+void stub_mqtt_reset(void);
+
+/* What the outbox timed, in METRIC_MQTT_PUBLISH_MS. */
+extern uint32_t stub_publish_ms[STUB_PUBLISH_MAX];
+extern size_t stub_publish_ms_count;
+
+void stub_metrics_reset(void);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+/*
+ * RAM-backed partition with NOR flash semantics: an erase sets every bit,
+ * a write can only clear them.
+ */
+
+#define STUB_PARTITION_SIZE         0x10000
+
+typedef enum {
+    ESP_PARTITION_TYPE_DATA = 0x01,
+} esp_partition_type_t;
+
+typedef enum {
+    ESP_PARTITION_SUBTYPE_ANY = 0xff,
+} esp_partition_subtype_t;
+
+typedef struct {
+    uint32_t size;
+    const char *label;
+} esp_partition_t;
+
+#define esp_partition_find_first    stub_partition_find_first
+#define esp_partition_read          stub_partition_read
+#define esp_partition_write         stub_partition_write
+#define esp_partition_erase_range   stub_partition_erase_range
+
+const esp_partition_t *stub_partition_find_first(esp_partition_type_t type,
+                                                 esp_partition_subtype_t subtype,
+                                                 const char *label);
+esp_err_t stub_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t size);
+esp_err_t stub_partition_write(const esp_partition_t *part, size_t offset, const void *src,
+                               size_t size);
+esp_err_t stub_partition_erase_range(const esp_partition_t *part, size_t offset, size_t size);
+
+/* Test controls. */
+extern uint8_t stub_flash[STUB_PARTITION_SIZE];
+/* Writes that would have needed an erase first. */
+extern uint32_t stub_flash_bad_writes;
+extern uint32_t stub_flash_erases;
+/* When non-zero, the next write stops after this many bytes, like a
+ * power cut would.
+ */
+extern size_t stub_flash_tear_at;
+
+void stub_partition_reset(void);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+#define esp_timer_get_time          stub_timer_get_time
+
+int64_t stub_timer_get_time(void);
+
+/* Test control: the clock only moves when a test says so. */
+extern int64_t stub_now_us;
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Single-threaded stand-ins for the FreeRTOS calls outbox.c makes.  Nothing
+ * runs in the background: the test calls the task's poll function itself.
+ */
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+
+#define pdTRUE                      1
+#define pdFALSE                     0
+#define pdPASS                      pdTRUE
+#define portMAX_DELAY               ((TickType_t)0xffffffffUL)
+#define pdMS_TO_TICKS(ms)           ((TickType_t)(ms))
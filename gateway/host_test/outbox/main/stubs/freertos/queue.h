@@ -0,0 +1,13 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct stub_queue *QueueHandle_t;
+
+#define xQueueCreate                stub_queue_create
+#define xQueueSend                  stub_queue_send
+#define xQueueReceive               stub_queue_receive
+
+QueueHandle_t stub_queue_create(UBaseType_t len, UBaseType_t item_size);
+BaseType_t stub_queue_send(QueueHandle_t queue, const void *item, TickType_t wait);
+BaseType_t stub_queue_receive(QueueHandle_t queue, void *item, TickType_t wait);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct stub_task *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+#define xTaskCreate                 stub_task_create
+#define xTaskNotifyGive             stub_task_notify_give
+#define ulTaskNotifyTake            stub_task_notify_take
+
+/* Records the task without starting it. */
+BaseType_t stub_task_create(TaskFunction_t fn, const char *name, uint32_t stack, void *param,
+                            UBaseType_t priority, TaskHandle_t *task);
+BaseType_t stub_task_notify_give(TaskHandle_t task);
+uint32_t stub_task_notify_take(BaseType_t clear, TickType_t wait);
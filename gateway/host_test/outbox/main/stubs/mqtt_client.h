@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Just what outbox.c uses of the esp-mqtt client. */
+
+typedef struct stub_mqtt_client *esp_mqtt_client_handle_t;
+
+typedef enum {
+    MQTT_EVENT_CONNECTED = 1,
+    MQTT_EVENT_DISCONNECTED,
+    MQTT_EVENT_PUBLISHED,
+    MQTT_EVENT_DATA,
+} esp_mqtt_event_id_t;
+
+typedef struct {
+    esp_mqtt_event_id_t event_id;
+    int msg_id;
+} esp_mqtt_event_t;
+
+typedef esp_mqtt_event_t *esp_mqtt_event_handle_t;
+
+#define esp_mqtt_client_publish     stub_mqtt_client_publish
+
+int stub_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic,
+                             const char *data, int len, int qos, int retain);
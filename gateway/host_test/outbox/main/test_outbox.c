@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "unity.h"
+
+/* Built in rather than linked, so the cases can reach the task's state and
+ * run it one pass at a time.
+ */
+#include "outbox.c"
+
+#include "stubs.h"
+
+#define TEST_TOPIC                  "/gateway/test/event"
+#define TEST_MSG_MAX                32768
+
+/*
+ * The broker.  A message counts as delivered once the broker acknowledged
+ * it; with QoS 1 the outbox has to keep it until then.
+ */
+static uint32_t published;
+static uint8_t delivered[TEST_MSG_MAX];
+static uint32_t delivered_count;
+static int32_t delivered_last;
+static uint32_t duplicates;
+static uint32_t lost;
+static uint32_t rng;
+
+static uint32_t
+test_rand(uint32_t n)
+{
+    rng = rng * 1103515245 + 12345;
+    return (rng >> 16) % n;
+}
+
+static void
+mqtt_event(esp_mqtt_event_id_t id, int msg_id)
+{
+    esp_mqtt_event_t event = {
+        .event_id = id,
+        .msg_id = msg_id,
+    };
+
+    outbox_on_mqtt_event(&event);
+}
+
+static void
+publish_one(void)
+{
+    char payload[16];
+    int len;
+
+    TEST_ASSERT_LESS_THAN(TEST_MSG_MAX, published);
+
+    len = snprintf(payload, sizeof(payload), "%lu", (unsigned long)published);
+    TEST_ASSERT_EQUAL(ESP_OK, outbox_publish(TEST_TOPIC, payload, len, 1));
+    published++;
+}
+
+/**
+ * Hands everything the client published since the last call to the broker
+ * and acknowledges it.
+ *
+ * @param link_lost The connection dropped first: none of it was
+ *                  acknowledged, so none of it counts as delivered.
+ */
+static void
+broker_run(bool link_lost)
+{
+    for (size_t i = 0; i < stub_publish_count; i++) {
+        const struct stub_publish *p = &stub_publishes[i];
+        uint32_t n = strtoul(p->payload, NULL, 10);
+
+        TEST_ASSERT_EQUAL_STRING(TEST_TOPIC, p->topic);
+
+        if (link_lost) {
+            lost++;
+            continue;
+        }
+
+        if (delivered[n]) {
+            duplicates++;
+        } else {
+            /* First deliveries keep the order they were published in. */
+            TEST_ASSERT_GREATER_THAN_INT32(delivered_last, (int32_t)n);
+            delivered_last = n;
+            delivered[n] = 1;
+            delivered_count++;
+        }
+
+        mqtt_event(MQTT_EVENT_PUBLISHED, p->msg_id);
+    }
+
+    stub_publish_count = 0;
+}
+
+/* One drain tick of the outbox task. */
+static void
+tick(void)
+{
+    stub_now_us += OUTBOX_DRAIN_INTERVAL_MS * 1000;
+    outbox_poll();
+}
+
+static void
+drain_all(void)
+{
+    for (int i = 0; i < 10000 && (stored != 0 || stub_publish_count != 0); i++) {
+        tick();
+        broker_run(false);
+    }
+    outbox_poll();
+
+    TEST_ASSERT_EQUAL_UINT32(0, stored);
+}
+
+static void
+assert_delivered(uint32_t from, uint32_t to)
+{
+    for (uint32_t n = from; n < to; n++) {
+        TEST_ASSERT_TRUE_MESSAGE(delivered[n], "message not delivered");
+    }
+}
+
+static void
+reboot(void)
+{
+    online = false;
+    inflight_first = 0;
+    inflight_count = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    TEST_ASSERT_EQUAL(ESP_OK, outbox_init());
+}
+
+void
+setUp(void)
+{
+    stub_partition_reset();
+    stub_mqtt_reset();
+    stub_metrics_reset();
+    stub_now_us = 0;
+
+    published = 0;
+    memset(delivered, 0, sizeof(delivered));
+    delivered_count = 0;
+    delivered_last = -1;
+    duplicates = 0;
+    lost = 0;
+    rng = 1;
+
+    reboot();
+}
+
+void
+tearDown(void)
+{
+    TEST_ASSERT_EQUAL_UINT32(0, stub_flash_bad_writes);
+}
+
+static void
+test_disconnect_cycles_lose_nothing(void)
+{
+    for (int cycle = 0; cycle < 1000; cycle++) {
+        mqtt_event(MQTT_EVENT_CONNECTED, 0);
+        outbox_poll();
+
+        /* Online: some traffic while the backlog drains, acks coming in
+         * late or not at all before the link drops again.
+         */
+        for (uint32_t steps = test_rand(60); steps > 0; steps--) {
+            if (test_rand(3) == 0) {
+                publish_one();
+            }
+            tick();
+            if (test_rand(4) != 0) {
+                broker_run(false);
+            }
+        }
+
+        broker_run(true);
+        stub_mqtt_refuse = true;
+        mqtt_event(MQTT_EVENT_DISCONNECTED, 0);
+        outbox_poll();
+
+        /* Offline: everything goes to flash. */
+        for (uint32_t n = test_rand(20); n > 0; n--) {
+            publish_one();
+            outbox_poll();
+        }
+        stub_mqtt_refuse = false;
+    }
+
+    mqtt_event(MQTT_EVENT_CONNECTED, 0);
+    drain_all();
+
+    printf("%lu messages, %lu resent, %lu lost in flight and sent again, %lu duplicates\n",
+           (unsigned long)published, (unsigned long)stats.resent, (unsigned long)lost,
+           (unsigned long)duplicates);
+
+    assert_delivered(0, published);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.dropped);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.corrupt);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.rejected);
+    TEST_ASSERT_GREATER_THAN_UINT32(0, lost);
+}
+
+static void
+test_reboot_recovers_pending(void)
+{
+    for (int i = 0; i < 40; i++) {
+        publish_one();
+        outbox_poll();
+    }
+
+    /* Ten get through before the power goes. */
+    mqtt_event(MQTT_EVENT_CONNECTED, 0);
+    while (delivered_count < 10) {
+        tick();
+        broker_run(false);
+    }
+    outbox_poll();
+    broker_run(true);
+    mqtt_event(MQTT_EVENT_DISCONNECTED, 0);
+    outbox_poll();
+    TEST_ASSERT_EQUAL_UINT32(30, stored);
+
+    /* And it goes in the middle of writing the next one. */
+    stub_flash_tear_at = 20;
+    publish_one();
+    outbox_poll();
+
+    reboot();
+    TEST_ASSERT_EQUAL_UINT32(31, stored);
+    TEST_ASSERT_EQUAL_UINT32(41, next_seq);
+
+    /* The torn message is skipped, those after it are not. */
+    publish_one();
+    outbox_poll();
+
+    mqtt_event(MQTT_EVENT_CONNECTED, 0);
+    drain_all();
+
+    TEST_ASSERT_EQUAL_UINT32(1, stats.corrupt);
+    assert_delivered(0, 40);
+    TEST_ASSERT_FALSE(delivered[40]);
+    assert_delivered(41, published);
+}
+
+static void
+test_reboot_before_puback_resends(void)
+{
+    /* Online and idle, so it goes out as soon as it is stored. */
+    mqtt_event(MQTT_EVENT_CONNECTED, 0);
+    outbox_poll();
+    publish_one();
+    outbox_poll();
+    TEST_ASSERT_EQUAL_UINT32(1, stub_publish_count);
+
+    /* The power goes before the PUBACK. */
+    broker_run(true);
+    reboot();
+    TEST_ASSERT_EQUAL_UINT32(1, stored);
+
+    mqtt_event(MQTT_EVENT_CONNECTED, 0);
+    drain_all();
+
+    assert_delivered(0, published);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.direct);
+}
+
+static void
+test_full_partition_wraps_by_sector(void)
+{
+    uint32_t extra = 2 * OUTBOX_SLOTS_PER_SECTOR + 8;
+
+    for (uint32_t i = 0; i < slot_count + extra; i++) {
+        publish_one();
+        outbox_poll();
+    }
+
+    /* Whole sectors of the oldest messages go, one per sector entered. */
+    TEST_ASSERT_EQUAL_UINT32(3 * OUTBOX_SLOTS_PER_SECTOR, stats.dropped);
+    TEST_ASSERT_EQUAL_UINT32(published - stats.dropped, stored);
+
+    reboot();
+    TEST_ASSERT_EQUAL_UINT32(published - 3 * OUTBOX_SLOTS_PER_SECTOR, stored);
+
+    mqtt_event(MQTT_EVENT_CONNECTED, 0);
+    drain_all();
+
+    TEST_ASSERT_EQUAL_UINT32(published - 3 * OUTBOX_SLOTS_PER_SECTOR, delivered_count);
+    assert_delivered(3 * OUTBOX_SLOTS_PER_SECTOR, published);
+    TEST_ASSERT_EQUAL_UINT32(0, duplicates);
+}
+
+static void
+test_ack_timeout_rewinds(void)
+{
+    for (int i = 0; i < 10; i++) {
+        publish_one();
+        outbox_poll();
+    }
+
+    mqtt_event(MQTT_EVENT_CONNECTED, 0);
+    for (int i = 0; i < 10; i++) {
+        tick();
+    }
+
+    /* The window is full and nothing was acknowledged. */
+    TEST_ASSERT_EQUAL_UINT32(OUTBOX_DRAIN_INFLIGHT, stub_publish_count);
+    TEST_ASSERT_EQUAL_UINT32(OUTBOX_DRAIN_INFLIGHT, inflight_count);
+    TEST_ASSERT_EQUAL_STRING("0", stub_publishes[0].payload);
+    stub_publish_count = 0;
+
+    stub_now_us += OUTBOX_ACK_TIMEOUT_MS * 1000;
+    outbox_poll();
+
+    TEST_ASSERT_EQUAL_UINT32(OUTBOX_DRAIN_INFLIGHT, stats.resent);
+    TEST_ASSERT_EQUAL_UINT32(1, stub_publish_count);
+    TEST_ASSERT_EQUAL_STRING("0", stub_publishes[0].payload);
+
+    drain_all();
+    assert_delivered(0, published);
+    TEST_ASSERT_EQUAL_UINT32(0, duplicates);
+}
+
+static void
+test_publish_timed_to_puback(void)
+{
+    mqtt_event(MQTT_EVENT_CONNECTED, 0);
+    for (int i = 0; i < 3; i++) {
+        publish_one();
+        outbox_poll();
+        stub_now_us += 40 * 1000;
+    }
+    TEST_ASSERT_EQUAL_UINT32(3, stub_publish_count);
+
+    /* Nothing is timed until the broker answers. */
+    TEST_ASSERT_EQUAL_UINT32(0, stub_publish_ms_count);
+
+    /* The PUBACKs arrive out of order; each is matched by its msg_id. */
+    mqtt_event(MQTT_EVENT_PUBLISHED, stub_publishes[1].msg_id);
+    outbox_poll();
+    stub_now_us += 100 * 1000;
+    mqtt_event(MQTT_EVENT_PUBLISHED, stub_publishes[0].msg_id);
+    mqtt_event(MQTT_EVENT_PUBLISHED, stub_publishes[2].msg_id);
+    /* One the outbox is no longer waiting for */
+    mqtt_event(MQTT_EVENT_PUBLISHED, stub_publishes[2].msg_id);
+    outbox_poll();
+
+    TEST_ASSERT_EQUAL_UINT32(3, stub_publish_ms_count);
+    TEST_ASSERT_EQUAL_UINT32(80, stub_publish_ms[0]);
+    TEST_ASSERT_EQUAL_UINT32(220, stub_publish_ms[1]);
+    TEST_ASSERT_EQUAL_UINT32(140, stub_publish_ms[2]);
+    TEST_ASSERT_EQUAL_UINT32(0, stored);
+}
+
+void
+app_main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_disconnect_cycles_lose_nothing);
+    RUN_TEST(test_reboot_recovers_pending);
+    RUN_TEST(test_reboot_before_puback_resends);
+    RUN_TEST(test_full_partition_wraps_by_sector);
+    RUN_TEST(test_ack_timeout_rewinds);
+    RUN_TEST(test_publish_timed_to_puback);
+    exit(UNITY_END());
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * In-place iterator over advertising data.
+ *
+ * Walks the length/type/value structures of an advertising or scan response
+ * payload without copying or decoding them, so a report can be rejected
+ * after looking at a few bytes.  Unlike ble_hs_adv_parse_fields() nothing
+ * is filled in for fields the caller does not ask about.
+ */
+
+/* AD types the gateway looks at. */
+#define ADV_TYPE_FLAGS              0x01
+#define ADV_TYPE_UUID128_SOME       0x06
+#define ADV_TYPE_UUID128_ALL        0x07
+#define ADV_TYPE_NAME_COMPLETE      0x09
+#define ADV_TYPE_MFG_DATA           0xff
+
+struct adv_iter {
+    const uint8_t *data;
+    uint16_t len;
+    uint16_t off;
+};
+
+struct adv_field {
+    uint8_t type;
+    uint8_t len;
+    const uint8_t *val;
+};
+
+static inline void
+adv_iter_init(struct adv_iter *it, const uint8_t *data, uint16_t len)
+{
+    it->data = data;
+    it->len = len;
+    it->off = 0;
+}
+
+/**
+ * Advances to the next structure.  The field points into the iterated data.
+ *
+ * @return false at the end of the significant part, or at a structure that
+ *         runs past the end of the data.
+ */
+static inline bool
+adv_iter_next(struct adv_iter *it, struct adv_field *field)
+{
+    uint16_t remaining = it->len - it->off;
+    uint8_t field_len;
+
+    if (it->off >= it->len || remaining < 2) {
+        return false;
+    }
+
+    /* A zero length ends the significant part of the data. */
+    field_len = it->data[it->off];
+    if (field_len == 0 || field_len > remaining - 1) {
+        return false;
+    }
+
+    field->type = it->data[it->off + 1];
+    field->len = field_len - 1;
+    field->val = &it->data[it->off + 2];
+    it->off += field_len + 1;
+
+    return true;
+}
+
+/**
+ * Looks for a 128-bit UUID, given in little-endian order as it appears in
+ * advertising data.  The walk stops at the first complete UUID list: a
+ * device that lists all its services without this one does not have it.
+ */
+static inline bool
+adv_has_uuid128(const uint8_t *data, uint16_t len, const uint8_t uuid[16])
+{
+    struct adv_iter it;
+    struct adv_field field;
+
+    adv_iter_init(&it, data, len);
+    while (adv_iter_next(&it, &field)) {
+        if (field.type != ADV_TYPE_UUID128_SOME && field.type != ADV_TYPE_UUID128_ALL) {
+            continue;
+        }
+
+        for (int i = 0; i + 16 <= field.len; i += 16) {
+            if (memcmp(&field.val[i], uuid, 16) == 0) {
+                return true;
+            }
+        }
+
+        if (field.type == ADV_TYPE_UUID128_ALL) {
+            return false;
+        }
+    }
+
+    return false;
+}
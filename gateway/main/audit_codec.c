@@ -0,0 +1,183 @@
+#include "audit_codec.h"
+
+static size_t
+varint_len(uint32_t value)
+{
+    size_t len = 1;
+
+    while (value >= 0x80) {
+        value >>= 7;
+        len++;
+    }
+
+    return len;
+}
+
+static size_t
+varint_put(uint8_t *out, uint32_t value)
+{
+    size_t len = 0;
+
+    while (value >= 0x80) {
+        out[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+
+    return len;
+}
+
+/* Reads at most five bytes; returns false past the end or on overflow. */
+static bool
+varint_get(struct audit_decoder *dec, uint32_t *value)
+{
+    uint32_t result = 0;
+
+    for (int shift = 0; shift < 35; shift += 7) {
+        uint8_t byte;
+
+        if (dec->pos == dec->len) {
+            return false;
+        }
+        byte = dec->frame[dec->pos++];
+
+        if (shift == 28 && byte > 0x0f) {
+            return false;
+        }
+        result |= (uint32_t)(byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static uint32_t
+zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t
+unzigzag(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+void
+audit_encoder_init(struct audit_encoder *enc, uint8_t *buf, size_t size)
+{
+    enc->buf = buf;
+    enc->size = size;
+    enc->len = AUDIT_CODEC_HDR_MAX;
+    enc->count = 0;
+}
+
+int
+audit_encoder_add(struct audit_encoder *enc, const struct audit_event *event)
+{
+    uint32_t seq_gap = 0;
+    uint32_t ts_delta = 0;
+    uint8_t *out;
+
+    if (enc->len + AUDIT_CODEC_EVENT_MAX > enc->size) {
+        return -1;
+    }
+
+    if (enc->count == 0) {
+        enc->first = *event;
+    } else {
+        seq_gap = event->seq - enc->prev.seq - 1;
+        ts_delta = zigzag((int32_t)(event->ts - enc->prev.ts));
+    }
+
+    out = enc->buf + enc->len;
+    out += varint_put(out, seq_gap);
+    out += varint_put(out, ts_delta);
+    out += varint_put(out, (uint16_t)(event->user + 1));
+    *out++ = event->source;
+    *out++ = event->result;
+
+    enc->len = out - enc->buf;
+    enc->prev = *event;
+    enc->count++;
+
+    return 0;
+}
+
+size_t
+audit_encoder_finish(struct audit_encoder *enc, const uint8_t **frame)
+{
+    uint32_t first_seq = enc->count != 0 ? enc->first.seq : 0;
+    uint32_t first_ts = enc->count != 0 ? enc->first.ts : 0;
+    size_t hdr_len;
+    uint8_t *out;
+
+    hdr_len = 1 + varint_len(first_seq) + varint_len(first_ts) + varint_len(enc->count);
+
+    /* The header is placed right in front of the events. */
+    out = enc->buf + AUDIT_CODEC_HDR_MAX - hdr_len;
+    *frame = out;
+
+    *out++ = AUDIT_CODEC_VERSION;
+    out += varint_put(out, first_seq);
+    out += varint_put(out, first_ts);
+    varint_put(out, enc->count);
+
+    return enc->len - (AUDIT_CODEC_HDR_MAX - hdr_len);
+}
+
+int
+audit_decoder_init(struct audit_decoder *dec, const uint8_t *frame, size_t len)
+{
+    uint32_t first_seq;
+    uint32_t first_ts;
+
+    dec->frame = frame;
+    dec->len = len;
+    dec->pos = 1;
+
+    if (len == 0 || frame[0] != AUDIT_CODEC_VERSION ||
+        !varint_get(dec, &first_seq) || !varint_get(dec, &first_ts) ||
+        !varint_get(dec, &dec->count)) {
+        return -1;
+    }
+
+    /* The first event is coded against a virtual one right before it. */
+    dec->left = dec->count;
+    dec->prev.seq = first_seq - 1;
+    dec->prev.ts = first_ts;
+
+    return 0;
+}
+
+int
+audit_decoder_next(struct audit_decoder *dec, struct audit_event *event)
+{
+    uint32_t seq_gap;
+    uint32_t ts_delta;
+    uint32_t user;
+
+    if (dec->left == 0) {
+        return dec->pos == dec->len ? 0 : -1;
+    }
+
+    if (!varint_get(dec, &seq_gap) || !varint_get(dec, &ts_delta) ||
+        !varint_get(dec, &user) || user > UINT16_MAX || dec->len - dec->pos < 2) {
+        return -1;
+    }
+
+    event->seq = dec->prev.seq + 1 + seq_gap;
+    event->ts = dec->prev.ts + (uint32_t)unzigzag(ts_delta);
+    event->user = (uint16_t)(user - 1);
+    event->source = dec->frame[dec->pos++];
+    event->result = dec->frame[dec->pos++];
+
+    dec->prev = *event;
+    dec->left--;
+
+    return 1;
+}
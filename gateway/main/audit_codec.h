@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * One access event as recorded by a lock.  Field meanings match the lock's
+ * audit_log.h; the gateway does not interpret them.
+ */
+struct audit_event {
+    uint32_t seq;
+    uint32_t ts;
+    uint16_t user;
+    uint8_t source;
+    uint8_t result;
+};
+
+/*
+ * Batch frame, as published on "/lock/<id>/audit":
+ *
+ *   u8      version (AUDIT_CODEC_VERSION)
+ *   varint  seq of the first event
+ *   varint  ts of the first event
+ *   varint  event count
+ *   then per event:
+ *   varint  seq gap: seq - previous seq - 1, normally 0
+ *   varint  zigzag(ts - previous ts); 0 for the first event
+ *   varint  (user + 1) & 0xffff, so "no user" (0xffff) encodes as 0
+ *   u8      source
+ *   u8      result
+ *
+ * Varints are unsigned LEB128.  Events minutes apart take about 6 bytes,
+ * against 8 on the lock and ~70 as a JSON message of their own.
+ */
+#define AUDIT_CODEC_VERSION     1
+
+/* Header and per-event worst cases, for sizing buffers. */
+#define AUDIT_CODEC_HDR_MAX     (1 + 5 + 5 + 5)
+#define AUDIT_CODEC_EVENT_MAX   (5 + 5 + 3 + 1 + 1)
+
+struct audit_encoder {
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    uint32_t count;
+    struct audit_event first;
+    struct audit_event prev;
+};
+
+/**
+ * Starts a batch in the given buffer.  The header is written by
+ * audit_encoder_finish() once the count is known, so events are encoded
+ * after AUDIT_CODEC_HDR_MAX reserved bytes.
+ */
+void audit_encoder_init(struct audit_encoder *enc, uint8_t *buf, size_t size);
+
+/**
+ * Appends an event.
+ *
+ * @return 0 on success, -1 if the buffer cannot hold it.
+ */
+int audit_encoder_add(struct audit_encoder *enc, const struct audit_event *event);
+
+/**
+ * Writes the header in front of the events.
+ *
+ * @param frame Set to the start of the encoded frame inside the buffer.
+ *
+ * @return Length of the frame in bytes.
+ */
+size_t audit_encoder_finish(struct audit_encoder *enc, const uint8_t **frame);
+
+struct audit_decoder {
+    const uint8_t *frame;
+    size_t len;
+    size_t pos;
+    uint32_t count;
+    uint32_t left;
+    struct audit_event prev;
+};
+
+/**
+ * Reads the header of a frame.  The frame must stay valid while events are
+ * taken from it.
+ *
+ * @return 0 on success, -1 if the header is malformed or of another
+ *         version.
+ */
+int audit_decoder_init(struct audit_decoder *dec, const uint8_t *frame, size_t len);
+
+/**
+ * Takes the next event from the frame.
+ *
+ * @return 1 if an event was decoded, 0 at the end of the frame, -1 if the
+ *         frame is truncated, malformed or has bytes after its last event.
+ */
+int audit_decoder_next(struct audit_decoder *dec, struct audit_event *event);
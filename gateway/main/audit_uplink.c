@@ -0,0 +1,659 @@
+#include "audit_uplink.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "nimble/nimble_npl.h"
+#include "nimble/nimble_port.h"
+#include "nvs.h"
+
+#include "spsc_ring.h"
+
+#define TAG "audit_uplink"
+
+#define AUDIT_UPLINK_STACK_SIZE         4096
+#define AUDIT_UPLINK_PRIORITY           4
+#define AUDIT_UPLINK_QUEUE_LEN          8
+#define AUDIT_UPLINK_TICK_MS            1000
+
+/* Acknowledged cursor per lock, keyed by lock ID. */
+#define AUDIT_UPLINK_NAMESPACE          "audit"
+
+/* Audit control point opcodes and notification layout, see the lock's
+ * gatt_lock_svc.c.
+ */
+#define AUDIT_CTRL_START                0x01
+#define AUDIT_CTRL_ABORT                0x02
+#define AUDIT_NOTIFY_HDR_LEN            4
+#define AUDIT_RECORD_LEN                8
+
+/* A lock that has not sent anything for this long is asked again. */
+#define AUDIT_UPLINK_STALL_US           ((int64_t)AUDIT_UPLINK_PULL_PERIOD_MS * 1000)
+
+struct audit_uplink_item {
+    char lock_id[LOCK_ID_STR_SIZE];
+    struct audit_event event;
+};
+
+enum audit_uplink_ev_type {
+    AUDIT_UPLINK_EV_RING,
+    AUDIT_UPLINK_EV_CONNECTED,
+    AUDIT_UPLINK_EV_DISCONNECTED,
+    AUDIT_UPLINK_EV_PUBLISHED,
+    AUDIT_UPLINK_EV_DELETED,
+};
+
+struct audit_uplink_ev {
+    uint8_t type;
+    int msg_id;
+};
+
+/*
+ * One batch slot per lock.  Events collect in the filling buffer while the
+ * other one is published; a lock never has more than one batch in flight,
+ * so batches are acknowledged in order and the cursor only moves forward.
+ *
+ * Once the client took a batch (msg_id >= 0), its own outbox sends it
+ * again after a reconnect, under the same msg_id, until the PUBACK or
+ * until it expires the message with MQTT_EVENT_DELETED.  Only then, or if
+ * the client refused the publish, is the batch published again here, so
+ * the broker never gets it from both.
+ */
+struct audit_batch {
+    bool in_use;
+    char lock_id[LOCK_ID_STR_SIZE];
+
+    struct audit_encoder enc;
+    int64_t opened_us;
+    uint8_t fill;
+
+    bool inflight;
+    int msg_id;
+    int64_t sent_us;
+    const uint8_t *frame;
+    size_t frame_len;
+    uint32_t count;
+    uint32_t end_seq;
+
+    uint8_t buf[2][AUDIT_UPLINK_FRAME_SIZE];
+};
+
+/* NimBLE host task -> uplink task; storage is allocated at init. */
+static struct spsc_ring event_ring;
+
+static QueueHandle_t uplink_queue;
+static esp_mqtt_client_handle_t uplink_client;
+
+/* Owned by the uplink task. */
+static struct audit_batch *batches;
+static struct audit_uplink_item held_item;
+static bool held;
+static bool online;
+static struct audit_uplink_stats stats;
+
+/* Owned by the NimBLE host task. */
+static struct ble_npl_callout pull_callout;
+static bool initialized;
+
+static void *
+audit_uplink_alloc(size_t size)
+{
+    void *p;
+
+    /* Prefer PSRAM; the ring and batches are only touched by the CPU. */
+    p = heap_caps_calloc(1, size, MALLOC_CAP_SPIRAM);
+    if (p == NULL) {
+        p = heap_caps_calloc(1, size, MALLOC_CAP_8BIT);
+    }
+
+    return p;
+}
+
+static void
+audit_uplink_post(uint8_t type, int msg_id)
+{
+    struct audit_uplink_ev ev = {
+        .type = type,
+        .msg_id = msg_id,
+    };
+
+    if (uplink_queue != NULL) {
+        /* A full queue already holds a wakeup; never block the caller. */
+        xQueueSend(uplink_queue, &ev, 0);
+    }
+}
+
+static esp_err_t
+audit_uplink_cursor_load(const char *lock_id, uint32_t *seq)
+{
+    nvs_handle_t handle;
+    esp_err_t ret;
+
+    ret = nvs_open(AUDIT_UPLINK_NAMESPACE, NVS_READONLY, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ret = nvs_get_u32(handle, lock_id, seq);
+    nvs_close(handle);
+
+    return ret;
+}
+
+static esp_err_t
+audit_uplink_cursor_store(const char *lock_id, uint32_t seq)
+{
+    nvs_handle_t handle;
+    esp_err_t ret;
+
+    ret = nvs_open(AUDIT_UPLINK_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ret = nvs_set_u32(handle, lock_id, seq);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    return ret;
+}
+
+/*
+ * Uplink task.
+ */
+
+static struct audit_batch *
+audit_batch_find(const char *lock_id)
+{
+    struct audit_batch *free_batch = NULL;
+
+    for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
+        struct audit_batch *batch = &batches[i];
+
+        if (batch->in_use && strcmp(batch->lock_id, lock_id) == 0) {
+            return batch;
+        }
+        if (free_batch == NULL &&
+            (!batch->in_use || (!batch->inflight && batch->enc.count == 0))) {
+            free_batch = batch;
+        }
+    }
+
+    if (free_batch != NULL) {
+        free_batch->in_use = true;
+        free_batch->inflight = false;
+        free_batch->fill = 0;
+        memcpy(free_batch->lock_id, lock_id, sizeof(free_batch->lock_id));
+        audit_encoder_init(&free_batch->enc, free_batch->buf[0],
+                           sizeof(free_batch->buf[0]));
+    }
+
+    return free_batch;
+}
+
+static void
+audit_batch_publish(struct audit_batch *batch)
+{
+    char topic[sizeof("/lock/") + LOCK_ID_LEN + sizeof("/audit")];
+
+    batch->sent_us = esp_timer_get_time();
+    batch->msg_id = -1;
+
+    if (!online || uplink_client == NULL) {
+        return;
+    }
+
+    snprintf(topic, sizeof(topic), "/lock/%s/audit", batch->lock_id);
+    batch->msg_id = esp_mqtt_client_publish(uplink_client, topic,
+                                            (const char *)batch->frame,
+                                            batch->frame_len, 1, 0);
+    if (batch->msg_id < 0) {
+        ESP_LOGW(TAG, "Publish for %s failed, retrying later", batch->lock_id);
+    }
+}
+
+/**
+ * Moves the filling buffer in flight and publishes it.
+ *
+ * @return false if the previous batch of the lock is still unacknowledged.
+ */
+static bool
+audit_batch_seal(struct audit_batch *batch)
+{
+    if (batch->inflight) {
+        return false;
+    }
+
+    batch->count = batch->enc.count;
+    batch->end_seq = batch->enc.prev.seq + 1;
+    batch->frame_len = audit_encoder_finish(&batch->enc, &batch->frame);
+    batch->inflight = true;
+
+    batch->fill ^= 1;
+    audit_encoder_init(&batch->enc, batch->buf[batch->fill],
+                       sizeof(batch->buf[batch->fill]));
+
+    audit_batch_publish(batch);
+
+    return true;
+}
+
+static void
+audit_batch_acked(int msg_id)
+{
+    struct audit_batch *batch = NULL;
+    esp_err_t ret;
+
+    for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
+        if (batches[i].in_use && batches[i].inflight && batches[i].msg_id == msg_id) {
+            batch = &batches[i];
+            break;
+        }
+    }
+    if (batch == NULL) {
+        return;
+    }
+
+    batch->inflight = false;
+
+    stats.events += batch->count;
+    stats.batches++;
+    stats.bytes += batch->frame_len;
+    stats.raw_bytes += batch->count * AUDIT_RECORD_LEN;
+
+    ESP_LOGI(TAG, "%s: %lu events acked in %u bytes, up to seq %lu; "
+             "%lu events in %lu messages so far",
+             batch->lock_id, (unsigned long)batch->count,
+             (unsigned)batch->frame_len, (unsigned long)batch->end_seq,
+             (unsigned long)stats.events, (unsigned long)stats.batches);
+
+    /* Only acknowledged events move the cursor: anything after it is
+     * downloaded again after a reboot, so delivery is at least once.
+     */
+    ret = audit_uplink_cursor_store(batch->lock_id, batch->end_seq);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store cursor for %s; err=0x%x", batch->lock_id, ret);
+    }
+}
+
+/* The client gave up on a batch; it is published again on the next tick. */
+static void
+audit_batch_expired(int msg_id)
+{
+    for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
+        if (batches[i].in_use && batches[i].inflight && batches[i].msg_id == msg_id) {
+            ESP_LOGW(TAG, "Batch for %s expired in the client", batches[i].lock_id);
+            batches[i].msg_id = -1;
+            batches[i].sent_us = 0;
+            break;
+        }
+    }
+}
+
+static void
+audit_uplink_drain(void)
+{
+    struct audit_uplink_item item;
+    struct audit_batch *batch;
+
+    for (;;) {
+        if (held) {
+            item = held_item;
+            held = false;
+        } else if (!spsc_ring_pop(&event_ring, &item)) {
+            break;
+        }
+
+        batch = audit_batch_find(item.lock_id);
+        if (batch != NULL && batch->enc.count == AUDIT_UPLINK_BATCH_MAX) {
+            (void)audit_batch_seal(batch);
+        }
+        if (batch == NULL || audit_encoder_add(&batch->enc, &item.event) != 0) {
+            /* Wait for an acknowledgement to free a buffer. */
+            held_item = item;
+            held = true;
+            break;
+        }
+
+        if (batch->enc.count == 1) {
+            batch->opened_us = esp_timer_get_time();
+        }
+        if (batch->enc.count == AUDIT_UPLINK_BATCH_MAX) {
+            (void)audit_batch_seal(batch);
+        }
+    }
+}
+
+static void
+audit_uplink_service(void)
+{
+    int64_t now = esp_timer_get_time();
+
+    for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
+        struct audit_batch *batch = &batches[i];
+
+        if (!batch->in_use) {
+            continue;
+        }
+
+        if (batch->inflight) {
+            if (online && batch->msg_id < 0 &&
+                now - batch->sent_us >= (int64_t)AUDIT_UPLINK_RETRY_MS * 1000) {
+                stats.republished++;
+                audit_batch_publish(batch);
+            }
+        } else if (batch->enc.count != 0 &&
+                   now - batch->opened_us >= (int64_t)AUDIT_UPLINK_BATCH_AGE_MS * 1000) {
+            (void)audit_batch_seal(batch);
+        }
+    }
+}
+
+static void
+audit_uplink_task(void *param)
+{
+    struct audit_uplink_ev ev;
+
+    for (;;) {
+        if (xQueueReceive(uplink_queue, &ev, pdMS_TO_TICKS(AUDIT_UPLINK_TICK_MS)) == pdTRUE) {
+            switch (ev.type) {
+            case AUDIT_UPLINK_EV_CONNECTED:
+                online = true;
+                /* Batches the client holds are its to send again. */
+                for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
+                    if (batches[i].in_use && batches[i].inflight && batches[i].msg_id < 0) {
+                        stats.republished++;
+                        audit_batch_publish(&batches[i]);
+                    }
+                }
+                break;
+
+            case AUDIT_UPLINK_EV_DISCONNECTED:
+                online = false;
+                break;
+
+            case AUDIT_UPLINK_EV_PUBLISHED:
+                audit_batch_acked(ev.msg_id);
+                break;
+
+            case AUDIT_UPLINK_EV_DELETED:
+                audit_batch_expired(ev.msg_id);
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        audit_uplink_drain();
+        audit_uplink_service();
+    }
+}
+
+void
+audit_uplink_set_client(esp_mqtt_client_handle_t client)
+{
+    uplink_client = client;
+}
+
+void
+audit_uplink_on_mqtt_event(esp_mqtt_event_handle_t event)
+{
+    switch (event->event_id) {
+    case MQTT_EVENT_CONNECTED:
+        audit_uplink_post(AUDIT_UPLINK_EV_CONNECTED, 0);
+        break;
+    case MQTT_EVENT_DISCONNECTED:
+        audit_uplink_post(AUDIT_UPLINK_EV_DISCONNECTED, 0);
+        break;
+    case MQTT_EVENT_PUBLISHED:
+        audit_uplink_post(AUDIT_UPLINK_EV_PUBLISHED, event->msg_id);
+        break;
+    case MQTT_EVENT_DELETED:
+        audit_uplink_post(AUDIT_UPLINK_EV_DELETED, event->msg_id);
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * NimBLE host task.
+ */
+
+static int
+audit_uplink_on_start(uint16_t conn_handle,
+                      const struct ble_gatt_error *error,
+                      struct ble_gatt_attr *attr,
+                      void *arg)
+{
+    const struct lock_entry *entry;
+
+    if (error->status == 0) {
+        return 0;
+    }
+
+    MODLOG_DFLT(ERROR, "Audit download start failed; status=%d conn_handle=%d\n",
+                error->status, conn_handle);
+
+    entry = lock_table_find_conn(conn_handle);
+    if (entry != NULL) {
+        lock_table_set_audit_state(conn_handle, entry->audit_ready, false,
+                                   entry->audit_next_seq);
+    }
+
+    return 0;
+}
+
+static void
+audit_uplink_pull(const struct lock_entry *entry)
+{
+    uint8_t value[5];
+    int rc;
+
+    value[0] = AUDIT_CTRL_START;
+    put_le32(&value[1], entry->audit_next_seq);
+
+    rc = ble_gattc_write_flat(entry->conn_handle, entry->audit_val_handle,
+                              value, sizeof(value), audit_uplink_on_start, NULL);
+    if (rc != 0) {
+        MODLOG_DFLT(ERROR, "Failed to start audit download; rc=%d\n", rc);
+        return;
+    }
+
+    lock_table_set_audit_state(entry->conn_handle, true, true, entry->audit_next_seq);
+}
+
+static void
+audit_uplink_pull_all(struct ble_npl_event *ev)
+{
+    struct spsc_ring_stats ring;
+    int64_t now = esp_timer_get_time();
+
+    spsc_ring_get_stats(&event_ring, &ring);
+
+    /* Leave the uplink task room to catch up before asking for more. */
+    if (ring.depth < ring.capacity / 2) {
+        for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
+            const struct lock_entry *entry = lock_table_get(i);
+
+            if (entry == NULL || entry->conn_handle == BLE_HS_CONN_HANDLE_NONE ||
+                !entry->audit_ready) {
+                continue;
+            }
+            if (entry->audit_busy && now - entry->audit_updated_us < AUDIT_UPLINK_STALL_US) {
+                continue;
+            }
+
+            audit_uplink_pull(entry);
+        }
+    }
+
+    ble_npl_callout_reset(&pull_callout,
+                          ble_npl_time_ms_to_ticks32(AUDIT_UPLINK_PULL_PERIOD_MS));
+}
+
+static int
+audit_uplink_on_subscribe(uint16_t conn_handle,
+                          const struct ble_gatt_error *error,
+                          struct ble_gatt_attr *attr,
+                          void *arg)
+{
+    const struct lock_entry *entry;
+
+    if (error->status != 0) {
+        MODLOG_DFLT(ERROR, "Audit subscribe failed; status=%d conn_handle=%d\n",
+                    error->status, conn_handle);
+        return 0;
+    }
+
+    entry = lock_table_find_conn(conn_handle);
+    if (entry != NULL) {
+        lock_table_set_audit_state(conn_handle, true, false, entry->audit_next_seq);
+        audit_uplink_pull(entry);
+    }
+
+    return 0;
+}
+
+void
+audit_uplink_link_up(uint16_t conn_handle)
+{
+    const struct lock_entry *entry = lock_table_find_conn(conn_handle);
+    uint8_t value[2];
+    uint32_t seq = 0;
+    int rc;
+
+    if (!initialized || entry == NULL || entry->audit_cccd_handle == 0) {
+        return;
+    }
+
+    if (!entry->audit_cursor_valid) {
+        (void)audit_uplink_cursor_load(entry->id, &seq);
+        lock_table_set_audit_state(conn_handle, false, false, seq);
+        MODLOG_DFLT(INFO, "Lock %s audit cursor %lu\n", entry->id, (unsigned long)seq);
+    }
+
+    value[0] = 1;
+    value[1] = 0;
+    rc = ble_gattc_write_flat(conn_handle, entry->audit_cccd_handle,
+                              value, sizeof(value), audit_uplink_on_subscribe, NULL);
+    if (rc != 0) {
+        MODLOG_DFLT(ERROR, "Failed to subscribe to the audit log; rc=%d\n", rc);
+    }
+}
+
+bool
+audit_uplink_on_notify(uint16_t conn_handle, uint16_t attr_handle,
+                       const struct os_mbuf *om)
+{
+    const struct lock_entry *entry = lock_table_find_conn(conn_handle);
+    struct audit_uplink_item item;
+    uint8_t hdr[AUDIT_NOTIFY_HDR_LEN];
+    uint8_t rec[AUDIT_RECORD_LEN];
+    uint32_t first_seq;
+    uint32_t next_seq;
+    int count;
+    uint8_t abort_op = AUDIT_CTRL_ABORT;
+
+    if (entry == NULL || entry->audit_val_handle == 0 ||
+        entry->audit_val_handle != attr_handle) {
+        return false;
+    }
+
+    /* Stragglers after an abort are downloaded again later. */
+    if (!entry->audit_busy ||
+        os_mbuf_copydata(om, 0, sizeof(hdr), hdr) != 0) {
+        return true;
+    }
+
+    first_seq = get_le32(hdr);
+    count = (OS_MBUF_PKTLEN(om) - AUDIT_NOTIFY_HDR_LEN) / AUDIT_RECORD_LEN;
+    next_seq = entry->audit_next_seq;
+
+    if (count == 0) {
+        /* End of the log; first_seq is where the next download starts. */
+        lock_table_set_audit_state(conn_handle, true, false, first_seq);
+        return true;
+    }
+
+    memcpy(item.lock_id, entry->id, sizeof(item.lock_id));
+
+    for (int i = 0; i < count; i++) {
+        uint32_t seq = first_seq + i;
+
+        /* Records before the cursor were already taken. */
+        if ((int32_t)(seq - next_seq) < 0) {
+            continue;
+        }
+
+        os_mbuf_copydata(om, AUDIT_NOTIFY_HDR_LEN + i * AUDIT_RECORD_LEN,
+                         sizeof(rec), rec);
+        item.event.seq = seq;
+        item.event.ts = get_le32(&rec[0]);
+        item.event.user = get_le16(&rec[4]);
+        item.event.source = rec[6];
+        item.event.result = rec[7];
+
+        if (!spsc_ring_push(&event_ring, &item)) {
+            /* Stop the lock and resume from here on the next pull. */
+            ble_gattc_write_flat(conn_handle, entry->audit_val_handle,
+                                 &abort_op, sizeof(abort_op), NULL, NULL);
+            lock_table_set_audit_state(conn_handle, true, false, seq);
+            audit_uplink_post(AUDIT_UPLINK_EV_RING, 0);
+            return true;
+        }
+
+        next_seq = seq + 1;
+    }
+
+    lock_table_set_audit_state(conn_handle, true, true, next_seq);
+    audit_uplink_post(AUDIT_UPLINK_EV_RING, 0);
+
+    return true;
+}
+
+void
+audit_uplink_init(void)
+{
+    struct audit_uplink_item *storage;
+
+    storage = audit_uplink_alloc(AUDIT_UPLINK_RING_SIZE * sizeof(*storage));
+    batches = audit_uplink_alloc(LOCK_TABLE_SIZE * sizeof(*batches));
+    uplink_queue = xQueueCreate(AUDIT_UPLINK_QUEUE_LEN, sizeof(struct audit_uplink_ev));
+    if (storage == NULL || batches == NULL || uplink_queue == NULL) {
+        ESP_LOGE(TAG, "Out of memory, audit upload disabled");
+        return;
+    }
+
+    spsc_ring_init(&event_ring, storage, sizeof(*storage), AUDIT_UPLINK_RING_SIZE);
+
+    xTaskCreate(audit_uplink_task, "audit_uplink", AUDIT_UPLINK_STACK_SIZE, NULL,
+                AUDIT_UPLINK_PRIORITY, NULL);
+
+    ble_npl_callout_init(&pull_callout, nimble_port_get_dflt_eventq(),
+                         audit_uplink_pull_all, NULL);
+    ble_npl_callout_reset(&pull_callout,
+                          ble_npl_time_ms_to_ticks32(AUDIT_UPLINK_PULL_PERIOD_MS));
+
+    initialized = true;
+}
+
+void
+audit_uplink_get_stats(struct audit_uplink_stats *out)
+{
+    struct spsc_ring_stats ring;
+
+    *out = stats;
+
+    spsc_ring_get_stats(&event_ring, &ring);
+    out->ring_dropped = ring.dropped;
+}
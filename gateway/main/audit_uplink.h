@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "host/ble_hs.h"
+#include "mqtt_client.h"
+
+#include "audit_codec.h"
+#include "lock_table.h"
+
+/* Events buffered between the host task and the uplink task, all locks. */
+#define AUDIT_UPLINK_RING_SIZE          512
+
+/* A batch is sealed at this many events or this age, whichever is first. */
+#define AUDIT_UPLINK_BATCH_MAX          64
+#define AUDIT_UPLINK_BATCH_AGE_MS       5000
+
+/* A batch the client refused or expired is published again after this
+ * long.  Batches the client took are resent by the client itself.
+ */
+#define AUDIT_UPLINK_RETRY_MS           10000
+
+/* How often connected locks are asked for new records. */
+#define AUDIT_UPLINK_PULL_PERIOD_MS     30000
+
+#define AUDIT_UPLINK_FRAME_SIZE         (AUDIT_CODEC_HDR_MAX + \
+                                         AUDIT_UPLINK_BATCH_MAX * AUDIT_CODEC_EVENT_MAX)
+
+struct audit_uplink_stats {
+    uint32_t events;
+    uint32_t batches;
+    uint32_t republished;
+    /* Payload bytes published, and what one 8-byte record per event is. */
+    uint32_t bytes;
+    uint32_t raw_bytes;
+    uint32_t ring_dropped;
+};
+
+/**
+ * Allocates the event ring, starts the uplink task and arms the periodic
+ * pull on the NimBLE default queue.  Must be called after nimble_port_init().
+ */
+void audit_uplink_init(void);
+
+/**
+ * Sets the client batches are published with.
+ */
+void audit_uplink_set_client(esp_mqtt_client_handle_t client);
+
+/**
+ * Passes CONNECTED, DISCONNECTED, PUBLISHED and DELETED events to the
+ * uplink task.
+ * Called from the MQTT event loop; other events are ignored.
+ */
+void audit_uplink_on_mqtt_event(esp_mqtt_event_handle_t event);
+
+/**
+ * Enables audit notifications on a lock whose handles are known and starts
+ * a download from its cursor.  Host task only.
+ */
+void audit_uplink_link_up(uint16_t conn_handle);
+
+/**
+ * Consumes an audit notification.  Host task only.
+ *
+ * @return true if the notification came from a lock's audit characteristic.
+ */
+bool audit_uplink_on_notify(uint16_t conn_handle, uint16_t attr_handle,
+                            const struct os_mbuf *om);
+
+void audit_uplink_get_stats(struct audit_uplink_stats *stats);
@@ -0,0 +1,153 @@
+#include "boot.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+
+#include "outbox.h"
+
+#define TAG "boot"
+
+static const char *const phase_names[BOOT_PHASE_COUNT] = {
+    [BOOT_PHASE_NVS] = "nvs",
+    [BOOT_PHASE_WIFI_STARTED] = "wifi_started",
+    [BOOT_PHASE_WIFI_ASSOC] = "wifi_assoc",
+    [BOOT_PHASE_IP] = "ip",
+    [BOOT_PHASE_BLE_STARTED] = "ble_started",
+    [BOOT_PHASE_BLE_SYNC] = "ble_sync",
+    [BOOT_PHASE_BLE_SCAN] = "ble_scan",
+    [BOOT_PHASE_FIRST_LOCK] = "first_lock",
+    [BOOT_PHASE_MQTT_STARTED] = "mqtt_started",
+    [BOOT_PHASE_MQTT_CONNECTED] = "mqtt_connected",
+};
+
+static EventGroupHandle_t boot_group;
+static portMUX_TYPE boot_mux = portMUX_INITIALIZER_UNLOCKED;
+static int64_t phase_us[BOOT_PHASE_COUNT];
+static bool published;
+static char id_str[GATEWAY_ID_STR_SIZE];
+
+void
+boot_init(void)
+{
+    uint8_t mac[6];
+
+    boot_group = xEventGroupCreate();
+
+    esp_efuse_mac_get_default(mac);
+    snprintf(id_str, sizeof(id_str), "%02x%02x%02x%02x%02x%02x",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+void
+boot_mark(enum boot_phase phase)
+{
+    bool first = false;
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&boot_mux);
+    if (phase_us[phase] == 0) {
+        phase_us[phase] = now;
+        first = true;
+    }
+    portEXIT_CRITICAL(&boot_mux);
+
+    if (!first) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "%s at %lld ms", phase_names[phase], now / 1000);
+    xEventGroupSetBits(boot_group, BOOT_BIT(phase));
+}
+
+void
+boot_run(const struct boot_step *steps, size_t count)
+{
+    uint32_t done = 0;
+    EventBits_t have;
+    EventBits_t waiting;
+
+    while (done != (1u << count) - 1) {
+        have = xEventGroupGetBits(boot_group);
+        waiting = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            if (done & (1u << i)) {
+                continue;
+            }
+            if ((steps[i].requires & have) != steps[i].requires) {
+                waiting |= steps[i].requires & ~have;
+                continue;
+            }
+
+            ESP_LOGI(TAG, "Starting %s", steps[i].name);
+            steps[i].run();
+            boot_mark(steps[i].provides);
+            done |= 1u << i;
+        }
+
+        if (waiting != 0 && done != (1u << count) - 1) {
+            /* Wakes on the first of the missing phases. */
+            xEventGroupWaitBits(boot_group, waiting, pdFALSE, pdFALSE, portMAX_DELAY);
+        }
+    }
+}
+
+int
+boot_report(char *buf, size_t size)
+{
+    int64_t us[BOOT_PHASE_COUNT];
+    int len;
+
+    portENTER_CRITICAL(&boot_mux);
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+        us[i] = phase_us[i];
+    }
+    portEXIT_CRITICAL(&boot_mux);
+
+    len = snprintf(buf, size, "{\"reset_reason\":%d", (int)esp_reset_reason());
+
+    for (int i = 0; i < BOOT_PHASE_COUNT; i++) {
+        if (us[i] == 0 || len < 0 || (size_t)len >= size) {
+            continue;
+        }
+        len += snprintf(buf + len, size - len, ",\"%s_ms\":%lld", phase_names[i], us[i] / 1000);
+    }
+
+    if (len >= 0 && (size_t)len < size) {
+        len += snprintf(buf + len, size - len, "}");
+    }
+
+    return len;
+}
+
+void
+boot_publish_once(void)
+{
+    char topic[sizeof("/gateway/") + GATEWAY_ID_STR_SIZE + sizeof("/boot")];
+    char payload[320];
+    int len;
+
+    if (published) {
+        return;
+    }
+    published = true;
+
+    len = boot_report(payload, sizeof(payload));
+    if (len < 0 || (size_t)len >= sizeof(payload)) {
+        return;
+    }
+
+    snprintf(topic, sizeof(topic), "/gateway/%s/boot", id_str);
+    outbox_publish(topic, payload, len, 1);
+}
+
+const char *
+gateway_id(void)
+{
+    return id_str;
+}
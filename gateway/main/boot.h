@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+/*
+ * Boot phases.  Each is reached once and recorded with its time since
+ * reset; the phases also form the event group that boot steps wait on.
+ */
+enum boot_phase {
+    BOOT_PHASE_NVS,
+    BOOT_PHASE_WIFI_STARTED,
+    BOOT_PHASE_WIFI_ASSOC,
+    BOOT_PHASE_IP,
+    BOOT_PHASE_BLE_STARTED,
+    BOOT_PHASE_BLE_SYNC,
+    BOOT_PHASE_BLE_SCAN,
+    BOOT_PHASE_FIRST_LOCK,
+    BOOT_PHASE_MQTT_STARTED,
+    BOOT_PHASE_MQTT_CONNECTED,
+
+    BOOT_PHASE_COUNT
+};
+
+#define BOOT_BIT(phase)         ((EventBits_t)1 << (phase))
+
+/* Gateway ID: factory MAC as 12 lowercase hex digits, like lock IDs. */
+#define GATEWAY_ID_STR_SIZE     13
+
+/**
+ * A boot step runs once every phase in @p requires has been reached, and
+ * marks @p provides when it returns.  Steps must not block for long: they
+ * start a subsystem and let its events mark the later phases.
+ */
+struct boot_step {
+    const char *name;
+    EventBits_t requires;
+    enum boot_phase provides;
+    void (*run)(void);
+};
+
+void boot_init(void);
+
+/**
+ * Records that a phase has been reached.  Only the first call per phase
+ * counts.  Safe to call from any task.
+ */
+void boot_mark(enum boot_phase phase);
+
+/**
+ * Runs the steps in dependency order and returns when all have run.
+ */
+void boot_run(const struct boot_step *steps, size_t count);
+
+/**
+ * Formats the phase timestamps as a JSON object.
+ *
+ * @return Length written, as snprintf().
+ */
+int boot_report(char *buf, size_t size);
+
+/**
+ * Publishes the boot report on "/gateway/<id>/boot" the first time it is
+ * called after reset.
+ */
+void boot_publish_once(void);
+
+const char *gateway_id(void);
@@ -0,0 +1,343 @@
+#include "cred_push.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "host/ble_hs.h"
+#include "nimble/nimble_npl.h"
+#include "nimble/nimble_port.h"
+
+#include "lock_cmd.h"
+#include "lock_table.h"
+
+#define TAG "cred_push"
+
+/* The lock's answer: [u8 status][u16 records staged]. */
+#define CRED_PUSH_RESULT_LEN        3
+#define CRED_PUSH_STATUS_OK         0x00
+#define CRED_PUSH_STATUS_INVALID    0x01
+#define CRED_PUSH_STATUS_NO_SPACE   0x02
+#define CRED_PUSH_STATUS_EXISTS     0x03
+#define CRED_PUSH_STATUS_BAD_CRC    0x04
+
+/* Smallest LE credit based channel MTU; the answer is far shorter. */
+#define CRED_PUSH_RX_MTU            23
+
+/* Largest SDU handed to the host at once.  The lock parses segments as
+ * they arrive, so this only bounds the mbufs one send holds.
+ */
+#define CRED_PUSH_SDU_MAX           512
+
+/* Data length extension maximum, and its airtime on the 1M PHY. */
+#define CRED_PUSH_DLE_OCTETS        251
+#define CRED_PUSH_DLE_TIME_US       2120
+
+/* Retry delay when the mbuf pool is exhausted. */
+#define CRED_PUSH_RETRY_MS          20
+
+/*
+ * The bundle is filled by the MQTT event loop while busy is clear, then
+ * handed to the NimBLE host task, which owns it until the push has finished
+ * and clears busy again.
+ */
+static uint8_t bundle[CRED_PUSH_BUNDLE_MAX];
+static size_t bundle_len;
+static struct lock_cmd push_cmd;
+static atomic_bool busy;
+
+/* Owned by the MQTT event loop. */
+static bool collecting;
+
+/* Owned by the NimBLE host task. */
+static struct ble_npl_event start_ev;
+static struct ble_npl_callout timeout_callout;
+static struct ble_npl_callout retry_callout;
+static struct ble_l2cap_chan *chan;
+static uint16_t sdu_len;
+static size_t sent;
+static bool timed_out;
+static int result;
+static int64_t transfer_start_us;
+
+static void
+cred_push_reject(esp_mqtt_event_handle_t event, const char *lock_id, int status)
+{
+    struct lock_cmd_result res = {
+        .op = LOCK_CMD_PIN_BUNDLE,
+        .qos = event->qos,
+        .status = status,
+    };
+
+    memcpy(res.lock_id, lock_id, LOCK_ID_LEN);
+    if (event->data_len >= 12) {
+        res.id = get_le32(&event->data[8]);
+    }
+    lock_cmd_publish_result(&res);
+}
+
+void
+cred_push_on_mqtt_data(esp_mqtt_event_handle_t event, const char *lock_id)
+{
+    size_t end;
+
+    if (lock_id != NULL) {
+        collecting = false;
+
+        if (atomic_load(&busy)) {
+            cred_push_reject(event, lock_id, BLE_HS_EBUSY);
+            return;
+        }
+        if (event->total_data_len < CRED_PUSH_HDR_LEN ||
+            event->total_data_len > CRED_PUSH_BUNDLE_MAX) {
+            cred_push_reject(event, lock_id, BLE_HS_EMSGSIZE);
+            return;
+        }
+
+        memset(&push_cmd, 0, sizeof(push_cmd));
+        memcpy(push_cmd.lock_id, lock_id, LOCK_ID_LEN);
+        push_cmd.op = LOCK_CMD_PIN_BUNDLE;
+        push_cmd.qos = event->qos;
+        push_cmd.submitted_us = esp_timer_get_time();
+        bundle_len = event->total_data_len;
+        collecting = true;
+    } else if (!collecting) {
+        return;
+    }
+
+    end = event->current_data_offset + event->data_len;
+    if (end > bundle_len) {
+        collecting = false;
+        return;
+    }
+
+    memcpy(&bundle[event->current_data_offset], event->data, event->data_len);
+    if (end < bundle_len) {
+        return;
+    }
+
+    collecting = false;
+    push_cmd.id = get_le32(&bundle[8]);
+    push_cmd.deadline_us = esp_timer_get_time() + CRED_PUSH_TIMEOUT_MS * 1000LL;
+
+    atomic_store(&busy, true);
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &start_ev);
+}
+
+static void
+cred_push_finish(int status)
+{
+    ble_npl_callout_stop(&timeout_callout);
+    ble_npl_callout_stop(&retry_callout);
+    chan = NULL;
+
+    lock_cmd_report(&push_cmd, status);
+    atomic_store(&busy, false);
+}
+
+static int
+cred_push_status(uint8_t status)
+{
+    switch (status) {
+    case CRED_PUSH_STATUS_OK:
+        return 0;
+    case CRED_PUSH_STATUS_INVALID:
+        return BLE_HS_EINVAL;
+    case CRED_PUSH_STATUS_NO_SPACE:
+        return BLE_HS_ENOMEM;
+    case CRED_PUSH_STATUS_EXISTS:
+        return BLE_HS_EALREADY;
+    case CRED_PUSH_STATUS_BAD_CRC:
+        return BLE_HS_EBADDATA;
+    default:
+        return BLE_HS_EAPP;
+    }
+}
+
+/**
+ * Hands SDUs to the host until the bundle is out or the channel runs out of
+ * credits, in which case TX_UNSTALLED resumes it.
+ */
+static void
+cred_push_send(void)
+{
+    struct os_mbuf *om;
+    uint16_t len;
+    int rc;
+
+    while (chan != NULL && sent < bundle_len) {
+        len = bundle_len - sent < sdu_len ? bundle_len - sent : sdu_len;
+        om = ble_hs_mbuf_from_flat(&bundle[sent], len);
+        if (om == NULL) {
+            ble_npl_callout_reset(&retry_callout,
+                                  ble_npl_time_ms_to_ticks32(CRED_PUSH_RETRY_MS));
+            return;
+        }
+
+        rc = ble_l2cap_send(chan, om);
+        if (rc == 0 || rc == BLE_HS_ESTALLED) {
+            /* The SDU is queued either way. */
+            sent += len;
+            if (rc == BLE_HS_ESTALLED) {
+                return;
+            }
+            continue;
+        }
+
+        os_mbuf_free_chain(om);
+        if (rc == BLE_HS_EBUSY) {
+            /* The previous SDU is still waiting for credits. */
+            return;
+        }
+
+        ESP_LOGW(TAG, "Bundle send failed; rc=%d", rc);
+        result = rc;
+        ble_l2cap_disconnect(chan);
+        return;
+    }
+}
+
+static int
+cred_push_on_l2cap(struct ble_l2cap_event *event, void *arg)
+{
+    struct ble_l2cap_chan_info info;
+    uint8_t answer[CRED_PUSH_RESULT_LEN];
+    int64_t elapsed_us;
+
+    switch (event->type) {
+    case BLE_L2CAP_EVENT_COC_CONNECTED:
+        if (event->connect.status != 0) {
+            ESP_LOGW(TAG, "Bundle channel not opened; status=%d", event->connect.status);
+            cred_push_finish(event->connect.status);
+            return 0;
+        }
+
+        chan = event->connect.chan;
+        if (timed_out) {
+            ble_l2cap_disconnect(chan);
+            return 0;
+        }
+
+        sdu_len = CRED_PUSH_SDU_MAX;
+        if (ble_l2cap_get_chan_info(chan, &info) == 0 && info.peer_coc_mtu < sdu_len) {
+            sdu_len = info.peer_coc_mtu;
+        }
+
+        transfer_start_us = esp_timer_get_time();
+        cred_push_send();
+        return 0;
+
+    case BLE_L2CAP_EVENT_COC_TX_UNSTALLED:
+        cred_push_send();
+        return 0;
+
+    case BLE_L2CAP_EVENT_COC_DATA_RECEIVED:
+        if (os_mbuf_copydata(event->receive.sdu_rx, 0, sizeof(answer), answer) == 0) {
+            result = cred_push_status(answer[0]);
+
+            /* Includes the lock's flash commit, which is what matters to
+             * whoever is provisioning.
+             */
+            elapsed_us = esp_timer_get_time() - transfer_start_us;
+            ESP_LOGI(TAG, "Bundle %lu to lock %s: status %u, %u records, "
+                     "%u bytes in %lld ms (%lld B/s)",
+                     (unsigned long)push_cmd.id, push_cmd.lock_id, answer[0],
+                     get_le16(&answer[1]), (unsigned)bundle_len, elapsed_us / 1000,
+                     elapsed_us > 0 ? (int64_t)bundle_len * 1000000 / elapsed_us : 0);
+        }
+        os_mbuf_free_chain(event->receive.sdu_rx);
+        ble_l2cap_disconnect(event->receive.chan);
+        return 0;
+
+    case BLE_L2CAP_EVENT_COC_DISCONNECTED:
+        cred_push_finish(result);
+        return 0;
+
+    default:
+        return 0;
+    }
+}
+
+static void
+cred_push_on_timeout(struct ble_npl_event *ev)
+{
+    ESP_LOGW(TAG, "Bundle %lu to lock %s timed out after %u of %u bytes",
+             (unsigned long)push_cmd.id, push_cmd.lock_id,
+             (unsigned)sent, (unsigned)bundle_len);
+
+    /* A channel that is still being opened is closed once it is up. */
+    timed_out = true;
+    result = BLE_HS_ETIMEOUT;
+    if (chan != NULL) {
+        ble_l2cap_disconnect(chan);
+    }
+}
+
+static void
+cred_push_on_retry(struct ble_npl_event *ev)
+{
+    cred_push_send();
+}
+
+static void
+cred_push_start(struct ble_npl_event *ev)
+{
+    const struct lock_entry *entry = lock_table_find_id(push_cmd.lock_id, LOCK_ID_LEN);
+    struct os_mbuf *sdu_rx;
+    int rc;
+
+    if (entry == NULL || entry->conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+        cred_push_finish(BLE_HS_ENOTCONN);
+        return;
+    }
+
+    /* Full-size packets and, where the controller has it, the 2M PHY for
+     * the transfer.  Both are best effort; the push works without them.
+     */
+    rc = ble_gap_set_data_len(entry->conn_handle, CRED_PUSH_DLE_OCTETS,
+                              CRED_PUSH_DLE_TIME_US);
+    if (rc != 0) {
+        ESP_LOGW(TAG, "Data length update failed; rc=%d", rc);
+    }
+#if CONFIG_BT_NIMBLE_50_FEATURE_SUPPORT
+    rc = ble_gap_set_prefered_le_phy(entry->conn_handle, BLE_GAP_LE_PHY_2M_MASK,
+                                     BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_CODED_ANY);
+    if (rc != 0) {
+        ESP_LOGW(TAG, "PHY update failed; rc=%d", rc);
+    }
+#endif
+
+    sdu_rx = os_msys_get_pkthdr(CRED_PUSH_RESULT_LEN, 0);
+    if (sdu_rx == NULL) {
+        cred_push_finish(BLE_HS_ENOMEM);
+        return;
+    }
+
+    sent = 0;
+    timed_out = false;
+    result = BLE_HS_ENOTCONN;
+
+    rc = ble_l2cap_connect(entry->conn_handle, CRED_PUSH_PSM, CRED_PUSH_RX_MTU,
+                           sdu_rx, cred_push_on_l2cap, NULL);
+    if (rc != 0) {
+        os_mbuf_free_chain(sdu_rx);
+        ESP_LOGW(TAG, "Bundle channel not opened; rc=%d", rc);
+        cred_push_finish(rc);
+        return;
+    }
+
+    ble_npl_callout_reset(&timeout_callout,
+                          ble_npl_time_ms_to_ticks32(CRED_PUSH_TIMEOUT_MS));
+}
+
+void
+cred_push_init(void)
+{
+    ble_npl_event_init(&start_ev, cred_push_start, NULL);
+    ble_npl_callout_init(&timeout_callout, nimble_port_get_dflt_eventq(),
+                         cred_push_on_timeout, NULL);
+    ble_npl_callout_init(&retry_callout, nimble_port_get_dflt_eventq(),
+                         cred_push_on_retry, NULL);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mqtt_client.h"
+
+/*
+ * Bulk credential provisioning.  A bundle published on "/lock/<id>/bundle"
+ * is forwarded verbatim to the lock over an L2CAP connection-oriented
+ * channel.  The lock checks the bundle's CRC and replaces its whole
+ * credential store in one step; see smart_lock/src/cred_bundle.h for the
+ * format.  The outcome is published on "/lock/<id>/result" with op
+ * "pin_bundle" and the bundle serial as its ID.
+ */
+
+#define CRED_PUSH_PSM               0x0081
+
+/* Header: [u32 magic][u8 version][u8 reserved][u16 count][u32 serial][u32 crc]. */
+#define CRED_PUSH_HDR_LEN           16
+/* A full lock store: the header and 512 records of 12 bytes. */
+#define CRED_PUSH_BUNDLE_MAX        8192
+
+/* Whole push, from opening the channel to the lock's answer. */
+#define CRED_PUSH_TIMEOUT_MS        30000
+
+/**
+ * Sets up the push events on the NimBLE default queue.  Must be called after
+ * nimble_port_init().
+ */
+void cred_push_init(void);
+
+/**
+ * Collects a bundle from MQTT_EVENT_DATA events and starts the push once it
+ * is complete.  Messages larger than the MQTT buffer arrive in several
+ * events, of which only the first carries the topic.  MQTT event loop only.
+ *
+ * @param lock_id The lock the bundle is for, or NULL for the continuation
+ *                of a message.
+ */
+void cred_push_on_mqtt_data(esp_mqtt_event_handle_t event, const char *lock_id);
@@ -0,0 +1,139 @@
+#include "gatt_cache.h"
+
+#include <stdio.h>
+
+#include "esp_log.h"
+#include "nvs.h"
+
+#define TAG "gatt_cache"
+
+#define GATT_CACHE_NAMESPACE    "gatt_cache"
+
+/* Bumped whenever struct gatt_cache_entry changes layout. */
+#define GATT_CACHE_VERSION      3
+
+struct gatt_cache_blob {
+    uint8_t version;
+    struct gatt_cache_entry entry;
+};
+
+static uint32_t cache_hits;
+static uint32_t cache_misses;
+
+/* NVS keys are limited to 15 characters: 'h' plus 12 hex digits. */
+static void
+gatt_cache_key(const ble_addr_t *id_addr, char *key, size_t key_size)
+{
+    snprintf(key, key_size, "h%02x%02x%02x%02x%02x%02x",
+             id_addr->val[5], id_addr->val[4], id_addr->val[3],
+             id_addr->val[2], id_addr->val[1], id_addr->val[0]);
+}
+
+esp_err_t
+gatt_cache_load(const ble_addr_t *id_addr, struct gatt_cache_entry *entry)
+{
+    struct gatt_cache_blob blob;
+    size_t len = sizeof(blob);
+    nvs_handle_t handle;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    esp_err_t ret;
+
+    ret = nvs_open(GATT_CACHE_NAMESPACE, NVS_READONLY, &handle);
+    if (ret != ESP_OK) {
+        return ret == ESP_ERR_NVS_NOT_FOUND ? ESP_ERR_NOT_FOUND : ret;
+    }
+
+    gatt_cache_key(id_addr, key, sizeof(key));
+    ret = nvs_get_blob(handle, key, &blob, &len);
+    nvs_close(handle);
+
+    if (ret == ESP_ERR_NVS_NOT_FOUND) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (len != sizeof(blob) || blob.version != GATT_CACHE_VERSION) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    *entry = blob.entry;
+    return ESP_OK;
+}
+
+esp_err_t
+gatt_cache_store(const ble_addr_t *id_addr, const struct gatt_cache_entry *entry)
+{
+    struct gatt_cache_blob blob = {
+        .version = GATT_CACHE_VERSION,
+        .entry = *entry,
+    };
+    nvs_handle_t handle;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    esp_err_t ret;
+
+    ret = nvs_open(GATT_CACHE_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    gatt_cache_key(id_addr, key, sizeof(key));
+    ret = nvs_set_blob(handle, key, &blob, sizeof(blob));
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to store handles for %s; err=0x%x", key, ret);
+    }
+
+    return ret;
+}
+
+esp_err_t
+gatt_cache_invalidate(const ble_addr_t *id_addr)
+{
+    nvs_handle_t handle;
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    esp_err_t ret;
+
+    ret = nvs_open(GATT_CACHE_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    gatt_cache_key(id_addr, key, sizeof(key));
+    ret = nvs_erase_key(handle, key);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    return ret == ESP_ERR_NVS_NOT_FOUND ? ESP_OK : ret;
+}
+
+void
+gatt_cache_record(bool hit)
+{
+    uint32_t total;
+
+    if (hit) {
+        cache_hits++;
+    } else {
+        cache_misses++;
+    }
+
+    total = cache_hits + cache_misses;
+    ESP_LOGI(TAG, "GATT cache %s; hits=%lu misses=%lu hit rate=%lu%%",
+             hit ? "hit" : "miss", (unsigned long)cache_hits,
+             (unsigned long)cache_misses,
+             (unsigned long)(cache_hits * 100 / total));
+}
+
+void
+gatt_cache_get_stats(struct gatt_cache_stats *stats)
+{
+    stats->hits = cache_hits;
+    stats->misses = cache_misses;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "host/ble_hs.h"
+
+/* Length of the GATT Database Hash characteristic value. */
+#define GATT_CACHE_DB_HASH_LEN  16
+
+/* UUID of the GATT Database Hash characteristic. */
+#define GATT_CACHE_DB_HASH_UUID16   0x2B2A
+
+/**
+ * Lock service handles discovered on a bonded lock, valid for as long as the
+ * lock's GATT Database Hash stays the same.
+ */
+struct gatt_cache_entry {
+    uint8_t db_hash[GATT_CACHE_DB_HASH_LEN];
+    uint16_t state_val_handle;
+    uint16_t state_cccd_handle;
+    uint16_t cmd_val_handle;
+    /* 0 when the lock has no audit log characteristic. */
+    uint16_t audit_val_handle;
+    uint16_t audit_cccd_handle;
+    /* 0 when the lock has no fast command characteristic. */
+    uint16_t fast_cmd_val_handle;
+    uint16_t fast_cmd_cccd_handle;
+};
+
+struct gatt_cache_stats {
+    uint32_t hits;
+    uint32_t misses;
+};
+
+/**
+ * Loads the cached handles for a lock.
+ *
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if nothing is cached for the lock, or
+ *         another NVS error.
+ */
+esp_err_t gatt_cache_load(const ble_addr_t *id_addr, struct gatt_cache_entry *entry);
+
+esp_err_t gatt_cache_store(const ble_addr_t *id_addr, const struct gatt_cache_entry *entry);
+
+esp_err_t gatt_cache_invalidate(const ble_addr_t *id_addr);
+
+/* Called once per reconnect with the outcome of the hash check. */
+void gatt_cache_record(bool hit);
+
+void gatt_cache_get_stats(struct gatt_cache_stats *stats);
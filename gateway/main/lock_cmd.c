@@ -0,0 +1,543 @@
+#include "lock_cmd.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "host/ble_hs.h"
+#include "nimble/nimble_npl.h"
+#include "nimble/nimble_port.h"
+
+#include "metrics.h"
+#include "outbox.h"
+
+#define TAG "lock_cmd"
+
+#define LOCK_CMD_PUBLISHER_STACK_SIZE   3072
+#define LOCK_CMD_PUBLISHER_PRIORITY     5
+
+/* Largest fast path frame: [seq][opcode] and a PIN to add. */
+#define LOCK_CMD_FRAME_MAX              9
+
+/* Retry delay for a command held while the host is out of GATT resources
+ * and none of our own procedures is in flight to free them.
+ */
+#define LOCK_CMD_RETRY_MS               20
+
+/* MQTT event loop -> NimBLE host task. */
+SPSC_RING_DEFINE(cmd_ring, struct lock_cmd, LOCK_CMD_RING_SIZE);
+
+/* NimBLE host task -> result publisher task. */
+SPSC_RING_DEFINE(result_ring, struct lock_cmd_result, LOCK_CMD_RESULT_RING_SIZE);
+
+/*
+ * Everything below up to the publisher is owned by the NimBLE host task: the
+ * dispatcher runs as an event on the host's default queue and the GATT
+ * callbacks run there as well.
+ */
+struct lock_cmd_slot {
+    bool in_use;
+    struct lock_cmd cmd;
+    /* Sent on the fast path; completed by the lock's acknowledgement. */
+    bool wait_ack;
+    uint16_t conn_handle;
+    uint8_t seq;
+    int64_t ack_deadline_us;
+};
+
+static struct ble_npl_event dispatch_ev;
+static struct ble_npl_callout ack_callout;
+static struct ble_npl_callout retry_callout;
+/* Acknowledgements are matched per connection, so one counter serves all
+ * locks.
+ */
+static uint8_t next_seq;
+static struct lock_cmd_slot inflight[LOCK_CMD_INFLIGHT_MAX];
+static struct lock_cmd held_cmd;
+static bool held;
+static uint32_t inflight_count;
+static uint32_t expired_count;
+
+/* Owned by the MQTT event loop. */
+static uint32_t cmd_high_water_logged;
+
+static TaskHandle_t publisher_task;
+static bool initialized;
+
+static const char *
+lock_cmd_op_str(uint8_t op)
+{
+    switch (op) {
+    case LOCK_CMD_LOCK:
+        return "lock";
+    case LOCK_CMD_UNLOCK:
+        return "unlock";
+    case LOCK_CMD_PIN_ADD:
+        return "pin_add";
+    case LOCK_CMD_PIN_REMOVE:
+        return "pin_remove";
+    case LOCK_CMD_PIN_BUNDLE:
+        return "pin_bundle";
+    default:
+        return "?";
+    }
+}
+
+static void
+lock_cmd_complete(const struct lock_cmd *cmd, int status)
+{
+    struct lock_cmd_result result = {
+        .id = cmd->id,
+        .op = cmd->op,
+        .qos = cmd->qos,
+        .status = status,
+        .latency_us = esp_timer_get_time() - cmd->submitted_us,
+    };
+
+    memcpy(result.lock_id, cmd->lock_id, sizeof(result.lock_id));
+
+    if (status == BLE_HS_ETIMEOUT) {
+        expired_count++;
+    }
+    if (cmd->op != LOCK_CMD_PIN_BUNDLE) {
+        metrics_hist_observe(METRIC_GATT_OP_MS, result.latency_us / 1000);
+    }
+
+    /* A full result ring is counted as a drop; the host task never waits. */
+    if (spsc_ring_push(&result_ring, &result)) {
+        xTaskNotifyGive(publisher_task);
+    }
+}
+
+void
+lock_cmd_report(const struct lock_cmd *cmd, int status)
+{
+    lock_cmd_complete(cmd, status);
+}
+
+static void
+lock_cmd_slot_free(struct lock_cmd_slot *slot)
+{
+    slot->in_use = false;
+    slot->wait_ack = false;
+    inflight_count--;
+
+    /* A command may be waiting for a free slot or GATT procedure. */
+    if (held) {
+        ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &dispatch_ev);
+    }
+}
+
+static int
+lock_cmd_on_write(uint16_t conn_handle,
+                  const struct ble_gatt_error *error,
+                  struct ble_gatt_attr *attr,
+                  void *arg)
+{
+    struct lock_cmd_slot *slot = arg;
+
+    lock_cmd_complete(&slot->cmd, error->status);
+    lock_cmd_slot_free(slot);
+
+    return 0;
+}
+
+/**
+ * Arms the acknowledgement timer for the earliest deadline among the
+ * commands still waiting, or stops it if there are none.
+ */
+static void
+lock_cmd_ack_timer_update(void)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t next = INT64_MAX;
+
+    for (int i = 0; i < LOCK_CMD_INFLIGHT_MAX; i++) {
+        if (inflight[i].in_use && inflight[i].wait_ack &&
+            inflight[i].ack_deadline_us < next) {
+            next = inflight[i].ack_deadline_us;
+        }
+    }
+
+    if (next == INT64_MAX) {
+        ble_npl_callout_stop(&ack_callout);
+        return;
+    }
+
+    ble_npl_callout_reset(&ack_callout,
+                          ble_npl_time_ms_to_ticks32(next > now ? (next - now + 999) / 1000 : 0));
+}
+
+static void
+lock_cmd_on_ack_timeout(struct ble_npl_event *ev)
+{
+    int64_t now = esp_timer_get_time();
+
+    /* A lost notification or a frame the lock dropped. */
+    for (int i = 0; i < LOCK_CMD_INFLIGHT_MAX; i++) {
+        if (inflight[i].in_use && inflight[i].wait_ack &&
+            inflight[i].ack_deadline_us <= now) {
+            lock_cmd_complete(&inflight[i].cmd, BLE_HS_ETIMEOUT);
+            lock_cmd_slot_free(&inflight[i]);
+        }
+    }
+
+    lock_cmd_ack_timer_update();
+}
+
+static int
+lock_cmd_ack_status(uint8_t status)
+{
+    switch (status) {
+    case LOCK_CMD_ACK_OK:
+        return 0;
+    case LOCK_CMD_ACK_BUSY:
+        return BLE_HS_EBUSY;
+    case LOCK_CMD_ACK_INVALID:
+        return BLE_HS_EINVAL;
+    case LOCK_CMD_ACK_NO_SPACE:
+        return BLE_HS_ENOMEM;
+    case LOCK_CMD_ACK_EXISTS:
+        return BLE_HS_EALREADY;
+    case LOCK_CMD_ACK_NOT_FOUND:
+        return BLE_HS_ENOENT;
+    default:
+        return BLE_HS_EAPP;
+    }
+}
+
+bool
+lock_cmd_on_notify(uint16_t conn_handle, uint16_t attr_handle,
+                   const struct os_mbuf *om)
+{
+    const struct lock_entry *entry = lock_table_find_conn(conn_handle);
+    uint8_t ack[2];
+    int len;
+
+    if (entry == NULL || entry->fast_cmd_val_handle == 0 ||
+        attr_handle != entry->fast_cmd_val_handle) {
+        return false;
+    }
+
+    len = OS_MBUF_PKTLEN(om);
+    for (int off = 0; off + (int)sizeof(ack) <= len; off += sizeof(ack)) {
+        if (os_mbuf_copydata(om, off, sizeof(ack), ack) != 0) {
+            break;
+        }
+
+        /* Acknowledgements of commands that already timed out find no
+         * slot and are dropped.
+         */
+        for (int i = 0; i < LOCK_CMD_INFLIGHT_MAX; i++) {
+            if (inflight[i].in_use && inflight[i].wait_ack &&
+                inflight[i].conn_handle == conn_handle && inflight[i].seq == ack[0]) {
+                lock_cmd_complete(&inflight[i].cmd, lock_cmd_ack_status(ack[1]));
+                lock_cmd_slot_free(&inflight[i]);
+                break;
+            }
+        }
+    }
+
+    lock_cmd_ack_timer_update();
+    return true;
+}
+
+void
+lock_cmd_link_down(uint16_t conn_handle)
+{
+    for (int i = 0; i < LOCK_CMD_INFLIGHT_MAX; i++) {
+        if (inflight[i].in_use && inflight[i].wait_ack &&
+            inflight[i].conn_handle == conn_handle) {
+            lock_cmd_complete(&inflight[i].cmd, BLE_HS_ENOTCONN);
+            lock_cmd_slot_free(&inflight[i]);
+        }
+    }
+
+    lock_cmd_ack_timer_update();
+}
+
+static int
+lock_cmd_on_subscribe(uint16_t conn_handle,
+                      const struct ble_gatt_error *error,
+                      struct ble_gatt_attr *attr,
+                      void *arg)
+{
+    lock_cmd_done_fn *done = arg;
+
+    if (error->status == 0) {
+        lock_table_set_fast_cmd_ready(conn_handle, true);
+    } else {
+        ESP_LOGW(TAG, "Fast command path not enabled; status=%d", error->status);
+    }
+
+    if (done != NULL) {
+        done(conn_handle);
+    }
+
+    return 0;
+}
+
+void
+lock_cmd_link_up(uint16_t conn_handle, lock_cmd_done_fn *done)
+{
+    const struct lock_entry *entry = lock_table_find_conn(conn_handle);
+    uint8_t value[2];
+    int rc;
+
+    if (entry != NULL && entry->fast_cmd_cccd_handle != 0) {
+        value[0] = 1;
+        value[1] = 0;
+        rc = ble_gattc_write_flat(conn_handle, entry->fast_cmd_cccd_handle,
+                                  value, sizeof(value), lock_cmd_on_subscribe, done);
+        if (rc == 0) {
+            return;
+        }
+        ESP_LOGW(TAG, "Fast command subscribe failed; rc=%d", rc);
+    }
+
+    if (done != NULL) {
+        done(conn_handle);
+    }
+}
+
+static struct lock_cmd_slot *
+lock_cmd_slot_alloc(void)
+{
+    for (int i = 0; i < LOCK_CMD_INFLIGHT_MAX; i++) {
+        if (!inflight[i].in_use) {
+            inflight[i].in_use = true;
+            inflight_count++;
+            return &inflight[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Encodes a command as a fast path frame.
+ *
+ * @return Frame length.
+ */
+static int
+lock_cmd_encode(const struct lock_cmd *cmd, uint8_t seq, uint8_t *frame)
+{
+    frame[0] = seq;
+
+    switch (cmd->op) {
+    case LOCK_CMD_PIN_ADD:
+        frame[1] = LOCK_CMD_FRAME_OP_PIN_ADD;
+        put_le16(&frame[2], cmd->user_id);
+        put_le32(&frame[4], cmd->pin);
+        frame[8] = cmd->pin_digits;
+        return 9;
+    case LOCK_CMD_PIN_REMOVE:
+        frame[1] = LOCK_CMD_FRAME_OP_PIN_REMOVE;
+        put_le16(&frame[2], cmd->user_id);
+        return 4;
+    case LOCK_CMD_UNLOCK:
+        frame[1] = LOCK_CMD_FRAME_OP_UNLOCK;
+        return 2;
+    default:
+        frame[1] = LOCK_CMD_FRAME_OP_LOCK;
+        return 2;
+    }
+}
+
+/**
+ * Starts the GATT procedure for a command.
+ *
+ * @return 0 if started, BLE_HS_EBUSY if it has to wait for a free slot or
+ *         GATT procedure, otherwise the error the command completes with.
+ */
+static int
+lock_cmd_start(const struct lock_cmd *cmd)
+{
+    const struct lock_entry *entry;
+    struct lock_cmd_slot *slot;
+    uint8_t frame[LOCK_CMD_FRAME_MAX];
+    uint8_t value;
+    int len;
+    int rc;
+
+    if (esp_timer_get_time() > cmd->deadline_us) {
+        return BLE_HS_ETIMEOUT;
+    }
+
+    entry = lock_table_find_id(cmd->lock_id, strlen(cmd->lock_id));
+    if (entry == NULL || entry->conn_handle == BLE_HS_CONN_HANDLE_NONE ||
+        entry->cmd_val_handle == 0) {
+        return BLE_HS_ENOTCONN;
+    }
+
+    if (!entry->fast_cmd_ready && cmd->op != LOCK_CMD_LOCK && cmd->op != LOCK_CMD_UNLOCK) {
+        return entry->fast_cmd_val_handle != 0 ? BLE_HS_ENOTCONN : BLE_HS_ENOTSUP;
+    }
+
+    slot = lock_cmd_slot_alloc();
+    if (slot == NULL) {
+        return BLE_HS_EBUSY;
+    }
+    slot->cmd = *cmd;
+
+    if (entry->fast_cmd_ready) {
+        len = lock_cmd_encode(cmd, next_seq, frame);
+        rc = ble_gattc_write_no_rsp_flat(entry->conn_handle, entry->fast_cmd_val_handle,
+                                         frame, len);
+        if (rc == 0) {
+            slot->wait_ack = true;
+            slot->conn_handle = entry->conn_handle;
+            slot->seq = next_seq++;
+            slot->ack_deadline_us = esp_timer_get_time() + LOCK_CMD_ACK_TIMEOUT_MS * 1000LL;
+            lock_cmd_ack_timer_update();
+        }
+    } else {
+        value = cmd->op == LOCK_CMD_UNLOCK ? 0x01 : 0x00;
+        rc = ble_gattc_write_flat(entry->conn_handle, entry->cmd_val_handle,
+                                  &value, sizeof(value), lock_cmd_on_write, slot);
+    }
+    if (rc != 0) {
+        slot->in_use = false;
+        inflight_count--;
+        /* Out of GATT procedures or buffers: held and retried. */
+        return rc == BLE_HS_ENOMEM ? BLE_HS_EBUSY : rc;
+    }
+
+    return 0;
+}
+
+/**
+ * Makes sure a held command is looked at again even if no slot is freed:
+ * soon if nothing of ours is in flight, otherwise by its deadline.
+ */
+static void
+lock_cmd_retry_timer_update(void)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t delay_ms;
+
+    if (inflight_count == 0) {
+        delay_ms = LOCK_CMD_RETRY_MS;
+    } else {
+        delay_ms = held_cmd.deadline_us > now ? (held_cmd.deadline_us - now + 999) / 1000 : 0;
+    }
+
+    ble_npl_callout_reset(&retry_callout, ble_npl_time_ms_to_ticks32(delay_ms));
+}
+
+static void
+lock_cmd_dispatch(struct ble_npl_event *ev)
+{
+    struct lock_cmd cmd;
+    int rc;
+
+    ble_npl_callout_stop(&retry_callout);
+
+    for (;;) {
+        if (held) {
+            cmd = held_cmd;
+            held = false;
+        } else if (!spsc_ring_pop(&cmd_ring, &cmd)) {
+            break;
+        }
+
+        rc = lock_cmd_start(&cmd);
+        if (rc == BLE_HS_EBUSY) {
+            held_cmd = cmd;
+            held = true;
+            lock_cmd_retry_timer_update();
+            break;
+        }
+        if (rc != 0) {
+            lock_cmd_complete(&cmd, rc);
+        }
+    }
+}
+
+void
+lock_cmd_publish_result(const struct lock_cmd_result *result)
+{
+    char topic[sizeof("/lock/") + LOCK_ID_LEN + sizeof("/result")];
+    char payload[96];
+    int len;
+
+    snprintf(topic, sizeof(topic), "/lock/%s/result", result->lock_id);
+    len = snprintf(payload, sizeof(payload),
+                   "{\"id\":%lu,\"op\":\"%s\",\"status\":%d,\"latency_ms\":%lld}",
+                   (unsigned long)result->id, lock_cmd_op_str(result->op),
+                   result->status, result->latency_us / 1000);
+
+    if (outbox_publish(topic, payload, len, result->qos) != ESP_OK) {
+        ESP_LOGW(TAG, "Result of command %lu dropped", (unsigned long)result->id);
+    }
+}
+
+static void
+lock_cmd_publisher_task(void *param)
+{
+    struct lock_cmd_result result;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (spsc_ring_pop(&result_ring, &result)) {
+            lock_cmd_publish_result(&result);
+        }
+    }
+}
+
+void
+lock_cmd_init(void)
+{
+    ble_npl_event_init(&dispatch_ev, lock_cmd_dispatch, NULL);
+    ble_npl_callout_init(&ack_callout, nimble_port_get_dflt_eventq(),
+                         lock_cmd_on_ack_timeout, NULL);
+    ble_npl_callout_init(&retry_callout, nimble_port_get_dflt_eventq(),
+                         lock_cmd_dispatch, NULL);
+
+    xTaskCreate(lock_cmd_publisher_task, "lock_cmd_pub",
+                LOCK_CMD_PUBLISHER_STACK_SIZE, NULL,
+                LOCK_CMD_PUBLISHER_PRIORITY, &publisher_task);
+
+    initialized = true;
+}
+
+int
+lock_cmd_submit(const struct lock_cmd *cmd)
+{
+    struct spsc_ring_stats stats;
+
+    if (!initialized) {
+        return BLE_HS_EDISABLED;
+    }
+
+    if (!spsc_ring_push(&cmd_ring, cmd)) {
+        return BLE_HS_ENOMEM;
+    }
+
+    /* Posting an event that is already queued is a no-op, so a burst of
+     * commands wakes the dispatcher once.
+     */
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &dispatch_ev);
+
+    spsc_ring_get_stats(&cmd_ring, &stats);
+    if (stats.high_water > cmd_high_water_logged) {
+        cmd_high_water_logged = stats.high_water;
+        ESP_LOGI(TAG, "command ring high water %lu/%lu",
+                 (unsigned long)stats.high_water, (unsigned long)stats.capacity);
+    }
+
+    return 0;
+}
+
+void
+lock_cmd_get_stats(struct lock_cmd_stats *stats)
+{
+    spsc_ring_get_stats(&cmd_ring, &stats->cmd);
+    spsc_ring_get_stats(&result_ring, &stats->result);
+    stats->inflight = inflight_count;
+    stats->expired = expired_count;
+}
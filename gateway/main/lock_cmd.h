@@ -0,0 +1,143 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "host/ble_hs.h"
+
+#include "lock_table.h"
+#include "spsc_ring.h"
+
+/* Commands queued between the MQTT event loop and the NimBLE host task. */
+#define LOCK_CMD_RING_SIZE          32
+#define LOCK_CMD_RESULT_RING_SIZE   32
+
+/* GATT writes kept in flight at once, across all locks.  Stays below the
+ * lock's command queue so pipelined frames are never dropped there.
+ */
+#define LOCK_CMD_INFLIGHT_MAX       8
+
+/* How long a frame written without response waits for its acknowledgement. */
+#define LOCK_CMD_ACK_TIMEOUT_MS     2000
+
+/* Deadline applied when the request does not carry one. */
+#define LOCK_CMD_DEFAULT_TIMEOUT_MS 5000
+
+/*
+ * Locks with the fast command characteristic take frames written without
+ * response, [u8 seq][u8 opcode][payload], and acknowledge them by
+ * notification with [u8 seq][u8 status] pairs.  Several frames go out per
+ * connection event; older locks get lock and unlock as write requests.
+ */
+#define LOCK_CMD_FRAME_OP_LOCK          0x01
+#define LOCK_CMD_FRAME_OP_UNLOCK        0x02
+#define LOCK_CMD_FRAME_OP_PIN_ADD       0x10
+#define LOCK_CMD_FRAME_OP_PIN_REMOVE    0x11
+
+#define LOCK_CMD_ACK_OK                 0x00
+#define LOCK_CMD_ACK_BUSY               0x01
+#define LOCK_CMD_ACK_INVALID            0x02
+#define LOCK_CMD_ACK_NO_SPACE           0x03
+#define LOCK_CMD_ACK_EXISTS             0x04
+#define LOCK_CMD_ACK_NOT_FOUND          0x05
+
+/* UUID of the fast command characteristic. */
+#define LOCK_CMD_FAST_UUID_DECLARE()                                            \
+    BLE_UUID128_DECLARE(0xe3, 0x1d, 0x5a, 0x25, 0x83, 0x41, 0x52, 0x86,         \
+                        0xDE, 0xEF, 0x8f, 0x46, 0x08, 0x6f, 0x37, 0x1c)
+
+enum lock_cmd_op {
+    LOCK_CMD_LOCK,
+    LOCK_CMD_UNLOCK,
+    /* Fast command path only. */
+    LOCK_CMD_PIN_ADD,
+    LOCK_CMD_PIN_REMOVE,
+    /* Carried out by cred_push over L2CAP; never queued here. */
+    LOCK_CMD_PIN_BUNDLE,
+};
+
+struct lock_cmd {
+    uint32_t id;
+    char lock_id[LOCK_ID_STR_SIZE];
+    uint8_t op;
+    uint8_t qos;
+    /* PIN_ADD and PIN_REMOVE. */
+    uint16_t user_id;
+    uint32_t pin;
+    uint8_t pin_digits;
+    int64_t submitted_us;
+    int64_t deadline_us;
+};
+
+struct lock_cmd_result {
+    uint32_t id;
+    char lock_id[LOCK_ID_STR_SIZE];
+    uint8_t op;
+    uint8_t qos;
+    /* 0 on success, otherwise a BLE_HS_* or ATT error code.  Statuses
+     * acknowledged by the lock are mapped to BLE_HS_* codes.
+     */
+    int status;
+    int64_t latency_us;
+};
+
+struct lock_cmd_stats {
+    struct spsc_ring_stats cmd;
+    struct spsc_ring_stats result;
+    uint32_t inflight;
+    uint32_t expired;
+};
+
+/**
+ * Sets up the dispatcher event on the NimBLE default queue and starts the
+ * result publisher task.  Must be called after nimble_port_init().
+ */
+void lock_cmd_init(void);
+
+/**
+ * Queues a command for the host task.  Must only be called from the MQTT
+ * event loop, the single producer of the command ring.  Never blocks.
+ *
+ * @return 0 if queued, BLE_HS_ENOMEM if the ring is full, BLE_HS_EDISABLED
+ *         if the dispatcher is not running yet.
+ */
+int lock_cmd_submit(const struct lock_cmd *cmd);
+
+typedef void lock_cmd_done_fn(uint16_t conn_handle);
+
+/**
+ * Enables the acknowledgements of the fast command path on a lock that just
+ * came up.  Host task only.
+ *
+ * @param done Called once the lock is ready, with or without the fast path,
+ *             so the caller can start its next GATT procedure on the link.
+ */
+void lock_cmd_link_up(uint16_t conn_handle, lock_cmd_done_fn *done);
+
+/**
+ * Fails the commands still waiting for an acknowledgement on a link that
+ * went down.  Host task only.
+ */
+void lock_cmd_link_down(uint16_t conn_handle);
+
+/**
+ * Completes the commands acknowledged in a notification.  Host task only.
+ *
+ * @return true if the notification was on the fast command characteristic.
+ */
+bool lock_cmd_on_notify(uint16_t conn_handle, uint16_t attr_handle,
+                        const struct os_mbuf *om);
+
+/**
+ * Reports the result of a command carried out outside the dispatcher
+ * through the result ring.  Host task only.
+ */
+void lock_cmd_report(const struct lock_cmd *cmd, int status);
+
+/**
+ * Publishes a command result on "/lock/<id>/result" through the outbox, so
+ * results produced while the broker is unreachable are kept.
+ */
+void lock_cmd_publish_result(const struct lock_cmd_result *result);
+
+void lock_cmd_get_stats(struct lock_cmd_stats *stats);
@@ -0,0 +1,374 @@
+#include "lock_status.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "mbedtls/md.h"
+#include "nvs.h"
+
+#include "adv_parse.h"
+
+#define TAG "lock_status"
+
+#define LOCK_STATUS_NAMESPACE       "status_key"
+
+/* Bytes covered by the tag, after the company ID. */
+#define LOCK_STATUS_SIGNED_LEN      4
+
+/*
+ * The tag is short enough to be guessed, so after a few bad tags from an
+ * address its reports are ignored for a while, doubling with every further
+ * bad tag.  A forgery then takes months instead of minutes.
+ */
+#define LOCK_STATUS_BAD_TAG_FREE    4
+#define LOCK_STATUS_BACKOFF_BASE_MS 1000
+#define LOCK_STATUS_BACKOFF_MAX_MS  (10 * 60 * 1000)
+
+enum lock_status_key {
+    LOCK_STATUS_KEY_UNKNOWN,
+    LOCK_STATUS_KEY_NONE,
+    LOCK_STATUS_KEY_VALID,
+};
+
+struct lock_status_entry {
+    bool in_use;
+    ble_addr_t addr;
+    char id[LOCK_ID_STR_SIZE];
+    uint8_t key_state;
+    uint8_t key[LOCK_STATUS_KEY_LEN];
+    bool status_valid;
+    struct lock_status status;
+    int64_t seen_us;
+    uint32_t bad_tags;
+    int64_t blocked_until_us;
+};
+
+/*
+ * Written from the NimBLE host task only; lock_status_snapshot() reads it
+ * from other tasks, so writes of the status are done under the mux.
+ */
+static struct lock_status_entry entries[LOCK_STATUS_MAX];
+static portMUX_TYPE lock_status_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static struct lock_status_stats stats;
+
+/* NVS keys are limited to 15 characters: 'k' plus 12 hex digits. */
+static void
+lock_status_nvs_key(const ble_addr_t *addr, char *key, size_t key_size)
+{
+    snprintf(key, key_size, "k%02x%02x%02x%02x%02x%02x",
+             addr->val[5], addr->val[4], addr->val[3],
+             addr->val[2], addr->val[1], addr->val[0]);
+}
+
+static void
+lock_status_load_key(struct lock_status_entry *entry)
+{
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    size_t len = sizeof(entry->key);
+    nvs_handle_t handle;
+    esp_err_t ret;
+
+    entry->key_state = LOCK_STATUS_KEY_NONE;
+
+    if (nvs_open(LOCK_STATUS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+
+    lock_status_nvs_key(&entry->addr, key, sizeof(key));
+    ret = nvs_get_blob(handle, key, entry->key, &len);
+    nvs_close(handle);
+
+    if (ret == ESP_OK && len == sizeof(entry->key)) {
+        entry->key_state = LOCK_STATUS_KEY_VALID;
+    }
+}
+
+static void
+lock_status_store_key(const ble_addr_t *addr, const uint8_t *value)
+{
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    nvs_handle_t handle;
+    esp_err_t ret;
+
+    ret = nvs_open(LOCK_STATUS_NAMESPACE, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "nvs_open failed: %s", esp_err_to_name(ret));
+        return;
+    }
+
+    lock_status_nvs_key(addr, key, sizeof(key));
+    ret = nvs_set_blob(handle, key, value, LOCK_STATUS_KEY_LEN);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Status key not stored: %s", esp_err_to_name(ret));
+    }
+}
+
+static struct lock_status_entry *
+lock_status_find(const ble_addr_t *addr)
+{
+    for (int i = 0; i < LOCK_STATUS_MAX; i++) {
+        if (entries[i].in_use && ble_addr_cmp(&entries[i].addr, addr) == 0) {
+            return &entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns the entry for the lock, taking a free slot or the one seen least
+ * recently if needed.  Locks with a known key are only given up when all
+ * entries have one, so a flood of made-up addresses cannot push out a lock
+ * and its bad tag backoff.
+ */
+static struct lock_status_entry *
+lock_status_get(const ble_addr_t *addr)
+{
+    struct lock_status_entry *entry = lock_status_find(addr);
+    bool entry_keyed = false;
+    bool keyed;
+
+    if (entry != NULL) {
+        return entry;
+    }
+
+    for (int i = 0; i < LOCK_STATUS_MAX; i++) {
+        if (!entries[i].in_use) {
+            entry = &entries[i];
+            break;
+        }
+        keyed = entries[i].key_state == LOCK_STATUS_KEY_VALID;
+        if (entry == NULL || (entry_keyed && !keyed) ||
+            (entry_keyed == keyed && entries[i].seen_us < entry->seen_us)) {
+            entry = &entries[i];
+            entry_keyed = keyed;
+        }
+    }
+    if (entry->in_use) {
+        stats.table_full++;
+    }
+
+    portENTER_CRITICAL(&lock_status_mux);
+    memset(entry, 0, sizeof(*entry));
+    entry->in_use = true;
+    entry->addr = *addr;
+    snprintf(entry->id, sizeof(entry->id), "%02x%02x%02x%02x%02x%02x",
+             addr->val[5], addr->val[4], addr->val[3],
+             addr->val[2], addr->val[1], addr->val[0]);
+    portEXIT_CRITICAL(&lock_status_mux);
+
+    return entry;
+}
+
+static bool
+lock_status_tag_ok(const struct lock_status_entry *entry, const uint8_t *signed_part)
+{
+    uint8_t input[sizeof(entry->addr.val) + LOCK_STATUS_SIGNED_LEN];
+    uint8_t mac[32];
+
+    memcpy(input, entry->addr.val, sizeof(entry->addr.val));
+    memcpy(&input[sizeof(entry->addr.val)], signed_part, LOCK_STATUS_SIGNED_LEN);
+
+    if (mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                        entry->key, sizeof(entry->key),
+                        input, sizeof(input), mac) != 0) {
+        return false;
+    }
+
+    return memcmp(mac, &signed_part[LOCK_STATUS_SIGNED_LEN], LOCK_STATUS_TAG_LEN) == 0;
+}
+
+static void
+lock_status_bad_tag(struct lock_status_entry *entry)
+{
+    uint32_t shift;
+    int64_t backoff_ms;
+
+    entry->bad_tags++;
+    if (entry->bad_tags < LOCK_STATUS_BAD_TAG_FREE) {
+        return;
+    }
+
+    shift = entry->bad_tags - LOCK_STATUS_BAD_TAG_FREE;
+    backoff_ms = shift < 20 ? (int64_t)LOCK_STATUS_BACKOFF_BASE_MS << shift :
+                              LOCK_STATUS_BACKOFF_MAX_MS;
+    if (backoff_ms > LOCK_STATUS_BACKOFF_MAX_MS) {
+        backoff_ms = LOCK_STATUS_BACKOFF_MAX_MS;
+    }
+    entry->blocked_until_us = entry->seen_us + backoff_ms * 1000;
+
+    if (entry->bad_tags == LOCK_STATUS_BAD_TAG_FREE) {
+        ESP_LOGW(TAG, "Bad status tags from %s, backing off", entry->id);
+    }
+}
+
+bool
+lock_status_on_adv(const ble_addr_t *addr, const uint8_t *data, uint8_t len)
+{
+    struct lock_status_entry *entry;
+    struct adv_iter it;
+    struct adv_field field;
+    const uint8_t *signed_part = NULL;
+    uint16_t counter;
+
+    adv_iter_init(&it, data, len);
+    while (adv_iter_next(&it, &field)) {
+        if (field.type == ADV_TYPE_MFG_DATA && field.len == LOCK_STATUS_DATA_LEN &&
+            get_le16(field.val) == LOCK_STATUS_COMPANY_ID &&
+            (field.val[2] >> 4) == LOCK_STATUS_VERSION) {
+            signed_part = &field.val[2];
+            break;
+        }
+    }
+    if (signed_part == NULL) {
+        return false;
+    }
+
+    entry = lock_status_get(addr);
+    entry->seen_us = esp_timer_get_time();
+
+    if (entry->key_state == LOCK_STATUS_KEY_UNKNOWN) {
+        lock_status_load_key(entry);
+    }
+    if (entry->key_state != LOCK_STATUS_KEY_VALID) {
+        stats.no_key++;
+        return false;
+    }
+
+    /* The controller drops reports whose address and data both match an
+     * earlier one (CONFIG_BTDM_SCAN_DUPL_TYPE_DATA_DEVICE), so a changed
+     * status always gets here; an older or repeated counter is a replay
+     * or a lock that was reset.
+     */
+    counter = get_le16(&signed_part[2]);
+    if (entry->status_valid && (int16_t)(counter - entry->status.counter) <= 0) {
+        stats.replayed++;
+        return false;
+    }
+
+    if (entry->seen_us < entry->blocked_until_us) {
+        stats.blocked++;
+        return false;
+    }
+
+    if (!lock_status_tag_ok(entry, signed_part)) {
+        stats.bad_tag++;
+        lock_status_bad_tag(entry);
+        return false;
+    }
+    entry->bad_tags = 0;
+
+    portENTER_CRITICAL(&lock_status_mux);
+    entry->status.state = signed_part[0] & 0x0f;
+    entry->status.battery = signed_part[1];
+    entry->status.counter = counter;
+    entry->status.updated_us = entry->seen_us;
+    entry->status_valid = true;
+    portEXIT_CRITICAL(&lock_status_mux);
+
+    stats.accepted++;
+    return true;
+}
+
+static int
+lock_status_on_key_read(uint16_t conn_handle, const struct ble_gatt_error *error,
+                        struct ble_gatt_attr *attr, void *arg)
+{
+    lock_status_done_fn *done = arg;
+    const struct lock_entry *lock;
+    struct lock_status_entry *entry;
+    uint8_t key[LOCK_STATUS_KEY_LEN];
+
+    /* Called per matching attribute, then once more with BLE_HS_EDONE or
+     * the error that ended the procedure.
+     */
+    if (error->status != 0 || attr == NULL) {
+        if (done != NULL) {
+            done(conn_handle);
+        }
+        return 0;
+    }
+
+    lock = lock_table_find_conn(conn_handle);
+    if (lock == NULL || OS_MBUF_PKTLEN(attr->om) != sizeof(key) ||
+        os_mbuf_copydata(attr->om, 0, sizeof(key), key) != 0) {
+        return 0;
+    }
+
+    entry = lock_status_get(&lock->id_addr);
+    entry->seen_us = esp_timer_get_time();
+    if (entry->key_state == LOCK_STATUS_KEY_UNKNOWN) {
+        lock_status_load_key(entry);
+    }
+    if (entry->key_state == LOCK_STATUS_KEY_VALID &&
+        memcmp(entry->key, key, sizeof(key)) == 0) {
+        return 0;
+    }
+
+    /* A new key comes with a fresh counter sequence. */
+    lock_status_store_key(&lock->id_addr, key);
+    memcpy(entry->key, key, sizeof(key));
+    entry->key_state = LOCK_STATUS_KEY_VALID;
+    portENTER_CRITICAL(&lock_status_mux);
+    entry->status_valid = false;
+    portEXIT_CRITICAL(&lock_status_mux);
+
+    ESP_LOGI(TAG, "Status key updated for lock %s", lock->id);
+    return 0;
+}
+
+void
+lock_status_link_up(uint16_t conn_handle, lock_status_done_fn *done)
+{
+    int rc;
+
+    /* Locks without the characteristic answer with an error; nothing is
+     * stored for them.
+     */
+    rc = ble_gattc_read_by_uuid(conn_handle, 1, 0xffff, LOCK_STATUS_KEY_UUID_DECLARE(),
+                                lock_status_on_key_read, done);
+    if (rc != 0) {
+        ESP_LOGW(TAG, "Status key read failed; rc=%d", rc);
+        if (done != NULL) {
+            done(conn_handle);
+        }
+    }
+}
+
+bool
+lock_status_snapshot(const char *id, size_t id_len, struct lock_status *out)
+{
+    bool found = false;
+
+    if (id_len != LOCK_ID_LEN) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&lock_status_mux);
+    for (int i = 0; i < LOCK_STATUS_MAX; i++) {
+        if (entries[i].in_use && entries[i].status_valid &&
+            strncmp(entries[i].id, id, id_len) == 0) {
+            *out = entries[i].status;
+            found = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&lock_status_mux);
+
+    return found;
+}
+
+void
+lock_status_get_stats(struct lock_status_stats *out)
+{
+    *out = stats;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "host/ble_hs.h"
+
+#include "lock_table.h"
+
+/*
+ * Lock status decoded from advertising reports.
+ *
+ * Locks carry their state, battery level and an event counter in
+ * manufacturer specific data:
+ *
+ *   [u16 company ID][u8 version << 4 | state][u8 battery %]
+ *   [u16 counter][u16 tag]
+ *
+ * The tag is the first two bytes of HMAC-SHA256(status key, identity address
+ * || version/state, battery, counter).  The status key is read once from the
+ * lock over an encrypted link and kept in NVS, so a lock stays monitored
+ * while it is out of connection slots.  Reports with a bad tag or a counter
+ * that is not newer than the last one are dropped, and an address that keeps
+ * sending bad tags is ignored for a growing time.
+ *
+ * The tag is only 16 bits: an advertised status is a hint, not the lock's
+ * word.  Replies built from it say so.
+ */
+
+/* Locks followed by advertising, connected or not. */
+#define LOCK_STATUS_MAX             32
+
+#define LOCK_STATUS_COMPANY_ID      0xFFFF
+#define LOCK_STATUS_VERSION         1
+#define LOCK_STATUS_KEY_LEN         16
+#define LOCK_STATUS_TAG_LEN         2
+#define LOCK_STATUS_DATA_LEN        8
+
+/* UUID of the status key characteristic. */
+#define LOCK_STATUS_KEY_UUID_DECLARE()                                          \
+    BLE_UUID128_DECLARE(0xe3, 0x1d, 0x5a, 0x25, 0x83, 0x41, 0x52, 0x86,         \
+                        0xDE, 0xEF, 0x8f, 0x46, 0x07, 0x6f, 0x37, 0x1c)
+
+struct lock_status {
+    uint8_t state;
+    uint8_t battery;
+    uint16_t counter;
+    int64_t updated_us;
+};
+
+struct lock_status_stats {
+    uint32_t accepted;
+    uint32_t replayed;
+    uint32_t bad_tag;
+    /* Reports ignored while an address is backed off for bad tags. */
+    uint32_t blocked;
+    /* Reports from locks whose status key is not known yet. */
+    uint32_t no_key;
+    uint32_t table_full;
+};
+
+/**
+ * Decodes the status in an advertising report from a lock.  Host task only.
+ *
+ * @return true if the report carried a valid, new status.
+ */
+bool lock_status_on_adv(const ble_addr_t *addr, const uint8_t *data, uint8_t len);
+
+typedef void lock_status_done_fn(uint16_t conn_handle);
+
+/**
+ * Reads the status key from a lock that just came up and stores it.  Host
+ * task only.
+ *
+ * @param done Called once the read has finished, successfully or not, so the
+ *             caller can start its next GATT procedure on the link.
+ */
+void lock_status_link_up(uint16_t conn_handle, lock_status_done_fn *done);
+
+/**
+ * Copies the last advertised status of a lock.  Safe to call from any task.
+ *
+ * @return true if a verified status has been received.
+ */
+bool lock_status_snapshot(const char *id, size_t id_len, struct lock_status *out);
+
+void lock_status_get_stats(struct lock_status_stats *stats);
@@ -0,0 +1,301 @@
+#include "lock_table.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+/*
+ * The table is only modified from the NimBLE host task.  Other tasks read
+ * it through lock_table_snapshot(), so every write is done under the mux.
+ */
+static struct lock_entry lock_table[LOCK_TABLE_SIZE];
+static portMUX_TYPE lock_table_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void
+lock_id_from_addr(const ble_addr_t *addr, char *id)
+{
+    snprintf(id, LOCK_ID_STR_SIZE, "%02x%02x%02x%02x%02x%02x",
+             addr->val[5], addr->val[4], addr->val[3],
+             addr->val[2], addr->val[1], addr->val[0]);
+}
+
+void
+lock_table_init(void)
+{
+    portENTER_CRITICAL(&lock_table_mux);
+    memset(lock_table, 0, sizeof(lock_table));
+    for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
+        lock_table[i].conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    }
+    portEXIT_CRITICAL(&lock_table_mux);
+}
+
+struct lock_entry *
+lock_table_attach(const ble_addr_t *id_addr, uint16_t conn_handle)
+{
+    struct lock_entry *entry;
+
+    entry = lock_table_find_addr(id_addr);
+    if (entry == NULL) {
+        /* Prefer a free slot, then one of a lock that is not connected. */
+        for (int i = 0; i < LOCK_TABLE_SIZE && entry == NULL; i++) {
+            if (!lock_table[i].in_use) {
+                entry = &lock_table[i];
+            }
+        }
+        for (int i = 0; i < LOCK_TABLE_SIZE && entry == NULL; i++) {
+            if (lock_table[i].conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+                entry = &lock_table[i];
+            }
+        }
+        if (entry == NULL) {
+            return NULL;
+        }
+
+        portENTER_CRITICAL(&lock_table_mux);
+        memset(entry, 0, sizeof(*entry));
+        entry->in_use = true;
+        entry->id_addr = *id_addr;
+        lock_id_from_addr(id_addr, entry->id);
+        portEXIT_CRITICAL(&lock_table_mux);
+    }
+
+    portENTER_CRITICAL(&lock_table_mux);
+    entry->conn_handle = conn_handle;
+    entry->state_val_handle = 0;
+    entry->state_cccd_handle = 0;
+    entry->cmd_val_handle = 0;
+    entry->audit_val_handle = 0;
+    entry->audit_cccd_handle = 0;
+    entry->fast_cmd_val_handle = 0;
+    entry->fast_cmd_cccd_handle = 0;
+    entry->fast_cmd_ready = false;
+    entry->audit_ready = false;
+    entry->audit_busy = false;
+    entry->db_hash_valid = false;
+    entry->link_up_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&lock_table_mux);
+
+    return entry;
+}
+
+void
+lock_table_detach(uint16_t conn_handle)
+{
+    struct lock_entry *entry = lock_table_find_conn(conn_handle);
+
+    if (entry == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&lock_table_mux);
+    entry->conn_handle = BLE_HS_CONN_HANDLE_NONE;
+    portEXIT_CRITICAL(&lock_table_mux);
+}
+
+struct lock_entry *
+lock_table_find_conn(uint16_t conn_handle)
+{
+    if (conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+        return NULL;
+    }
+
+    for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
+        if (lock_table[i].in_use && lock_table[i].conn_handle == conn_handle) {
+            return &lock_table[i];
+        }
+    }
+
+    return NULL;
+}
+
+struct lock_entry *
+lock_table_find_addr(const ble_addr_t *addr)
+{
+    for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
+        if (lock_table[i].in_use && ble_addr_cmp(&lock_table[i].id_addr, addr) == 0) {
+            return &lock_table[i];
+        }
+    }
+
+    return NULL;
+}
+
+struct lock_entry *
+lock_table_find_id(const char *id, size_t id_len)
+{
+    if (id_len != LOCK_ID_LEN) {
+        return NULL;
+    }
+
+    for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
+        if (lock_table[i].in_use && strncmp(lock_table[i].id, id, LOCK_ID_LEN) == 0) {
+            return &lock_table[i];
+        }
+    }
+
+    return NULL;
+}
+
+int
+lock_table_connected_count(void)
+{
+    int count = 0;
+
+    for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
+        if (lock_table[i].in_use && lock_table[i].conn_handle != BLE_HS_CONN_HANDLE_NONE) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+void
+lock_table_set_handles(uint16_t conn_handle, uint16_t state_val_handle,
+                       uint16_t state_cccd_handle, uint16_t cmd_val_handle)
+{
+    struct lock_entry *entry = lock_table_find_conn(conn_handle);
+
+    if (entry == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&lock_table_mux);
+    entry->state_val_handle = state_val_handle;
+    entry->state_cccd_handle = state_cccd_handle;
+    entry->cmd_val_handle = cmd_val_handle;
+    portEXIT_CRITICAL(&lock_table_mux);
+}
+
+void
+lock_table_set_audit_handles(uint16_t conn_handle, uint16_t audit_val_handle,
+                             uint16_t audit_cccd_handle)
+{
+    struct lock_entry *entry = lock_table_find_conn(conn_handle);
+
+    if (entry == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&lock_table_mux);
+    entry->audit_val_handle = audit_val_handle;
+    entry->audit_cccd_handle = audit_cccd_handle;
+    portEXIT_CRITICAL(&lock_table_mux);
+}
+
+void
+lock_table_set_fast_cmd_handles(uint16_t conn_handle, uint16_t val_handle,
+                                uint16_t cccd_handle)
+{
+    struct lock_entry *entry = lock_table_find_conn(conn_handle);
+
+    if (entry == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&lock_table_mux);
+    entry->fast_cmd_val_handle = val_handle;
+    entry->fast_cmd_cccd_handle = cccd_handle;
+    portEXIT_CRITICAL(&lock_table_mux);
+}
+
+void
+lock_table_set_fast_cmd_ready(uint16_t conn_handle, bool ready)
+{
+    struct lock_entry *entry = lock_table_find_conn(conn_handle);
+
+    if (entry == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&lock_table_mux);
+    entry->fast_cmd_ready = ready;
+    portEXIT_CRITICAL(&lock_table_mux);
+}
+
+void
+lock_table_set_audit_state(uint16_t conn_handle, bool ready, bool busy,
+                           uint32_t next_seq)
+{
+    struct lock_entry *entry = lock_table_find_conn(conn_handle);
+
+    if (entry == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&lock_table_mux);
+    entry->audit_ready = ready;
+    entry->audit_busy = busy;
+    entry->audit_cursor_valid = true;
+    entry->audit_next_seq = next_seq;
+    entry->audit_updated_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&lock_table_mux);
+}
+
+struct lock_entry *
+lock_table_get(int index)
+{
+    if (index < 0 || index >= LOCK_TABLE_SIZE || !lock_table[index].in_use) {
+        return NULL;
+    }
+
+    return &lock_table[index];
+}
+
+void
+lock_table_set_db_hash(uint16_t conn_handle, const uint8_t *db_hash)
+{
+    struct lock_entry *entry = lock_table_find_conn(conn_handle);
+
+    if (entry == NULL) {
+        return;
+    }
+
+    portENTER_CRITICAL(&lock_table_mux);
+    memcpy(entry->db_hash, db_hash, sizeof(entry->db_hash));
+    entry->db_hash_valid = true;
+    portEXIT_CRITICAL(&lock_table_mux);
+}
+
+bool
+lock_table_store_state(uint16_t conn_handle, uint16_t attr_handle, uint8_t state)
+{
+    struct lock_entry *entry = lock_table_find_conn(conn_handle);
+
+    if (entry == NULL || entry->state_val_handle != attr_handle) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&lock_table_mux);
+    entry->state = state;
+    entry->state_valid = true;
+    entry->state_updated_us = esp_timer_get_time();
+    portEXIT_CRITICAL(&lock_table_mux);
+
+    return true;
+}
+
+bool
+lock_table_snapshot(const char *id, size_t id_len, struct lock_entry *out)
+{
+    bool found = false;
+
+    if (id_len != LOCK_ID_LEN) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&lock_table_mux);
+    for (int i = 0; i < LOCK_TABLE_SIZE; i++) {
+        if (lock_table[i].in_use && strncmp(lock_table[i].id, id, LOCK_ID_LEN) == 0) {
+            *out = lock_table[i];
+            found = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&lock_table_mux);
+
+    return found;
+}
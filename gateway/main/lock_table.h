@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "host/ble_hs.h"
+
+#include "gatt_cache.h"
+
+/* One slot per connection the host can hold. */
+#define LOCK_TABLE_SIZE             MYNEWT_VAL(BLE_MAX_CONNECTIONS)
+
+/* Per-lock share of the esp_central peer pools passed to peer_init(). */
+#define LOCK_PEER_SVCS_PER_LOCK     8
+#define LOCK_PEER_CHRS_PER_LOCK     24
+#define LOCK_PEER_DSCS_PER_LOCK     16
+
+/* Lock ID: identity address as 12 lowercase hex digits, MSB first. */
+#define LOCK_ID_LEN                 12
+#define LOCK_ID_STR_SIZE            (LOCK_ID_LEN + 1)
+
+struct lock_entry {
+    bool in_use;
+    ble_addr_t id_addr;
+    char id[LOCK_ID_STR_SIZE];
+
+    /* BLE_HS_CONN_HANDLE_NONE while the lock is not connected. */
+    uint16_t conn_handle;
+    uint16_t state_val_handle;
+    uint16_t state_cccd_handle;
+    uint16_t cmd_val_handle;
+
+    /* Audit log characteristic; 0 on locks without one. */
+    uint16_t audit_val_handle;
+    uint16_t audit_cccd_handle;
+
+    /* Write-without-response command characteristic; 0 on locks without
+     * one.  Commands take that path once its acknowledgements are enabled
+     * on this link.
+     */
+    uint16_t fast_cmd_val_handle;
+    uint16_t fast_cmd_cccd_handle;
+    bool fast_cmd_ready;
+
+    /* Audit download state, owned by the NimBLE host task.  The cursor is the
+     * next sequence number to request; it survives reconnects and is seeded
+     * from the acknowledged cursor in NVS the first time the lock is seen.
+     */
+    bool audit_ready;
+    bool audit_busy;
+    bool audit_cursor_valid;
+    uint32_t audit_next_seq;
+    int64_t audit_updated_us;
+
+    /* GATT Database Hash read on this connection, if the lock has one. */
+    bool db_hash_valid;
+    uint8_t db_hash[GATT_CACHE_DB_HASH_LEN];
+
+    /* When the current link came up; used for time-to-ready. */
+    int64_t link_up_us;
+
+    bool state_valid;
+    uint8_t state;
+    int64_t state_updated_us;
+};
+
+void lock_table_init(void);
+
+/**
+ * Binds a connection to the lock with the given identity address.  The
+ * existing slot is reused when the lock has been seen before, otherwise a
+ * free slot is taken.
+ *
+ * @return The entry, or NULL if the table is full.
+ */
+struct lock_entry *lock_table_attach(const ble_addr_t *id_addr, uint16_t conn_handle);
+
+/**
+ * Marks the lock bound to the connection as disconnected.  The slot and the
+ * last known state are kept so the lock reuses them on reconnect.
+ */
+void lock_table_detach(uint16_t conn_handle);
+
+/* Lookups below must run on the NimBLE host task. */
+struct lock_entry *lock_table_find_conn(uint16_t conn_handle);
+struct lock_entry *lock_table_find_addr(const ble_addr_t *addr);
+struct lock_entry *lock_table_find_id(const char *id, size_t id_len);
+
+int lock_table_connected_count(void);
+
+/**
+ * Records the lock service handles for the connection, either resolved by
+ * service discovery or taken from the GATT cache.
+ */
+void lock_table_set_handles(uint16_t conn_handle, uint16_t state_val_handle,
+                            uint16_t state_cccd_handle, uint16_t cmd_val_handle);
+
+/**
+ * Records the audit log handles for the connection.  Both are 0 when the
+ * lock does not keep an audit log.
+ */
+void lock_table_set_audit_handles(uint16_t conn_handle, uint16_t audit_val_handle,
+                                  uint16_t audit_cccd_handle);
+
+/**
+ * Records the fast command handles for the connection.  Both are 0 when the
+ * lock only takes commands with a write request.
+ */
+void lock_table_set_fast_cmd_handles(uint16_t conn_handle, uint16_t val_handle,
+                                     uint16_t cccd_handle);
+
+/**
+ * Marks the fast command path of the lock on the connection as usable.
+ */
+void lock_table_set_fast_cmd_ready(uint16_t conn_handle, bool ready);
+
+/**
+ * Updates the audit download state of the lock on the connection.
+ *
+ * @param ready    Notifications are enabled on this link.
+ * @param busy     A download is running.
+ * @param next_seq Next sequence number to request.
+ */
+void lock_table_set_audit_state(uint16_t conn_handle, bool ready, bool busy,
+                                uint32_t next_seq);
+
+/**
+ * Returns the entry in the given slot, or NULL if the slot is free.  Used to
+ * walk the table from the host task.
+ */
+struct lock_entry *lock_table_get(int index);
+
+/**
+ * Records the GATT Database Hash read from the lock on this connection.
+ */
+void lock_table_set_db_hash(uint16_t conn_handle, const uint8_t *db_hash);
+
+/**
+ * Stores a lock state value received from the lock.
+ *
+ * @return true if the value belonged to a tracked lock state characteristic.
+ */
+bool lock_table_store_state(uint16_t conn_handle, uint16_t attr_handle, uint8_t state);
+
+/**
+ * Copies the entry for the given lock ID.  Safe to call from any task.
+ *
+ * @return true if the lock is known.
+ */
+bool lock_table_snapshot(const char *id, size_t id_len, struct lock_entry *out);
@@ -30,6 +30,16 @@
 
 #include "esp_wifi.h"
 #include "wifi.h"
+#include "lock_table.h"
+#include "lock_cmd.h"
+#include "cred_push.h"
+#include "gatt_cache.h"
+#include "audit_uplink.h"
+#include "outbox.h"
+#include "boot.h"
+#include "scan.h"
+#include "lock_status.h"
+#include "metrics.h"
 
 #include "freertos/task.h"
 #include "wifi_credential.h"
@@ -38,28 +48,6 @@
 #define WIFI_SSID SSID
 #define WIFI_PASSWORD PASSWORD
 
-#if CONFIG_EXAMPLE_USE_CI_ADDRESS
-#ifdef CONFIG_IDF_TARGET_ESP32
-#define TEST_CI_ADDRESS_CHIP_OFFSET (0)
-#elif CONFIG_IDF_TARGET_ESP32C2
-#define TEST_CI_ADDRESS_CHIP_OFFSET (1)
-#elif CONFIG_IDF_TARGET_ESP32C3
-#define TEST_CI_ADDRESS_CHIP_OFFSET (2)
-#elif CONFIG_IDF_TARGET_ESP32C6
-#define TEST_CI_ADDRESS_CHIP_OFFSET (3)
-#elif CONFIG_IDF_TARGET_ESP32C5
-#define TEST_CI_ADDRESS_CHIP_OFFSET (4)
-#elif CONFIG_IDF_TARGET_ESP32H2
-#define TEST_CI_ADDRESS_CHIP_OFFSET (5)
-#elif CONFIG_IDF_TARGET_ESP32P4
-#define TEST_CI_ADDRESS_CHIP_OFFSET (6)
-#elif CONFIG_IDF_TARGET_ESP32S3
-#define TEST_CI_ADDRESS_CHIP_OFFSET (7)
-#elif CONFIG_IDF_TARGET_ESP32C61
-#define TEST_CI_ADDRESS_CHIP_OFFSET (8)
-#endif
-#endif
-
 static const char *tag = "NimBLE_BLE_CENT";
 
 static void log_error_if_nonzero(const char *message, int error_code)
@@ -70,13 +58,204 @@ static void log_error_if_nonzero(const char *message, int error_code)
 }
 
 #include "mqtt_client.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+
+#define LOCK_TOPIC_PREFIX       "/lock/"
+#define LOCK_CMD_TOPIC_SUFFIX   "/cmd"
+#define LOCK_BUNDLE_TOPIC_SUFFIX "/bundle"
+
+/**
+ * Extracts the lock ID from a "/lock/<id><suffix>" topic.
+ *
+ * @return 0 on success, -1 if the topic does not have that form.
+ */
+static int
+lock_topic_parse_id(const char *topic, int topic_len, const char *suffix,
+                    const char **id, size_t *id_len)
+{
+    const size_t prefix_len = strlen(LOCK_TOPIC_PREFIX);
+    const size_t suffix_len = strlen(suffix);
+
+    if ((size_t)topic_len != prefix_len + LOCK_ID_LEN + suffix_len ||
+        strncmp(topic, LOCK_TOPIC_PREFIX, prefix_len) != 0 ||
+        strncmp(topic + prefix_len + LOCK_ID_LEN, suffix, suffix_len) != 0) {
+        return -1;
+    }
+
+    *id = topic + prefix_len;
+    *id_len = LOCK_ID_LEN;
+    return 0;
+}
+
+/**
+ * Answers a lock state query from the lock table, which is kept current by
+ * notifications, or from the status the lock advertises when it has no link.
+ * No GATT procedure is started, so the reply costs no radio airtime.
+ *
+ * "authoritative" is false for an advertised status: its 16-bit tag can be
+ * forged with enough tries, so it must not be acted on like state read over
+ * the encrypted link.
+ */
+static void
+lock_state_publish_cached(esp_mqtt_client_handle_t client, const char *id, size_t id_len)
+{
+    struct lock_entry snapshot;
+    struct lock_status status;
+    char topic[sizeof(LOCK_TOPIC_PREFIX) + LOCK_ID_LEN + sizeof("/state")];
+    char payload[128];
+    bool have_gatt;
+    int len;
+
+    snprintf(topic, sizeof(topic), LOCK_TOPIC_PREFIX "%.*s/state", (int)id_len, id);
+
+    have_gatt = lock_table_snapshot(id, id_len, &snapshot) && snapshot.state_valid;
+
+    if (lock_status_snapshot(id, id_len, &status) &&
+        (!have_gatt || (snapshot.conn_handle == BLE_HS_CONN_HANDLE_NONE &&
+                        status.updated_us > snapshot.state_updated_us))) {
+        len = snprintf(payload, sizeof(payload),
+                       "{\"state\":%u,\"battery\":%u,\"age_ms\":%lld,"
+                       "\"connected\":false,\"source\":\"adv\",\"authoritative\":false}",
+                       status.state, status.battery,
+                       (esp_timer_get_time() - status.updated_us) / 1000);
+    } else if (!have_gatt) {
+        len = snprintf(payload, sizeof(payload), "{\"state\":null}");
+    } else {
+        len = snprintf(payload, sizeof(payload),
+                       "{\"state\":%u,\"age_ms\":%lld,\"connected\":%s,"
+                       "\"source\":\"gatt\",\"authoritative\":true}",
+                       snapshot.state,
+                       (esp_timer_get_time() - snapshot.state_updated_us) / 1000,
+                       snapshot.conn_handle != BLE_HS_CONN_HANDLE_NONE ? "true" : "false");
+    }
+
+    esp_mqtt_client_publish(client, topic, payload, len, 0, 0);
+}
 
+static bool
+mqtt_payload_is(const char *data, int data_len, const char *cmd)
+{
+    return (size_t)data_len == strlen(cmd) && strncmp(data, cmd, data_len) == 0;
+}
+
+/**
+ * Parses the "<user> <pin>" or "<user>" arguments of a PIN command.  The PIN
+ * keeps its leading zeros as digits.
+ *
+ * @return Pointer past the arguments, or NULL if they are malformed.
+ */
+static const char *
+lock_cmd_parse_pin_args(const char *args, struct lock_cmd *cmd)
+{
+    const char *p = args;
+    char *end;
+    unsigned long value;
+
+    value = strtoul(p, &end, 10);
+    if (end == p || value > UINT16_MAX) {
+        return NULL;
+    }
+    cmd->user_id = value;
+    p = end;
+
+    if (cmd->op != LOCK_CMD_PIN_ADD) {
+        return p;
+    }
+
+    while (*p == ' ') {
+        p++;
+    }
+    value = strtoul(p, &end, 10);
+    if (end == p || end - p > 6 || *p < '0' || *p > '9') {
+        return NULL;
+    }
+    cmd->pin = value;
+    cmd->pin_digits = end - p;
 
-int connection_handle;
+    return end;
+}
 
-const struct peer *peer_handle;
+/**
+ * Handles a message on "/lock/<id>/cmd".  The payload is "state", "lock",
+ * "unlock", "pin_add <user> <pin>" or "pin_remove <user>", optionally
+ * followed by a space and a numeric command ID that is echoed in the result.
+ *
+ * State queries are answered here from the lock table.  Everything else
+ * goes through the command ring to the NimBLE host task; this task never
+ * touches the host directly.  PIN commands need a lock with the fast
+ * command path, which pipelines them for bulk provisioning.
+ */
+static void
+lock_cmd_handle(esp_mqtt_client_handle_t client, const char *id, size_t id_len,
+                const char *data, int data_len, int qos)
+{
+    static uint32_t next_cmd_id = 1;
+    struct lock_cmd cmd = { 0 };
+    const char *sep = memchr(data, ' ', data_len);
+    int op_len = sep != NULL ? sep - data : data_len;
+    char args[40];
+    const char *rest = "";
+    char *end;
+    int rc;
 
-void blecent_read_lockstate(const struct peer *peer);
+    if (mqtt_payload_is(data, op_len, "state")) {
+        lock_state_publish_cached(client, id, id_len);
+        return;
+    } else if (mqtt_payload_is(data, op_len, "lock")) {
+        cmd.op = LOCK_CMD_LOCK;
+    } else if (mqtt_payload_is(data, op_len, "unlock")) {
+        cmd.op = LOCK_CMD_UNLOCK;
+    } else if (mqtt_payload_is(data, op_len, "pin_add")) {
+        cmd.op = LOCK_CMD_PIN_ADD;
+    } else if (mqtt_payload_is(data, op_len, "pin_remove")) {
+        cmd.op = LOCK_CMD_PIN_REMOVE;
+    } else {
+        ESP_LOGW(tag, "Unknown lock command %.*s", op_len, data);
+        return;
+    }
+
+    if (sep != NULL) {
+        if (data_len - op_len - 1 >= (int)sizeof(args)) {
+            ESP_LOGW(tag, "Lock command too long");
+            return;
+        }
+        snprintf(args, sizeof(args), "%.*s", data_len - op_len - 1, sep + 1);
+        rest = args;
+    }
+
+    if (cmd.op == LOCK_CMD_PIN_ADD || cmd.op == LOCK_CMD_PIN_REMOVE) {
+        rest = lock_cmd_parse_pin_args(rest, &cmd);
+        if (rest == NULL) {
+            ESP_LOGW(tag, "Malformed %.*s command", op_len, data);
+            return;
+        }
+    }
+
+    cmd.id = strtoul(rest, &end, 10);
+    if (end == rest) {
+        cmd.id = next_cmd_id++;
+    }
+
+    memcpy(cmd.lock_id, id, id_len);
+    cmd.qos = qos;
+    cmd.submitted_us = esp_timer_get_time();
+    cmd.deadline_us = cmd.submitted_us + LOCK_CMD_DEFAULT_TIMEOUT_MS * 1000LL;
+
+    rc = lock_cmd_submit(&cmd);
+    if (rc != 0) {
+        struct lock_cmd_result result = {
+            .id = cmd.id,
+            .op = cmd.op,
+            .qos = cmd.qos,
+            .status = rc,
+        };
+
+        memcpy(result.lock_id, cmd.lock_id, sizeof(result.lock_id));
+        lock_cmd_publish_result(&result);
+    }
+}
 
 /*
  * @brief Event handler registered to receive MQTT events
@@ -99,22 +278,35 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         case MQTT_EVENT_CONNECTED:
 
             ESP_LOGI(tag, "MQTT_EVENT_CONNECTED");
+            boot_mark(BOOT_PHASE_MQTT_CONNECTED);
 
-            msg_id = esp_mqtt_client_subscribe(client, "/topic/lock/state", 1);
+            msg_id = esp_mqtt_client_subscribe(client, LOCK_TOPIC_PREFIX "+" LOCK_CMD_TOPIC_SUFFIX, 1);
+            ESP_LOGI(tag, "sent subscribe successful, msg_id=%d", msg_id);
+            msg_id = esp_mqtt_client_subscribe(client, LOCK_TOPIC_PREFIX "+" LOCK_BUNDLE_TOPIC_SUFFIX, 1);
             ESP_LOGI(tag, "sent subscribe successful, msg_id=%d", msg_id);
 
+            /* Stored messages are published again; so are audit batches
+             * the client does not hold any more.
+             */
+            outbox_on_mqtt_event(event);
+            audit_uplink_on_mqtt_event(event);
+            metrics_set_online(true);
+
+            /* Per-phase boot times, once per reset. */
+            boot_publish_once();
             break;
 
         case MQTT_EVENT_DISCONNECTED:
 
             ESP_LOGI(tag, "MQTT_EVENT_DISCONNECTED");
+            outbox_on_mqtt_event(event);
+            audit_uplink_on_mqtt_event(event);
+            metrics_set_online(false);
             break;
 
         case MQTT_EVENT_SUBSCRIBED:
 
             ESP_LOGI(tag, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
-            msg_id = esp_mqtt_client_publish(client, "/topic/qos0", "data", 0, 0, 0);
-            ESP_LOGI(tag, "sent publish successful, msg_id=%d", msg_id);
             break;
 
         case MQTT_EVENT_UNSUBSCRIBED:
@@ -125,24 +317,42 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         case MQTT_EVENT_PUBLISHED:
 
             ESP_LOGI(tag, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            outbox_on_mqtt_event(event);
+            audit_uplink_on_mqtt_event(event);
             break;
 
-        case MQTT_EVENT_DATA:
+        case MQTT_EVENT_DELETED:
 
-            ESP_LOGI(tag, "MQTT_EVENT_DATA");
+            ESP_LOGW(tag, "MQTT_EVENT_DELETED, msg_id=%d", event->msg_id);
+            audit_uplink_on_mqtt_event(event);
+            break;
 
-            printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-            printf("DATA=%.*s\r\n", event->data_len, event->data);
+        case MQTT_EVENT_DATA:
 
-            
+            /* Payloads carry PINs; never log them. */
+            ESP_LOGD(tag, "MQTT_EVENT_DATA, topic=%.*s, %d bytes at %d of %d",
+                     event->topic_len, event->topic, event->data_len,
+                     event->current_data_offset, event->total_data_len);
 
-            if(strncmp(event->topic, "/topic/lock/state", event->topic_len) == 0)
-            {
-                printf("Lock\r\n");
+            const char *lock_id;
+            size_t lock_id_len;
 
-                peer_handle = peer_find(connection_handle);
+            /* Only bundles outgrow the MQTT buffer; the rest of such a
+             * message arrives without a topic.
+             */
+            if (event->current_data_offset > 0) {
+                cred_push_on_mqtt_data(event, NULL);
+                break;
+            }
 
-                blecent_read_lockstate(peer_handle);
+            if (lock_topic_parse_id(event->topic, event->topic_len, LOCK_CMD_TOPIC_SUFFIX,
+                                    &lock_id, &lock_id_len) == 0) {
+                lock_cmd_handle(client, lock_id, lock_id_len, event->data, event->data_len,
+                                event->qos);
+            } else if (lock_topic_parse_id(event->topic, event->topic_len,
+                                           LOCK_BUNDLE_TOPIC_SUFFIX,
+                                           &lock_id, &lock_id_len) == 0) {
+                cred_push_on_mqtt_data(event, lock_id);
             }
 
             break;
@@ -196,410 +406,239 @@ static void mqtt_app_start(void)
     esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
     /* The last argument may be used to pass data to the event handler, in this example mqtt_event_handler */
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+    outbox_set_client(client);
+    audit_uplink_set_client(client);
     esp_mqtt_client_start(client);
 }
 
-/*** The UUID of the service containing the subscribable characteristic ***/
-static const ble_uuid_t * remote_svc_uuid =
-    BLE_UUID128_DECLARE(0x2d, 0x71, 0xa2, 0x59, 0xb4, 0x58, 0xc8, 0x12,
-                     	0x99, 0x99, 0x43, 0x95, 0x12, 0x2f, 0x46, 0x59);
-
-/*** The UUID of the subscribable chatacteristic ***/
-static const ble_uuid_t * remote_chr_uuid =
-    BLE_UUID128_DECLARE(0x00, 0x00, 0x00, 0x00, 0x11, 0x11, 0x11, 0x11,
-                     	0x22, 0x22, 0x22, 0x22, 0x33, 0x33, 0x33, 0x33);
-
-
-/*** The UUID of the subscribable chatacteristic ***/
+/*** The UUID of the lock service ***/
 static const ble_uuid_t * lock_svc_uuid =
     BLE_UUID128_DECLARE(0xe3, 0x1d, 0x5a, 0x25, 0x83, 0x41, 0x52, 0x86,
                         0xDE, 0xEF, 0x8f, 0x46, 0x00, 0x6f, 0x37, 0x1c);
 
-/*** The UUID of the subscribable chatacteristic ***/
+/*** The UUID of the lock state characteristic ***/
 static const ble_uuid_t * lock_chr_uuid =
     BLE_UUID128_DECLARE(0xe3, 0x1d, 0x5a, 0x25, 0x83, 0x41, 0x52, 0x86,
                         0xDE, 0xEF, 0x8f, 0x46, 0x02, 0x6f, 0x37, 0x1c);
 
 
+/*** The UUID of the lock command characteristic ***/
+static const ble_uuid_t * lock_cmd_uuid =
+    BLE_UUID128_DECLARE(0xe3, 0x1d, 0x5a, 0x25, 0x83, 0x41, 0x52, 0x86,
+                        0xDE, 0xEF, 0x8f, 0x46, 0x01, 0x6f, 0x37, 0x1c);
+
+/*** The UUID of the lock audit log characteristic ***/
+static const ble_uuid_t * lock_audit_uuid =
+    BLE_UUID128_DECLARE(0xe3, 0x1d, 0x5a, 0x25, 0x83, 0x41, 0x52, 0x86,
+                        0xDE, 0xEF, 0x8f, 0x46, 0x06, 0x6f, 0x37, 0x1c);
+
+
 static int blecent_gap_event(struct ble_gap_event *event, void *arg);
-static uint8_t peer_addr[6];
 
 
 void ble_store_config_init(void);
 
 /**
- * Application Callback. Called when the custom subscribable chatacteristic
- * in the remote GATT server is read.
- * Expect to get the recently written data.
- **/
-static int
-blecent_on_custom_read(uint16_t conn_handle,
-                       const struct ble_gatt_error *error,
-                       struct ble_gatt_attr *attr,
-                       void *arg)
+ * Copies a lock state value out of an ATT payload into the lock table.
+ */
+static void
+blecent_store_lockstate(uint16_t conn_handle, uint16_t attr_handle,
+                        const struct os_mbuf *om)
 {
-    MODLOG_DFLT(INFO,
-                "Read complete for the subscribable characteristic; "
-                "status=%d conn_handle=%d", error->status, conn_handle);
-    if (error->status == 0) {
-        MODLOG_DFLT(INFO, " attr_handle=%d value=", attr->handle);
-        print_mbuf(attr->om);
+    uint8_t state;
+
+    if (os_mbuf_copydata(om, 0, sizeof(state), &state) != 0) {
+        return;
     }
-    MODLOG_DFLT(INFO, "\n");
 
-    return 0;
+    lock_table_store_state(conn_handle, attr_handle, state);
 }
 
-/**
- * Application Callback. Called when the custom subscribable characteristic
- * in the remote GATT server is written to.
- * Client has previously subscribed to this characeteristic,
- * so expect a notification from the server.
- **/
-static int
-blecent_on_custom_write(uint16_t conn_handle,
-                        const struct ble_gatt_error *error,
-                        struct ble_gatt_attr *attr,
-                        void *arg)
+static void
+blecent_lock_cmd_link_up(uint16_t conn_handle)
 {
-    const struct peer_chr *chr;
-    const struct peer *peer;
-    int rc;
-
-    MODLOG_DFLT(INFO,
-                "Write to the custom subscribable characteristic complete; "
-                "status=%d conn_handle=%d attr_handle=%d\n",
-                error->status, conn_handle, attr->handle);
-
-    peer = peer_find(conn_handle);
-    chr = peer_chr_find_uuid(peer,
-                             remote_svc_uuid,
-                             remote_chr_uuid);
-    if (chr == NULL) {
-        MODLOG_DFLT(ERROR,
-                    "Error: Peer doesn't have the custom subscribable characteristic\n");
-        goto err;
-    }
-
-    /*** Performs a read on the characteristic, the result is handled in blecent_on_new_read callback ***/
-    rc = ble_gattc_read(conn_handle, chr->chr.val_handle,
-                        blecent_on_custom_read, NULL);
-    if (rc != 0) {
-        MODLOG_DFLT(ERROR,
-                    "Error: Failed to read the custom subscribable characteristic; "
-                    "rc=%d\n", rc);
-        goto err;
-    }
-
-    return 0;
-err:
-    /* Terminate the connection */
-    return ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+    lock_cmd_link_up(conn_handle, audit_uplink_link_up);
 }
 
 /**
- * Application Callback. Called when the custom subscribable characteristic
- * is subscribed to.
- **/
+ * Application callback.  Called when the lock state read has completed.  The
+ * value seeds the lock state cache; later changes arrive as notifications.
+ */
 static int
-blecent_on_custom_subscribe(uint16_t conn_handle,
-                            const struct ble_gatt_error *error,
-                            struct ble_gatt_attr *attr,
-                            void *arg)
+blecent_on_lockstate_read(uint16_t conn_handle,
+                          const struct ble_gatt_error *error,
+                          struct ble_gatt_attr *attr,
+                          void *arg)
 {
-    const struct peer_chr *chr;
-    uint8_t value;
-    int rc;
-    const struct peer *peer;
-
-    MODLOG_DFLT(INFO,
-                "Subscribe to the custom subscribable characteristic complete; "
-                "status=%d conn_handle=%d", error->status, conn_handle);
+    MODLOG_DFLT(INFO, "Lock state read complete; status=%d conn_handle=%d\n",
+                error->status, conn_handle);
 
     if (error->status == 0) {
-        MODLOG_DFLT(INFO, " attr_handle=%d value=", attr->handle);
-        print_mbuf(attr->om);
-    }
-    MODLOG_DFLT(INFO, "\n");
-
-    peer = peer_find(conn_handle);
-    chr = peer_chr_find_uuid(peer,
-                             remote_svc_uuid,
-                             remote_chr_uuid);
-    if (chr == NULL) {
-        MODLOG_DFLT(ERROR, "Error: Peer doesn't have the subscribable characteristic\n");
-        goto err;
+        blecent_store_lockstate(conn_handle, attr->handle, attr->om);
     }
 
-    /* Write 1 byte to the new characteristic to test if it notifies after subscribing */
-    value = 0x19;
-    rc = ble_gattc_write_flat(conn_handle, chr->chr.val_handle,
-                              &value, sizeof(value), blecent_on_custom_write, NULL);
-    if (rc != 0) {
-        MODLOG_DFLT(ERROR,
-                    "Error: Failed to write to the subscribable characteristic; "
-                    "rc=%d\n", rc);
-        goto err;
-    }
+    /* Once the lock is ready, pick up the key for its advertised status,
+     * enable command acknowledgements, then fetch any access events it
+     * logged offline.
+     */
+    lock_status_link_up(conn_handle, blecent_lock_cmd_link_up);
 
     return 0;
-err:
-    /* Terminate the connection */
-    return ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
 }
 
 /**
- * Performs 3 operations on the remote GATT server.
- * 1. Subscribes to a characteristic by writing 0x10 to it's CCCD.
- * 2. Writes to the characteristic and expect a notification from remote.
- * 3. Reads the characteristic and expect to get the recently written information.
- **/
+ * Reads the lock state once so that the cache is valid before the first
+ * notification arrives.
+ */
 static void
-blecent_custom_gatt_operations(const struct peer* peer)
+blecent_read_lockstate(uint16_t conn_handle)
 {
-    const struct peer_dsc *dsc;
+    const struct lock_entry *entry = lock_table_find_conn(conn_handle);
     int rc;
-    uint8_t value[2];
 
-    dsc = peer_dsc_find_uuid(peer,
-                             remote_svc_uuid,
-                             remote_chr_uuid,
-                             BLE_UUID16_DECLARE(BLE_GATT_DSC_CLT_CFG_UUID16));
-    if (dsc == NULL) {
-        MODLOG_DFLT(ERROR, "Error: Peer lacks a CCCD for the subscribable characteristic\n");
-        goto err;
+    if (entry == NULL || entry->state_val_handle == 0) {
+        return;
     }
 
-    /*** Write 0x00 and 0x01 (The subscription code) to the CCCD ***/
-    value[0] = 1;
-    value[1] = 0;
-    rc = ble_gattc_write_flat(peer->conn_handle, dsc->dsc.handle,
-                              value, sizeof(value), blecent_on_custom_subscribe, NULL);
+    rc = ble_gattc_read(conn_handle, entry->state_val_handle,
+                        blecent_on_lockstate_read, NULL);
     if (rc != 0) {
-        MODLOG_DFLT(ERROR,
-                    "Error: Failed to subscribe to the subscribable characteristic; "
-                    "rc=%d\n", rc);
-        goto err;
-    }
-
-    return;
-err:
-    /* Terminate the connection */
-    ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
-}
-
-/**
- * Application callback.  Called when the attempt to subscribe to notifications
- * for the ANS Unread Alert Status characteristic has completed.
- */
-static int
-blecent_on_subscribe(uint16_t conn_handle,
-                     const struct ble_gatt_error *error,
-                     struct ble_gatt_attr *attr,
-                     void *arg)
-{
-    struct peer *peer;
-
-    MODLOG_DFLT(INFO, "Subscribe complete; status=%d conn_handle=%d "
-                "attr_handle=%d\n",
-                error->status, conn_handle, attr->handle);
-
-    peer = peer_find(conn_handle);
-    if (peer == NULL) {
-        MODLOG_DFLT(ERROR, "Error in finding peer, aborting...");
+        MODLOG_DFLT(ERROR, "Error: Failed to read characteristic; rc=%d\n",
+                    rc);
+        /* Terminate the connection. */
         ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
     }
-    /* Subscribe to, write to, and read the custom characteristic*/
-    blecent_custom_gatt_operations(peer);
-
-    return 0;
 }
 
 /**
- * Application callback.  Called when the write to the ANS Alert Notification
- * Control Point characteristic has completed.
+ * Application callback.  Called when the write to the lock state CCCD has
+ * completed.  From here on the lock accepts commands.
  */
 static int
-blecent_on_write(uint16_t conn_handle,
-                 const struct ble_gatt_error *error,
-                 struct ble_gatt_attr *attr,
-                 void *arg)
+blecent_on_lockstate_subscribe(uint16_t conn_handle,
+                               const struct ble_gatt_error *error,
+                               struct ble_gatt_attr *attr,
+                               void *arg)
 {
-    MODLOG_DFLT(INFO,
-                "Write complete; status=%d conn_handle=%d attr_handle=%d\n",
-                error->status, conn_handle, attr->handle);
+    const struct lock_entry *entry;
 
-    /* Subscribe to notifications for the Unread Alert Status characteristic.
-     * A central enables notifications by writing two bytes (1, 0) to the
-     * characteristic's client-characteristic-configuration-descriptor (CCCD).
-     */
-    const struct peer_dsc *dsc;
-    uint8_t value[2];
-    int rc;
-    const struct peer *peer = peer_find(conn_handle);
+    MODLOG_DFLT(INFO, "Lock state subscribe complete; status=%d "
+                "conn_handle=%d\n", error->status, conn_handle);
 
-    dsc = peer_dsc_find_uuid(peer,
-                             BLE_UUID16_DECLARE(BLECENT_SVC_ALERT_UUID),
-                             BLE_UUID16_DECLARE(BLECENT_CHR_UNR_ALERT_STAT_UUID),
-                             BLE_UUID16_DECLARE(BLE_GATT_DSC_CLT_CFG_UUID16));
-    if (dsc == NULL) {
-        MODLOG_DFLT(ERROR, "Error: Peer lacks a CCCD for the Unread Alert "
-                    "Status characteristic\n");
-        goto err;
+    if (error->status != 0) {
+        return ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
     }
 
-    value[0] = 1;
-    value[1] = 0;
-    rc = ble_gattc_write_flat(conn_handle, dsc->dsc.handle,
-                              value, sizeof value, blecent_on_subscribe, NULL);
-    if (rc != 0) {
-        MODLOG_DFLT(ERROR, "Error: Failed to subscribe to characteristic; "
-                    "rc=%d\n", rc);
-        goto err;
+    entry = lock_table_find_conn(conn_handle);
+    if (entry != NULL) {
+        MODLOG_DFLT(INFO, "Lock %s ready %lld ms after connect\n", entry->id,
+                    (esp_timer_get_time() - entry->link_up_us) / 1000);
     }
 
+    boot_mark(BOOT_PHASE_FIRST_LOCK);
+
+    blecent_read_lockstate(conn_handle);
+
     return 0;
-err:
-    /* Terminate the connection. */
-    return ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
 }
 
 /**
- * Application callback.  Called when the read of the ANS Supported New Alert
- * Category characteristic has completed.
+ * Enables notifications on the lock state characteristic by writing (1, 0)
+ * to its CCCD.  Called once per connection once the lock handles are known.
  */
-static int
-blecent_on_read(uint16_t conn_handle,
-                const struct ble_gatt_error *error,
-                struct ble_gatt_attr *attr,
-                void *arg)
+static void
+blecent_subscribe_lockstate(uint16_t conn_handle)
 {
-    MODLOG_DFLT(INFO, "Read complete; status=%d conn_handle=%d", error->status,
-                conn_handle);
-    if (error->status == 0) {
-        MODLOG_DFLT(INFO, " attr_handle=%d value=", attr->handle);
-        print_mbuf(attr->om);
-    }
-    MODLOG_DFLT(INFO, "\n");
-
-    return 0;
-
-    #if 0
-    /* Write two bytes (99, 100) to the alert-notification-control-point
-     * characteristic.
-     */
-    const struct peer_chr *chr;
+    const struct lock_entry *entry = lock_table_find_conn(conn_handle);
     uint8_t value[2];
     int rc;
-    const struct peer *peer = peer_find(conn_handle);
-
-    chr = peer_chr_find_uuid(peer,
-                             BLE_UUID16_DECLARE(BLECENT_SVC_ALERT_UUID),
-                             BLE_UUID16_DECLARE(BLECENT_CHR_ALERT_NOT_CTRL_PT));
-    if (chr == NULL) {
-        MODLOG_DFLT(ERROR, "Error: Peer doesn't support the Alert "
-                    "Notification Control Point characteristic\n");
+
+    if (entry == NULL || entry->state_cccd_handle == 0) {
         goto err;
     }
 
-    value[0] = 99;
-    value[1] = 100;
-    rc = ble_gattc_write_flat(conn_handle, chr->chr.val_handle,
-                              value, sizeof value, blecent_on_write, NULL);
+    value[0] = 1;
+    value[1] = 0;
+    rc = ble_gattc_write_flat(conn_handle, entry->state_cccd_handle,
+                              value, sizeof(value),
+                              blecent_on_lockstate_subscribe, NULL);
     if (rc != 0) {
-        MODLOG_DFLT(ERROR, "Error: Failed to write characteristic; rc=%d\n",
-                    rc);
+        MODLOG_DFLT(ERROR, "Error: Failed to subscribe to the lock state "
+                    "characteristic; rc=%d\n", rc);
         goto err;
     }
 
-
-    return 0;
+    return;
 err:
     /* Terminate the connection. */
-    return ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
-    #endif
+    ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
 }
 
 /**
- * Performs three GATT operations against the specified peer:
- * 1. Reads the ANS Supported New Alert Category characteristic.
- * 2. After read is completed, writes the ANS Alert Notification Control Point characteristic.
- * 3. After write is completed, subscribes to notifications for the ANS Unread Alert Status
- *    characteristic.
- *
- * If the peer does not support a required service, characteristic, or
- * descriptor, then the peer lied when it claimed support for the alert
- * notification service!  When this happens, or if a GATT procedure fails,
- * this function immediately terminates the connection.
+ * Resolves the lock service handles from the discovered database, records
+ * them in the lock table and caches them under the database hash.
  */
 static void
-blecent_read_write_subscribe(const struct peer *peer)
+blecent_resolve_lock_handles(const struct peer *peer)
 {
     const struct peer_chr *chr;
-    int rc;
-
-    /* Read the supported-new-alert-category characteristic. */
-    chr = peer_chr_find_uuid(peer,
-                             BLE_UUID16_DECLARE(BLECENT_SVC_ALERT_UUID),
-                             BLE_UUID16_DECLARE(BLECENT_CHR_SUP_NEW_ALERT_CAT_UUID));
-    if (chr == NULL) {
-        MODLOG_DFLT(ERROR, "Error: Peer doesn't support the Supported New "
-                    "Alert Category characteristic\n");
-        goto err;
+    const struct peer_chr *cmd_chr;
+    const struct peer_chr *audit_chr;
+    const struct peer_chr *fast_cmd_chr;
+    const struct peer_dsc *dsc;
+    const struct peer_dsc *audit_dsc;
+    const struct peer_dsc *fast_cmd_dsc;
+    const struct lock_entry *entry;
+    struct gatt_cache_entry cache;
+
+    chr = peer_chr_find_uuid(peer, lock_svc_uuid, lock_chr_uuid);
+    cmd_chr = peer_chr_find_uuid(peer, lock_svc_uuid, lock_cmd_uuid);
+    dsc = peer_dsc_find_uuid(peer, lock_svc_uuid, lock_chr_uuid,
+                             BLE_UUID16_DECLARE(BLE_GATT_DSC_CLT_CFG_UUID16));
+    if (chr == NULL || cmd_chr == NULL || dsc == NULL) {
+        MODLOG_DFLT(ERROR, "Error: Peer lacks the lock characteristics\n");
+        ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        return;
     }
 
-    rc = ble_gattc_read(peer->conn_handle, chr->chr.val_handle,
-                        blecent_on_read, NULL);
-    if (rc != 0) {
-        MODLOG_DFLT(ERROR, "Error: Failed to read characteristic; rc=%d\n",
-                    rc);
-        goto err;
-    }
+    lock_table_set_handles(peer->conn_handle, chr->chr.val_handle,
+                           dsc->dsc.handle, cmd_chr->chr.val_handle);
 
-    return;
-err:
-    /* Terminate the connection. */
-    ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
-}
-
-
-void
-blecent_read_lockstate(const struct peer *peer)
-{
-    const struct peer_chr *chr;
-    int rc;
-
-    /* Read the supported-new-alert-category characteristic. */
-    chr = peer_chr_find_uuid(peer,
-                             lock_svc_uuid,
-                             lock_chr_uuid);
-    if (chr == NULL) {
-        MODLOG_DFLT(ERROR, "Error: Peer doesn't support the Supported New "
-                    "Alert Category characteristic\n");
-        goto err;
+    /* The audit log is optional; older locks do not have one. */
+    audit_chr = peer_chr_find_uuid(peer, lock_svc_uuid, lock_audit_uuid);
+    audit_dsc = peer_dsc_find_uuid(peer, lock_svc_uuid, lock_audit_uuid,
+                                   BLE_UUID16_DECLARE(BLE_GATT_DSC_CLT_CFG_UUID16));
+    if (audit_chr != NULL && audit_dsc != NULL) {
+        lock_table_set_audit_handles(peer->conn_handle, audit_chr->chr.val_handle,
+                                     audit_dsc->dsc.handle);
     }
-    else
-    {
-       printf("FOUND LOCK STATE\r\n");
+
+    /* So is the fast command path. */
+    fast_cmd_chr = peer_chr_find_uuid(peer, lock_svc_uuid, LOCK_CMD_FAST_UUID_DECLARE());
+    fast_cmd_dsc = peer_dsc_find_uuid(peer, lock_svc_uuid, LOCK_CMD_FAST_UUID_DECLARE(),
+                                      BLE_UUID16_DECLARE(BLE_GATT_DSC_CLT_CFG_UUID16));
+    if (fast_cmd_chr != NULL && fast_cmd_dsc != NULL) {
+        lock_table_set_fast_cmd_handles(peer->conn_handle, fast_cmd_chr->chr.val_handle,
+                                        fast_cmd_dsc->dsc.handle);
     }
 
-    rc = ble_gattc_read(peer->conn_handle, chr->chr.val_handle,
-                        blecent_on_read, NULL);
-    if (rc != 0) {
-        MODLOG_DFLT(ERROR, "Error: Failed to read characteristic; rc=%d\n",
-                    rc);
-        goto err;
+    /* Without a database hash there is nothing to validate a cache with. */
+    entry = lock_table_find_conn(peer->conn_handle);
+    if (entry != NULL && entry->db_hash_valid) {
+        memcpy(cache.db_hash, entry->db_hash, sizeof(cache.db_hash));
+        cache.state_val_handle = entry->state_val_handle;
+        cache.state_cccd_handle = entry->state_cccd_handle;
+        cache.cmd_val_handle = entry->cmd_val_handle;
+        cache.audit_val_handle = entry->audit_val_handle;
+        cache.audit_cccd_handle = entry->audit_cccd_handle;
+        cache.fast_cmd_val_handle = entry->fast_cmd_val_handle;
+        cache.fast_cmd_cccd_handle = entry->fast_cmd_cccd_handle;
+        gatt_cache_store(&entry->id_addr, &cache);
     }
 
-    return;
-err:
-    /* Terminate the connection. */
-    ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+    blecent_subscribe_lockstate(peer->conn_handle);
 }
 
-
-
-
 /**
  * Called when service discovery of the specified peer has completed.
  */
@@ -622,223 +661,166 @@ blecent_on_disc_complete(const struct peer *peer, int status, void *arg)
     MODLOG_DFLT(INFO, "Service discovery complete; status=%d "
                 "conn_handle=%d\n", status, peer->conn_handle);
 
-    /* Now perform three GATT procedures against the peer: read,
-     * write, and subscribe to notifications for the ANS service.
+    /* Subscribe to lock state changes; MQTT state queries are then served
+     * from the cache instead of a GATT read per query.
      */
-    //blecent_read_write_subscribe(peer);
-    blecent_read_lockstate(peer);
+    blecent_resolve_lock_handles(peer);
 }
 
 /**
- * Initiates the GAP general discovery procedure.
+ * Application callback.  Called for the GATT Database Hash read issued when
+ * a bonded link comes up.  If the hash matches the one the cached handles
+ * were discovered under, service discovery is skipped entirely.
  */
-static void
-blecent_scan(void)
+static int
+blecent_on_db_hash(uint16_t conn_handle,
+                   const struct ble_gatt_error *error,
+                   struct ble_gatt_attr *attr,
+                   void *arg)
 {
-    uint8_t own_addr_type;
-    struct ble_gap_disc_params disc_params;
+    const struct lock_entry *entry;
+    struct gatt_cache_entry cache;
+    uint8_t db_hash[GATT_CACHE_DB_HASH_LEN];
     int rc;
 
-    /* Figure out address to use while advertising (no privacy for now) */
-    rc = ble_hs_id_infer_auto(0, &own_addr_type);
-    if (rc != 0) {
-        MODLOG_DFLT(ERROR, "error determining address type; rc=%d\n", rc);
-        return;
+    if (error->status == 0) {
+        /* One call per matching attribute; the procedure ends with EDONE. */
+        if (os_mbuf_copydata(attr->om, 0, sizeof(db_hash), db_hash) == 0) {
+            lock_table_set_db_hash(conn_handle, db_hash);
+        }
+        return 0;
     }
 
-    /* Tell the controller to filter duplicates; we don't want to process
-     * repeated advertisements from the same device.
-     */
-    disc_params.filter_duplicates = 1;
+    entry = lock_table_find_conn(conn_handle);
+    if (entry == NULL) {
+        return 0;
+    }
 
-    /**
-     * Perform a passive scan.  I.e., don't send follow-up scan requests to
-     * each advertiser.
-     */
-    disc_params.passive = 1;
+    if (entry->db_hash_valid &&
+        gatt_cache_load(&entry->id_addr, &cache) == ESP_OK &&
+        memcmp(cache.db_hash, entry->db_hash, sizeof(cache.db_hash)) == 0) {
+        gatt_cache_record(true);
+        lock_table_set_handles(conn_handle, cache.state_val_handle,
+                               cache.state_cccd_handle, cache.cmd_val_handle);
+        lock_table_set_audit_handles(conn_handle, cache.audit_val_handle,
+                                     cache.audit_cccd_handle);
+        lock_table_set_fast_cmd_handles(conn_handle, cache.fast_cmd_val_handle,
+                                        cache.fast_cmd_cccd_handle);
+        blecent_subscribe_lockstate(conn_handle);
+        return 0;
+    }
 
-    /* Use defaults for the rest of the parameters. */
-    disc_params.itvl = 0;
-    disc_params.window = 0;
-    disc_params.filter_policy = 0;
-    disc_params.limited = 0;
+    gatt_cache_record(false);
 
-    rc = ble_gap_disc(own_addr_type, BLE_HS_FOREVER, &disc_params,
-                      blecent_gap_event, NULL);
+    rc = peer_disc_all(conn_handle, blecent_on_disc_complete, NULL);
     if (rc != 0) {
-        MODLOG_DFLT(ERROR, "Error initiating GAP discovery procedure; rc=%d\n",
-                    rc);
+        MODLOG_DFLT(ERROR, "Failed to discover services; rc=%d\n", rc);
+        ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
     }
+
+    return 0;
 }
 
 /**
- * Indicates whether we should try to connect to the sender of the specified
- * advertisement.  The function returns a positive result if the device
- * advertises connectability and support for the Alert Notification service.
+ * Brings up the lock service on a new link.  The lock's database hash is
+ * read first (one ATT round trip) to decide between cached handles and a
+ * full service discovery.
  */
-#if CONFIG_EXAMPLE_EXTENDED_ADV
 static int
-ext_blecent_should_connect(const struct ble_gap_ext_disc_desc *disc)
+blecent_lock_link_start(uint16_t conn_handle)
 {
-    int offset = 0;
-    int ad_struct_len = 0;
-#if CONFIG_EXAMPLE_USE_CI_ADDRESS
-    uint32_t *addr_offset;
-#endif // CONFIG_EXAMPLE_USE_CI_ADDRESS
-
-    if (disc->legacy_event_type != BLE_HCI_ADV_RPT_EVTYPE_ADV_IND &&
-            disc->legacy_event_type != BLE_HCI_ADV_RPT_EVTYPE_DIR_IND) {
-        return 0;
-    }
-    if (strlen(CONFIG_EXAMPLE_PEER_ADDR) && (strncmp(CONFIG_EXAMPLE_PEER_ADDR, "ADDR_ANY", strlen    ("ADDR_ANY")) != 0)) {
-#if !CONFIG_EXAMPLE_USE_CI_ADDRESS
-        ESP_LOGI(tag, "Peer address from menuconfig: %s", CONFIG_EXAMPLE_PEER_ADDR);
-        /* Convert string to address */
-        sscanf(CONFIG_EXAMPLE_PEER_ADDR, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
-               &peer_addr[5], &peer_addr[4], &peer_addr[3],
-               &peer_addr[2], &peer_addr[1], &peer_addr[0]);
-#else
-        addr_offset = (uint32_t *)&peer_addr[1];
-        *addr_offset = atoi(CONFIG_EXAMPLE_PEER_ADDR);
-        peer_addr[5] = 0xC3;
-        peer_addr[0] = TEST_CI_ADDRESS_CHIP_OFFSET;
-#endif // !CONFIG_EXAMPLE_USE_CI_ADDRESS
-        if (memcmp(peer_addr, disc->addr.val, sizeof(disc->addr.val)) != 0) {
-            return 0;
-        }
-    }
-
-    /* The device has to advertise support for the Alert Notification
-    * service (0x1811).
-    */
-    do {
-        ad_struct_len = disc->data[offset];
-
-        if (!ad_struct_len) {
-            break;
-        }
-
-	/* Search if ANS UUID is advertised */
-        if (disc->data[offset] == 0x03 && disc->data[offset + 1] == 0x03) {
-            if ( disc->data[offset + 2] == 0x18 && disc->data[offset + 3] == 0x11 ) {
-                return 1;
-            }
-        }
-
-        offset += ad_struct_len + 1;
-
-     } while ( offset < disc->length_data );
-
-    return 0;
+    return ble_gattc_read_by_uuid(conn_handle, 1, 0xffff,
+                                  BLE_UUID16_DECLARE(GATT_CACHE_DB_HASH_UUID16),
+                                  blecent_on_db_hash, NULL);
 }
-#else
+
+/**
+ * Indicates whether we should try to connect to the sender of the specified
+ * advertisement.  The function returns a positive result if the device
+ * advertises connectability and the lock service, or if a lock we know
+ * advertises directly to us.
+ */
 static int
-blecent_should_connect(const struct ble_gap_disc_desc *disc)
+blecent_should_connect(uint8_t event_type, const ble_addr_t *addr,
+                       const uint8_t *data, uint8_t len)
 {
-    ESP_LOGI(tag, "In CONNECT");
-
-    struct ble_hs_adv_fields fields;
-    int rc;
-    int i;
-#if CONFIG_EXAMPLE_USE_CI_ADDRESS
-    uint32_t *addr_offset;
-#endif // CONFIG_EXAMPLE_USE_CI_ADDRESS
-
-    /* The device has to be advertising connectability. */
-    if (disc->event_type != BLE_HCI_ADV_RPT_EVTYPE_ADV_IND &&
-            disc->event_type != BLE_HCI_ADV_RPT_EVTYPE_DIR_IND) {
-
-        return 0;
-    }
-
-    rc = ble_hs_adv_parse_fields(&fields, disc->data, disc->length_data);
-    if (rc != 0) {
-        return 0;
-    }
-
-    //strlen(CONFIG_EXAMPLE_PEER_ADDR) && (strncmp(CONFIG_EXAMPLE_PEER_ADDR, "ADDR_ANY", strlen("ADDR_ANY")) != 0)
-
-    if (1) {
-        ESP_LOGI(tag, "Peer address from menuconfig: %s", CONFIG_EXAMPLE_PEER_ADDR);
-#if !CONFIG_EXAMPLE_USE_CI_ADDRESS
-        /* Convert string to address */
-        sscanf(CONFIG_EXAMPLE_PEER_ADDR, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
-               &peer_addr[5], &peer_addr[4], &peer_addr[3],
-               &peer_addr[2], &peer_addr[1], &peer_addr[0]);
-#else
-        addr_offset = (uint32_t *)&peer_addr[1];
-        *addr_offset = atoi(CONFIG_EXAMPLE_PEER_ADDR);
-        peer_addr[5] = 0xC3;
-        peer_addr[0] = TEST_CI_ADDRESS_CHIP_OFFSET;
-#endif // !CONFIG_EXAMPLE_USE_CI_ADDRESS
-#if 0
-        if (memcmp(peer_addr, disc->addr.val, sizeof(disc->addr.val)) != 0) {
-            return 0;
-        }
-            #endif
-    }
-
-    /* The device has to advertise support for the Alert Notification
-     * service (0x1811).
+    /* A lock that just lost its link to us sends a short burst of directed
+     * advertising, which carries no data.  The controller only reports it
+     * when it is addressed to us.
      */
-
-    if(fields.num_uuids128 != 0)
-    {
-        ESP_LOGI(tag, "Detected 128UUID: ");
-
-        for(int i = 0; i < 16; ++i)
-        {
-            printf("%x,", fields.uuids128[0].value[i]);
-
-            
-        }
-
-        return 1;
+    if (event_type == BLE_HCI_ADV_RPT_EVTYPE_DIR_IND) {
+        return lock_table_find_addr(addr) != NULL;
     }
 
-    for (i = 0; i < fields.num_uuids16; i++) {
-        if (ble_uuid_u16(&fields.uuids16[i].u) == BLECENT_SVC_ALERT_UUID) {
-            return 1;
-        }
+    /* The device has to be advertising connectability. */
+    if (event_type != BLE_HCI_ADV_RPT_EVTYPE_ADV_IND) {
+        return 0;
     }
 
-    return 0;
+    return scan_adv_is_lock(data, len);
 }
-#endif
 
 /**
- * Connects to the sender of the specified advertisement of it looks
- * interesting.  A device is "interesting" if it advertises connectability and
- * support for the Alert Notification service.
+ * Connects to the sender of the specified advertisement if it looks
+ * interesting.  A device is "interesting" if it is a connectable lock that
+ * does not have a link yet and a link slot is free.
  */
 static void
 blecent_connect_if_interesting(void *disc)
 {
+    const struct lock_entry *entry;
     uint8_t own_addr_type;
     int rc;
     ble_addr_t *addr;
 
     /* Don't do anything if we don't care about this advertiser. */
 #if CONFIG_EXAMPLE_EXTENDED_ADV
-    if (!ext_blecent_should_connect((struct ble_gap_ext_disc_desc *)disc)) {
+    const struct ble_gap_ext_disc_desc *desc = disc;
+
+    if (!blecent_should_connect(desc->legacy_event_type, &desc->addr,
+                                desc->data, desc->length_data)) {
         return;
     }
 #else
-    if (!blecent_should_connect((struct ble_gap_disc_desc *)disc)) {
+    const struct ble_gap_disc_desc *desc = disc;
+
+    if (!blecent_should_connect(desc->event_type, &desc->addr,
+                                desc->data, desc->length_data)) {
         return;
     }
 #endif
 
+    addr = &desc->addr;
+
+    /* Locks advertise their status; keep it even if no link is made. */
+    lock_status_on_adv(addr, desc->data, desc->length_data);
+
+    /* Only one connection can be initiated at a time.  Locks that already
+     * have a link are not interesting either.
+     */
+    if (ble_gap_conn_active()) {
+        return;
+    }
+
+    entry = lock_table_find_addr(addr);
+    if (entry != NULL && entry->conn_handle != BLE_HS_CONN_HANDLE_NONE) {
+        return;
+    }
+
+    if (lock_table_connected_count() >= LOCK_TABLE_SIZE) {
+        return;
+    }
+
 #if !(MYNEWT_VAL(BLE_HOST_ALLOW_CONNECT_WITH_SCAN))
     /* Scanning must be stopped before a connection can be initiated. */
-    rc = ble_gap_disc_cancel();
+    rc = scan_stop();
     if (rc != 0) {
         MODLOG_DFLT(DEBUG, "Failed to cancel scan; rc=%d\n", rc);
         return;
     }
 #endif
 
-    /* Figure out address to use for connect (no privacy for now) */
+    /* Figure out address to use for connect */
     rc = ble_hs_id_infer_auto(0, &own_addr_type);
     if (rc != 0) {
         MODLOG_DFLT(ERROR, "error determining address type; rc=%d\n", rc);
@@ -848,15 +830,11 @@ blecent_connect_if_interesting(void *disc)
     /* Try to connect the the advertiser.  Allow 30 seconds (30000 ms) for
      * timeout.
      */
-#if CONFIG_EXAMPLE_EXTENDED_ADV
-    addr = &((struct ble_gap_ext_disc_desc *)disc)->addr;
-#else
-    addr = &((struct ble_gap_disc_desc *)disc)->addr;
-#endif
-
+    metrics_counter_add(METRIC_CONNECT_ATTEMPTS, 1);
     rc = ble_gap_connect(own_addr_type, addr, 30000, NULL,
                          blecent_gap_event, NULL);
     if (rc != 0) {
+        metrics_counter_add(METRIC_CONNECT_FAILURES, 1);
         MODLOG_DFLT(ERROR, "Error: Failed to connect to device; addr_type=%d "
                     "addr=%s; rc=%d\n",
                     addr->type, addr_str(addr->val), rc);
@@ -901,7 +879,7 @@ static int
 blecent_gap_event(struct ble_gap_event *event, void *arg)
 {
     struct ble_gap_conn_desc desc;
-    struct ble_hs_adv_fields fields;
+    int64_t start_us;
 #if MYNEWT_VAL(BLE_HCI_VS)
 #if MYNEWT_VAL(BLE_POWER_CONTROL)
     struct ble_gap_set_auto_pcl_params params;
@@ -911,17 +889,13 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
 
     switch (event->type) {
     case BLE_GAP_EVENT_DISC:
-        rc = ble_hs_adv_parse_fields(&fields, event->disc.data,
-                                     event->disc.length_data);
-        if (rc != 0) {
-            return 0;
-        }
-
-        /* An advertisement report was received during GAP discovery. */
-        print_adv_fields(&fields);
-
-        /* Try to connect to the advertiser if it looks interesting. */
+        /* An advertisement report was received during GAP discovery.  Try to
+         * connect to the advertiser if it looks interesting; most reports
+         * are not, so nothing is parsed or logged up front.
+         */
+        start_us = esp_timer_get_time();
         blecent_connect_if_interesting(&event->disc);
+        scan_note_report(start_us, esp_timer_get_time());
         return 0;
 
     case BLE_GAP_EVENT_LINK_ESTAB:
@@ -942,6 +916,18 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
                 return 0;
             }
 
+            /* Bind the link to the lock's slot, keyed by identity. */
+            if (lock_table_attach(&desc.peer_id_addr, event->connect.conn_handle) == NULL) {
+                MODLOG_DFLT(ERROR, "Lock table full\n");
+                return ble_gap_terminate(event->connect.conn_handle,
+                                         BLE_ERR_REM_USER_CONN_TERM);
+            }
+
+#if !(MYNEWT_VAL(BLE_HOST_ALLOW_CONNECT_WITH_SCAN))
+            /* Look for the remaining locks. */
+            scan_update();
+#endif
+
 #if MYNEWT_VAL(BLE_POWER_CONTROL)
             blecent_power_control(event->connect.conn_handle);
 #endif
@@ -977,9 +963,8 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
                 MODLOG_DFLT(INFO, "Connection secured\n");
             }
 #else
-            /* Perform service discovery */
-            rc = peer_disc_all(event->connect.conn_handle,
-                        blecent_on_disc_complete, NULL);
+            /* Perform service discovery, unless the handles are cached */
+            rc = blecent_lock_link_start(event->connect.conn_handle);
             if(rc != 0) {
                 MODLOG_DFLT(ERROR, "Failed to discover services; rc=%d\n", rc);
                 return 0;
@@ -989,7 +974,8 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
             /* Connection attempt failed; resume scanning. */
             MODLOG_DFLT(ERROR, "Error: Connection failed; status=%d\n",
                         event->connect.status);
-            blecent_scan();
+            metrics_counter_add(METRIC_CONNECT_FAILURES, 1);
+            scan_update();
         }
 
         return 0;
@@ -1003,8 +989,14 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
         /* Forget about peer. */
         peer_delete(event->disconnect.conn.conn_handle);
 
-        /* Resume scanning. */
-        blecent_scan();
+        /* Commands waiting for an acknowledgement will not get one. */
+        lock_cmd_link_down(event->disconnect.conn.conn_handle);
+
+        /* Keep the lock's slot and last known state for the reconnect. */
+        lock_table_detach(event->disconnect.conn.conn_handle);
+
+        /* Resume scanning; a lock is missing again. */
+        scan_update();
         return 0;
 
     case BLE_GAP_EVENT_DISC_COMPLETE:
@@ -1020,12 +1012,16 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
         assert(rc == 0);
         print_conn_desc(&desc);
 #if CONFIG_EXAMPLE_ENCRYPTION
-        /*** Go for service discovery after encryption has been successfully enabled ***/
-        rc = peer_disc_all(event->connect.conn_handle,
-                           blecent_on_disc_complete, NULL);
+        if (event->enc_change.status != 0) {
+            return 0;
+        }
 
-        connection_handle = event->connect.conn_handle;
+        /* A new bond moves the lock onto the scanner's accept list. */
+        scan_update();
 
+        /*** Go for service discovery after encryption has been successfully enabled,
+         *** unless the handles cached for this lock are still valid ***/
+        rc = blecent_lock_link_start(event->enc_change.conn_handle);
         if (rc != 0) {
             MODLOG_DFLT(ERROR, "Failed to discover services; rc=%d\n", rc);
             return 0;
@@ -1034,6 +1030,20 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
         return 0;
 
     case BLE_GAP_EVENT_NOTIFY_RX:
+        /* Audit downloads stream many notifications; they are not logged. */
+        if (audit_uplink_on_notify(event->notify_rx.conn_handle,
+                                   event->notify_rx.attr_handle,
+                                   event->notify_rx.om)) {
+            return 0;
+        }
+
+        /* Pipelined commands are acknowledged in bulk; not logged either. */
+        if (lock_cmd_on_notify(event->notify_rx.conn_handle,
+                               event->notify_rx.attr_handle,
+                               event->notify_rx.om)) {
+            return 0;
+        }
+
         /* Peer sent us a notification or indication. */
         MODLOG_DFLT(INFO, "received %s; conn_handle=%d attr_handle=%d "
                     "attr_len=%d\n",
@@ -1046,6 +1056,9 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
 
         /* Attribute data is contained in event->notify_rx.om. Use
          * `os_mbuf_copydata` to copy the data received in notification mbuf */
+        blecent_store_lockstate(event->notify_rx.conn_handle,
+                                event->notify_rx.attr_handle,
+                                event->notify_rx.om);
         return 0;
 
     case BLE_GAP_EVENT_MTU:
@@ -1078,9 +1091,9 @@ blecent_gap_event(struct ble_gap_event *event, void *arg)
 #if CONFIG_EXAMPLE_EXTENDED_ADV
     case BLE_GAP_EVENT_EXT_DISC:
         /* An advertisement report was received during GAP discovery. */
-        ext_print_adv_report(&event->disc);
-
+        start_us = esp_timer_get_time();
         blecent_connect_if_interesting(&event->disc);
+        scan_note_report(start_us, esp_timer_get_time());
         return 0;
 #endif
 
@@ -1125,9 +1138,11 @@ blecent_on_sync(void)
     rc = ble_hs_util_ensure_addr(0);
     assert(rc == 0);
 
+    boot_mark(BOOT_PHASE_BLE_SYNC);
+
 #if !CONFIG_EXAMPLE_INIT_DEINIT_LOOP
     /* Begin scanning for a peripheral to connect to. */
-    blecent_scan();
+    scan_update();
 #endif
 }
 
@@ -1177,14 +1192,6 @@ static void stack_init_deinit(void)
 #endif
 
 static void nimble_host_config_init(void) {
-    /* Set host callbacks */
-    #if 0
-    ble_hs_cfg.reset_cb = on_stack_reset;
-    ble_hs_cfg.sync_cb = on_stack_sync;
-    ble_hs_cfg.gatts_register_cb = gatt_svr_register_cb;
-    ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
-    #endif
-
     /* Security manager configuration */
     ble_hs_cfg.sm_io_cap = BLE_HS_IO_DISPLAY_ONLY;
     ble_hs_cfg.sm_bonding = 1;
@@ -1196,37 +1203,89 @@ static void nimble_host_config_init(void) {
     ble_store_config_init();
 }
 
-void
-app_main(void)
+/**
+ * Boot step: brings up the NimBLE host.  Scanning starts from the sync
+ * callback, without waiting for the network.
+ */
+static void
+boot_start_ble(void)
 {
     esp_err_t ret;
-    
-
     int rc;
-    /* Initialize NVS — it is used to store PHY calibration data */
-    ret = nvs_flash_init();
-    if  (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
+
+    ret = nimble_port_init();
+    if (ret != ESP_OK) {
+        ESP_LOGE(tag, "Failed to init nimble %d ", ret);
+        return;
     }
-    ESP_ERROR_CHECK(ret);
+
+    /* Configure the host. */
+    ble_hs_cfg.reset_cb = blecent_on_reset;
+    ble_hs_cfg.sync_cb = blecent_on_sync;
+    ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
+
+    /* Initialize data structures to track connected peers. */
+    rc = peer_init(MYNEWT_VAL(BLE_MAX_CONNECTIONS),
+                   MYNEWT_VAL(BLE_MAX_CONNECTIONS) * LOCK_PEER_SVCS_PER_LOCK,
+                   MYNEWT_VAL(BLE_MAX_CONNECTIONS) * LOCK_PEER_CHRS_PER_LOCK,
+                   MYNEWT_VAL(BLE_MAX_CONNECTIONS) * LOCK_PEER_DSCS_PER_LOCK);
+    assert(rc == 0);
+
+    lock_table_init();
+
+    /* Hand MQTT commands to the host task through the command ring. */
+    lock_cmd_init();
+
+    /* Credential bundles go to the locks over L2CAP. */
+    cred_push_init();
+
+    /* Pull access events from the locks and upload them in batches. */
+    audit_uplink_init();
+
+    /* Look for locks by their service UUID, at a duty set by how many bonded
+     * locks are missing.
+     */
+    scan_init(lock_svc_uuid, blecent_gap_event);
+
+    /* Set the default device name. */
+    rc = ble_svc_gap_device_name_set("nimble-blecent");
+    assert(rc == 0);
+
+    /* XXX Need to have template for store */
+    ble_store_config_init();
+
+    nimble_port_freertos_init(blecent_host_task);
+}
+
+/**
+ * Boot step: starts associating.  The phases after this are marked by the
+ * Wi-Fi event handlers.
+ */
+static void
+boot_start_wifi(void)
+{
+    esp_err_t ret;
 
     ESP_LOGI(tag, "Starting tutorial...");
     ESP_ERROR_CHECK(tutorial_init());
 
     ret = tutorial_connect(WIFI_SSID, WIFI_PASSWORD);
     if (ret != ESP_OK) {
-        ESP_LOGE(tag, "Failed to connect to Wi-Fi network");
+        ESP_LOGE(tag, "Failed to start Wi-Fi");
     }
+}
 
+/**
+ * Boot step: starts the MQTT client once there is an IP address.  Drops
+ * after this are handled by the Wi-Fi reconnect logic and the client's own
+ * reconnect.
+ */
+static void
+boot_start_mqtt(void)
+{
     wifi_ap_record_t ap_info;
-    ret = esp_wifi_sta_get_ap_info(&ap_info);
-    if (ret == ESP_ERR_WIFI_CONN) {
-        ESP_LOGE(tag, "Wi-Fi station interface not initialized");
-    }
-    else if (ret == ESP_ERR_WIFI_NOT_CONNECT) {
-        ESP_LOGE(tag, "Wi-Fi station is not connected");
-    } else {
+
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
         ESP_LOGI(tag, "--- Access Point Information ---");
         ESP_LOG_BUFFER_HEX("MAC Address", ap_info.bssid, sizeof(ap_info.bssid));
         ESP_LOG_BUFFER_CHAR("SSID", ap_info.ssid, sizeof(ap_info.ssid));
@@ -1235,30 +1294,45 @@ app_main(void)
     }
 
     mqtt_app_start();
+}
 
-    ret = nimble_port_init();
-    if (ret != ESP_OK) {
-        ESP_LOGE(tag, "Failed to init nimble %d ", ret);
-        return;
-    }
+/*
+ * Boot dependency graph.  BLE and Wi-Fi only need NVS and start together;
+ * locks can be connected before the DHCP lease is in.
+ */
+static const struct boot_step boot_steps[] = {
+    { "ble", BOOT_BIT(BOOT_PHASE_NVS), BOOT_PHASE_BLE_STARTED, boot_start_ble },
+    { "wifi", BOOT_BIT(BOOT_PHASE_NVS), BOOT_PHASE_WIFI_STARTED, boot_start_wifi },
+    { "mqtt", BOOT_BIT(BOOT_PHASE_WIFI_STARTED) | BOOT_BIT(BOOT_PHASE_IP),
+      BOOT_PHASE_MQTT_STARTED, boot_start_mqtt },
+};
 
-    /* Configure the host. */
-    ble_hs_cfg.reset_cb = blecent_on_reset;
-    ble_hs_cfg.sync_cb = blecent_on_sync;
-    ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
+void
+app_main(void)
+{
+    esp_err_t ret;
 
-    /* Initialize data structures to track connected peers. */
-    rc = peer_init(MYNEWT_VAL(BLE_MAX_CONNECTIONS), 64, 64, 64);
-    assert(rc == 0);
+    boot_init();
 
-    /* Set the default device name. */
-    rc = ble_svc_gap_device_name_set("nimble-blecent");
-    assert(rc == 0);
+    /* Initialize NVS — it is used to store PHY calibration data */
+    ret = nvs_flash_init();
+    if  (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
 
-    /* XXX Need to have template for store */
-    ble_store_config_init();
+    /* Messages queued before a reboot are sent once the broker is up. */
+    ret = outbox_init();
+    if (ret != ESP_OK) {
+        ESP_LOGE(tag, "Outbox unavailable; err=0x%x", ret);
+    }
 
-    nimble_port_freertos_init(blecent_host_task);
+    /* Snapshots go out once the broker is connected. */
+    metrics_init();
+
+    boot_mark(BOOT_PHASE_NVS);
+    boot_run(boot_steps, sizeof(boot_steps) / sizeof(boot_steps[0]));
 
 #if CONFIG_EXAMPLE_INIT_DEINIT_LOOP
     stack_init_deinit();
@@ -0,0 +1,272 @@
+#include "metrics.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "host/ble_hs.h"
+
+#include "boot.h"
+#include "outbox.h"
+#include "scan.h"
+
+#define TAG "metrics"
+
+#define METRIC_HIST_FIRST           METRIC_GATT_OP_MS
+#define METRIC_HIST_COUNT           (METRIC_COUNT - METRIC_HIST_FIRST)
+
+enum metric_type {
+    METRIC_TYPE_GAUGE,
+    METRIC_TYPE_COUNTER,
+    METRIC_TYPE_HIST,
+};
+
+struct metric_def {
+    const char *name;
+    uint8_t type;
+};
+
+static const struct metric_def defs[METRIC_COUNT] = {
+    [METRIC_SCAN_REPORTS_PER_S] = { "scan_rps", METRIC_TYPE_GAUGE },
+    [METRIC_WIFI_RSSI]          = { "rssi", METRIC_TYPE_GAUGE },
+    [METRIC_HEAP_MIN_FREE]      = { "heap_min", METRIC_TYPE_GAUGE },
+    [METRIC_MBUF_USED]          = { "mbuf_used", METRIC_TYPE_GAUGE },
+    [METRIC_MBUF_TOTAL]         = { "mbuf_total", METRIC_TYPE_GAUGE },
+    [METRIC_CONNECT_ATTEMPTS]   = { "conn_att", METRIC_TYPE_COUNTER },
+    [METRIC_CONNECT_FAILURES]   = { "conn_fail", METRIC_TYPE_COUNTER },
+    [METRIC_WIFI_RECONNECTS]    = { "wifi_reconn", METRIC_TYPE_COUNTER },
+    [METRIC_GATT_OP_MS]         = { "gatt_ms", METRIC_TYPE_HIST },
+    [METRIC_MQTT_PUBLISH_MS]    = { "mqtt_ms", METRIC_TYPE_HIST },
+};
+
+static const uint32_t hist_bounds_ms[METRICS_HIST_BUCKETS - 1] = METRICS_HIST_BOUNDS_MS;
+
+/* Written from any task, so every access is under the mux. */
+static int32_t values[METRIC_COUNT];
+static uint32_t hist[METRIC_HIST_COUNT][METRICS_HIST_BUCKETS];
+static portMUX_TYPE metrics_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static esp_timer_handle_t snapshot_timer;
+static volatile bool online;
+
+void
+metrics_gauge_set(enum metric_id id, int32_t value)
+{
+    portENTER_CRITICAL(&metrics_mux);
+    values[id] = value;
+    portEXIT_CRITICAL(&metrics_mux);
+}
+
+void
+metrics_counter_add(enum metric_id id, uint32_t n)
+{
+    portENTER_CRITICAL(&metrics_mux);
+    values[id] += n;
+    portEXIT_CRITICAL(&metrics_mux);
+}
+
+void
+metrics_hist_observe(enum metric_id id, uint32_t ms)
+{
+    int bucket = 0;
+
+    while (bucket < METRICS_HIST_BUCKETS - 1 && ms > hist_bounds_ms[bucket]) {
+        bucket++;
+    }
+
+    portENTER_CRITICAL(&metrics_mux);
+    hist[id - METRIC_HIST_FIRST][bucket]++;
+    portEXIT_CRITICAL(&metrics_mux);
+}
+
+void
+metrics_set_online(bool is_online)
+{
+    online = is_online;
+}
+
+/* Gauges owned by other modules. */
+static void
+metrics_sample(void)
+{
+    struct scan_stats scan;
+    wifi_ap_record_t ap;
+
+    scan_get_stats(&scan);
+    metrics_gauge_set(METRIC_SCAN_REPORTS_PER_S, scan.reports_per_s);
+
+    metrics_gauge_set(METRIC_WIFI_RSSI,
+                      esp_wifi_sta_get_ap_info(&ap) == ESP_OK ? ap.rssi : 0);
+
+    metrics_gauge_set(METRIC_HEAP_MIN_FREE, esp_get_minimum_free_heap_size());
+
+    metrics_gauge_set(METRIC_MBUF_USED, os_msys_count() - os_msys_num_free());
+    metrics_gauge_set(METRIC_MBUF_TOTAL, os_msys_count());
+}
+
+struct metrics_copy {
+    int32_t values[METRIC_COUNT];
+    uint32_t hist[METRIC_HIST_COUNT][METRICS_HIST_BUCKETS];
+};
+
+#define METRICS_TOPIC_LEN \
+    (sizeof("/gateway/") - 1 + GATEWAY_ID_STR_SIZE - 1 + sizeof("/metrics") - 1)
+#define METRICS_PAYLOAD_MAX         (OUTBOX_DATA_MAX - METRICS_TOPIC_LEN)
+
+/* Longest names in defs[], checked in metrics_init(). */
+#define METRICS_NAME_MAX            11
+
+/* Worst cases: "{"up":<int64>}" and a histogram with every bucket at
+ * UINT32_MAX, the longest of the metrics.
+ */
+#define METRICS_HEAD_MAX            (sizeof("{\"up\":}") - 1 + 20)
+#define METRICS_ITEM_MAX \
+    (sizeof(",\"\":[]") - 1 + METRICS_NAME_MAX + \
+     METRICS_HIST_BUCKETS * 10 + METRICS_HIST_BUCKETS - 1)
+
+/* A message always has room for at least one metric. */
+_Static_assert(METRICS_HEAD_MAX + METRICS_ITEM_MAX <= METRICS_PAYLOAD_MAX,
+               "metric does not fit an outbox slot");
+
+/* Formats one metric as ',"name":value'. */
+static int
+metrics_format_item(const struct metrics_copy *m, int id, char *buf, size_t size)
+{
+    int len;
+
+    len = snprintf(buf, size, ",\"%s\":", defs[id].name);
+
+    if (defs[id].type != METRIC_TYPE_HIST) {
+        return len + snprintf(buf + len, size - len, "%ld", (long)m->values[id]);
+    }
+
+    for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+        len += snprintf(buf + len, size - len, "%c%lu", b == 0 ? '[' : ',',
+                        (unsigned long)m->hist[id - METRIC_HIST_FIRST][b]);
+    }
+
+    return len + snprintf(buf + len, size - len, "]");
+}
+
+/**
+ * Formats a snapshot as a JSON object, from metric @p first on for as many
+ * as fit a message.
+ *
+ * @param next Set to the first metric left out, METRIC_COUNT if none.
+ * @return Length written.
+ */
+static int
+metrics_format(const struct metrics_copy *m, int first, char *buf, int *next)
+{
+    char item[METRICS_ITEM_MAX + 1];
+    int item_len;
+    int len;
+    int id;
+
+    len = snprintf(buf, METRICS_PAYLOAD_MAX + 1, "{\"up\":%lld",
+                   esp_timer_get_time() / 1000000);
+
+    for (id = first; id < METRIC_COUNT; id++) {
+        item_len = metrics_format_item(m, id, item, sizeof(item));
+        if (len + item_len + 1 > METRICS_PAYLOAD_MAX) {
+            break;
+        }
+        memcpy(buf + len, item, item_len);
+        len += item_len;
+    }
+
+    buf[len++] = '}';
+    buf[len] = '\0';
+    *next = id;
+
+    return len;
+}
+
+/* Takes what was published off the counters and histograms; anything
+ * counted since the copy stays for the next snapshot.
+ */
+static void
+metrics_consume(const struct metrics_copy *m, int first, int end)
+{
+    portENTER_CRITICAL(&metrics_mux);
+    for (int id = first; id < end; id++) {
+        if (defs[id].type == METRIC_TYPE_COUNTER) {
+            values[id] -= m->values[id];
+        } else if (defs[id].type == METRIC_TYPE_HIST) {
+            for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+                hist[id - METRIC_HIST_FIRST][b] -= m->hist[id - METRIC_HIST_FIRST][b];
+            }
+        }
+    }
+    portEXIT_CRITICAL(&metrics_mux);
+}
+
+static void
+metrics_timer_cb(void *arg)
+{
+    static struct metrics_copy copy;
+    char topic[METRICS_TOPIC_LEN + 1];
+    char payload[METRICS_PAYLOAD_MAX + 1];
+    esp_err_t ret;
+    int next;
+    int len;
+
+    /* Stored offline, snapshots could push audit records out of the
+     * outbox; they are merged into the next one instead.
+     */
+    if (!online) {
+        return;
+    }
+
+    metrics_sample();
+
+    portENTER_CRITICAL(&metrics_mux);
+    memcpy(copy.values, values, sizeof(copy.values));
+    memcpy(copy.hist, hist, sizeof(copy.hist));
+    portEXIT_CRITICAL(&metrics_mux);
+
+    snprintf(topic, sizeof(topic), "/gateway/%s/metrics", gateway_id());
+
+    /* Usually one message; large counts split the snapshot across more,
+     * each a complete object.  A full queue leaves the rest to the next
+     * snapshot.
+     */
+    for (int id = 0; id < METRIC_COUNT; id = next) {
+        len = metrics_format(&copy, id, payload, &next);
+        ret = outbox_publish(topic, payload, len, 0);
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Snapshot not queued: %s", esp_err_to_name(ret));
+            return;
+        }
+        metrics_consume(&copy, id, next);
+    }
+}
+
+void
+metrics_init(void)
+{
+    const esp_timer_create_args_t args = {
+        .callback = metrics_timer_cb,
+        .name = "metrics",
+    };
+
+    if (CONFIG_GATEWAY_METRICS_PERIOD_S == 0) {
+        return;
+    }
+
+    for (int id = 0; id < METRIC_COUNT; id++) {
+        assert(strlen(defs[id].name) <= METRICS_NAME_MAX);
+    }
+
+    if (esp_timer_create(&args, &snapshot_timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create the snapshot timer");
+        return;
+    }
+
+    esp_timer_start_periodic(snapshot_timer, (uint64_t)CONFIG_GATEWAY_METRICS_PERIOD_S * 1000000);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Gateway runtime metrics.
+ *
+ * Counters, gauges and latency histograms live in a static table indexed by
+ * enum metric_id.  Updates are safe from any task.  Gauges owned by other
+ * modules (scan rate, RSSI, heap, mbufs) are sampled right before each
+ * snapshot.
+ *
+ * Every CONFIG_GATEWAY_METRICS_PERIOD_S seconds a snapshot is published on
+ * "/gateway/<id>/metrics", for example
+ *
+ *   {"up":3600,"scan_rps":41,"conn_att":2,"conn_fail":0,"rssi":-61,
+ *    "wifi_reconn":0,"heap_min":81240,"mbuf_used":3,"mbuf_total":24,
+ *    "gatt_ms":[0,4,9,1,0,0,0,0],"mqtt_ms":[12,0,0,0,0,0,0,0]}
+ *
+ * Counters and histograms hold what happened since the previous snapshot,
+ * so they can be summed across a fleet.  While the broker is unreachable
+ * nothing is published and they keep accumulating.  A snapshot too large
+ * for one outbox slot is split across several objects, each with "up".
+ *
+ * mqtt_ms is the time from publishing a QoS 1 message to its PUBACK.
+ */
+
+/* Upper bounds of the histogram buckets, in ms; the last bucket counts
+ * everything slower.
+ */
+#define METRICS_HIST_BOUNDS_MS      { 10, 25, 50, 100, 250, 1000, 5000 }
+#define METRICS_HIST_BUCKETS        8
+
+enum metric_id {
+    /* Gauges. */
+    METRIC_SCAN_REPORTS_PER_S,
+    METRIC_WIFI_RSSI,
+    METRIC_HEAP_MIN_FREE,
+    METRIC_MBUF_USED,
+    METRIC_MBUF_TOTAL,
+
+    /* Counters. */
+    METRIC_CONNECT_ATTEMPTS,
+    METRIC_CONNECT_FAILURES,
+    METRIC_WIFI_RECONNECTS,
+
+    /* Histograms. */
+    METRIC_GATT_OP_MS,
+    METRIC_MQTT_PUBLISH_MS,
+
+    METRIC_COUNT
+};
+
+/**
+ * Starts the snapshot timer.  Does nothing if the period is 0.
+ */
+void metrics_init(void);
+
+/**
+ * Snapshots are only published while the MQTT client is connected.
+ */
+void metrics_set_online(bool online);
+
+void metrics_gauge_set(enum metric_id id, int32_t value);
+
+void metrics_counter_add(enum metric_id id, uint32_t n);
+
+void metrics_hist_observe(enum metric_id id, uint32_t ms);
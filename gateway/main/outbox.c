@@ -0,0 +1,530 @@
+#include "outbox.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "metrics.h"
+
+#define TAG "outbox"
+
+#define OUTBOX_PARTITION_LABEL      "outbox"
+#define OUTBOX_SECTOR_SIZE          4096
+#define OUTBOX_SLOTS_PER_SECTOR     (OUTBOX_SECTOR_SIZE / OUTBOX_SLOT_SIZE)
+
+#define OUTBOX_TASK_STACK_SIZE      4096
+#define OUTBOX_TASK_PRIORITY        4
+#define OUTBOX_EVENT_QUEUE_LEN      8
+
+/*
+ * Slots are written once, front to back, and a sector is erased just before
+ * its first slot is reused.  The state byte starts as VALID and is cleared
+ * to DONE in place once the message has been delivered, which flash allows
+ * without an erase.  The sequence number orders the slots after a reboot.
+ */
+#define OUTBOX_STATE_ERASED         0xff
+#define OUTBOX_STATE_VALID          0xfe
+#define OUTBOX_STATE_DONE           0x00
+
+struct outbox_hdr {
+    uint32_t seq;
+    uint8_t state;
+    uint8_t qos;
+    uint8_t topic_len;
+    uint8_t reserved;
+    uint16_t payload_len;
+    uint16_t crc;
+};
+
+_Static_assert(sizeof(struct outbox_hdr) == OUTBOX_HDR_SIZE, "header size");
+_Static_assert(OUTBOX_SECTOR_SIZE % OUTBOX_SLOT_SIZE == 0, "slot size");
+
+/* One slot image; also what producers hand to the task. */
+struct outbox_msg {
+    struct outbox_hdr hdr;
+    char data[OUTBOX_DATA_MAX];
+};
+
+enum outbox_ev_type {
+    OUTBOX_EV_CONNECTED,
+    OUTBOX_EV_DISCONNECTED,
+    OUTBOX_EV_PUBLISHED,
+};
+
+struct outbox_ev {
+    uint8_t type;
+    int msg_id;
+};
+
+struct outbox_inflight {
+    uint32_t slot;
+    int msg_id;
+    bool acked;
+    int64_t sent_us;
+};
+
+static QueueHandle_t msg_queue;
+static QueueHandle_t ev_queue;
+static TaskHandle_t outbox_task;
+static esp_mqtt_client_handle_t outbox_client;
+
+/*
+ * Owned by the outbox task.  Slots tail..head-1 are stored and not yet
+ * delivered; tail..send-1 of those have been published and wait for an
+ * acknowledgement, tracked in the inflight FIFO.
+ */
+static const esp_partition_t *part;
+static uint32_t slot_count;
+static uint32_t head;
+static uint32_t tail;
+static uint32_t send;
+static uint32_t stored;
+static uint32_t next_seq;
+static bool online;
+
+static struct outbox_inflight inflight[OUTBOX_DRAIN_INFLIGHT];
+static uint32_t inflight_first;
+static uint32_t inflight_count;
+
+static struct outbox_stats stats;
+
+static uint32_t
+slot_next(uint32_t slot)
+{
+    return slot + 1 == slot_count ? 0 : slot + 1;
+}
+
+static uint32_t
+slot_distance(uint32_t from, uint32_t to)
+{
+    return (to + slot_count - from) % slot_count;
+}
+
+static size_t
+slot_offset(uint32_t slot)
+{
+    return (size_t)slot * OUTBOX_SLOT_SIZE;
+}
+
+static uint16_t
+outbox_crc(const struct outbox_msg *msg)
+{
+    uint16_t crc;
+
+    crc = esp_rom_crc16_le(0, &msg->hdr.qos, 1);
+    crc = esp_rom_crc16_le(crc, &msg->hdr.topic_len, 1);
+    crc = esp_rom_crc16_le(crc, (const uint8_t *)&msg->hdr.payload_len,
+                           sizeof(msg->hdr.payload_len));
+    return esp_rom_crc16_le(crc, (const uint8_t *)msg->data,
+                            msg->hdr.topic_len + msg->hdr.payload_len);
+}
+
+static void
+outbox_mark_done(uint32_t slot)
+{
+    uint8_t state = OUTBOX_STATE_DONE;
+
+    esp_partition_write(part, slot_offset(slot) + offsetof(struct outbox_hdr, state),
+                        &state, sizeof(state));
+}
+
+/* Messages in flight are forgotten and sent again from the tail. */
+static void
+outbox_rewind(void)
+{
+    inflight_count = 0;
+    send = tail;
+}
+
+/**
+ * Erases the sector the head is about to enter.  If it still holds
+ * undelivered messages, the partition is full and they are dropped.
+ */
+static esp_err_t
+outbox_open_sector(void)
+{
+    uint32_t sector = head / OUTBOX_SLOTS_PER_SECTOR;
+    uint32_t new_tail;
+    uint32_t lost;
+
+    if (stored != 0 && tail / OUTBOX_SLOTS_PER_SECTOR == sector) {
+        new_tail = ((sector + 1) * OUTBOX_SLOTS_PER_SECTOR) % slot_count;
+        lost = stored == slot_count ? OUTBOX_SLOTS_PER_SECTOR : slot_distance(tail, new_tail);
+
+        ESP_LOGW(TAG, "Outbox full, dropping %lu oldest messages", (unsigned long)lost);
+        stats.dropped += lost;
+        stored -= lost;
+        tail = new_tail;
+        outbox_rewind();
+    }
+
+    return esp_partition_erase_range(part, sector * OUTBOX_SECTOR_SIZE, OUTBOX_SECTOR_SIZE);
+}
+
+static void
+outbox_store(struct outbox_msg *msg)
+{
+    esp_err_t ret;
+
+    if (head % OUTBOX_SLOTS_PER_SECTOR == 0) {
+        ret = outbox_open_sector();
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Sector erase failed; err=0x%x", ret);
+            return;
+        }
+    }
+
+    msg->hdr.seq = next_seq;
+    msg->hdr.state = OUTBOX_STATE_VALID;
+    msg->hdr.reserved = 0xff;
+    msg->hdr.crc = outbox_crc(msg);
+
+    ret = esp_partition_write(part, slot_offset(head), msg,
+                              sizeof(msg->hdr) + msg->hdr.topic_len + msg->hdr.payload_len);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Write failed, message lost; err=0x%x", ret);
+    }
+
+    /* The slot is used either way; a torn record fails its CRC later. */
+    head = slot_next(head);
+    next_seq++;
+    stored++;
+}
+
+static int
+outbox_client_publish(const struct outbox_msg *msg)
+{
+    char topic[OUTBOX_DATA_MAX + 1];
+
+    memcpy(topic, msg->data, msg->hdr.topic_len);
+    topic[msg->hdr.topic_len] = '\0';
+
+    return esp_mqtt_client_publish(outbox_client, topic, msg->data + msg->hdr.topic_len,
+                                   msg->hdr.payload_len, msg->hdr.qos, 0);
+}
+
+/* Frees slots at the tail once their messages have been acknowledged. */
+static void
+outbox_retire(void)
+{
+    while (inflight_count != 0 && inflight[inflight_first].acked) {
+        outbox_mark_done(inflight[inflight_first].slot);
+        tail = slot_next(inflight[inflight_first].slot);
+        stored--;
+        stats.drained++;
+        inflight_first = (inflight_first + 1) % OUTBOX_DRAIN_INFLIGHT;
+        inflight_count--;
+    }
+}
+
+static void
+outbox_acked(int msg_id)
+{
+    for (uint32_t i = 0; i < inflight_count; i++) {
+        struct outbox_inflight *f = &inflight[(inflight_first + i) % OUTBOX_DRAIN_INFLIGHT];
+
+        if (!f->acked && f->msg_id == msg_id) {
+            /* From the last send of this message to its PUBACK. */
+            metrics_hist_observe(METRIC_MQTT_PUBLISH_MS,
+                                 (esp_timer_get_time() - f->sent_us) / 1000);
+            f->acked = true;
+            break;
+        }
+    }
+
+    outbox_retire();
+}
+
+/**
+ * Publishes the next stored message, if the window has room.
+ */
+static void
+outbox_drain_one(void)
+{
+    struct outbox_msg msg;
+    struct outbox_inflight *f;
+    int msg_id;
+
+    if (inflight_count == stored || inflight_count == OUTBOX_DRAIN_INFLIGHT) {
+        return;
+    }
+
+    f = &inflight[(inflight_first + inflight_count) % OUTBOX_DRAIN_INFLIGHT];
+    f->slot = send;
+    f->sent_us = esp_timer_get_time();
+    f->acked = false;
+    f->msg_id = -1;
+
+    if (esp_partition_read(part, slot_offset(send), &msg, sizeof(msg)) != ESP_OK ||
+        msg.hdr.state != OUTBOX_STATE_VALID ||
+        msg.hdr.topic_len + msg.hdr.payload_len > OUTBOX_DATA_MAX ||
+        msg.hdr.crc != outbox_crc(&msg)) {
+        /* Torn by a power cut during the write; skipped. */
+        stats.corrupt++;
+        f->acked = true;
+    } else {
+        msg_id = outbox_client_publish(&msg);
+        if (msg_id < 0) {
+            /* Client not ready after all; try again on the next tick. */
+            return;
+        }
+        f->msg_id = msg_id;
+        f->acked = msg.hdr.qos == 0;
+    }
+
+    inflight_count++;
+    send = slot_next(send);
+    outbox_retire();
+}
+
+static void
+outbox_check_timeout(void)
+{
+    int64_t now = esp_timer_get_time();
+
+    if (inflight_count != 0 &&
+        now - inflight[inflight_first].sent_us >= (int64_t)OUTBOX_ACK_TIMEOUT_MS * 1000) {
+        stats.resent += inflight_count;
+        outbox_rewind();
+    }
+}
+
+/* Stores a message; outbox_poll() publishes it right after if online. */
+static void
+outbox_handle_msg(struct outbox_msg *msg)
+{
+    if (part == NULL) {
+        if (online && outbox_client_publish(msg) >= 0) {
+            stats.direct++;
+        } else {
+            stats.dropped++;
+        }
+        return;
+    }
+
+    outbox_store(msg);
+}
+
+static void
+outbox_handle_ev(const struct outbox_ev *ev)
+{
+    switch (ev->type) {
+    case OUTBOX_EV_CONNECTED:
+        online = true;
+        if (stored != 0) {
+            ESP_LOGI(TAG, "Draining %lu stored messages", (unsigned long)stored);
+        }
+        break;
+
+    case OUTBOX_EV_DISCONNECTED:
+        online = false;
+        stats.resent += inflight_count;
+        outbox_rewind();
+        break;
+
+    case OUTBOX_EV_PUBLISHED:
+        outbox_acked(ev->msg_id);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* One pass of the outbox task, after a wakeup or a drain tick. */
+static void
+outbox_poll(void)
+{
+    struct outbox_msg msg;
+    struct outbox_ev ev;
+
+    /* Events first, so acknowledgements free the window. */
+    while (xQueueReceive(ev_queue, &ev, 0) == pdTRUE) {
+        outbox_handle_ev(&ev);
+    }
+    while (xQueueReceive(msg_queue, &msg, 0) == pdTRUE) {
+        outbox_handle_msg(&msg);
+    }
+
+    if (online) {
+        outbox_check_timeout();
+        outbox_drain_one();
+    }
+}
+
+static void
+outbox_task_fn(void *param)
+{
+    TickType_t wait;
+
+    for (;;) {
+        wait = online && stored > inflight_count ? pdMS_TO_TICKS(OUTBOX_DRAIN_INTERVAL_MS) :
+               online && inflight_count != 0 ? pdMS_TO_TICKS(OUTBOX_ACK_TIMEOUT_MS) :
+               portMAX_DELAY;
+        ulTaskNotifyTake(pdTRUE, wait);
+        outbox_poll();
+    }
+}
+
+/**
+ * Rebuilds head, tail and the sequence number from the slot headers.
+ */
+static void
+outbox_recover(void)
+{
+    struct outbox_hdr hdr;
+    bool any = false;
+    bool pending = false;
+    uint32_t max_seq = 0;
+    uint32_t min_pending = 0;
+
+    head = 0;
+    tail = 0;
+
+    for (uint32_t slot = 0; slot < slot_count; slot++) {
+        if (esp_partition_read(part, slot_offset(slot), &hdr, sizeof(hdr)) != ESP_OK ||
+            hdr.state == OUTBOX_STATE_ERASED) {
+            continue;
+        }
+
+        if (!any || (int32_t)(hdr.seq - max_seq) > 0) {
+            max_seq = hdr.seq;
+            head = slot_next(slot);
+        }
+        any = true;
+
+        if (hdr.state != OUTBOX_STATE_DONE &&
+            (!pending || (int32_t)(hdr.seq - min_pending) < 0)) {
+            min_pending = hdr.seq;
+            tail = slot;
+            pending = true;
+        }
+    }
+
+    next_seq = any ? max_seq + 1 : 0;
+    if (!pending) {
+        tail = head;
+    }
+    stored = pending ? slot_distance(tail, head) : 0;
+    if (pending && stored == 0) {
+        stored = slot_count;
+    }
+    send = tail;
+}
+
+esp_err_t
+outbox_init(void)
+{
+    part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                    OUTBOX_PARTITION_LABEL);
+    if (part != NULL) {
+        slot_count = (part->size / OUTBOX_SECTOR_SIZE) * OUTBOX_SLOTS_PER_SECTOR;
+        if (slot_count < 2 * OUTBOX_SLOTS_PER_SECTOR) {
+            part = NULL;
+        }
+    }
+
+    if (part != NULL) {
+        outbox_recover();
+        ESP_LOGI(TAG, "%lu messages pending from the last boot, %lu slots",
+                 (unsigned long)stored, (unsigned long)slot_count);
+    } else {
+        /* Messages still go out while connected; offline ones are lost. */
+        ESP_LOGW(TAG, "No usable \"" OUTBOX_PARTITION_LABEL "\" partition, "
+                 "messages are not kept while offline");
+    }
+
+    msg_queue = xQueueCreate(OUTBOX_QUEUE_LEN, sizeof(struct outbox_msg));
+    ev_queue = xQueueCreate(OUTBOX_EVENT_QUEUE_LEN, sizeof(struct outbox_ev));
+    if (msg_queue == NULL || ev_queue == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (xTaskCreate(outbox_task_fn, "outbox", OUTBOX_TASK_STACK_SIZE, NULL,
+                    OUTBOX_TASK_PRIORITY, &outbox_task) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+void
+outbox_set_client(esp_mqtt_client_handle_t client)
+{
+    outbox_client = client;
+}
+
+void
+outbox_on_mqtt_event(esp_mqtt_event_handle_t event)
+{
+    struct outbox_ev ev = {
+        .msg_id = event->msg_id,
+    };
+
+    switch (event->event_id) {
+    case MQTT_EVENT_CONNECTED:
+        ev.type = OUTBOX_EV_CONNECTED;
+        break;
+    case MQTT_EVENT_DISCONNECTED:
+        ev.type = OUTBOX_EV_DISCONNECTED;
+        break;
+    case MQTT_EVENT_PUBLISHED:
+        ev.type = OUTBOX_EV_PUBLISHED;
+        break;
+    default:
+        return;
+    }
+
+    if (ev_queue == NULL) {
+        return;
+    }
+
+    /* A lost acknowledgement is recovered by the ack timeout. */
+    if (xQueueSend(ev_queue, &ev, 0) == pdTRUE) {
+        xTaskNotifyGive(outbox_task);
+    }
+}
+
+esp_err_t
+outbox_publish(const char *topic, const char *payload, size_t len, int qos)
+{
+    struct outbox_msg msg;
+    size_t topic_len = strlen(topic);
+
+    if (msg_queue == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    if (topic_len > UINT8_MAX || topic_len + len > OUTBOX_DATA_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    msg.hdr.qos = qos > 0 ? 1 : 0;
+    msg.hdr.topic_len = topic_len;
+    msg.hdr.payload_len = len;
+    memcpy(msg.data, topic, topic_len);
+    memcpy(msg.data + topic_len, payload, len);
+
+    if (xQueueSend(msg_queue, &msg, 0) != pdTRUE) {
+        stats.rejected++;
+        return ESP_ERR_NO_MEM;
+    }
+    xTaskNotifyGive(outbox_task);
+
+    return ESP_OK;
+}
+
+void
+outbox_get_stats(struct outbox_stats *out)
+{
+    *out = stats;
+    out->stored = stored;
+    out->capacity = slot_count;
+}
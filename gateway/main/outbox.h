@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "mqtt_client.h"
+
+/*
+ * Store-and-forward queue for outbound MQTT messages.
+ *
+ * Every message is appended to a FIFO on the "outbox" flash partition
+ * first and published from there, in order: straight away while the
+ * broker is reachable, at a bounded rate once the client reconnects.  A
+ * stored message is only removed after the broker acknowledged it (QoS 1)
+ * or it was handed to the client (QoS 0), so delivery is at least once
+ * across disconnects and reboots, including a reboot before the PUBACK.
+ */
+
+/* Flash slot per message, header included. */
+#define OUTBOX_SLOT_SIZE            256
+#define OUTBOX_HDR_SIZE             12
+/* Topic and payload together. */
+#define OUTBOX_DATA_MAX             (OUTBOX_SLOT_SIZE - OUTBOX_HDR_SIZE)
+
+/* Messages waiting between producers and the outbox task. */
+#define OUTBOX_QUEUE_LEN            16
+
+/* Drain pacing after a reconnect: one message per interval, with at most
+ * this many unacknowledged at once.
+ */
+#define OUTBOX_DRAIN_INTERVAL_MS    50
+#define OUTBOX_DRAIN_INFLIGHT       4
+
+/* Unacknowledged messages are sent again after this long. */
+#define OUTBOX_ACK_TIMEOUT_MS       10000
+
+struct outbox_stats {
+    /* Messages on flash, not yet acknowledged. */
+    uint32_t stored;
+    uint32_t capacity;
+    /* Published without being stored, for want of a partition. */
+    uint32_t direct;
+    uint32_t drained;
+    uint32_t resent;
+    /* Oldest messages overwritten because the partition was full. */
+    uint32_t dropped;
+    /* Messages refused because the producer queue was full. */
+    uint32_t rejected;
+    uint32_t corrupt;
+};
+
+/**
+ * Mounts the outbox partition, recovers the queue left by the previous
+ * boot and starts the outbox task.
+ */
+esp_err_t outbox_init(void);
+
+void outbox_set_client(esp_mqtt_client_handle_t client);
+
+/**
+ * Passes CONNECTED, DISCONNECTED and PUBLISHED events to the outbox task.
+ * Called from the MQTT event loop; other events are ignored.
+ */
+void outbox_on_mqtt_event(esp_mqtt_event_handle_t event);
+
+/**
+ * Queues a message for publishing.  Copies the message and never blocks,
+ * so it is safe to call from any task, including the NimBLE host task.
+ *
+ * @return ESP_OK, ESP_ERR_INVALID_SIZE if topic and payload do not fit a
+ *         slot, ESP_ERR_NO_MEM if the producer queue is full, or
+ *         ESP_ERR_INVALID_STATE before outbox_init().
+ */
+esp_err_t outbox_publish(const char *topic, const char *payload, size_t len, int qos);
+
+void outbox_get_stats(struct outbox_stats *stats);
@@ -0,0 +1,348 @@
+#include "scan.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "host/ble_store.h"
+#include "nimble/nimble_npl.h"
+#include "nimble/nimble_port.h"
+#if CONFIG_ESP_COEX_SW_COEXIST_ENABLE
+#include "esp_coexist.h"
+#endif
+
+#include "adv_parse.h"
+#include "boot.h"
+#include "lock_table.h"
+
+#define TAG "scan"
+
+/* Window the report rate is measured over. */
+#define SCAN_RATE_WINDOW_US     1000000
+
+/* Bonds the accept list is built from; bounded by the controller's list. */
+#define SCAN_BONDS_MAX          MYNEWT_VAL(BLE_STORE_MAX_BONDS)
+
+static const ble_uuid128_t *lock_uuid;
+static ble_gap_event_fn *scan_cb;
+
+static struct ble_npl_callout slow_callout;
+static struct ble_npl_callout slice_callout;
+
+static enum scan_mode cur_mode;
+static bool cur_fast;
+/* The running RECONNECT scan is an unfiltered slice. */
+static bool cur_slice;
+static uint8_t cur_missing;
+static bool initialized;
+
+/* Radio time accounting for the running scan. */
+static int64_t started_us;
+static uint32_t cur_itvl_ms;
+static uint32_t cur_window_ms;
+static int64_t boot_us;
+static uint64_t on_us;
+
+static int64_t window_start_us;
+static uint32_t window_reports;
+
+static struct scan_stats stats;
+
+bool
+scan_adv_is_lock(const uint8_t *data, uint8_t len)
+{
+    stats.reports++;
+
+    if (!adv_has_uuid128(data, len, lock_uuid->value)) {
+        return false;
+    }
+
+    stats.matched++;
+    return true;
+}
+
+void
+scan_note_report(int64_t start_us, int64_t end_us)
+{
+    uint32_t elapsed_us = end_us - start_us;
+
+    stats.report_us += elapsed_us;
+    if (elapsed_us > stats.report_max_us) {
+        stats.report_max_us = elapsed_us;
+    }
+
+    /* Report rate over the last full window. */
+    window_reports++;
+    if (end_us - window_start_us >= SCAN_RATE_WINDOW_US) {
+        stats.reports_per_s = (uint64_t)window_reports * 1000000 /
+                              (uint64_t)(end_us - window_start_us);
+        window_reports = 0;
+        window_start_us = end_us;
+    }
+}
+
+/**
+ * Counts bonded locks that have no link, and collects the bonded identities
+ * for the accept list.
+ */
+static int
+scan_missing_locks(ble_addr_t *bonds, int *num_bonds)
+{
+    const struct lock_entry *entry;
+    int missing = 0;
+    int rc;
+
+    rc = ble_store_util_bonded_peers(bonds, num_bonds, SCAN_BONDS_MAX);
+    if (rc != 0) {
+        *num_bonds = 0;
+        return 0;
+    }
+
+    for (int i = 0; i < *num_bonds; i++) {
+        entry = lock_table_find_addr(&bonds[i]);
+        if (entry == NULL || entry->conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+            missing++;
+        }
+    }
+
+    return missing;
+}
+
+static void
+scan_account_stop(void)
+{
+    int64_t now = esp_timer_get_time();
+
+    if (started_us != 0 && cur_itvl_ms != 0) {
+        on_us += (uint64_t)(now - started_us) * cur_window_ms / cur_itvl_ms;
+    }
+    started_us = 0;
+}
+
+int
+scan_stop(void)
+{
+    int rc;
+
+    if (!ble_gap_disc_active()) {
+        return 0;
+    }
+
+    rc = ble_gap_disc_cancel();
+    if (rc == 0) {
+        scan_account_stop();
+    }
+
+    return rc;
+}
+
+static void
+scan_set_coex(bool fast)
+{
+#if CONFIG_ESP_COEX_SW_COEXIST_ENABLE
+    /* Share the radio evenly while locks are being looked for, and let
+     * Wi-Fi have it the rest of the time.
+     */
+    esp_coex_preference_set(fast ? ESP_COEX_PREFER_BALANCE : ESP_COEX_PREFER_WIFI);
+#endif
+}
+
+static int
+scan_start(enum scan_mode mode, bool fast, bool slice, const ble_addr_t *bonds,
+           int num_bonds)
+{
+    struct ble_gap_disc_params disc_params = {0};
+    bool keep_fast_deadline;
+    uint8_t own_addr_type;
+    int rc;
+
+    rc = ble_hs_id_infer_auto(0, &own_addr_type);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "error determining address type; rc=%d", rc);
+        return rc;
+    }
+
+    /* Only the bonded locks are interesting while some of them are missing;
+     * the controller drops everything else before it reaches the host.
+     * Slices leave the list out to find locks that are not bonded yet.
+     */
+    if (mode == SCAN_MODE_RECONNECT && !slice) {
+        rc = ble_gap_wl_set(bonds, num_bonds);
+        if (rc != 0) {
+            ESP_LOGW(TAG, "accept list not set; rc=%d", rc);
+            mode = SCAN_MODE_IDLE;
+        }
+    }
+    slice = slice && mode == SCAN_MODE_RECONNECT;
+
+    cur_itvl_ms = fast && !slice ? SCAN_FAST_ITVL_MS : SCAN_SLOW_ITVL_MS;
+    cur_window_ms = fast && !slice ? SCAN_FAST_WINDOW_MS : SCAN_SLOW_WINDOW_MS;
+
+    /* Passive scan: the lock service UUID is in the advertising data, so
+     * scan requests would only cost airtime.
+     */
+    disc_params.passive = 1;
+    /* Duplicates by address and data: a lock's status change still comes
+     * through.
+     */
+    disc_params.filter_duplicates = 1;
+    disc_params.itvl = BLE_GAP_SCAN_ITVL_MS(cur_itvl_ms);
+    disc_params.window = BLE_GAP_SCAN_WIN_MS(cur_window_ms);
+    disc_params.filter_policy = mode == SCAN_MODE_RECONNECT && !slice ?
+                                BLE_HCI_SCAN_FILT_USE_WL : BLE_HCI_SCAN_FILT_NO_WL;
+
+    rc = ble_gap_disc(own_addr_type, BLE_HS_FOREVER, &disc_params, scan_cb, NULL);
+    if (rc != 0) {
+        ESP_LOGE(TAG, "Error initiating GAP discovery procedure; rc=%d", rc);
+        return rc;
+    }
+
+    /* Slices come and go inside one stretch of high duty; only a new
+     * stretch gets a new deadline.
+     */
+    keep_fast_deadline = cur_mode == SCAN_MODE_RECONNECT && cur_fast &&
+                         ble_npl_callout_is_active(&slow_callout);
+
+    started_us = esp_timer_get_time();
+    cur_mode = mode;
+    cur_fast = fast;
+    cur_slice = slice;
+    stats.restarts++;
+    if (slice) {
+        stats.slices++;
+    }
+
+    scan_set_coex(fast && !slice);
+
+    if (fast && mode == SCAN_MODE_RECONNECT) {
+        if (!keep_fast_deadline) {
+            ble_npl_callout_reset(&slow_callout, ble_npl_time_ms_to_ticks32(SCAN_FAST_MAX_MS));
+        }
+    } else {
+        ble_npl_callout_stop(&slow_callout);
+    }
+
+    if (mode == SCAN_MODE_RECONNECT) {
+        ble_npl_callout_reset(&slice_callout, ble_npl_time_ms_to_ticks32(
+                                  slice ? SCAN_SLICE_MS : SCAN_SLICE_EVERY_MS));
+    } else {
+        ble_npl_callout_stop(&slice_callout);
+    }
+
+    ESP_LOGI(TAG, "scan %s%s, %s duty, %d bonded missing",
+             mode == SCAN_MODE_DISCOVER ? "discover" :
+             mode == SCAN_MODE_RECONNECT ? "reconnect" : "idle",
+             slice ? " slice" : "", fast && !slice ? "high" : "low", cur_missing);
+
+    boot_mark(BOOT_PHASE_BLE_SCAN);
+    return 0;
+}
+
+static void
+scan_schedule(bool timed_out, bool slice)
+{
+    ble_addr_t bonds[SCAN_BONDS_MAX];
+    uint8_t prev_missing = cur_missing;
+    enum scan_mode mode;
+    int num_bonds;
+    int missing;
+    bool fast;
+
+    missing = scan_missing_locks(bonds, &num_bonds);
+    cur_missing = missing;
+
+    if (num_bonds == 0) {
+        mode = SCAN_MODE_DISCOVER;
+        fast = true;
+    } else if (missing > 0) {
+        mode = SCAN_MODE_RECONNECT;
+        /* Stay slow once the missing locks have had their fast window; a
+         * lock dropping off restarts it.
+         */
+        fast = !timed_out &&
+               !(cur_mode == SCAN_MODE_RECONNECT && !cur_fast && missing <= prev_missing);
+    } else {
+        mode = SCAN_MODE_IDLE;
+        fast = false;
+    }
+
+    if (ble_gap_disc_active()) {
+        /* A lock that connected stays on the accept list until the next
+         * restart; it no longer advertises, so that is harmless.
+         */
+        if (mode == cur_mode && fast == cur_fast) {
+            return;
+        }
+        if (scan_stop() != 0) {
+            return;
+        }
+    }
+
+    scan_start(mode, fast, slice, bonds, num_bonds);
+}
+
+static void
+scan_slow_down(struct ble_npl_event *ev)
+{
+    scan_schedule(true, false);
+}
+
+/**
+ * Switches a RECONNECT scan between the filtered scan and an unfiltered
+ * slice.
+ */
+static void
+scan_slice_toggle(struct ble_npl_event *ev)
+{
+    if (cur_mode != SCAN_MODE_RECONNECT || !ble_gap_disc_active()) {
+        return;
+    }
+    if (scan_stop() != 0) {
+        return;
+    }
+
+    scan_schedule(false, !cur_slice);
+}
+
+void
+scan_update(void)
+{
+    if (!initialized) {
+        return;
+    }
+
+    scan_schedule(false, false);
+}
+
+void
+scan_init(const ble_uuid_t *svc_uuid, ble_gap_event_fn *cb)
+{
+    lock_uuid = BLE_UUID128(svc_uuid);
+    scan_cb = cb;
+    cur_mode = SCAN_MODE_OFF;
+    boot_us = esp_timer_get_time();
+
+    ble_npl_callout_init(&slow_callout, nimble_port_get_dflt_eventq(),
+                         scan_slow_down, NULL);
+    ble_npl_callout_init(&slice_callout, nimble_port_get_dflt_eventq(),
+                         scan_slice_toggle, NULL);
+
+    initialized = true;
+}
+
+void
+scan_get_stats(struct scan_stats *out)
+{
+    int64_t now = esp_timer_get_time();
+    uint64_t radio_us = on_us;
+
+    *out = stats;
+    out->mode = ble_gap_disc_active() ? cur_mode : SCAN_MODE_OFF;
+    out->fast = cur_fast;
+    out->missing = cur_missing;
+
+    if (ble_gap_disc_active() && started_us != 0 && cur_itvl_ms != 0) {
+        radio_us += (uint64_t)(now - started_us) * cur_window_ms / cur_itvl_ms;
+    }
+    if (now > boot_us) {
+        out->duty_permille = radio_us * 1000 / (uint64_t)(now - boot_us);
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "host/ble_hs.h"
+
+/*
+ * Lock scanner.
+ *
+ * The scan runs in one of three modes, re-evaluated whenever a link comes or
+ * goes:
+ *
+ *  - DISCOVER: no lock is bonded yet.  High duty, no accept list, so a new
+ *    lock is found quickly while it is being commissioned.
+ *  - RECONNECT: a bonded lock is not connected.  High duty, filtered by an
+ *    accept list built from the bonded identities.  After SCAN_FAST_MAX_MS
+ *    without the missing locks coming back the scan drops to low duty; the
+ *    locks are likely out of range or powered down.  Every
+ *    SCAN_SLICE_EVERY_MS the filtered scan gives way to SCAN_SLICE_MS of
+ *    low duty scanning without the accept list, so a lock that is not bonded
+ *    yet is still found while a bonded one is away.
+ *  - IDLE: every bonded lock is connected.  Low duty, no accept list, only
+ *    to pick up locks that are not bonded yet.
+ *
+ * Low duty hands the shared radio back to Wi-Fi.
+ */
+
+/* High duty: 30 ms of every 60 ms. */
+#define SCAN_FAST_ITVL_MS       60
+#define SCAN_FAST_WINDOW_MS     30
+
+/* Low duty: 60 ms of every 1280 ms. */
+#define SCAN_SLOW_ITVL_MS       1280
+#define SCAN_SLOW_WINDOW_MS     60
+
+/* Longest stretch of high duty spent waiting for bonded locks. */
+#define SCAN_FAST_MAX_MS        60000
+
+/* Unfiltered slices in RECONNECT: two low duty windows every 15 s. */
+#define SCAN_SLICE_MS           (2 * SCAN_SLOW_ITVL_MS)
+#define SCAN_SLICE_EVERY_MS     15000
+
+enum scan_mode {
+    SCAN_MODE_OFF,
+    SCAN_MODE_DISCOVER,
+    SCAN_MODE_RECONNECT,
+    SCAN_MODE_IDLE,
+};
+
+struct scan_stats {
+    uint8_t mode;
+    bool fast;
+    /* Bonded locks without a link. */
+    uint8_t missing;
+
+    /* Advertising reports seen, and how many carried the lock service. */
+    uint32_t reports;
+    uint32_t matched;
+
+    /* Time spent handling reports in the GAP callback. */
+    uint64_t report_us;
+    uint32_t report_max_us;
+    /* Reports handled in the last second. */
+    uint32_t reports_per_s;
+
+    /* Share of time the radio was scanning since boot, in 1/1000. */
+    uint16_t duty_permille;
+    uint32_t restarts;
+    /* Unfiltered slices run while reconnecting. */
+    uint32_t slices;
+};
+
+/**
+ * Sets the lock service UUID the scanner filters on and the GAP callback
+ * scans report to.  Must be called after nimble_port_init().
+ */
+void scan_init(const ble_uuid_t *svc_uuid, ble_gap_event_fn *cb);
+
+/**
+ * Starts scanning, or restarts it when the mode derived from the bonded and
+ * connected locks changed.  Host task only.
+ */
+void scan_update(void);
+
+/**
+ * Stops scanning.  Host task only.
+ */
+int scan_stop(void);
+
+/**
+ * Walks the advertising data in place and reports whether it lists the lock
+ * service UUID.  Nothing is copied or allocated, and the walk ends at the
+ * first complete UUID list without the lock service.
+ */
+bool scan_adv_is_lock(const uint8_t *data, uint8_t len);
+
+/**
+ * Accounts the time the GAP callback spent on one advertising report.
+ */
+void scan_note_report(int64_t start_us, int64_t end_us);
+
+void scan_get_stats(struct scan_stats *stats);
@@ -0,0 +1,68 @@
+#include "spsc_ring.h"
+
+#include <string.h>
+
+void
+spsc_ring_init(struct spsc_ring *ring, void *storage, size_t elem_size, uint32_t cap)
+{
+    ring->buf = storage;
+    ring->elem_size = elem_size;
+    ring->capacity = cap;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->high_water, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+bool
+spsc_ring_push(struct spsc_ring *ring, const void *elem)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t depth;
+
+    if (head - tail >= ring->capacity) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+
+    memcpy(ring->buf + (head & (ring->capacity - 1)) * ring->elem_size,
+           elem, ring->elem_size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    depth = head + 1 - tail;
+    if (depth > atomic_load_explicit(&ring->high_water, memory_order_relaxed)) {
+        atomic_store_explicit(&ring->high_water, depth, memory_order_relaxed);
+    }
+
+    return true;
+}
+
+bool
+spsc_ring_pop(struct spsc_ring *ring, void *elem)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) {
+        return false;
+    }
+
+    memcpy(elem, ring->buf + (tail & (ring->capacity - 1)) * ring->elem_size,
+           ring->elem_size);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+void
+spsc_ring_get_stats(struct spsc_ring *ring, struct spsc_ring_stats *stats)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    stats->depth = head - tail;
+    stats->high_water = atomic_load_explicit(&ring->high_water, memory_order_relaxed);
+    stats->dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    stats->capacity = ring->capacity;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bounded single-producer/single-consumer ring of fixed-size elements.
+ *
+ * Exactly one task may push and exactly one task may pop.  Neither side
+ * takes a lock or blocks: push fails when the ring is full and pop fails
+ * when it is empty.  The capacity must be a power of two.
+ */
+struct spsc_ring {
+    uint8_t *buf;
+    size_t elem_size;
+    uint32_t capacity;
+
+    /* Written by the producer only. */
+    _Atomic uint32_t head;
+    _Atomic uint32_t high_water;
+    _Atomic uint32_t dropped;
+
+    /* Written by the consumer only. */
+    _Atomic uint32_t tail;
+};
+
+#define SPSC_RING_DEFINE(name, type, cap)                                   \
+    _Static_assert(((cap) & ((cap) - 1)) == 0, #name " capacity");          \
+    static type name##_storage[(cap)];                                      \
+    static struct spsc_ring name = {                                        \
+        .buf = (uint8_t *)name##_storage,                                   \
+        .elem_size = sizeof(type),                                          \
+        .capacity = (cap),                                                  \
+    }
+
+/**
+ * Sets up a ring over caller-provided storage of cap * elem_size bytes, for
+ * rings whose storage is allocated at run time.  The capacity must be a
+ * power of two.
+ */
+void spsc_ring_init(struct spsc_ring *ring, void *storage, size_t elem_size, uint32_t cap);
+
+struct spsc_ring_stats {
+    uint32_t depth;
+    uint32_t high_water;
+    uint32_t dropped;
+    uint32_t capacity;
+};
+
+/**
+ * Copies an element into the ring.  Producer side only.
+ *
+ * @return true on success, false if the ring is full (counted as dropped).
+ */
+bool spsc_ring_push(struct spsc_ring *ring, const void *elem);
+
+/**
+ * Copies the oldest element out of the ring.  Consumer side only.
+ *
+ * @return true on success, false if the ring is empty.
+ */
+bool spsc_ring_pop(struct spsc_ring *ring, void *elem);
+
+/**
+ * Reads the ring counters.  Safe to call from any task.
+ */
+void spsc_ring_get_stats(struct spsc_ring *ring, struct spsc_ring_stats *stats);
@@ -3,24 +3,189 @@
 #include <inttypes.h>
 #include <string.h>
 
+#include "esp_random.h"
+#include "esp_timer.h"
 #include "freertos/event_groups.h"
+#include "nvs.h"
+
+#include "boot.h"
+#include "metrics.h"
 
 #define TAG "tutorial"
 
 #define WIFI_AUTHMODE WIFI_AUTH_WPA2_PSK
 
 #define WIFI_CONNECTED_BIT BIT0
-#define WIFI_FAIL_BIT BIT1
 
-static const int WIFI_RETRY_ATTEMPT = 3;
-static int wifi_retry_count = 0;
+/* Posted by the backoff timer to make the retry on the event loop. */
+ESP_EVENT_DEFINE_BASE(WIFI_RETRY_EVENT);
+#define WIFI_RETRY_EVENT_ATTEMPT 0
+
+/* Last AP joined, so a reconnect can skip the all-channel scan. */
+#define WIFI_NVS_NAMESPACE "wifi"
+#define WIFI_NVS_KEY_AP "ap"
+
+struct wifi_ap_cache {
+    uint8_t bssid[6];
+    uint8_t channel;
+    uint8_t valid;
+};
 
 static esp_netif_t *tutorial_netif = NULL;
 static esp_event_handler_instance_t ip_event_handler;
 static esp_event_handler_instance_t wifi_event_handler;
+static esp_event_handler_instance_t retry_event_handler;
 
 static EventGroupHandle_t s_wifi_event_group = NULL;
 
+/*
+ * Reconnect state, only touched from handlers on the default event loop.
+ * The backoff timer fires on the esp_timer task, so it does not attempt
+ * itself: it posts WIFI_RETRY_EVENT and the attempt is made from the loop,
+ * in order with the Wi-Fi events.
+ */
+static wifi_config_t sta_config;
+static struct wifi_ap_cache ap_cache;
+static esp_timer_handle_t retry_timer;
+static uint32_t retry_count;
+static bool attempt_fast;
+static bool stopping;
+static int64_t link_lost_us;
+static struct wifi_stats stats;
+
+static void wifi_ap_cache_load(void)
+{
+    nvs_handle_t handle;
+    size_t len = sizeof(ap_cache);
+
+    memset(&ap_cache, 0, sizeof(ap_cache));
+
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_get_blob(handle, WIFI_NVS_KEY_AP, &ap_cache, &len) != ESP_OK ||
+        len != sizeof(ap_cache)) {
+        memset(&ap_cache, 0, sizeof(ap_cache));
+    }
+    nvs_close(handle);
+}
+
+static void wifi_ap_cache_store(const uint8_t *bssid, uint8_t channel)
+{
+    nvs_handle_t handle;
+
+    if (ap_cache.valid && ap_cache.channel == channel &&
+        memcmp(ap_cache.bssid, bssid, sizeof(ap_cache.bssid)) == 0) {
+        return;
+    }
+
+    memcpy(ap_cache.bssid, bssid, sizeof(ap_cache.bssid));
+    ap_cache.channel = channel;
+    ap_cache.valid = 1;
+
+    if (nvs_open(WIFI_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(handle, WIFI_NVS_KEY_AP, &ap_cache, sizeof(ap_cache)) == ESP_OK) {
+        nvs_commit(handle);
+    }
+    nvs_close(handle);
+}
+
+/**
+ * Starts one association attempt.  While the cached AP is trusted only its
+ * channel is probed, which takes tens of milliseconds instead of a full
+ * scan of every channel.
+ */
+static void wifi_attempt(void)
+{
+    attempt_fast = ap_cache.valid && retry_count <= WIFI_FAST_ATTEMPTS;
+
+    if (attempt_fast) {
+        memcpy(sta_config.sta.bssid, ap_cache.bssid, sizeof(sta_config.sta.bssid));
+        sta_config.sta.bssid_set = true;
+        sta_config.sta.channel = ap_cache.channel;
+    } else {
+        sta_config.sta.bssid_set = false;
+        sta_config.sta.channel = 0;
+        stats.full_scans++;
+    }
+
+    esp_wifi_set_config(WIFI_IF_STA, &sta_config);
+    esp_wifi_connect();
+}
+
+static void wifi_retry_timer_cb(void *arg)
+{
+    if (esp_event_post(WIFI_RETRY_EVENT, WIFI_RETRY_EVENT_ATTEMPT, NULL, 0, 0) != ESP_OK) {
+        /* The loop's queue is full; try again shortly. */
+        esp_timer_start_once(retry_timer, (uint64_t)WIFI_BACKOFF_BASE_MS * 1000);
+    }
+}
+
+static void retry_event_cb(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    if (!stopping) {
+        wifi_attempt();
+    }
+}
+
+static uint32_t wifi_backoff_ms(uint32_t attempt)
+{
+    uint32_t delay = WIFI_BACKOFF_MAX_MS;
+
+    if (attempt < 16 && ((uint32_t)WIFI_BACKOFF_BASE_MS << attempt) < delay) {
+        delay = (uint32_t)WIFI_BACKOFF_BASE_MS << attempt;
+    }
+
+    return delay / 2 + esp_random() % (delay / 2 + 1);
+}
+
+static void wifi_schedule_retry(void)
+{
+    uint32_t delay_ms;
+
+    if (retry_count == 0) {
+        /* Likely an AP blip: go again straight away. */
+        retry_count++;
+        wifi_attempt();
+        return;
+    }
+
+    delay_ms = wifi_backoff_ms(retry_count - 1);
+    retry_count++;
+
+    ESP_LOGI(TAG, "Retrying to connect to Wi-Fi network in %" PRIu32 " ms (attempt %" PRIu32 ")",
+             delay_ms, retry_count);
+    esp_timer_stop(retry_timer);
+    esp_timer_start_once(retry_timer, (uint64_t)delay_ms * 1000);
+}
+
+static void wifi_record_reconnect(void)
+{
+    uint32_t ms;
+
+    if (link_lost_us == 0) {
+        return;
+    }
+
+    ms = (uint32_t)((esp_timer_get_time() - link_lost_us) / 1000);
+    link_lost_us = 0;
+
+    stats.reconnects++;
+    metrics_counter_add(METRIC_WIFI_RECONNECTS, 1);
+    stats.last_reconnect_ms = ms;
+    if (stats.reconnects == 1 || ms < stats.min_reconnect_ms) {
+        stats.min_reconnect_ms = ms;
+    }
+    if (ms > stats.max_reconnect_ms) {
+        stats.max_reconnect_ms = ms;
+    }
+
+    ESP_LOGI(TAG, "Reconnected in %" PRIu32 " ms; min=%" PRIu32 " max=%" PRIu32 " count=%" PRIu32,
+             ms, stats.min_reconnect_ms, stats.max_reconnect_ms, stats.reconnects);
+}
+
 static void ip_event_cb(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
 {
     ESP_LOGI(TAG, "Handling IP event, event code 0x%" PRIx32, event_id);
@@ -29,16 +194,21 @@ static void ip_event_cb(void *arg, esp_event_base_t event_base, int32_t event_id
     case (IP_EVENT_STA_GOT_IP):
         ip_event_got_ip_t *event_ip = (ip_event_got_ip_t *)event_data;
         ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event_ip->ip_info.ip));
-        wifi_retry_count = 0;
+        boot_mark(BOOT_PHASE_IP);
+        retry_count = 0;
+        wifi_record_reconnect();
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
         break;
     case (IP_EVENT_STA_LOST_IP):
         ESP_LOGI(TAG, "Lost IP");
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
         break;
     case (IP_EVENT_GOT_IP6):
         ip_event_got_ip6_t *event_ip6 = (ip_event_got_ip6_t *)event_data;
         ESP_LOGI(TAG, "Got IPv6: " IPV6STR, IPV62STR(event_ip6->ip6_info.ip));
-        wifi_retry_count = 0;
+        boot_mark(BOOT_PHASE_IP);
+        retry_count = 0;
+        wifi_record_reconnect();
         xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
         break;
     default:
@@ -61,24 +231,33 @@ static void wifi_event_cb(void *arg, esp_event_base_t event_base, int32_t event_
         break;
     case (WIFI_EVENT_STA_START):
         ESP_LOGI(TAG, "Wi-Fi started, connecting to AP...");
-        esp_wifi_connect();
+        link_lost_us = esp_timer_get_time();
+        wifi_attempt();
         break;
     case (WIFI_EVENT_STA_STOP):
         ESP_LOGI(TAG, "Wi-Fi stopped");
         break;
     case (WIFI_EVENT_STA_CONNECTED):
-        ESP_LOGI(TAG, "Wi-Fi connected");
+        wifi_event_sta_connected_t *connected = (wifi_event_sta_connected_t *)event_data;
+        ESP_LOGI(TAG, "Wi-Fi connected, channel %u%s", connected->channel,
+                 attempt_fast ? " (cached AP)" : "");
+        if (attempt_fast) {
+            stats.fast_hits++;
+        }
+        boot_mark(BOOT_PHASE_WIFI_ASSOC);
+        wifi_ap_cache_store(connected->bssid, connected->channel);
         break;
     case (WIFI_EVENT_STA_DISCONNECTED):
-        ESP_LOGI(TAG, "Wi-Fi disconnected");
-        if (wifi_retry_count < WIFI_RETRY_ATTEMPT) {
-            ESP_LOGI(TAG, "Retrying to connect to Wi-Fi network...");
-            esp_wifi_connect();
-            wifi_retry_count++;
-        } else {
-            ESP_LOGI(TAG, "Failed to connect to Wi-Fi network");
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+        wifi_event_sta_disconnected_t *disconnected = (wifi_event_sta_disconnected_t *)event_data;
+        ESP_LOGI(TAG, "Wi-Fi disconnected, reason %u", disconnected->reason);
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        if (stopping) {
+            break;
+        }
+        if (link_lost_us == 0) {
+            link_lost_us = esp_timer_get_time();
         }
+        wifi_schedule_retry();
         break;
     case (WIFI_EVENT_STA_AUTHMODE_CHANGE):
         ESP_LOGI(TAG, "Wi-Fi authmode changed");
@@ -121,6 +300,18 @@ esp_err_t tutorial_init(void)
         return ESP_FAIL;
     }
 
+    const esp_timer_create_args_t retry_timer_args = {
+        .callback = wifi_retry_timer_cb,
+        .name = "wifi_retry",
+    };
+    ret = esp_timer_create(&retry_timer_args, &retry_timer);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to create the reconnect timer");
+        return ret;
+    }
+
+    wifi_ap_cache_load();
+
     // Wi-Fi stack configuration parameters
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -135,47 +326,58 @@ esp_err_t tutorial_init(void)
                                                         &ip_event_cb,
                                                         NULL,
                                                         &ip_event_handler));
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_RETRY_EVENT,
+                                                        WIFI_RETRY_EVENT_ATTEMPT,
+                                                        &retry_event_cb,
+                                                        NULL,
+                                                        &retry_event_handler));
     return ret;
 }
 
 esp_err_t tutorial_connect(char* wifi_ssid, char* wifi_password)
 {
-    wifi_config_t wifi_config = {
-        .sta = {
-            // this sets the weakest authmode accepted in fast scan mode (default)
-            .threshold.authmode = WIFI_AUTHMODE,
-        },
-    };
+    memset(&sta_config, 0, sizeof(sta_config));
+    // this sets the weakest authmode accepted in fast scan mode (default)
+    sta_config.sta.threshold.authmode = WIFI_AUTHMODE;
+    // with a cached BSSID the scan stops at the first match on its channel
+    sta_config.sta.scan_method = WIFI_FAST_SCAN;
+    sta_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
 
-    strncpy((char*)wifi_config.sta.ssid, wifi_ssid, sizeof(wifi_config.sta.ssid));
-    strncpy((char*)wifi_config.sta.password, wifi_password, sizeof(wifi_config.sta.password));
+    strncpy((char*)sta_config.sta.ssid, wifi_ssid, sizeof(sta_config.sta.ssid));
+    strncpy((char*)sta_config.sta.password, wifi_password, sizeof(sta_config.sta.password));
 
     ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE)); // default is WIFI_PS_MIN_MODEM
     ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM)); // default is WIFI_STORAGE_FLASH
 
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
 
-    ESP_LOGI(TAG, "Connecting to Wi-Fi network: %s", wifi_config.sta.ssid);
-    ESP_ERROR_CHECK(esp_wifi_start());
+    if (ap_cache.valid) {
+        ESP_LOGI(TAG, "Connecting to Wi-Fi network: %s, cached AP on channel %u",
+                 sta_config.sta.ssid, ap_cache.channel);
+    } else {
+        ESP_LOGI(TAG, "Connecting to Wi-Fi network: %s", sta_config.sta.ssid);
+    }
 
-    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
-        pdFALSE, pdFALSE, portMAX_DELAY);
+    stopping = false;
+    retry_count = 0;
 
-    if (bits & WIFI_CONNECTED_BIT) {
-        ESP_LOGI(TAG, "Connected to Wi-Fi network: %s", wifi_config.sta.ssid);
-        return ESP_OK;
-    } else if (bits & WIFI_FAIL_BIT) {
-        ESP_LOGE(TAG, "Failed to connect to Wi-Fi network: %s", wifi_config.sta.ssid);
-        return ESP_FAIL;
-    }
+    // the first attempt is made from WIFI_EVENT_STA_START
+    return esp_wifi_start();
+}
 
-    ESP_LOGE(TAG, "Unexpected Wi-Fi error");
-    return ESP_FAIL;
+esp_err_t tutorial_wait_connected(TickType_t timeout)
+{
+    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT,
+        pdFALSE, pdFALSE, timeout);
+
+    return (bits & WIFI_CONNECTED_BIT) ? ESP_OK : ESP_ERR_TIMEOUT;
 }
 
 esp_err_t tutorial_disconnect(void)
 {
+    stopping = true;
+    esp_timer_stop(retry_timer);
+
     if (s_wifi_event_group) {
         vEventGroupDelete(s_wifi_event_group);
     }
@@ -185,6 +387,9 @@ esp_err_t tutorial_disconnect(void)
 
 esp_err_t tutorial_deinit(void)
 {
+    stopping = true;
+    esp_timer_stop(retry_timer);
+
     esp_err_t ret = esp_wifi_stop();
     if (ret == ESP_ERR_WIFI_NOT_INIT) {
         ESP_LOGE(TAG, "Wi-Fi stack not initialized");
@@ -197,6 +402,15 @@ esp_err_t tutorial_deinit(void)
 
     ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, ESP_EVENT_ANY_ID, ip_event_handler));
     ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_event_handler));
+    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_RETRY_EVENT, WIFI_RETRY_EVENT_ATTEMPT,
+                                                          retry_event_handler));
+
+    esp_timer_delete(retry_timer);
 
     return ESP_OK;
-}
\ No newline at end of file
+}
+
+void tutorial_get_stats(struct wifi_stats *out)
+{
+    *out = stats;
+}
@@ -1,6 +1,8 @@
 // tutorial.h
 #pragma once
 
+#include <stdint.h>
+
 #include "esp_err.h"
 #include "esp_log.h"
 
@@ -10,10 +12,45 @@
 
 #include "freertos/FreeRTOS.h"
 
+/* Reconnect backoff: the first retry after a drop is immediate, later ones
+ * wait BASE << n ms, capped at MAX, with up to half of it taken off at
+ * random so that gateways behind one AP do not retry in step.
+ */
+#define WIFI_BACKOFF_BASE_MS    250
+#define WIFI_BACKOFF_MAX_MS     30000
+
+/* Attempts after a drop that go straight to the cached BSSID and channel
+ * before falling back to a full scan.
+ */
+#define WIFI_FAST_ATTEMPTS      2
+
+struct wifi_stats {
+    uint32_t reconnects;
+    /* Time from losing the link to getting an IP address again. */
+    uint32_t last_reconnect_ms;
+    uint32_t min_reconnect_ms;
+    uint32_t max_reconnect_ms;
+    uint32_t fast_hits;
+    uint32_t full_scans;
+};
+
 esp_err_t tutorial_init(void);
 
+/**
+ * Starts connecting to the network and returns.  The link is kept up from
+ * then on: drops are retried with backoff, without a limit.
+ */
 esp_err_t tutorial_connect(char* wifi_ssid, char* wifi_password);
 
+/**
+ * Waits until the station has an IP address.
+ *
+ * @return ESP_OK, or ESP_ERR_TIMEOUT.
+ */
+esp_err_t tutorial_wait_connected(TickType_t timeout);
+
 esp_err_t tutorial_disconnect(void);
 
-esp_err_t tutorial_deinit(void);
\ No newline at end of file
+esp_err_t tutorial_deinit(void);
+
+void tutorial_get_stats(struct wifi_stats *stats);
@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+#
+# Decode a dictionary log captured from the lock's UART, e.g.
+#
+#   west build -b nrf52840dk/nrf52840 -- -DEXTRA_CONF_FILE=overlay-log-dictionary.conf
+#   cat /dev/ttyACM0 > lock.log
+#   scripts/decode_log.py -d build lock.log
+#
+# Wraps the parser that ships with Zephyr, which needs the dictionary
+# database of the exact image that produced the log.
+
+import argparse
+import os
+import subprocess
+import sys
+from pathlib import Path
+
+DATABASE = Path("zephyr") / "log_dictionary.json"
+
+
+def find_database(build_dir):
+    # Sysbuild puts the application in a subdirectory named after it.
+    for candidate in (build_dir / DATABASE, build_dir / "smart_lock" / DATABASE):
+        if candidate.is_file():
+            return candidate
+    sys.exit(f"No {DATABASE} under {build_dir}; build with overlay-log-dictionary.conf")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode dictionary logs from the lock")
+    parser.add_argument("-d", "--build-dir", type=Path, default=Path("build"),
+                        help="build directory of the image that produced the log")
+    parser.add_argument("--hex", action="store_true",
+                        help="the capture is hex text rather than raw binary")
+    parser.add_argument("logfile", help="captured UART output")
+    args = parser.parse_args()
+
+    zephyr_base = os.environ.get("ZEPHYR_BASE")
+    if not zephyr_base:
+        sys.exit("ZEPHYR_BASE is not set")
+
+    log_parser = Path(zephyr_base) / "scripts" / "logging" / "dictionary" / "log_parser.py"
+    cmd = [sys.executable, str(log_parser)]
+    if args.hex:
+        cmd.append("--hex")
+    cmd += [str(find_database(args.build_dir)), args.logfile]
+
+    return subprocess.call(cmd)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,418 @@
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/logging/log.h>
+
+#include "actuator.h"
+#include "gatt_lock_svc.h"
+#include "audit_log.h"
+#include "trace.h"
+
+
+LOG_MODULE_REGISTER(actuator);
+
+
+#define ACTUATOR_NODE		DT_PATH(zephyr_user)
+
+enum bolt_position {
+	BOLT_BETWEEN,
+	BOLT_LOCKED,
+	BOLT_UNLOCKED,
+};
+
+/*
+ * Driver interface. The GPIO driver runs an H-bridge with one input per
+ * direction and reads a limit switch at each end of the bolt travel.
+ */
+static int driver_init(void);
+static void driver_drive(enum actuator_state target);
+static void driver_stop(void);
+static enum bolt_position driver_position(void);
+
+/* Unused when the board has no driver. */
+static __maybe_unused void actuator_sensor_changed(void);
+
+
+#if defined(CONFIG_LOCK_ACTUATOR_EMUL)
+
+static void emul_travel_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(emul_travel_work, emul_travel_handler);
+static enum bolt_position emul_position = BOLT_LOCKED;
+static enum bolt_position emul_target;
+
+static void emul_travel_handler(struct k_work *work)
+{
+	emul_position = emul_target;
+	actuator_sensor_changed();
+}
+
+static int driver_init(void)
+{
+	LOG_WRN("Using the emulated actuator");
+
+	return 0;
+}
+
+static void driver_drive(enum actuator_state target)
+{
+	emul_target = target == ACTUATOR_LOCKED ? BOLT_LOCKED : BOLT_UNLOCKED;
+	emul_position = BOLT_BETWEEN;
+	k_work_reschedule(&emul_travel_work, K_MSEC(ACTUATOR_EMUL_TRAVEL_MS));
+}
+
+static void driver_stop(void)
+{
+	(void)k_work_cancel_delayable(&emul_travel_work);
+}
+
+static enum bolt_position driver_position(void)
+{
+	return emul_position;
+}
+
+#elif DT_NODE_HAS_PROP(ACTUATOR_NODE, lock_motor_gpios)
+
+/* Index 0 drives towards locked, index 1 towards unlocked. */
+static const struct gpio_dt_spec motor[] = {
+	GPIO_DT_SPEC_GET_BY_IDX(ACTUATOR_NODE, lock_motor_gpios, 0),
+	GPIO_DT_SPEC_GET_BY_IDX(ACTUATOR_NODE, lock_motor_gpios, 1),
+};
+
+/* Index 0 is the locked limit switch, index 1 the unlocked one. */
+static const struct gpio_dt_spec sensor[] = {
+	GPIO_DT_SPEC_GET_BY_IDX(ACTUATOR_NODE, lock_sensor_gpios, 0),
+	GPIO_DT_SPEC_GET_BY_IDX(ACTUATOR_NODE, lock_sensor_gpios, 1),
+};
+
+static struct gpio_callback sensor_cb_data[ARRAY_SIZE(sensor)];
+
+static void sensor_isr(const struct device *dev, struct gpio_callback *cb, uint32_t pins)
+{
+	actuator_sensor_changed();
+}
+
+static int driver_init(void)
+{
+	int err;
+
+	for (size_t i = 0; i < ARRAY_SIZE(motor); i++) {
+		if (!gpio_is_ready_dt(&motor[i])) {
+			return -ENODEV;
+		}
+		err = gpio_pin_configure_dt(&motor[i], GPIO_OUTPUT_INACTIVE);
+		if (err) {
+			return err;
+		}
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(sensor); i++) {
+		if (!gpio_is_ready_dt(&sensor[i])) {
+			return -ENODEV;
+		}
+		err = gpio_pin_configure_dt(&sensor[i], GPIO_INPUT);
+		if (err) {
+			return err;
+		}
+		err = gpio_pin_interrupt_configure_dt(&sensor[i], GPIO_INT_EDGE_BOTH);
+		if (err) {
+			return err;
+		}
+		gpio_init_callback(&sensor_cb_data[i], sensor_isr, BIT(sensor[i].pin));
+		err = gpio_add_callback(sensor[i].port, &sensor_cb_data[i]);
+		if (err) {
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static void driver_drive(enum actuator_state target)
+{
+	/* Never drive both H-bridge inputs at once. */
+	driver_stop();
+	gpio_pin_set_dt(&motor[target == ACTUATOR_LOCKED ? 0 : 1], 1);
+}
+
+static void driver_stop(void)
+{
+	gpio_pin_set_dt(&motor[0], 0);
+	gpio_pin_set_dt(&motor[1], 0);
+}
+
+static enum bolt_position driver_position(void)
+{
+	bool locked = gpio_pin_get_dt(&sensor[0]) > 0;
+	bool unlocked = gpio_pin_get_dt(&sensor[1]) > 0;
+
+	if (locked == unlocked) {
+		return BOLT_BETWEEN;
+	}
+
+	return locked ? BOLT_LOCKED : BOLT_UNLOCKED;
+}
+
+#else /* No driver */
+
+static int driver_init(void)
+{
+	LOG_ERR("No lock-motor-gpios in the zephyr,user node");
+
+	return -ENODEV;
+}
+
+static void driver_drive(enum actuator_state target)
+{
+}
+
+static void driver_stop(void)
+{
+}
+
+static enum bolt_position driver_position(void)
+{
+	return BOLT_BETWEEN;
+}
+
+#endif /* CONFIG_LOCK_ACTUATOR_EMUL */
+
+
+static void start_work_handler(struct k_work *work);
+static void debounce_work_handler(struct k_work *work);
+static void jam_work_handler(struct k_work *work);
+
+static K_WORK_DEFINE(start_work, start_work_handler);
+static K_WORK_DELAYABLE_DEFINE(debounce_work, debounce_work_handler);
+static K_WORK_DELAYABLE_DEFINE(jam_work, jam_work_handler);
+
+/*
+ * Requests come from the Bluetooth RX thread and the keypad, sensor edges
+ * from interrupts; all state changes are made under the lock and the
+ * driver itself is only touched from the system workqueue.
+ */
+static struct k_spinlock lock;
+static enum actuator_state state = ACTUATOR_LOCKED;
+static bool ready;
+static int64_t request_ms;
+static int64_t last_edge_ms;
+static struct actuator_stats stats;
+static uint32_t latency_sum_ms;
+
+
+static bool state_is_moving(enum actuator_state s)
+{
+	return s == ACTUATOR_LOCKING || s == ACTUATOR_UNLOCKING;
+}
+
+static enum actuator_state state_from_position(enum bolt_position pos)
+{
+	switch (pos) {
+	case BOLT_LOCKED:
+		return ACTUATOR_LOCKED;
+	case BOLT_UNLOCKED:
+		return ACTUATOR_UNLOCKED;
+	default:
+		return ACTUATOR_JAMMED;
+	}
+}
+
+/* Called with the lock held. */
+static void stats_record_move(uint32_t latency_ms)
+{
+	latency_ms = MIN(latency_ms, UINT16_MAX);
+
+	stats.last_ms = latency_ms;
+	if (stats.moves == 0 || latency_ms < stats.min_ms) {
+		stats.min_ms = latency_ms;
+	}
+	if (latency_ms > stats.max_ms) {
+		stats.max_ms = latency_ms;
+	}
+	stats.moves++;
+	latency_sum_ms += latency_ms;
+	stats.avg_ms = latency_sum_ms / stats.moves;
+}
+
+static void actuator_sensor_changed(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	last_edge_ms = k_uptime_get();
+
+	k_spin_unlock(&lock, key);
+
+	/* Sampled once the switch has stopped bouncing. */
+	k_work_reschedule(&debounce_work, K_MSEC(ACTUATOR_DEBOUNCE_MS));
+}
+
+static void start_work_handler(struct k_work *work)
+{
+	enum actuator_state target;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	target = state == ACTUATOR_LOCKING ? ACTUATOR_LOCKED : ACTUATOR_UNLOCKED;
+
+	k_spin_unlock(&lock, key);
+
+	driver_drive(target);
+	TRACE_END(TRACE_SPAN_ACTUATOR);
+	k_work_reschedule(&jam_work, K_MSEC(ACTUATOR_JAM_TIMEOUT_MS));
+	lock_svc_state_update(target == ACTUATOR_LOCKED ? ACTUATOR_LOCKING : ACTUATOR_UNLOCKING);
+}
+
+static void debounce_work_handler(struct k_work *work)
+{
+	enum bolt_position pos = driver_position();
+	enum actuator_state new_state;
+	bool changed = false;
+	bool moved = false;
+	uint32_t latency_ms = 0;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (state_is_moving(state)) {
+		enum bolt_position target = state == ACTUATOR_LOCKING ?
+					    BOLT_LOCKED : BOLT_UNLOCKED;
+
+		if (pos == target) {
+			new_state = state_from_position(pos);
+			latency_ms = (uint32_t)(last_edge_ms - request_ms);
+			stats_record_move(latency_ms);
+			moved = true;
+			changed = true;
+		}
+	} else if (pos != BOLT_BETWEEN && state_from_position(pos) != state) {
+		/* Bolt turned by hand, or freed after a jam. */
+		new_state = state_from_position(pos);
+		changed = true;
+	}
+
+	if (changed) {
+		state = new_state;
+	}
+
+	k_spin_unlock(&lock, key);
+
+	if (!changed) {
+		return;
+	}
+
+	if (moved) {
+		driver_stop();
+		(void)k_work_cancel_delayable(&jam_work);
+		LOG_INF("Bolt %s in %u ms",
+			new_state == ACTUATOR_LOCKED ? "locked" : "unlocked", latency_ms);
+	}
+
+	lock_svc_state_update(new_state);
+}
+
+static void jam_work_handler(struct k_work *work)
+{
+	bool jammed = false;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (state_is_moving(state)) {
+		state = ACTUATOR_JAMMED;
+		stats.jams++;
+		jammed = true;
+	}
+
+	k_spin_unlock(&lock, key);
+
+	if (!jammed) {
+		return;
+	}
+
+	driver_stop();
+	LOG_WRN("Bolt jammed");
+	audit_log_add(AUDIT_SRC_LOCK, AUDIT_USER_NONE, AUDIT_RESULT_JAMMED);
+
+	lock_svc_state_update(ACTUATOR_JAMMED);
+}
+
+int actuator_init(void)
+{
+	enum bolt_position pos;
+	int err;
+
+	err = driver_init();
+	if (err) {
+		LOG_ERR("Actuator driver init failed (err %d)", err);
+		return err;
+	}
+
+	pos = driver_position();
+
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	state = state_from_position(pos);
+	ready = true;
+	k_spin_unlock(&lock, key);
+
+	LOG_INF("Actuator ready, state %d", state);
+
+	return lock_svc_state_update(state);
+}
+
+int actuator_request(enum actuator_state target)
+{
+	enum actuator_state current;
+	int err = 0;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	current = state;
+	if (!ready) {
+		err = -ENODEV;
+	} else if (state_is_moving(current)) {
+		err = -EBUSY;
+	} else if (current != target) {
+		state = target == ACTUATOR_LOCKED ? ACTUATOR_LOCKING : ACTUATOR_UNLOCKING;
+		request_ms = k_uptime_get();
+	}
+
+	k_spin_unlock(&lock, key);
+
+	if (err) {
+		return err;
+	}
+
+	if (current == target) {
+		/* Already there; confirm so the client sees the final state.
+		 * The request itself has succeeded whether or not that goes
+		 * out.
+		 */
+		(void)lock_svc_state_update(current);
+		return 0;
+	}
+
+	/* Ended by start_work_handler(), which runs once per move started
+	 * here: later requests are refused until the move is over.
+	 */
+	TRACE_BEGIN(TRACE_SPAN_ACTUATOR);
+	k_work_submit(&start_work);
+
+	return 0;
+}
+
+enum actuator_state actuator_state_get(void)
+{
+	enum actuator_state current;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	current = state;
+
+	k_spin_unlock(&lock, key);
+
+	return current;
+}
+
+void actuator_stats_get(struct actuator_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = stats;
+
+	k_spin_unlock(&lock, key);
+}
@@ -0,0 +1,59 @@
+#ifndef ACTUATOR_H
+#define ACTUATOR_H
+
+#include <stdint.h>
+
+/* Bolt travel has to finish within this time or the lock reports a jam. */
+#define ACTUATOR_JAM_TIMEOUT_MS		2000
+/* Position sensors must be stable this long before they are trusted. */
+#define ACTUATOR_DEBOUNCE_MS		20
+/* Bolt travel time of the emulated driver, CONFIG_LOCK_ACTUATOR_EMUL. */
+#define ACTUATOR_EMUL_TRAVEL_MS		300
+
+/** @brief Lock states, as sent in the lock state characteristic. */
+enum actuator_state {
+	ACTUATOR_LOCKED = 0,
+	ACTUATOR_UNLOCKED = 1,
+	ACTUATOR_LOCKING = 2,
+	ACTUATOR_UNLOCKING = 3,
+	ACTUATOR_JAMMED = 4,
+};
+
+/** @brief Write-to-bolt-moved latency, in milliseconds. */
+struct actuator_stats {
+	uint16_t last_ms;
+	uint16_t min_ms;
+	uint16_t max_ms;
+	uint16_t avg_ms;
+	uint32_t moves;
+	uint32_t jams;
+} __packed;
+
+/** @brief Initialize the motor driver and position sensors.
+ *
+ * The motor and limit switches come from lock-motor-gpios and
+ * lock-sensor-gpios in the zephyr,user node. With CONFIG_LOCK_ACTUATOR_EMUL
+ * an emulated driver moves the bolt after ACTUATOR_EMUL_TRAVEL_MS instead.
+ *
+ * @retval 0 on success, -ENODEV if the board has neither, otherwise a
+ *         negative error code.
+ */
+int actuator_init(void);
+
+/** @brief Request the bolt to move to the locked or unlocked position.
+ *
+ * Returns right away; every state change is sent through
+ * lock_svc_state_update().
+ *
+ * @param target ACTUATOR_LOCKED or ACTUATOR_UNLOCKED.
+ *
+ * @retval 0 on success, including when the bolt is already at @p target,
+ *         -EBUSY if the bolt is moving, -ENODEV if actuator_init() failed.
+ */
+int actuator_request(enum actuator_state target);
+
+enum actuator_state actuator_state_get(void);
+
+void actuator_stats_get(struct actuator_stats *stats);
+
+#endif /* ACTUATOR_H */
@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/random/random.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <tinycrypt/constants.h>
+#include <tinycrypt/hmac.h>
+
+#include "adv_status.h"
+#include "gap_advertising.h"
+
+
+LOG_MODULE_REGISTER(adv_status);
+
+
+/*
+ * Settings layout, all under "adv":
+ *   adv/key    status key, generated on first boot
+ *   adv/cnt    counter ceiling; every value below it may have been sent
+ */
+#define ADV_KEY_KEY		"adv/key"
+#define ADV_KEY_COUNTER		"adv/cnt"
+
+/* Bytes covered by the tag, after the company ID. */
+#define ADV_SIGNED_LEN		4
+
+
+static struct k_spinlock status_lock;
+static uint8_t status_key[ADV_STATUS_KEY_LEN];
+static uint8_t lock_state;
+static uint8_t battery;
+static uint16_t counter;
+/* Changes before init are only recorded; the first advertising start
+ * encodes them.
+ */
+static bool ready;
+
+/* Owned by the system workqueue. */
+static uint16_t counter_ceiling;
+
+
+static int load_direct_cb(const char *key, size_t len, settings_read_cb read_cb,
+			  void *cb_arg, void *param)
+{
+	size_t dst_len = param == status_key ? sizeof(status_key) : sizeof(counter_ceiling);
+	ssize_t rc;
+
+	if (len != dst_len) {
+		return 0;
+	}
+
+	rc = read_cb(cb_arg, param, dst_len);
+
+	return rc < 0 ? rc : 0;
+}
+
+int adv_status_rotate_key(void)
+{
+	uint8_t key[ADV_STATUS_KEY_LEN];
+	k_spinlock_key_t k;
+	int err;
+
+	err = sys_csrand_get(key, sizeof(key));
+	if (!err) {
+		err = settings_save_one(ADV_KEY_KEY, key, sizeof(key));
+	}
+	if (err) {
+		LOG_ERR("Status key not stored (err %d)", err);
+		return err;
+	}
+
+	k = k_spin_lock(&status_lock);
+	memcpy(status_key, key, sizeof(status_key));
+	k_spin_unlock(&status_lock, k);
+
+	if (ready) {
+		advertising_update();
+	}
+	return 0;
+}
+
+int adv_status_init(void)
+{
+	static const uint8_t no_key[ADV_STATUS_KEY_LEN];
+	int err;
+
+	err = settings_load_subtree_direct(ADV_KEY_KEY, load_direct_cb, status_key);
+	if (!err) {
+		err = settings_load_subtree_direct(ADV_KEY_COUNTER, load_direct_cb,
+						   &counter_ceiling);
+	}
+	if (err) {
+		LOG_ERR("Status settings not loaded (err %d)", err);
+		return err;
+	}
+
+	/* Nothing at or above the ceiling was ever sent. */
+	counter = counter_ceiling;
+
+	if (memcmp(status_key, no_key, sizeof(status_key)) == 0) {
+		err = adv_status_rotate_key();
+		if (err) {
+			return err;
+		}
+	}
+
+	ready = true;
+	return 0;
+}
+
+static void status_changed(uint8_t *field, uint8_t value)
+{
+	k_spinlock_key_t k = k_spin_lock(&status_lock);
+	bool changed = *field != value;
+
+	if (changed) {
+		*field = value;
+		counter++;
+	}
+	k_spin_unlock(&status_lock, k);
+
+	if (changed && ready) {
+		advertising_update();
+	}
+}
+
+void adv_status_set_state(uint8_t state)
+{
+	status_changed(&lock_state, state);
+}
+
+void adv_status_set_battery(uint8_t level)
+{
+	status_changed(&battery, level);
+}
+
+void adv_status_key_get(uint8_t key[ADV_STATUS_KEY_LEN])
+{
+	k_spinlock_key_t k = k_spin_lock(&status_lock);
+
+	memcpy(key, status_key, ADV_STATUS_KEY_LEN);
+	k_spin_unlock(&status_lock, k);
+}
+
+void adv_status_encode(uint8_t buf[ADV_STATUS_LEN])
+{
+	struct tc_hmac_state_struct hmac;
+	uint8_t mac[TC_SHA256_DIGEST_SIZE];
+	uint8_t key[ADV_STATUS_KEY_LEN];
+	bt_addr_le_t id = { 0 };
+	size_t id_count = 1;
+	uint8_t *signed_part = &buf[2];
+	k_spinlock_key_t k;
+	uint16_t value;
+	int err;
+
+	k = k_spin_lock(&status_lock);
+	sys_put_le16(ADV_STATUS_COMPANY_ID, buf);
+	signed_part[0] = (ADV_STATUS_VERSION << 4) | (lock_state & 0x0f);
+	signed_part[1] = battery;
+	value = counter;
+	memcpy(key, status_key, sizeof(key));
+	k_spin_unlock(&status_lock, k);
+
+	sys_put_le16(value, &signed_part[2]);
+
+	/* Reserve a block of counter values before sending the first of them,
+	 * so a reboot never repeats one.
+	 */
+	if ((uint16_t)(value - counter_ceiling) < 0x8000) {
+		uint16_t ceiling = value + ADV_STATUS_COUNTER_RESERVE;
+
+		err = settings_save_one(ADV_KEY_COUNTER, &ceiling, sizeof(ceiling));
+		if (err) {
+			LOG_WRN("Counter ceiling not stored (err %d)", err);
+		} else {
+			counter_ceiling = ceiling;
+		}
+	}
+
+	bt_id_get(&id, &id_count);
+
+	(void)tc_hmac_set_key(&hmac, key, sizeof(key));
+	(void)tc_hmac_init(&hmac);
+	(void)tc_hmac_update(&hmac, id.a.val, sizeof(id.a.val));
+	(void)tc_hmac_update(&hmac, signed_part, ADV_SIGNED_LEN);
+	(void)tc_hmac_final(mac, sizeof(mac), &hmac);
+
+	memcpy(&signed_part[ADV_SIGNED_LEN], mac, ADV_STATUS_TAG_LEN);
+}
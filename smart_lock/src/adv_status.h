@@ -0,0 +1,61 @@
+#ifndef ADV_STATUS_H
+#define ADV_STATUS_H
+
+#include <stdint.h>
+
+/*
+ * Lock status carried in the advertising packet, so a gateway can follow
+ * the lock without connecting. Manufacturer specific data:
+ *
+ *   [u16 company ID][u8 version << 4 | state][u8 battery %]
+ *   [u16 counter][u16 tag]
+ *
+ * All fields little endian. The counter is bumped on every change and never
+ * goes back across reboots. The tag is the first two bytes of
+ * HMAC-SHA256(status key, identity address || version/state, battery,
+ * counter). Bonded centrals read the status key from the status key
+ * characteristic.
+ */
+
+/* Bluetooth SIG ID reserved for internal use and testing. */
+#define ADV_STATUS_COMPANY_ID		0xFFFF
+#define ADV_STATUS_VERSION		1
+
+#define ADV_STATUS_KEY_LEN		16
+#define ADV_STATUS_TAG_LEN		2
+/* Company ID included; fills the packet next to flags and service UUID. */
+#define ADV_STATUS_LEN			8
+
+/* Counter values reserved per settings write. */
+#define ADV_STATUS_COUNTER_RESERVE	64
+
+/** @brief Load the status key and counter, creating the key on first boot.
+ *
+ * Must run after settings_load().
+ *
+ * @retval 0 on success, otherwise a negative error code.
+ */
+int adv_status_init(void);
+
+/** @brief Record a new lock state and refresh the advertising data. */
+void adv_status_set_state(uint8_t state);
+
+/** @brief Record a new battery level and refresh the advertising data. */
+void adv_status_set_battery(uint8_t level);
+
+/** @brief Replace the status key, e.g. after the bonds were cleared.
+ *
+ * @retval 0 on success, otherwise a negative error code.
+ */
+int adv_status_rotate_key(void);
+
+/** @brief Copy the status key for the status key characteristic. */
+void adv_status_key_get(uint8_t key[ADV_STATUS_KEY_LEN]);
+
+/** @brief Encode the current status for the advertising data.
+ *
+ * Runs on the system workqueue, which owns the advertising data.
+ */
+void adv_status_encode(uint8_t buf[ADV_STATUS_LEN]);
+
+#endif /* ADV_STATUS_H */
@@ -0,0 +1,412 @@
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/storage/flash_map.h>
+
+#include "audit_log.h"
+#include "wall_clock.h"
+
+
+LOG_MODULE_REGISTER(audit_log);
+
+
+#if FIXED_PARTITION_EXISTS(audit_partition)
+
+/*
+ * The partition is a ring of erase sectors. Each sector starts with a
+ * header holding a sequence number that grows by one per sector, followed
+ * by fixed-size records in the erased (0xFF) state until written. The
+ * newest sector is the one with the highest sequence number; when it is
+ * full the oldest sector is erased and becomes the newest. Once the ring
+ * has wrapped, (AUDIT_SECTOR_COUNT - 1) * AUDIT_RECORDS_PER_SECTOR records
+ * are always kept, plus those in the head sector.
+ */
+#define AUDIT_SECTOR_SIZE	4096
+#define AUDIT_SECTOR_COUNT	(FIXED_PARTITION_SIZE(audit_partition) / AUDIT_SECTOR_SIZE)
+#define AUDIT_RECORD_SIZE	sizeof(struct audit_record)
+#define AUDIT_RECORDS_PER_SECTOR	(AUDIT_SECTOR_SIZE / AUDIT_RECORD_SIZE - 1)
+/* Bumped when the partition layout changes, so an old log is reformatted
+ * rather than misread.
+ */
+#define AUDIT_SECTOR_MAGIC	0x41554432	/* "AUD2" */
+
+/* Write-combining buffer. Flash is programmed in chunks of this size, or
+ * whatever has collected when the flush delay expires.
+ */
+#define AUDIT_WBUF_SIZE		256
+#define AUDIT_WBUF_RECORDS	(AUDIT_WBUF_SIZE / AUDIT_RECORD_SIZE)
+#define AUDIT_FLUSH_DELAY_MS	10000
+
+BUILD_ASSERT(AUDIT_SECTOR_COUNT >= 2, "audit_partition needs at least two sectors");
+
+struct audit_sector_hdr {
+	uint32_t magic;
+	uint32_t seq;
+} __packed;
+
+BUILD_ASSERT(sizeof(struct audit_sector_hdr) == AUDIT_RECORD_SIZE);
+
+
+static void flush_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(flush_work, flush_work_handler);
+
+/* Flash state, only touched with the mutex held. */
+static K_MUTEX_DEFINE(audit_mutex);
+static const struct flash_area *fa;
+static uint32_t head_sector;
+static uint32_t head_seq;
+static uint32_t head_count;
+static uint32_t oldest_seq;
+
+/* RAM buffer, filled from any thread. */
+static struct k_spinlock wbuf_lock;
+static struct audit_record wbuf[AUDIT_WBUF_RECORDS];
+static size_t wbuf_count;
+static uint32_t dropped;
+
+
+static off_t sector_offset(uint32_t sector)
+{
+	return (off_t)sector * AUDIT_SECTOR_SIZE;
+}
+
+static bool record_is_erased(const struct audit_record *record)
+{
+	const uint8_t *p = (const uint8_t *)record;
+
+	for (size_t i = 0; i < sizeof(*record); i++) {
+		if (p[i] != 0xFF) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static int sector_start(uint32_t sector, uint32_t seq)
+{
+	struct audit_sector_hdr hdr = {
+		.magic = AUDIT_SECTOR_MAGIC,
+		.seq = seq,
+	};
+	int err;
+
+	err = flash_area_erase(fa, sector_offset(sector), AUDIT_SECTOR_SIZE);
+	if (!err) {
+		err = flash_area_write(fa, sector_offset(sector), &hdr, sizeof(hdr));
+	}
+
+	return err;
+}
+
+/* Called with the mutex held. */
+static int head_advance(void)
+{
+	uint32_t next = (head_sector + 1) % AUDIT_SECTOR_COUNT;
+	int err;
+
+	err = sector_start(next, head_seq + 1);
+	if (err) {
+		return err;
+	}
+
+	head_sector = next;
+	head_seq++;
+	head_count = 0;
+	if (head_seq >= AUDIT_SECTOR_COUNT) {
+		oldest_seq = MAX(oldest_seq, head_seq - (AUDIT_SECTOR_COUNT - 1));
+	}
+
+	return 0;
+}
+
+static uint32_t head_count_scan(uint32_t sector)
+{
+	struct audit_record records[16];
+	uint32_t count = 0;
+
+	while (count < AUDIT_RECORDS_PER_SECTOR) {
+		size_t n = MIN(ARRAY_SIZE(records), AUDIT_RECORDS_PER_SECTOR - count);
+
+		if (flash_area_read(fa, sector_offset(sector) + (1 + count) * AUDIT_RECORD_SIZE,
+				    records, n * AUDIT_RECORD_SIZE)) {
+			break;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			if (record_is_erased(&records[i])) {
+				return count;
+			}
+			count++;
+		}
+	}
+
+	return count;
+}
+
+int audit_log_init(void)
+{
+	struct audit_sector_hdr hdr;
+	bool found = false;
+	uint32_t min_seq = UINT32_MAX;
+	int err;
+
+	err = flash_area_open(FIXED_PARTITION_ID(audit_partition), &fa);
+	if (err) {
+		LOG_ERR("Cannot open audit partition (err %d)", err);
+		return err;
+	}
+
+	k_mutex_lock(&audit_mutex, K_FOREVER);
+
+	for (uint32_t sector = 0; sector < AUDIT_SECTOR_COUNT; sector++) {
+		if (flash_area_read(fa, sector_offset(sector), &hdr, sizeof(hdr)) ||
+		    hdr.magic != AUDIT_SECTOR_MAGIC) {
+			continue;
+		}
+
+		if (!found || hdr.seq > head_seq) {
+			head_sector = sector;
+			head_seq = hdr.seq;
+		}
+		min_seq = MIN(min_seq, hdr.seq);
+		found = true;
+	}
+
+	if (found) {
+		head_count = head_count_scan(head_sector);
+		oldest_seq = min_seq;
+	} else {
+		LOG_INF("Formatting audit log");
+		head_sector = 0;
+		head_seq = 0;
+		head_count = 0;
+		oldest_seq = 0;
+		err = sector_start(0, 0);
+	}
+
+	k_mutex_unlock(&audit_mutex);
+
+	if (!err) {
+		LOG_INF("Audit log: sector %u seq %u, %u records in head", head_sector,
+			head_seq, head_count);
+	}
+
+	return err;
+}
+
+void audit_log_add(uint8_t source, uint16_t user, uint8_t result)
+{
+	struct audit_record record = {
+		.user = user,
+		.source = source,
+		.result = result,
+	};
+	bool full;
+	k_spinlock_key_t key;
+
+	if (wall_clock_get(&record.ts) != 0) {
+		record.ts = (uint32_t)(k_uptime_get() / MSEC_PER_SEC);
+		record.source |= AUDIT_SRC_TS_UPTIME;
+	}
+
+	key = k_spin_lock(&wbuf_lock);
+
+	if (wbuf_count < AUDIT_WBUF_RECORDS) {
+		wbuf[wbuf_count++] = record;
+	} else {
+		dropped++;
+	}
+	full = wbuf_count == AUDIT_WBUF_RECORDS;
+
+	k_spin_unlock(&wbuf_lock, key);
+
+	if (full) {
+		k_work_reschedule(&flush_work, K_NO_WAIT);
+	} else {
+		/* Keeps the earlier deadline if one is pending. */
+		k_work_schedule(&flush_work, K_MSEC(AUDIT_FLUSH_DELAY_MS));
+	}
+}
+
+/* Puts records that could not be written back at the front of the buffer,
+ * ahead of those added since they were taken. The newest are dropped if
+ * they no longer all fit.
+ */
+static void wbuf_requeue(const struct audit_record *records, size_t count)
+{
+	k_spinlock_key_t key = k_spin_lock(&wbuf_lock);
+	size_t keep = MIN(wbuf_count, AUDIT_WBUF_RECORDS - count);
+
+	dropped += wbuf_count - keep;
+	memmove(&wbuf[count], wbuf, keep * AUDIT_RECORD_SIZE);
+	memcpy(wbuf, records, count * AUDIT_RECORD_SIZE);
+	wbuf_count = count + keep;
+
+	k_spin_unlock(&wbuf_lock, key);
+}
+
+int audit_log_flush(void)
+{
+	struct audit_record records[AUDIT_WBUF_RECORDS];
+	size_t count;
+	size_t written = 0;
+	uint32_t lost;
+	int err = 0;
+	k_spinlock_key_t key;
+
+	if (fa == NULL) {
+		return -ENODEV;
+	}
+
+	/* Taken first so concurrent flushes keep the records in order. */
+	k_mutex_lock(&audit_mutex, K_FOREVER);
+
+	key = k_spin_lock(&wbuf_lock);
+	count = wbuf_count;
+	memcpy(records, wbuf, count * AUDIT_RECORD_SIZE);
+	wbuf_count = 0;
+	lost = dropped;
+	dropped = 0;
+	k_spin_unlock(&wbuf_lock, key);
+
+	if (lost != 0) {
+		LOG_WRN("%u audit records dropped, buffer full", lost);
+	}
+
+	while (written < count) {
+		size_t n;
+
+		if (head_count == AUDIT_RECORDS_PER_SECTOR) {
+			err = head_advance();
+			if (err) {
+				break;
+			}
+		}
+
+		n = MIN(count - written, AUDIT_RECORDS_PER_SECTOR - head_count);
+		err = flash_area_write(fa, sector_offset(head_sector) +
+				       (1 + head_count) * AUDIT_RECORD_SIZE,
+				       &records[written], n * AUDIT_RECORD_SIZE);
+		if (err) {
+			break;
+		}
+
+		head_count += n;
+		written += n;
+	}
+
+	/* Retried in place: head_count only moves past what was written, and
+	 * programming the same data over a partly written record again
+	 * leaves it as intended.
+	 */
+	if (err) {
+		wbuf_requeue(&records[written], count - written);
+	}
+
+	k_mutex_unlock(&audit_mutex);
+
+	if (err) {
+		LOG_ERR("Audit log write failed (err %d), %zu records kept for retry",
+			err, count - written);
+		k_work_schedule(&flush_work, K_MSEC(AUDIT_FLUSH_DELAY_MS));
+	}
+
+	return err;
+}
+
+static void flush_work_handler(struct k_work *work)
+{
+	(void)audit_log_flush();
+}
+
+int audit_log_read(uint32_t seq, struct audit_record *records, size_t max,
+		   uint32_t *first_seq)
+{
+	uint32_t oldest;
+	uint32_t end;
+	uint32_t sector_seq;
+	uint32_t sector;
+	uint32_t index;
+	size_t n;
+	int err;
+
+	if (fa == NULL) {
+		return -ENODEV;
+	}
+
+	k_mutex_lock(&audit_mutex, K_FOREVER);
+
+	oldest = oldest_seq * AUDIT_RECORDS_PER_SECTOR;
+	end = head_seq * AUDIT_RECORDS_PER_SECTOR + head_count;
+	seq = MAX(seq, oldest);
+
+	if (seq >= end) {
+		k_mutex_unlock(&audit_mutex);
+		*first_seq = end;
+		return 0;
+	}
+
+	sector_seq = seq / AUDIT_RECORDS_PER_SECTOR;
+	index = seq % AUDIT_RECORDS_PER_SECTOR;
+	sector = (head_sector + AUDIT_SECTOR_COUNT - (head_seq - sector_seq)) % AUDIT_SECTOR_COUNT;
+	n = MIN(max, MIN(AUDIT_RECORDS_PER_SECTOR - index, end - seq));
+
+	err = flash_area_read(fa, sector_offset(sector) + (1 + index) * AUDIT_RECORD_SIZE,
+			      records, n * AUDIT_RECORD_SIZE);
+
+	k_mutex_unlock(&audit_mutex);
+
+	if (err) {
+		return err;
+	}
+
+	*first_seq = seq;
+
+	return n;
+}
+
+#else /* No audit partition on this board */
+
+int audit_log_init(void)
+{
+	LOG_WRN("No audit_partition, audit log disabled");
+
+	return -ENODEV;
+}
+
+void audit_log_add(uint8_t source, uint16_t user, uint8_t result)
+{
+}
+
+/* Puts records that could not be written back at the front of the buffer,
+ * ahead of those added since they were taken. The newest are dropped if
+ * they no longer all fit.
+ */
+static void wbuf_requeue(const struct audit_record *records, size_t count)
+{
+	k_spinlock_key_t key = k_spin_lock(&wbuf_lock);
+	size_t keep = MIN(wbuf_count, AUDIT_WBUF_RECORDS - count);
+
+	dropped += wbuf_count - keep;
+	memmove(&wbuf[count], wbuf, keep * AUDIT_RECORD_SIZE);
+	memcpy(wbuf, records, count * AUDIT_RECORD_SIZE);
+	wbuf_count = count + keep;
+
+	k_spin_unlock(&wbuf_lock, key);
+}
+
+int audit_log_flush(void)
+{
+	return -ENODEV;
+}
+
+int audit_log_read(uint32_t seq, struct audit_record *records, size_t max,
+		   uint32_t *first_seq)
+{
+	return -ENODEV;
+}
+
+#endif /* FIXED_PARTITION_EXISTS(audit_partition) */
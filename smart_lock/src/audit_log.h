@@ -0,0 +1,77 @@
+#ifndef AUDIT_LOG_H
+#define AUDIT_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Record sources. The top bit is set when the timestamp is seconds since
+ * boot because the wall clock had not been set yet.
+ */
+#define AUDIT_SRC_KEYPAD	0x01
+#define AUDIT_SRC_BLE		0x02
+#define AUDIT_SRC_GATEWAY	0x03
+#define AUDIT_SRC_BUTTON	0x04
+#define AUDIT_SRC_LOCK		0x05
+#define AUDIT_SRC_TS_UPTIME	0x80
+
+#define AUDIT_RESULT_UNLOCKED		0x00
+#define AUDIT_RESULT_LOCKED		0x01
+#define AUDIT_RESULT_DENIED		0x02
+#define AUDIT_RESULT_LOCKED_OUT		0x03
+#define AUDIT_RESULT_OUTSIDE_WINDOW	0x04
+#define AUDIT_RESULT_BUSY		0x05
+#define AUDIT_RESULT_JAMMED		0x06
+#define AUDIT_RESULT_BONDS_CLEARED	0x07
+
+/* User ID of records not tied to a credential. */
+#define AUDIT_USER_NONE		0xFFFF
+
+/* Records are 8 bytes on flash and on air, little endian. */
+struct audit_record {
+	uint32_t ts;
+	uint16_t user;
+	uint8_t source;
+	uint8_t result;
+} __packed;
+
+/** @brief Mount the audit log partition.
+ *
+ * Finds the newest sector and the write position in it. An unformatted
+ * partition is formatted.
+ *
+ * @retval 0 on success, -ENODEV if the board has no audit partition.
+ */
+int audit_log_init(void);
+
+/** @brief Append a record.
+ *
+ * The record goes to a RAM write-combining buffer, which is written to
+ * flash from the system workqueue when full or after a short delay. Safe
+ * to call from any thread.
+ */
+void audit_log_add(uint8_t source, uint16_t user, uint8_t result);
+
+/** @brief Write buffered records to flash now.
+ *
+ * Records that fail to write stay buffered and are written by the next
+ * flush, which is scheduled again after a failure.
+ */
+int audit_log_flush(void);
+
+/** @brief Read records that are on flash, starting at a sequence number.
+ *
+ * Records older than the oldest one kept are skipped. At most one
+ * sector's worth is returned per call.
+ *
+ * @param seq       First sequence number wanted.
+ * @param records   Output buffer.
+ * @param max       Capacity of the output buffer, in records.
+ * @param first_seq Set to the sequence number of records[0].
+ *
+ * @return Number of records read, 0 once @p seq is past the newest record,
+ *         or a negative error code.
+ */
+int audit_log_read(uint32_t seq, struct audit_record *records, size_t max,
+		   uint32_t *first_seq);
+
+#endif /* AUDIT_LOG_H */
@@ -0,0 +1,211 @@
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/l2cap.h>
+
+#include "cred_bundle.h"
+#include "cred_bundle_parse.h"
+#include "gap_connection.h"
+
+
+LOG_MODULE_REGISTER(cred_bundle);
+
+
+/*
+ * Segments are copied out on the Bluetooth RX thread and parsed on the
+ * system workqueue. Every segment costs the central one credit, and the
+ * credit is only returned once the segment has been parsed, so the
+ * central never has more in flight than the queue holds.
+ */
+#define BUNDLE_CREDITS		8
+#define BUNDLE_SEG_MAX		BT_L2CAP_RX_MTU
+/* SDUs are parsed segment by segment and never reassembled, so their size
+ * costs no RAM here.
+ */
+#define BUNDLE_SDU_MTU		2048
+#define BUNDLE_RESULT_LEN	3
+
+#define BUNDLE_OPENED		0
+#define BUNDLE_CLOSED		1
+
+struct bundle_seg {
+	uint16_t len;
+	uint8_t data[BUNDLE_SEG_MAX];
+};
+
+static void bundle_work_handler(struct k_work *work);
+
+K_MSGQ_DEFINE(bundle_seg_queue, sizeof(struct bundle_seg), BUNDLE_CREDITS, 4);
+static K_WORK_DEFINE(bundle_work, bundle_work_handler);
+NET_BUF_POOL_FIXED_DEFINE(bundle_tx_pool, 1, BT_L2CAP_SDU_BUF_SIZE(BUNDLE_RESULT_LEN),
+			  CONFIG_BT_CONN_TX_USER_DATA_SIZE, NULL);
+
+static struct bt_l2cap_le_chan bundle_chan;
+/* One bundle at a time; cleared once the closed channel is cleaned up. */
+static atomic_t bundle_busy;
+static atomic_t bundle_events;
+
+/* Owned by the system workqueue. */
+static struct cred_bundle_parse parse;
+
+
+static uint8_t bundle_status(int err)
+{
+	switch (err) {
+	case 0:
+		return CRED_BUNDLE_STATUS_OK;
+	case -EINVAL:
+		return CRED_BUNDLE_STATUS_INVALID;
+	case -ENOSPC:
+		return CRED_BUNDLE_STATUS_NO_SPACE;
+	case -EEXIST:
+		return CRED_BUNDLE_STATUS_EXISTS;
+	case -EBADMSG:
+		return CRED_BUNDLE_STATUS_BAD_CRC;
+	default:
+		return CRED_BUNDLE_STATUS_FAILED;
+	}
+}
+
+static void bundle_finish(int err)
+{
+	struct net_buf *buf;
+	int rc;
+
+	if (err) {
+		LOG_WRN("Bundle %u rejected after %u records (err %d)", parse.serial,
+			parse.staged, err);
+	} else {
+		LOG_INF("Bundle %u with %u records committed", parse.serial, parse.staged);
+	}
+
+	buf = net_buf_alloc(&bundle_tx_pool, K_NO_WAIT);
+	if (buf == NULL) {
+		LOG_WRN("No buffer for the bundle result");
+		return;
+	}
+
+	net_buf_reserve(buf, BT_L2CAP_SDU_CHAN_SEND_RESERVE);
+	net_buf_add_u8(buf, bundle_status(err));
+	net_buf_add_le16(buf, parse.staged);
+
+	rc = bt_l2cap_chan_send(&bundle_chan.chan, buf);
+	if (rc < 0) {
+		net_buf_unref(buf);
+		LOG_WRN("Bundle result not sent (err %d)", rc);
+	}
+}
+
+static void bundle_work_handler(struct k_work *work)
+{
+	struct bundle_seg seg;
+	int err;
+
+	if (atomic_test_and_clear_bit(&bundle_events, BUNDLE_CLOSED)) {
+		atomic_clear_bit(&bundle_events, BUNDLE_OPENED);
+		k_msgq_purge(&bundle_seg_queue);
+		if (cred_bundle_parse_abort(&parse)) {
+			LOG_WRN("Bundle channel closed after %u records", parse.staged);
+		}
+		atomic_clear(&bundle_busy);
+		return;
+	}
+
+	if (atomic_test_and_clear_bit(&bundle_events, BUNDLE_OPENED)) {
+		cred_bundle_parse_begin(&parse);
+	}
+
+	while (k_msgq_get(&bundle_seg_queue, &seg, K_NO_WAIT) == 0) {
+		err = cred_bundle_parse_feed(&parse, seg.data, seg.len);
+		if (err != -EINPROGRESS && err != -EALREADY) {
+			bundle_finish(err);
+		}
+		(void)bt_l2cap_chan_give_credits(&bundle_chan.chan, 1);
+	}
+}
+
+static void bundle_connected(struct bt_l2cap_chan *chan)
+{
+	atomic_set_bit(&bundle_events, BUNDLE_OPENED);
+	k_work_submit(&bundle_work);
+
+	/* With segmented receive the channel starts without credits. */
+	(void)bt_l2cap_chan_give_credits(chan, BUNDLE_CREDITS);
+	conn_param_activity();
+}
+
+static void bundle_disconnected(struct bt_l2cap_chan *chan)
+{
+	atomic_set_bit(&bundle_events, BUNDLE_CLOSED);
+	k_work_submit(&bundle_work);
+}
+
+static void bundle_seg_recv(struct bt_l2cap_chan *chan, size_t sdu_len,
+			    off_t seg_offset, struct net_buf_simple *seg)
+{
+	struct bundle_seg copy;
+
+	if (seg->len > sizeof(copy.data)) {
+		(void)bt_l2cap_chan_disconnect(chan);
+		return;
+	}
+
+	copy.len = seg->len;
+	memcpy(copy.data, seg->data, seg->len);
+
+	if (k_msgq_put(&bundle_seg_queue, &copy, K_NO_WAIT) != 0) {
+		/* Only a central that ignores its credits gets here. */
+		LOG_WRN("Bundle segment overrun");
+		(void)bt_l2cap_chan_disconnect(chan);
+		return;
+	}
+
+	conn_param_activity();
+	k_work_submit(&bundle_work);
+}
+
+static const struct bt_l2cap_chan_ops bundle_chan_ops = {
+	.connected = bundle_connected,
+	.disconnected = bundle_disconnected,
+	.seg_recv = bundle_seg_recv,
+};
+
+static int bundle_accept(struct bt_conn *conn, struct bt_l2cap_server *server,
+			 struct bt_l2cap_chan **chan)
+{
+	if (!atomic_cas(&bundle_busy, 0, 1)) {
+		return -ENOMEM;
+	}
+
+	memset(&bundle_chan, 0, sizeof(bundle_chan));
+	bundle_chan.chan.ops = &bundle_chan_ops;
+	bundle_chan.rx.mtu = BUNDLE_SDU_MTU;
+	bundle_chan.rx.mps = BUNDLE_SEG_MAX;
+
+	*chan = &bundle_chan.chan;
+
+	return 0;
+}
+
+static struct bt_l2cap_server bundle_server = {
+	.psm = CRED_BUNDLE_PSM,
+	/* Encrypted links only, like the lock service. */
+	.sec_level = BT_SECURITY_L2,
+	.accept = bundle_accept,
+};
+
+int cred_bundle_init(void)
+{
+	int err;
+
+	err = bt_l2cap_server_register(&bundle_server);
+	if (err) {
+		LOG_ERR("L2CAP server not registered (err %d)", err);
+	}
+
+	return err;
+}
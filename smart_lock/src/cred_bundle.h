@@ -0,0 +1,47 @@
+#ifndef CRED_BUNDLE_H
+#define CRED_BUNDLE_H
+
+#include <zephyr/sys/util.h>
+
+/*
+ * Bulk credential provisioning over an L2CAP connection-oriented channel.
+ *
+ * A bonded central opens the channel on CRED_BUNDLE_PSM and sends one
+ * bundle as a byte stream, cut into SDUs of any size:
+ *
+ *   header   [u32 magic][u8 version][u8 reserved][u16 count][u32 serial]
+ *            [u32 CRC-32 of the records]
+ *   records  count x [u16 user][u32 pin][u8 digits][u8 flags]
+ *                    [u16 window start][u16 window end]
+ *
+ * All fields little endian; the CRC is the IEEE 802.3 one. Records are
+ * staged as they arrive and the whole store is replaced once the CRC
+ * matches. The lock answers with one SDU, [u8 status][u16 records
+ * staged], after which the central closes the channel.
+ */
+
+/* LE dynamic PSM range is 0x0080-0x00FF. */
+#define CRED_BUNDLE_PSM		0x0081
+
+#define CRED_BUNDLE_MAGIC	0x42445243	/* "CRDB" */
+#define CRED_BUNDLE_VERSION	1
+#define CRED_BUNDLE_HDR_LEN	16
+#define CRED_BUNDLE_RECORD_LEN	12
+
+/* Record flags. */
+#define CRED_BUNDLE_FLAG_WINDOW	BIT(0)
+
+#define CRED_BUNDLE_STATUS_OK		0x00
+#define CRED_BUNDLE_STATUS_INVALID	0x01
+#define CRED_BUNDLE_STATUS_NO_SPACE	0x02
+#define CRED_BUNDLE_STATUS_EXISTS	0x03
+#define CRED_BUNDLE_STATUS_BAD_CRC	0x04
+#define CRED_BUNDLE_STATUS_FAILED	0xFF
+
+/** @brief Register the L2CAP server. Must run after bt_enable().
+ *
+ * @retval 0 on success, otherwise a negative error code.
+ */
+int cred_bundle_init(void);
+
+#endif /* CRED_BUNDLE_H */
@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <string.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+
+#include "cred_bundle_parse.h"
+#include "credentials.h"
+#include "pin_entry.h"
+
+
+/* Zero, so a parser that never began takes no bytes. */
+#define PARSE_DONE	0
+#define PARSE_HEADER	1
+#define PARSE_RECORDS	2
+
+
+static int parse_finish(struct cred_bundle_parse *p, int err)
+{
+	p->state = PARSE_DONE;
+
+	if (err) {
+		credentials_stage_abort();
+	}
+
+	return err;
+}
+
+static int parse_header(struct cred_bundle_parse *p, const uint8_t *hdr)
+{
+	int err;
+
+	if (sys_get_le32(hdr) != CRED_BUNDLE_MAGIC || hdr[4] != CRED_BUNDLE_VERSION) {
+		return parse_finish(p, -EINVAL);
+	}
+
+	p->count = sys_get_le16(&hdr[6]);
+	p->serial = sys_get_le32(&hdr[8]);
+	p->crc_expected = sys_get_le32(&hdr[12]);
+
+	if (p->count == 0U) {
+		return parse_finish(p, -EINVAL);
+	}
+	if (p->count > CRED_MAX_USERS) {
+		return parse_finish(p, -ENOSPC);
+	}
+
+	/* Records go straight to flash as they are parsed. */
+	err = credentials_stage_begin();
+	if (err) {
+		return parse_finish(p, err);
+	}
+
+	p->state = PARSE_RECORDS;
+
+	return -EINPROGRESS;
+}
+
+static int parse_record(struct cred_bundle_parse *p, const uint8_t *rec)
+{
+	struct cred_window window;
+	uint8_t digits = rec[6];
+	uint8_t flags = rec[7];
+	int err;
+
+	p->crc = crc32_ieee_update(p->crc, rec, CRED_BUNDLE_RECORD_LEN);
+
+	window.start = sys_get_le16(&rec[8]);
+	window.end = sys_get_le16(&rec[10]);
+
+	if (digits == 0U || digits > PIN_ENTRY_MAX_DIGITS ||
+	    ((flags & CRED_BUNDLE_FLAG_WINDOW) &&
+	     (window.start >= 24 * 60 || window.end >= 24 * 60))) {
+		return parse_finish(p, -EINVAL);
+	}
+
+	err = credentials_stage_add(sys_get_le16(rec), sys_get_le32(&rec[2]), digits,
+				    (flags & CRED_BUNDLE_FLAG_WINDOW) ? &window : NULL);
+	if (err) {
+		return parse_finish(p, err);
+	}
+
+	if (++p->staged < p->count) {
+		return -EINPROGRESS;
+	}
+
+	/* Nothing reaches the active store unless the CRC matches. */
+	return parse_finish(p, p->crc == p->crc_expected ? credentials_stage_commit() :
+							    -EBADMSG);
+}
+
+void cred_bundle_parse_begin(struct cred_bundle_parse *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->state = PARSE_HEADER;
+}
+
+int cred_bundle_parse_feed(struct cred_bundle_parse *p, const uint8_t *data, size_t len)
+{
+	int err = -EINPROGRESS;
+	size_t want;
+	size_t n;
+
+	if (p->state == PARSE_DONE) {
+		return -EALREADY;
+	}
+
+	/* Anything after the end of the bundle is dropped. */
+	while (len > 0 && err == -EINPROGRESS) {
+		want = p->state == PARSE_HEADER ? CRED_BUNDLE_HDR_LEN : CRED_BUNDLE_RECORD_LEN;
+		n = MIN(want - p->partial_len, len);
+
+		memcpy(&p->partial[p->partial_len], data, n);
+		p->partial_len += n;
+		data += n;
+		len -= n;
+
+		if (p->partial_len < want) {
+			break;
+		}
+		p->partial_len = 0;
+
+		if (p->state == PARSE_HEADER) {
+			err = parse_header(p, p->partial);
+		} else {
+			err = parse_record(p, p->partial);
+		}
+	}
+
+	return err;
+}
+
+bool cred_bundle_parse_abort(struct cred_bundle_parse *p)
+{
+	if (p->state == PARSE_DONE) {
+		return false;
+	}
+
+	(void)parse_finish(p, -ECANCELED);
+
+	return true;
+}
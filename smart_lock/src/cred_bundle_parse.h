@@ -0,0 +1,47 @@
+#ifndef CRED_BUNDLE_PARSE_H
+#define CRED_BUNDLE_PARSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cred_bundle.h"
+
+/*
+ * Parser for the bundle format described in cred_bundle.h, apart from the
+ * channel it arrives on. Records are staged with credentials_stage_add()
+ * as they complete, and the store is replaced once the CRC matches.
+ */
+struct cred_bundle_parse {
+	uint8_t state;
+	uint8_t partial[CRED_BUNDLE_HDR_LEN];
+	size_t partial_len;
+	uint16_t count;
+	/* Records staged so far, reported back to the central. */
+	uint16_t staged;
+	uint32_t serial;
+	uint32_t crc_expected;
+	uint32_t crc;
+};
+
+/** @brief Start on a new bundle. */
+void cred_bundle_parse_begin(struct cred_bundle_parse *p);
+
+/** @brief Parse the next bytes of the bundle, which may be cut anywhere.
+ *
+ * @retval -EINPROGRESS if the bundle is not complete yet.
+ * @retval 0 if the bundle was committed.
+ * @retval -EINVAL, -ENOSPC, -EEXIST or -EBADMSG (CRC mismatch) if the bundle
+ *         was rejected, or another negative error code from the store.
+ *         Nothing staged is kept.
+ * @retval -EALREADY if the bundle ended before; the bytes are dropped.
+ */
+int cred_bundle_parse_feed(struct cred_bundle_parse *p, const uint8_t *data, size_t len);
+
+/** @brief Drop a bundle that did not end.
+ *
+ * @retval true if a bundle was in progress.
+ */
+bool cred_bundle_parse_abort(struct cred_bundle_parse *p);
+
+#endif /* CRED_BUNDLE_PARSE_H */
@@ -0,0 +1,991 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/random/random.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/byteorder.h>
+#include <tinycrypt/constants.h>
+#include <tinycrypt/sha256.h>
+
+#include "credentials.h"
+#include "wall_clock.h"
+
+
+LOG_MODULE_REGISTER(credentials);
+
+
+#if FIXED_PARTITION_EXISTS(cred_partition)
+
+#define CRED_SALT_LEN		16
+#define CRED_HASH_LEN		TC_SHA256_DIGEST_SIZE
+
+#define CRED_SLOT_WINDOW	BIT(0)
+
+#define CRED_DEFAULT_PIN	123456
+#define CRED_DEFAULT_DIGITS	6
+
+/*
+ * Settings layout, all under "cred":
+ *   cred/salt         device salt, generated on first boot
+ *   cred/init         set once the store was first set up; an empty store
+ *                     is only seeded with the default PIN before that
+ *   cred/lockout      failed attempts in a row, only kept while they lock
+ *                     the keypad out
+ */
+#define CRED_KEY_SALT		"cred/salt"
+#define CRED_KEY_INIT		"cred/init"
+#define CRED_KEY_LOCKOUT	"cred/lockout"
+
+/*
+ * cred_partition holds two banks, each laid out as
+ *
+ *   header    [u32 seq][u32 magic], programmed last
+ *   slots     CRED_SLOTS slots, bucket after bucket
+ *   removed   one word per slot, zeroed when its user is removed
+ *
+ * The active bank is the valid one with the higher seq. No word is
+ * programmed twice between erases: a user goes to an erased slot, a
+ * removal zeroes the slot's word, and once no erased slot is left the
+ * live users are compacted into the other bank. A replacement store is
+ * written into the other bank the same way. Either only becomes active
+ * when its header is programmed, so a reset at any point leaves the old
+ * or the new store.
+ */
+#define CRED_BANK_MAGIC		0x31545243	/* "CRT1" */
+#define CRED_SLOT_WRITTEN	0x544f4c53	/* "SLOT" */
+#define CRED_WORD_ERASED	0xffffffffU
+#define CRED_SECTOR_SIZE	4096
+
+#define CRED_SLOTS_OFFSET	sizeof(struct cred_bank_hdr)
+#define CRED_REMOVED_OFFSET	(CRED_SLOTS_OFFSET + CRED_SLOTS * sizeof(struct cred_slot))
+#define CRED_BANK_SIZE		ROUND_UP(CRED_REMOVED_OFFSET + CRED_SLOTS * sizeof(uint32_t), \
+					 CRED_SECTOR_SIZE)
+
+
+struct cred_bank_hdr {
+	uint32_t seq;
+	uint32_t magic;
+} __packed;
+
+struct cred_slot {
+	uint8_t hash[CRED_HASH_LEN];
+	uint16_t user_id;
+	uint16_t flags;
+	uint16_t window_start;
+	uint16_t window_end;
+	/* Programmed after the rest, so a torn write is never taken for a user. */
+	uint32_t written;
+} __packed;
+
+BUILD_ASSERT(sizeof(struct cred_slot) % sizeof(uint32_t) == 0);
+BUILD_ASSERT(FIXED_PARTITION_SIZE(cred_partition) >= 2 * CRED_BANK_SIZE,
+	     "cred_partition needs room for two banks");
+
+/*
+ * RAM view of a bank. A user goes to the first unused slot from its home
+ * bucket on, wrapping around, at most CRED_PROBE_MAX buckets away.
+ * probe_len is the longest distance of any user from its home bucket,
+ * plus one; lookups always compare that many buckets.
+ */
+struct cred_bank {
+	uint8_t index;
+	uint8_t probe_len;
+	uint16_t count;
+	uint32_t seq;
+	/* Slots programmed since the bank was erased, live or not. */
+	uint32_t used[DIV_ROUND_UP(CRED_SLOTS, 32)];
+};
+
+struct cred_setting {
+	void *dst;
+	size_t len;
+};
+
+
+static K_MUTEX_DEFINE(cred_mutex);
+static const struct flash_area *fa;
+static uint8_t salt[CRED_SALT_LEN];
+static uint8_t provisioned;
+static struct cred_bank banks[2];
+static struct cred_bank *active;
+
+/* Replacement store built by credentials_stage_*() in the other bank. */
+static bool staging;
+static uint16_t staged_users[CRED_MAX_USERS];
+
+/* fail_count is saved once it locks the keypad out, so a reset does not
+ * clear it. The attempts before that are not, typos never wear the flash.
+ */
+static uint32_t fail_count;
+static int64_t locked_until;
+
+
+static void cred_hash(uint32_t pin, uint8_t digits, uint8_t hash[CRED_HASH_LEN])
+{
+	struct tc_sha256_state_struct sha;
+	uint8_t input[sizeof(uint32_t) + 1];
+
+	sys_put_le32(pin, input);
+	input[sizeof(uint32_t)] = digits;
+
+	(void)tc_sha256_init(&sha);
+	(void)tc_sha256_update(&sha, salt, sizeof(salt));
+	(void)tc_sha256_update(&sha, input, sizeof(input));
+	(void)tc_sha256_final(hash, &sha);
+}
+
+static uint8_t cred_tag(const uint8_t hash[CRED_HASH_LEN])
+{
+	return hash[CRED_HASH_LEN - 1] % CRED_BUCKETS;
+}
+
+/* Compares without an early exit, so the time taken does not depend on
+ * how many leading bytes match.
+ */
+static bool hash_equal(const uint8_t *a, const uint8_t *b)
+{
+	uint8_t diff = 0;
+
+	for (size_t i = 0; i < CRED_HASH_LEN; i++) {
+		diff |= a[i] ^ b[i];
+	}
+
+	return diff == 0;
+}
+
+static bool window_contains(const struct cred_slot *slot)
+{
+	uint16_t now;
+
+	if (!(slot->flags & CRED_SLOT_WINDOW)) {
+		return true;
+	}
+
+	/* Without a wall clock a restricted user is refused. */
+	if (wall_clock_minute_of_day(&now) != 0) {
+		return false;
+	}
+
+	if (slot->window_start <= slot->window_end) {
+		return now >= slot->window_start && now <= slot->window_end;
+	}
+
+	return now >= slot->window_start || now <= slot->window_end;
+}
+
+static bool is_erased(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	for (size_t i = 0; i < len; i++) {
+		if (p[i] != 0xFF) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static off_t bank_offset(const struct cred_bank *bk)
+{
+	return (off_t)bk->index * CRED_BANK_SIZE;
+}
+
+static off_t slot_offset(const struct cred_bank *bk, uint16_t index)
+{
+	return bank_offset(bk) + CRED_SLOTS_OFFSET + index * sizeof(struct cred_slot);
+}
+
+static off_t removed_offset(const struct cred_bank *bk, uint16_t index)
+{
+	return bank_offset(bk) + CRED_REMOVED_OFFSET + index * sizeof(uint32_t);
+}
+
+static struct cred_bank *bank_other(const struct cred_bank *bk)
+{
+	return &banks[bk->index ^ 1];
+}
+
+static bool slot_used(const struct cred_bank *bk, uint16_t index)
+{
+	return bk->used[index / 32] & BIT(index % 32);
+}
+
+static bool slot_live(const struct cred_slot *slot, uint32_t removed)
+{
+	return slot->written == CRED_SLOT_WRITTEN && removed == CRED_WORD_ERASED;
+}
+
+static void slot_fill(struct cred_slot *slot, uint16_t user_id, uint32_t pin,
+		      uint8_t digits, const struct cred_window *window)
+{
+	memset(slot, 0, sizeof(*slot));
+	cred_hash(pin, digits, slot->hash);
+	slot->user_id = user_id;
+	if (window != NULL) {
+		slot->flags = CRED_SLOT_WINDOW;
+		slot->window_start = window->start;
+		slot->window_end = window->end;
+	}
+}
+
+/* Reads bucket @p b of @p bk along with its slots' removal words. */
+static int bucket_read(const struct cred_bank *bk, uint8_t b,
+		       struct cred_slot slot[CRED_BUCKET_SLOTS],
+		       uint32_t removed[CRED_BUCKET_SLOTS])
+{
+	uint16_t first = b * CRED_BUCKET_SLOTS;
+	int err;
+
+	err = flash_area_read(fa, slot_offset(bk, first), slot,
+			      CRED_BUCKET_SLOTS * sizeof(slot[0]));
+	if (!err) {
+		err = flash_area_read(fa, removed_offset(bk, first), removed,
+				      CRED_BUCKET_SLOTS * sizeof(removed[0]));
+	}
+
+	return err;
+}
+
+/* Rebuilds the RAM view of a bank from flash. */
+static int bank_load(struct cred_bank *bk)
+{
+	struct cred_slot slot[CRED_BUCKET_SLOTS];
+	uint32_t removed[CRED_BUCKET_SLOTS];
+	int err;
+
+	bk->count = 0;
+	bk->probe_len = 0;
+	memset(bk->used, 0, sizeof(bk->used));
+
+	for (uint8_t b = 0; b < CRED_BUCKETS; b++) {
+		err = bucket_read(bk, b, slot, removed);
+		if (err) {
+			return err;
+		}
+
+		for (int i = 0; i < CRED_BUCKET_SLOTS; i++) {
+			uint16_t index = b * CRED_BUCKET_SLOTS + i;
+			uint8_t dist;
+
+			if (!is_erased(&slot[i], sizeof(slot[i]))) {
+				bk->used[index / 32] |= BIT(index % 32);
+			}
+			if (!slot_live(&slot[i], removed[i])) {
+				continue;
+			}
+
+			bk->count++;
+			dist = (b + CRED_BUCKETS - cred_tag(slot[i].hash)) % CRED_BUCKETS;
+			bk->probe_len = MAX(bk->probe_len, dist + 1);
+		}
+	}
+
+	return 0;
+}
+
+/* Makes @p bk an empty bank, erasing it unless it is blank already. */
+static int bank_prepare(struct cred_bank *bk)
+{
+	uint8_t buf[128];
+	int err = 0;
+
+	for (size_t off = 0; off < CRED_BANK_SIZE; off += sizeof(buf)) {
+		err = flash_area_read(fa, bank_offset(bk) + off, buf, sizeof(buf));
+		if (err) {
+			return err;
+		}
+		if (!is_erased(buf, sizeof(buf))) {
+			err = flash_area_erase(fa, bank_offset(bk), CRED_BANK_SIZE);
+			break;
+		}
+	}
+
+	if (!err) {
+		bk->count = 0;
+		bk->probe_len = 0;
+		bk->seq = 0;
+		memset(bk->used, 0, sizeof(bk->used));
+	}
+
+	return err;
+}
+
+/* Programs the header that makes @p bk the active bank. */
+static int bank_activate(struct cred_bank *bk, uint32_t seq)
+{
+	struct cred_bank_hdr hdr = {
+		.seq = seq,
+		.magic = CRED_BANK_MAGIC,
+	};
+	int err;
+
+	err = flash_area_write(fa, bank_offset(bk), &hdr, sizeof(hdr));
+	if (!err) {
+		bk->seq = seq;
+		active = bk;
+	}
+
+	return err;
+}
+
+/* Looks a PIN hash up in @p bk. Every slot within the bank's probe length
+ * is compared, whatever the PIN, so the time does not reveal where or
+ * whether it matched.
+ *
+ * @param match Set to the matching slot.
+ *
+ * @retval the index of the matching slot, -ENOENT if there is none, or
+ *         another negative error code.
+ */
+static int bank_find(const struct cred_bank *bk, const uint8_t hash[CRED_HASH_LEN],
+		     struct cred_slot *match)
+{
+	struct cred_slot slot[CRED_BUCKET_SLOTS];
+	uint32_t removed[CRED_BUCKET_SLOTS];
+	uint8_t home = cred_tag(hash);
+	int found = -ENOENT;
+	int err;
+
+	for (uint8_t p = 0; p < bk->probe_len; p++) {
+		uint8_t b = (home + p) % CRED_BUCKETS;
+
+		err = bucket_read(bk, b, slot, removed);
+		if (err) {
+			return err;
+		}
+
+		for (int i = 0; i < CRED_BUCKET_SLOTS; i++) {
+			bool equal = hash_equal(slot[i].hash, hash);
+
+			if (equal && slot_live(&slot[i], removed[i])) {
+				found = b * CRED_BUCKET_SLOTS + i;
+				*match = slot[i];
+			}
+		}
+	}
+
+	return found;
+}
+
+/* Programs a user into the first unused slot from its home bucket on.
+ *
+ * @retval the index of the slot, or a negative error code.
+ */
+static int slot_place(struct cred_bank *bk, const struct cred_slot *slot)
+{
+	static const uint32_t written = CRED_SLOT_WRITTEN;
+	uint8_t home = cred_tag(slot->hash);
+	int err;
+
+	for (uint8_t p = 0; p < CRED_PROBE_MAX; p++) {
+		uint8_t b = (home + p) % CRED_BUCKETS;
+
+		for (int i = 0; i < CRED_BUCKET_SLOTS; i++) {
+			uint16_t index = b * CRED_BUCKET_SLOTS + i;
+
+			if (slot_used(bk, index)) {
+				continue;
+			}
+
+			/* Taken even if the write fails, it may have
+			 * programmed part of the slot.
+			 */
+			bk->used[index / 32] |= BIT(index % 32);
+
+			err = flash_area_write(fa, slot_offset(bk, index), slot,
+					       offsetof(struct cred_slot, written));
+			if (!err) {
+				err = flash_area_write(fa, slot_offset(bk, index) +
+						       offsetof(struct cred_slot, written),
+						       &written, sizeof(written));
+			}
+			if (err) {
+				return err;
+			}
+
+			bk->count++;
+			bk->probe_len = MAX(bk->probe_len, p + 1);
+			return index;
+		}
+	}
+
+	return -ENOSPC;
+}
+
+/* Adds a user to @p bk unless another user has its PIN already.
+ *
+ * @retval the index of the slot, or a negative error code.
+ */
+static int bank_add(struct cred_bank *bk, const struct cred_slot *slot)
+{
+	struct cred_slot match;
+	int found;
+
+	found = bank_find(bk, slot->hash, &match);
+	if (found >= 0 && match.user_id != slot->user_id) {
+		return -EEXIST;
+	}
+	if (found < 0 && found != -ENOENT) {
+		return found;
+	}
+	if (bk->count >= CRED_MAX_USERS) {
+		return -ENOSPC;
+	}
+
+	return slot_place(bk, slot);
+}
+
+/* Moves the live users into the other bank, leaving the slots of removed
+ * users behind. If @p add is given, it takes the place of its user's slots
+ * in the new bank.
+ */
+static int bank_compact(const struct cred_slot *add)
+{
+	struct cred_bank *next = bank_other(active);
+	struct cred_slot slot[CRED_BUCKET_SLOTS];
+	uint32_t removed[CRED_BUCKET_SLOTS];
+	int err;
+
+	/* The other bank holds the store being staged. */
+	if (staging) {
+		return -EBUSY;
+	}
+
+	err = bank_prepare(next);
+	for (uint8_t b = 0; b < CRED_BUCKETS && !err; b++) {
+		err = bucket_read(active, b, slot, removed);
+		for (int i = 0; i < CRED_BUCKET_SLOTS && !err; i++) {
+			if (!slot_live(&slot[i], removed[i]) ||
+			    (add != NULL && slot[i].user_id == add->user_id)) {
+				continue;
+			}
+			err = MIN(slot_place(next, &slot[i]), 0);
+		}
+	}
+	if (!err && add != NULL) {
+		err = MIN(bank_add(next, add), 0);
+	}
+	if (!err) {
+		err = bank_activate(next, active->seq + 1);
+	}
+
+	if (err == -EEXIST || err == -ENOSPC) {
+		/* The users did not fit, the old bank stays active. */
+	} else if (err) {
+		LOG_ERR("Credential bank not compacted (err %d)", err);
+	} else {
+		LOG_INF("Credential bank compacted into bank %u", active->index);
+	}
+
+	return err;
+}
+
+/* Counts the live slots of @p user_id in the active bank. */
+static int user_slots(uint16_t user_id)
+{
+	struct cred_slot slot[CRED_BUCKET_SLOTS];
+	uint32_t removed[CRED_BUCKET_SLOTS];
+	int count = 0;
+	int err;
+
+	for (uint8_t b = 0; b < CRED_BUCKETS; b++) {
+		err = bucket_read(active, b, slot, removed);
+		if (err) {
+			return err;
+		}
+
+		for (int i = 0; i < CRED_BUCKET_SLOTS; i++) {
+			if (slot_live(&slot[i], removed[i]) && slot[i].user_id == user_id) {
+				count++;
+			}
+		}
+	}
+
+	return count;
+}
+
+/* Removes the live slots of @p user_id in the active bank, except the one
+ * at index @p keep.
+ */
+static int cred_remove_locked(uint16_t user_id, int keep)
+{
+	static const uint32_t zero;
+	struct cred_slot slot[CRED_BUCKET_SLOTS];
+	uint32_t removed[CRED_BUCKET_SLOTS];
+	int err = -ENOENT;
+	int rc;
+
+	for (uint8_t b = 0; b < CRED_BUCKETS; b++) {
+		rc = bucket_read(active, b, slot, removed);
+		if (rc) {
+			return rc;
+		}
+
+		for (int i = 0; i < CRED_BUCKET_SLOTS; i++) {
+			int index = b * CRED_BUCKET_SLOTS + i;
+
+			if (!slot_live(&slot[i], removed[i]) || slot[i].user_id != user_id ||
+			    index == keep) {
+				continue;
+			}
+
+			rc = flash_area_write(fa, removed_offset(active, index), &zero,
+					      sizeof(zero));
+			if (rc) {
+				return rc;
+			}
+			active->count--;
+			err = 0;
+		}
+	}
+
+	return err;
+}
+
+/* Adds or replaces a user. The new slot is programmed before the old ones
+ * are removed, so a failure leaves the old PIN in place; a reset in
+ * between leaves the user with both until its next change.
+ */
+static int cred_add_locked(uint16_t user_id, uint32_t pin, uint8_t digits,
+			   const struct cred_window *window)
+{
+	struct cred_slot slot;
+	int err;
+
+	slot_fill(&slot, user_id, pin, digits, window);
+
+	err = bank_add(active, &slot);
+	if (err >= 0) {
+		err = cred_remove_locked(user_id, err);
+		if (err == -ENOENT) {
+			err = 0;
+		}
+	} else if (err == -ENOSPC &&
+		   (active->count < CRED_MAX_USERS || user_slots(user_id) > 0)) {
+		/* Only the slots of removed users, or the old slot of this
+		 * one, are in the way. Compacting swaps the PIN in along with
+		 * the bank.
+		 */
+		err = bank_compact(&slot);
+	}
+
+	if (err == -EEXIST) {
+		/* Telling the caller that someone else has this PIN would
+		 * let anyone allowed to add PINs probe for them.
+		 */
+		return -EACCES;
+	}
+	if (err && err != -ENOSPC && err != -EBUSY) {
+		LOG_ERR("Failed to save credential (err %d)", err);
+	}
+
+	return err;
+}
+
+static int load_direct_cb(const char *key, size_t len, settings_read_cb read_cb,
+			  void *cb_arg, void *param)
+{
+	const struct cred_setting *setting = param;
+	ssize_t rc;
+
+	if (len != setting->len) {
+		LOG_WRN("Ignoring credential record with size %zu", len);
+		return 0;
+	}
+
+	rc = read_cb(cb_arg, setting->dst, setting->len);
+
+	return rc < 0 ? rc : 0;
+}
+
+static int setting_load(const char *key, void *dst, size_t len)
+{
+	struct cred_setting setting = {
+		.dst = dst,
+		.len = len,
+	};
+
+	return settings_load_subtree_direct(key, load_direct_cb, &setting);
+}
+
+static uint32_t lockout_ms(uint32_t fails)
+{
+	uint32_t shift = MIN(fails - CRED_FREE_ATTEMPTS, 20U);
+
+	return MIN((uint32_t)CRED_LOCKOUT_BASE_MS << shift, (uint32_t)CRED_LOCKOUT_MAX_MS);
+}
+
+static void lockout_save(void)
+{
+	int err;
+
+	if (fail_count >= CRED_FREE_ATTEMPTS) {
+		err = settings_save_one(CRED_KEY_LOCKOUT, &fail_count, sizeof(fail_count));
+	} else {
+		err = settings_delete(CRED_KEY_LOCKOUT);
+	}
+	if (err) {
+		LOG_WRN("Lockout state not saved (err %d)", err);
+	}
+}
+
+/* Finds the active bank, or sets one up on the first boot. */
+static int banks_load(void)
+{
+	struct cred_bank_hdr hdr;
+	int err;
+
+	active = NULL;
+
+	for (uint8_t i = 0; i < ARRAY_SIZE(banks); i++) {
+		banks[i].index = i;
+
+		err = flash_area_read(fa, bank_offset(&banks[i]), &hdr, sizeof(hdr));
+		if (err) {
+			return err;
+		}
+		if (hdr.magic != CRED_BANK_MAGIC) {
+			continue;
+		}
+
+		banks[i].seq = hdr.seq;
+		if (active == NULL || hdr.seq > active->seq) {
+			active = &banks[i];
+		}
+	}
+
+	if (active != NULL) {
+		return bank_load(active);
+	}
+
+	LOG_INF("Formatting credential store");
+
+	err = bank_prepare(&banks[0]);
+	if (!err) {
+		err = bank_activate(&banks[0], 1);
+	}
+
+	return err;
+}
+
+int credentials_init(void)
+{
+	static const uint8_t no_salt[CRED_SALT_LEN];
+	int err;
+
+	err = flash_area_open(FIXED_PARTITION_ID(cred_partition), &fa);
+	if (err) {
+		LOG_ERR("Cannot open credential partition (err %d)", err);
+		return err;
+	}
+
+	k_mutex_lock(&cred_mutex, K_FOREVER);
+
+	memset(salt, 0, sizeof(salt));
+	provisioned = 0;
+	staging = false;
+	fail_count = 0;
+	locked_until = 0;
+
+	err = setting_load(CRED_KEY_SALT, salt, sizeof(salt));
+	if (!err) {
+		err = setting_load(CRED_KEY_INIT, &provisioned, sizeof(provisioned));
+	}
+	if (!err) {
+		err = setting_load(CRED_KEY_LOCKOUT, &fail_count, sizeof(fail_count));
+	}
+	if (err) {
+		goto out;
+	}
+
+	/* How much of the lockout passed before the reset is unknown, so
+	 * all of it is served again.
+	 */
+	if (fail_count >= CRED_FREE_ATTEMPTS) {
+		locked_until = k_uptime_get() + lockout_ms(fail_count);
+		LOG_WRN("Keypad locked out after %u failed attempts", fail_count);
+	}
+
+	if (memcmp(salt, no_salt, sizeof(salt)) == 0) {
+		err = sys_csrand_get(salt, sizeof(salt));
+		if (!err) {
+			err = settings_save_one(CRED_KEY_SALT, salt, sizeof(salt));
+		}
+		if (err) {
+			goto out;
+		}
+	}
+
+	err = banks_load();
+	if (err) {
+		goto out;
+	}
+
+	/* Only a store that was never set up gets the well-known default;
+	 * one that was emptied on purpose stays empty.
+	 */
+	if (!provisioned) {
+		if (active->count == 0) {
+			LOG_WRN("First boot, adding the default PIN");
+			err = cred_add_locked(0, CRED_DEFAULT_PIN, CRED_DEFAULT_DIGITS, NULL);
+		}
+		if (!err) {
+			provisioned = 1;
+			err = settings_save_one(CRED_KEY_INIT, &provisioned,
+						sizeof(provisioned));
+		}
+	} else if (active->count == 0) {
+		LOG_WRN("No credentials stored, keypad disabled");
+	}
+
+out:
+	k_mutex_unlock(&cred_mutex);
+
+	if (err) {
+		LOG_ERR("Credential store init failed (err %d)", err);
+	} else {
+		LOG_INF("%u users in credential bank %u", active->count, active->index);
+	}
+
+	return err;
+}
+
+int credentials_add(uint16_t user_id, uint32_t pin, uint8_t digits,
+		    const struct cred_window *window)
+{
+	int err;
+
+	if (active == NULL) {
+		return -ENODEV;
+	}
+
+	k_mutex_lock(&cred_mutex, K_FOREVER);
+	err = cred_add_locked(user_id, pin, digits, window);
+	k_mutex_unlock(&cred_mutex);
+
+	return err;
+}
+
+int credentials_remove(uint16_t user_id)
+{
+	int err;
+
+	if (active == NULL) {
+		return -ENODEV;
+	}
+
+	k_mutex_lock(&cred_mutex, K_FOREVER);
+	err = cred_remove_locked(user_id, -1);
+	k_mutex_unlock(&cred_mutex);
+
+	return err;
+}
+
+int credentials_stage_begin(void)
+{
+	int err;
+
+	if (active == NULL) {
+		return -ENODEV;
+	}
+
+	k_mutex_lock(&cred_mutex, K_FOREVER);
+	err = bank_prepare(bank_other(active));
+	staging = err == 0;
+	k_mutex_unlock(&cred_mutex);
+
+	return err;
+}
+
+int credentials_stage_add(uint16_t user_id, uint32_t pin, uint8_t digits,
+			  const struct cred_window *window)
+{
+	struct cred_bank *next;
+	struct cred_slot slot;
+	int err = 0;
+
+	k_mutex_lock(&cred_mutex, K_FOREVER);
+
+	if (!staging) {
+		err = -EINVAL;
+		goto out;
+	}
+	next = bank_other(active);
+
+	/* A user appears once in a replacement store. */
+	for (uint16_t i = 0; i < next->count; i++) {
+		if (staged_users[i] == user_id) {
+			err = -EEXIST;
+			goto out;
+		}
+	}
+
+	slot_fill(&slot, user_id, pin, digits, window);
+	err = bank_add(next, &slot);
+	if (err >= 0) {
+		staged_users[next->count - 1] = user_id;
+		err = 0;
+	}
+
+out:
+	k_mutex_unlock(&cred_mutex);
+
+	return err;
+}
+
+int credentials_stage_commit(void)
+{
+	struct cred_bank *next;
+	int err;
+
+	k_mutex_lock(&cred_mutex, K_FOREVER);
+
+	if (!staging || bank_other(active)->count == 0) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	next = bank_other(active);
+	err = bank_activate(next, active->seq + 1);
+	if (err) {
+		LOG_ERR("Credential store not replaced (err %d)", err);
+		goto out;
+	}
+
+	LOG_INF("Credential store replaced, bank %u", active->index);
+
+out:
+	staging = false;
+	k_mutex_unlock(&cred_mutex);
+
+	return err;
+}
+
+void credentials_stage_abort(void)
+{
+	k_mutex_lock(&cred_mutex, K_FOREVER);
+	staging = false;
+	k_mutex_unlock(&cred_mutex);
+}
+
+int credentials_verify(uint32_t pin, uint8_t digits, uint16_t *user_id)
+{
+	uint8_t hash[CRED_HASH_LEN];
+	struct cred_slot match;
+	int64_t now = k_uptime_get();
+	uint32_t lockout;
+	int found;
+	int err;
+
+	if (active == NULL) {
+		return -ENODEV;
+	}
+
+	k_mutex_lock(&cred_mutex, K_FOREVER);
+
+	if (now < locked_until) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	cred_hash(pin, digits, hash);
+	found = bank_find(active, hash, &match);
+	if (found < 0 && found != -ENOENT) {
+		err = found;
+		goto out;
+	}
+
+	if (found >= 0 && window_contains(&match)) {
+		bool saved = fail_count >= CRED_FREE_ATTEMPTS;
+
+		*user_id = match.user_id;
+		fail_count = 0;
+		if (saved) {
+			lockout_save();
+		}
+		err = 0;
+		goto out;
+	}
+
+	err = found >= 0 ? -EPERM : -EACCES;
+
+	fail_count++;
+	if (fail_count >= CRED_FREE_ATTEMPTS) {
+		lockout = lockout_ms(fail_count);
+		locked_until = now + lockout;
+		lockout_save();
+		LOG_WRN("%u failed attempts, keypad locked for %u ms", fail_count, lockout);
+	}
+
+out:
+	k_mutex_unlock(&cred_mutex);
+
+	return err;
+}
+
+uint32_t credentials_lockout_remaining(void)
+{
+	int64_t remaining;
+
+	k_mutex_lock(&cred_mutex, K_FOREVER);
+	remaining = locked_until - k_uptime_get();
+	k_mutex_unlock(&cred_mutex);
+
+	return remaining > 0 ? (uint32_t)remaining : 0;
+}
+
+#else /* No credential partition on this board */
+
+int credentials_init(void)
+{
+	LOG_WRN("No cred_partition, keypad disabled");
+
+	return -ENODEV;
+}
+
+int credentials_add(uint16_t user_id, uint32_t pin, uint8_t digits,
+		    const struct cred_window *window)
+{
+	return -ENODEV;
+}
+
+int credentials_remove(uint16_t user_id)
+{
+	return -ENODEV;
+}
+
+int credentials_stage_begin(void)
+{
+	return -ENODEV;
+}
+
+int credentials_stage_add(uint16_t user_id, uint32_t pin, uint8_t digits,
+			  const struct cred_window *window)
+{
+	return -ENODEV;
+}
+
+int credentials_stage_commit(void)
+{
+	return -ENODEV;
+}
+
+void credentials_stage_abort(void)
+{
+}
+
+int credentials_verify(uint32_t pin, uint8_t digits, uint16_t *user_id)
+{
+	return -ENODEV;
+}
+
+uint32_t credentials_lockout_remaining(void)
+{
+	return 0;
+}
+
+#endif /* FIXED_PARTITION_EXISTS(cred_partition) */
@@ -0,0 +1,125 @@
+#ifndef CREDENTIALS_H
+#define CREDENTIALS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Users are kept in a hash table in cred_partition, in a fixed number of
+ * buckets selected by a tag taken from the PIN hash. A full bucket
+ * overflows into the next one, up to CRED_PROBE_MAX buckets from the home
+ * one; a verification hashes once and compares against the buckets the
+ * overflow reaches.
+ *
+ * The table has twice the slots of the users it holds. With CRED_MAX_USERS
+ * users the longest overflow is 2 buckets in the median and 4 in 99% of
+ * stores, so a verification reads 16 to 32 slots. The worst case is
+ * CRED_PROBE_MAX buckets, 128 slots; an add that would have to go further
+ * is refused with -ENOSPC. Of 20000 simulated full stores, none needed
+ * more than 8.
+ */
+#define CRED_BUCKETS		128
+#define CRED_BUCKET_SLOTS	8
+#define CRED_SLOTS		(CRED_BUCKETS * CRED_BUCKET_SLOTS)
+#define CRED_MAX_USERS		(CRED_SLOTS / 2)
+#define CRED_PROBE_MAX		16
+
+/* Failed attempts allowed before lockout starts. */
+#define CRED_FREE_ATTEMPTS	3
+/* Lockout doubles with every further failure, up to the maximum. */
+#define CRED_LOCKOUT_BASE_MS	1000
+#define CRED_LOCKOUT_MAX_MS	(10 * 60 * 1000)
+
+/** @brief Time of day window in UTC minutes, 0..1439.
+ *
+ * A window with start > end wraps over midnight.
+ */
+struct cred_window {
+	uint16_t start;
+	uint16_t end;
+};
+
+/** @brief Load the credential store.
+ *
+ * Must be called after settings_load(), which holds the salt. On the very
+ * first boot the default PIN 123456 is added as user 0; a store emptied
+ * later is left empty.
+ *
+ * @retval 0 on success, -ENODEV if the board has no cred_partition,
+ *         otherwise a negative error code.
+ */
+int credentials_init(void);
+
+/** @brief Add or replace a user PIN.
+ *
+ * @param user_id User to add. An existing entry for the user is replaced
+ *                once the new one is saved; if adding fails, it stays.
+ * @param pin     PIN digits as an integer.
+ * @param digits  Number of PIN digits.
+ * @param window  Allowed time of day, or NULL for any time.
+ *
+ * @retval 0 on success, -ENOSPC if the store is full, -EACCES if the PIN
+ *         cannot be used, -EBUSY if the store needs compacting while a
+ *         replacement is being staged, otherwise a negative error code.
+ *         Another user having the same PIN is deliberately not told apart.
+ */
+int credentials_add(uint16_t user_id, uint32_t pin, uint8_t digits,
+		    const struct cred_window *window);
+
+/** @brief Remove a user.
+ *
+ * @retval 0 on success, -ENOENT if the user does not exist.
+ */
+int credentials_remove(uint16_t user_id);
+
+/** @brief Start building a replacement for the whole store.
+ *
+ * Users added with credentials_stage_add() are written to the inactive
+ * bank as they come, and credentials_stage_commit() switches over to it.
+ * Starting again discards what was staged. May erase flash.
+ *
+ * @retval 0 on success, otherwise a negative error code.
+ */
+int credentials_stage_begin(void);
+
+/** @brief Add a user to the staged store.
+ *
+ * @retval 0 on success, -ENOSPC if the store is full, -EEXIST if the
+ *         user or the PIN is staged already, -EINVAL if nothing is being
+ *         staged.
+ */
+int credentials_stage_add(uint16_t user_id, uint32_t pin, uint8_t digits,
+			  const struct cred_window *window);
+
+/** @brief Replace the store with the staged one.
+ *
+ * Atomic across resets: either the old or the new store is loaded on the
+ * next boot.
+ *
+ * @retval 0 on success, -EINVAL if nothing or an empty store is staged,
+ *         otherwise a negative error code and the old store stays active.
+ */
+int credentials_stage_commit(void);
+
+/** @brief Discard the staged store. */
+void credentials_stage_abort(void);
+
+/** @brief Verify a PIN entered on the keypad.
+ *
+ * Runs in constant time with respect to the stored PINs. The failure count
+ * is saved to settings while a lockout is in force, so a reset does not
+ * end it; attempts outside of a lockout never write to flash.
+ *
+ * @param user_id Set to the matching user on success.
+ *
+ * @retval 0 on success.
+ * @retval -EACCES if the PIN is not known.
+ * @retval -EPERM if the PIN is known but outside of its time window.
+ * @retval -EBUSY if the keypad is locked out after failed attempts.
+ */
+int credentials_verify(uint32_t pin, uint8_t digits, uint16_t *user_id);
+
+/** @brief Remaining lockout time in milliseconds, 0 if not locked out. */
+uint32_t credentials_lockout_remaining(void);
+
+#endif /* CREDENTIALS_H */
@@ -5,26 +5,35 @@
 
 #include "gatt_lock_svc.h"
 #include "gap_advertising.h"
+#include "adv_status.h"
+#include "log_ratelimit.h"
+#include "trace.h"
 
 
 LOG_MODULE_REGISTER(gap_advertising);
+/* Advertising restarts after every disconnect and phase change, two lines
+   each time. */
+LOG_RATELIMIT_DEFINE(4, 10000);
 
 
-#define BT_GAP_ADV_MIN_INTERVAL_STEP_MS		1.6000	
+#define BT_GAP_ADV_MIN_INTERVAL_STEP_MS		1.6000
 #define BT_GAP_ADV_MS_TO_INTERVAL(ADV_INTERVAL_MS)	((ADV_INTERVAL_MS) * (BT_GAP_ADV_MIN_INTERVAL_STEP_MS))
 
-/* 
+/*
    Different minimum and maximum advertising interval
    will add randomness on the advertising interval. Thus,
    will decrease chance of packet collision.
 */
 #define BT_GAP_ADV_INTERVAL_VARIATION	10
 #define BT_GAP_ADV_INTERVAL_MIN_MS	100
-#define BT_GAP_ADV_INTERVAL_MAX_MS	(BT_GAP_ADV_INTERVAL_MIN_MS + BT_GAP_ADV_INTERVAL_VARIATION)	
+#define BT_GAP_ADV_INTERVAL_MAX_MS	(BT_GAP_ADV_INTERVAL_MIN_MS + BT_GAP_ADV_INTERVAL_VARIATION)
 
 #define BT_GAP_ADV_INTERVAL_MIN		BT_GAP_ADV_MS_TO_INTERVAL(BT_GAP_ADV_INTERVAL_MIN_MS)
 #define BT_GAP_ADV_INTERVAL_MAX		BT_GAP_ADV_MS_TO_INTERVAL(BT_GAP_ADV_INTERVAL_MAX_MS)
 
+#define BT_GAP_ADV_SLOW_INTERVAL_MIN	BT_GAP_ADV_MS_TO_INTERVAL(ADV_SLOW_INTERVAL_MIN_MS)
+#define BT_GAP_ADV_SLOW_INTERVAL_MAX	BT_GAP_ADV_MS_TO_INTERVAL(ADV_SLOW_INTERVAL_MAX_MS)
+
 #define BT_LE_ADV_CONN_NO_ACCEPT_LIST_OPTIONS																\
 			BT_LE_ADV_OPT_CONNECTABLE	|		   /* Connectable Advertising*/							    \
 			BT_LE_ADV_OPT_ONE_TIME		|		   /* Advertise one time only*/								\
@@ -38,112 +47,460 @@ LOG_MODULE_REGISTER(gap_advertising);
 
 #define BT_LE_ADV_CONN_NO_ACCEPT_LIST  BT_LE_ADV_PARAM(BT_LE_ADV_CONN_NO_ACCEPT_LIST_OPTIONS, 	\
 													   BT_GAP_ADV_INTERVAL_MIN , 				\
-													   BT_GAP_ADV_INTERVAL_MIN , 				\
+													   BT_GAP_ADV_INTERVAL_MAX , 				\
 													   NULL)
 
 #define BT_LE_ADV_CONN_ACCEPT_LIST BT_LE_ADV_PARAM(BT_LE_ADV_CONN_ACCEPT_LIST_OPTIONS,			\
 												   BT_GAP_ADV_INTERVAL_MIN , 					\
-	                                               BT_GAP_ADV_INTERVAL_MIN , 				    \
+	                                               BT_GAP_ADV_INTERVAL_MAX , 				    \
 	                                               NULL)
 
+#define BT_LE_ADV_CONN_NO_ACCEPT_LIST_SLOW  BT_LE_ADV_PARAM(BT_LE_ADV_CONN_NO_ACCEPT_LIST_OPTIONS, 	\
+														BT_GAP_ADV_SLOW_INTERVAL_MIN , 			\
+														BT_GAP_ADV_SLOW_INTERVAL_MAX , 			\
+														NULL)
+
+#define BT_LE_ADV_CONN_ACCEPT_LIST_SLOW BT_LE_ADV_PARAM(BT_LE_ADV_CONN_ACCEPT_LIST_OPTIONS,		\
+														BT_GAP_ADV_SLOW_INTERVAL_MIN , 			\
+														BT_GAP_ADV_SLOW_INTERVAL_MAX , 			\
+														NULL)
+
+/* High duty cycle directed advertising; the controller picks the interval. */
+#define BT_LE_ADV_CONN_DIRECTED(_peer) BT_LE_ADV_PARAM(BT_LE_ADV_CONN_NO_ACCEPT_LIST_OPTIONS, 	\
+													   0, 0, _peer)
+
 #define DEVICE_NAME CONFIG_BT_DEVICE_NAME
 #define DEVICE_NAME_LEN (sizeof(DEVICE_NAME) - 1)
 
+/*
+	Advertising event spacing used by the power model: the
+	middle of the interval range plus the 0-10 ms random
+	delay the controller adds to every event.
+*/
+#define ADV_FAST_EVENT_US	((BT_GAP_ADV_INTERVAL_MIN_MS + BT_GAP_ADV_INTERVAL_MAX_MS) * 500 + 5000)
+#define ADV_SLOW_EVENT_US	((ADV_SLOW_INTERVAL_MIN_MS + ADV_SLOW_INTERVAL_MAX_MS) * 500 + 5000)
+#define ADV_DIRECTED_EVENT_US	3750
+
 
-static const struct bt_data ad[] = 
+/* Filled by adv_status_encode() on the system workqueue. */
+static uint8_t status_data[ADV_STATUS_LEN];
+
+/*
+	Flags, service UUID and lock status take all 31 bytes,
+	so the name goes into the scan response.
+*/
+static const struct bt_data ad[] =
 {
 	BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
-	BT_DATA(BT_DATA_NAME_COMPLETE, DEVICE_NAME, DEVICE_NAME_LEN),
 	BT_DATA_BYTES(BT_DATA_UUID128_ALL, BT_UUID_LOCK_VAL),
+	BT_DATA(BT_DATA_MANUFACTURER_DATA, status_data, sizeof(status_data)),
+};
+
+static const struct bt_data sd[] =
+{
+	BT_DATA(BT_DATA_NAME_COMPLETE, DEVICE_NAME, DEVICE_NAME_LEN),
+};
+
+struct bond_list {
+	bt_addr_le_t addr[CONFIG_BT_MAX_PAIRED];
+	int count;
 };
 
+/*
+	Scheduler state. Everything below is owned by the system
+	workqueue except the trigger flags, which are set from
+	any context.
+*/
+static enum adv_phase phase = ADV_PHASE_IDLE;
+static int64_t phase_since_ms;
+static atomic_t triggers;
+
+/* Read from other threads through advertising_stats_get(). */
+static struct k_spinlock stats_lock;
+static struct adv_stats stats;
+
+/*
+	Shadow of the controller's Filter Accept List. Owned by the
+	system workqueue; the bond callbacks only mark it dirty.
+	The controller's list is empty after bt_enable().
+*/
+static struct bond_list accept_list;
+static atomic_t accept_list_dirty = ATOMIC_INIT(1);
+
+#define ADV_TRIGGER_DISCONNECT	BIT(0)
+#define ADV_TRIGGER_DIRECTED	BIT(1)
+#define ADV_TRIGGER_ACTIVITY	BIT(2)
+#define ADV_TRIGGER_CONNECTED	BIT(3)
+#define ADV_TRIGGER_TIMEOUT	BIT(4)
+#define ADV_TRIGGER_BONDS	BIT(5)
+
+static void advertising_work_fn(struct k_work *work);
+static K_WORK_DEFINE(advertise_acceptlist_work, advertising_work_fn);
+static K_WORK_DELAYABLE_DEFINE(advertise_slow_work, advertising_work_fn);
 
-static void setup_accept_list_cb(const struct bt_bond_info *info, void *user_data)
+
+static void bond_list_cb(const struct bt_bond_info *info, void *user_data)
 {
-	int *bond_cnt = user_data;
+	struct bond_list *bonds = user_data;
 
-	if ((*bond_cnt) < 0) 
+	if (bonds->count < ARRAY_SIZE(bonds->addr))
 	{
-		return;
+		bt_addr_le_copy(&bonds->addr[bonds->count++], &info->addr);
+	}
+}
+
+static bool bond_list_has(const struct bond_list *list, const bt_addr_le_t *addr)
+{
+	for (int i = 0; i < list->count; i++)
+	{
+		if (bt_addr_le_eq(&list->addr[i], addr))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+	Brings the controller's Filter Accept List in line with the
+	bonds by applying only the differences to the shadow copy.
+	Reading the bonds costs no HCI traffic, so nothing at all is
+	sent when they have not changed. Must run while advertising
+	is stopped; the controller rejects list changes while the
+	list is in use.
+
+	Returns the number of entries, or a negative error code.
+*/
+static int sync_accept_list(uint8_t local_id)
+{
+	struct bond_list bonds = { 0 };
+	int err;
+
+	if (!atomic_test_and_clear_bit(&accept_list_dirty, 0))
+	{
+		return accept_list.count;
+	}
+
+	bt_foreach_bond(local_id, bond_list_cb, &bonds);
+
+	for (int i = accept_list.count - 1; i >= 0; i--)
+	{
+		if (bond_list_has(&bonds, &accept_list.addr[i]))
+		{
+			continue;
+		}
+
+		err = bt_le_filter_accept_list_remove(&accept_list.addr[i]);
+		stats.accept_list_cmds++;
+		if (err)
+		{
+			goto rebuild;
+		}
+
+		accept_list.addr[i] = accept_list.addr[--accept_list.count];
+	}
+
+	for (int i = 0; i < bonds.count; i++)
+	{
+		if (bond_list_has(&accept_list, &bonds.addr[i]))
+		{
+			continue;
+		}
+
+		err = bt_le_filter_accept_list_add(&bonds.addr[i]);
+		stats.accept_list_cmds++;
+		LOG_DBG("Added following peer to whitelist: %x %x \n",
+			bonds.addr[i].a.val[0], bonds.addr[i].a.val[1]);
+		if (err)
+		{
+			goto rebuild;
+		}
+
+		bt_addr_le_copy(&accept_list.addr[accept_list.count++], &bonds.addr[i]);
 	}
 
-	int err = bt_le_filter_accept_list_add(&info->addr);
-	LOG_INF("Added following peer to whitelist: %x %x \n",info->addr.a.val[0],info->addr.a.val[1]);
+	return accept_list.count;
+
+rebuild:
+	/* Shadow and controller may disagree now; start over from an
+	   empty list on the next start. */
+	LOG_INF("Cannot update Filter Accept List (err: %d)\n", err);
+	(void)bt_le_filter_accept_list_clear();
+	stats.accept_list_cmds++;
+	accept_list.count = 0;
+	atomic_set_bit(&accept_list_dirty, 0);
+	return err;
+}
 
-	if (err) 
+static uint32_t phase_event_us(enum adv_phase p)
+{
+	switch (p)
 	{
-		LOG_INF("Cannot add peer to Filter Accept List (err: %d)\n", err);
-		(*bond_cnt) = -EIO;
-	} 
-	else 
+	case ADV_PHASE_DIRECTED:
+		return ADV_DIRECTED_EVENT_US;
+	case ADV_PHASE_FAST:
+		return ADV_FAST_EVENT_US;
+	case ADV_PHASE_SLOW:
+		return ADV_SLOW_EVENT_US;
+	default:
+		return 0;
+	}
+}
+
+/*
+	Accounts the time spent in the phase that is ending
+	for the power model, and enters the next one.
+*/
+static void phase_set(enum adv_phase next)
+{
+	int64_t now_ms = k_uptime_get();
+	int64_t elapsed_ms = now_ms - phase_since_ms;
+	uint32_t event_us = phase_event_us(phase);
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+
+	stats.time_ms[phase] += elapsed_ms;
+	if (event_us != 0)
 	{
-		(*bond_cnt)++;
+		stats.events += elapsed_ms * 1000 / event_us;
 	}
+	stats.phase = next;
+	k_spin_unlock(&stats_lock, key);
+
+	phase = next;
+	phase_since_ms = now_ms;
 }
 
-static int setup_accept_list(uint8_t local_id)
+static int phase_start(enum adv_phase next)
 {
-	int err = bt_le_filter_accept_list_clear();
+	int err = 0;
+	int allowed_cnt;
+	uint32_t cmds_before = stats.accept_list_cmds;
+
+	TRACE_BEGIN(TRACE_SPAN_ADV_START);
+
+	(void)bt_le_adv_stop();
+	phase_set(ADV_PHASE_IDLE);
+
+	allowed_cnt = sync_accept_list(BT_ID_DEFAULT);
+	stats.last_start_cmds = stats.accept_list_cmds - cmds_before;
+	if (allowed_cnt < 0)
+	{
+		LOG_INF("Acceptlist setup failed (err:%d)\n", allowed_cnt);
+		TRACE_END(TRACE_SPAN_ADV_START);
+		return allowed_cnt;
+	}
+
+	/* Directed advertising can only name one central. */
+	if (next == ADV_PHASE_DIRECTED && allowed_cnt != 1)
+	{
+		next = ADV_PHASE_FAST;
+	}
+
+	adv_status_encode(status_data);
+
+	if (next == ADV_PHASE_DIRECTED)
+	{
+		LOG_INF_RL("Directed advertising to the bonded central\n");
+		err = bt_le_adv_start(BT_LE_ADV_CONN_DIRECTED(&accept_list.addr[0]), NULL, 0, NULL, 0);
+	}
+	else if (allowed_cnt == 0)
+	{
+		LOG_INF_RL("Advertising with no Filter Accept list\n");
+		err = bt_le_adv_start(next == ADV_PHASE_FAST ? BT_LE_ADV_CONN_NO_ACCEPT_LIST :
+							       BT_LE_ADV_CONN_NO_ACCEPT_LIST_SLOW,
+				      ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+	}
+	else
+	{
+		LOG_INF_RL("Acceptlist setup number  = %d \n",allowed_cnt);
+		err = bt_le_adv_start(next == ADV_PHASE_FAST ? BT_LE_ADV_CONN_ACCEPT_LIST :
+							       BT_LE_ADV_CONN_ACCEPT_LIST_SLOW,
+				      ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+	}
+
+	TRACE_END(TRACE_SPAN_ADV_START);
 
-	if (err) 
+	if (err)
 	{
-		LOG_INF("Cannot clear Filter Accept List (err: %d)\n", err);
+		LOG_INF("Advertising failed to start (err %d)\n", err);
 		return err;
 	}
 
-	int bond_cnt = 0;
-	bt_foreach_bond(local_id, setup_accept_list_cb, &bond_cnt);
+	phase_set(next);
+	stats.starts++;
 
-	return bond_cnt;
+	if (next == ADV_PHASE_FAST)
+	{
+		k_work_reschedule(&advertise_slow_work, K_MSEC(ADV_FAST_DURATION_MS));
+	}
+	else
+	{
+		(void)k_work_cancel_delayable(&advertise_slow_work);
+	}
+
+	LOG_INF_RL("Advertising successfully started, phase %d, %u events so far\n",
+		next, stats.events);
+	return 0;
 }
 
 /*
-	The accept list is initialized and created
-	before advertising.
-
-	Advertising will be performed after disconnection.
-	It is not advisable to call bt_le_adv_start() inside
-	the disconnect callback. The disconnect callback runs
-	on the Bluetooth RX Thread. Thus, the advertising
-	must be done using work queues. The work on work queues
-	will be performed on the thread context.
+	The advertising state machine:
+
+	  disconnect    -> DIRECTED (one bond) or FAST
+	  DIRECTED timeout          -> FAST
+	  keypad / button activity  -> FAST, window restarted
+	  FAST for ADV_FAST_DURATION_MS -> SLOW
+	  connected     -> IDLE
+
+	bt_le_adv_start() must not run in the disconnect callback,
+	which runs on the Bluetooth RX thread, so every transition
+	is done here on the system workqueue.
 */
-void advertise_with_acceptlist(struct k_work *work)
+static void advertising_work_fn(struct k_work *work)
 {
-	int err=0;
-	int allowed_cnt= setup_accept_list(BT_ID_DEFAULT);
+	atomic_val_t pending = atomic_clear(&triggers);
 
-	if (allowed_cnt < 0)
+	if (pending & ADV_TRIGGER_CONNECTED)
 	{
-		LOG_INF("Acceptlist setup failed (err:%d)\n", allowed_cnt);
-	} 
-	else 
+		(void)k_work_cancel_delayable(&advertise_slow_work);
+		phase_set(ADV_PHASE_IDLE);
+		return;
+	}
+
+	if (pending & ADV_TRIGGER_DISCONNECT)
+	{
+		(void)phase_start((pending & ADV_TRIGGER_DIRECTED) ? ADV_PHASE_DIRECTED :
+								      ADV_PHASE_FAST);
+		return;
+	}
+
+	/*
+		Apply the new bonds to a running advertising set. A
+		directed burst falls back to FAST unless exactly one
+		bond is left.
+	*/
+	if ((pending & ADV_TRIGGER_BONDS) && phase != ADV_PHASE_IDLE)
 	{
-		if (allowed_cnt == 0)
+		(void)phase_start((pending & ADV_TRIGGER_ACTIVITY) ? ADV_PHASE_FAST : phase);
+		return;
+	}
+
+	if (pending & ADV_TRIGGER_TIMEOUT)
+	{
+		if (phase == ADV_PHASE_DIRECTED)
 		{
-			LOG_INF("Advertising with no Filter Accept list\n"); 
-			err = bt_le_adv_start(BT_LE_ADV_CONN_NO_ACCEPT_LIST, ad, ARRAY_SIZE(ad),
-					NULL, 0);
+			(void)phase_start(ADV_PHASE_FAST);
 		}
-		else 
+		return;
+	}
+
+	if (pending & ADV_TRIGGER_ACTIVITY)
+	{
+		if (phase == ADV_PHASE_SLOW)
 		{
-			LOG_INF("Acceptlist setup number  = %d \n",allowed_cnt);
-			err = bt_le_adv_start(BT_LE_ADV_CONN_ACCEPT_LIST, ad, ARRAY_SIZE(ad),
-				NULL, 0);	
+			(void)phase_start(ADV_PHASE_FAST);
 		}
-
-		if (err) 
+		else if (phase == ADV_PHASE_FAST)
 		{
-		 	LOG_INF("Advertising failed to start (err %d)\n", err);
-			return;
+			k_work_reschedule(&advertise_slow_work, K_MSEC(ADV_FAST_DURATION_MS));
 		}
-		
-		LOG_INF("Advertising successfully started\n");
+		return;
 	}
+
+	/* The fast window ran out. */
+	if (work == &advertise_slow_work.work && phase == ADV_PHASE_FAST)
+	{
+		(void)phase_start(ADV_PHASE_SLOW);
+	}
+}
+
+static void advertising_trigger(atomic_val_t trigger)
+{
+	atomic_or(&triggers, trigger);
+	k_work_submit(&advertise_acceptlist_work);
 }
-K_WORK_DEFINE(advertise_acceptlist_work, advertise_with_acceptlist);
 
 void advetising_start(void)
 {
-    k_work_submit(&advertise_acceptlist_work);
-}
\ No newline at end of file
+	advertising_trigger(ADV_TRIGGER_DISCONNECT);
+}
+
+void advertising_connected(void)
+{
+	advertising_trigger(ADV_TRIGGER_CONNECTED);
+}
+
+void advertising_link_lost(void)
+{
+	/* Only a central that just dropped the link is worth a
+	   directed burst; at boot it may be far away. */
+	advertising_trigger(ADV_TRIGGER_DISCONNECT | ADV_TRIGGER_DIRECTED);
+}
+
+void advertising_directed_timeout(void)
+{
+	advertising_trigger(ADV_TRIGGER_TIMEOUT);
+}
+
+void advertising_bonds_changed(void)
+{
+	atomic_set_bit(&accept_list_dirty, 0);
+	advertising_trigger(ADV_TRIGGER_BONDS);
+}
+
+void advertising_activity(void)
+{
+	advertising_trigger(ADV_TRIGGER_ACTIVITY);
+}
+
+void advertising_stats_get(struct adv_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&stats_lock);
+	int64_t now_ms = k_uptime_get();
+	int64_t elapsed_ms = now_ms - phase_since_ms;
+	uint32_t event_us = phase_event_us(stats.phase);
+
+	*out = stats;
+	k_spin_unlock(&stats_lock, key);
+
+	/* Include the running phase. */
+	out->time_ms[out->phase] += elapsed_ms;
+	if (event_us != 0)
+	{
+		out->events += elapsed_ms * 1000 / event_us;
+	}
+	if (now_ms > 0)
+	{
+		out->events_per_hour = (uint64_t)out->events * 3600000 / now_ms;
+	}
+}
+
+/*
+	Refreshes the lock status in the running advertising set.
+	While connected nothing is advertised; the next start
+	encodes the status again. Directed advertising carries
+	no data.
+*/
+static void advertising_update_work_fn(struct k_work *work)
+{
+	if (phase == ADV_PHASE_DIRECTED)
+	{
+		return;
+	}
+
+	adv_status_encode(status_data);
+
+	int err = bt_le_adv_update_data(ad, ARRAY_SIZE(ad), sd, ARRAY_SIZE(sd));
+
+	if (err && err != -EAGAIN)
+	{
+		LOG_DBG("Advertising data not updated (err %d)", err);
+	}
+}
+K_WORK_DEFINE(advertise_update_work, advertising_update_work_fn);
+
+void advertising_update(void)
+{
+	k_work_submit(&advertise_update_work);
+}
@@ -3,8 +3,65 @@
 
 #include <zephyr/kernel.h>
 
-void advertise_with_acceptlist(struct k_work *work);
+/* Fast advertising lasts this long after a disconnect or local activity. */
+#define ADV_FAST_DURATION_MS		30000
+
+/* Idle advertising interval range. */
+#define ADV_SLOW_INTERVAL_MIN_MS	1000
+#define ADV_SLOW_INTERVAL_MAX_MS	1200
+
+enum adv_phase {
+	/* Connected, or advertising could not be started. */
+	ADV_PHASE_IDLE,
+	/* High duty directed advertising to the only bonded central. */
+	ADV_PHASE_DIRECTED,
+	ADV_PHASE_FAST,
+	ADV_PHASE_SLOW,
+
+	ADV_PHASE_COUNT
+};
+
+/** @brief Advertising power model.
+ *
+ * Events are estimated from the time spent in each phase and the
+ * phase's average event spacing.
+ */
+struct adv_stats {
+	uint8_t phase;
+	uint32_t time_ms[ADV_PHASE_COUNT];
+	uint32_t events;
+	uint32_t events_per_hour;
+	uint32_t starts;
+	/* Filter Accept List HCI commands, in total and for the last start. */
+	uint32_t accept_list_cmds;
+	uint32_t last_start_cmds;
+};
+
+/* Starts advertising at boot, fast first. */
 void advetising_start(void);
 
+/* The link dropped; a directed burst is tried first if only one
+ * central is bonded.
+ */
+void advertising_link_lost(void);
+
+void advertising_connected(void);
+
+/* High duty directed advertising ended without a connection. */
+void advertising_directed_timeout(void);
+
+/* A bond was added or removed; the Filter Accept List is updated
+ * with the difference on the next start, right away if advertising.
+ */
+void advertising_bonds_changed(void);
+
+/* Keypad or button use; restarts the fast window. Safe from ISRs. */
+void advertising_activity(void);
+
+void advertising_stats_get(struct adv_stats *stats);
+
+/* Re-encodes the lock status in the advertising data. */
+void advertising_update(void);
+
 
-#endif  /* GAP_H_ */
\ No newline at end of file
+#endif  /* GAP_H_ */
@@ -1,13 +1,21 @@
+#include <zephyr/kernel.h>
 #include <zephyr/bluetooth/bluetooth.h>
 #include <zephyr/bluetooth/conn.h>
 #include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/hci.h>
 #include <zephyr/logging/log.h>
 
 #include "gap_advertising.h"
 #include "gap_connection.h"
+#include "log_ratelimit.h"
+#include "trace.h"
 
 
 LOG_MODULE_REGISTER(gap_connection);
+/* One connection logs about a dozen lines from connect to link ready, and
+   parameter updates come in bursts while the profile switches. With
+   several gateways reconnecting after an outage, the rest are dropped. */
+LOG_RATELIMIT_DEFINE(12, 10000);
 
 
 static void on_connected(struct bt_conn *conn, uint8_t err);
@@ -20,7 +28,68 @@ static void on_le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *
 static void on_le_data_len_updated(struct bt_conn *conn, struct bt_conn_le_data_len_info *info);
 
 
-static struct bt_gatt_exchange_params exchange_params;
+/* Link bring-up steps, issued together once the connection is up. */
+#define LINK_STEP_PHY		BIT(0)
+#define LINK_STEP_DLE		BIT(1)
+#define LINK_STEP_MTU		BIT(2)
+#define LINK_STEP_ALL		(LINK_STEP_PHY | LINK_STEP_DLE | LINK_STEP_MTU)
+
+#define LINK_SETUP_TIMEOUT_MS	5000
+
+/* Upper bounds of the time-to-ready histogram buckets, in ms. The last
+ * bucket counts everything slower, including timeouts.
+ */
+static const uint16_t link_ready_bounds_ms[] = { 50, 100, 200, 500, 1000, 2000 };
+
+struct link_setup {
+	struct bt_conn *conn;
+	atomic_t pending;
+	int64_t start_ms;
+	struct k_work start_work;
+	struct k_work_delayable timeout_work;
+	struct bt_gatt_exchange_params exchange_params;
+	bool work_initialized;
+};
+
+static struct link_setup link_setups[CONFIG_BT_MAX_CONN];
+/* Guards link_setup.conn, which the workqueue reads while the RX thread
+ * may be handling the disconnection.
+ */
+static struct k_spinlock link_setup_lock;
+static uint32_t link_ready_hist[ARRAY_SIZE(link_ready_bounds_ms) + 1];
+
+static void conn_param_work_handler(struct k_work *work);
+static void conn_idle_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(conn_param_work, conn_param_work_handler);
+static K_WORK_DELAYABLE_DEFINE(conn_idle_work, conn_idle_work_handler);
+
+static const struct bt_le_conn_param conn_profiles[CONN_PROFILE_COUNT] =
+{
+	[CONN_PROFILE_FAST] = BT_LE_CONN_PARAM_INIT(CONN_FAST_INTERVAL_MIN, CONN_FAST_INTERVAL_MAX,
+						    CONN_FAST_LATENCY, CONN_FAST_TIMEOUT),
+	[CONN_PROFILE_SLOW] = BT_LE_CONN_PARAM_INIT(CONN_SLOW_INTERVAL_MIN, CONN_SLOW_INTERVAL_MAX,
+						    CONN_SLOW_LATENCY, CONN_SLOW_TIMEOUT),
+};
+
+static const uint16_t conn_profile_current_ua[CONN_PROFILE_COUNT] =
+{
+	[CONN_PROFILE_FAST] = CONN_FAST_CURRENT_UA,
+	[CONN_PROFILE_SLOW] = CONN_SLOW_CURRENT_UA,
+};
+
+/* Connection parameter manager state, shared between the Bluetooth RX
+ * thread, the keypad and the system workqueue.
+ */
+static struct k_spinlock conn_param_lock;
+static struct bt_conn *current_conn;
+static enum conn_profile target_profile = CONN_PROFILE_SLOW;
+static enum conn_profile requested_profile = CONN_PROFILE_SLOW;
+static enum conn_profile active_profile = CONN_PROFILE_SLOW;
+static int64_t profile_since_ms;
+static int64_t last_update_ms = -CONN_UPDATE_MIN_GAP_MS;
+static uint64_t profile_time_ms[CONN_PROFILE_COUNT];
+static uint32_t update_count;
                                 
 struct bt_conn_cb connection_callbacks = 
 {
@@ -33,6 +102,156 @@ struct bt_conn_cb connection_callbacks =
 };
 
 
+static enum conn_profile profile_from_interval(uint16_t interval)
+{
+	return interval <= CONN_FAST_INTERVAL_MAX ? CONN_PROFILE_FAST : CONN_PROFILE_SLOW;
+}
+
+/* Called with conn_param_lock held. */
+static void profile_account(int64_t now)
+{
+	if (current_conn != NULL)
+	{
+		profile_time_ms[active_profile] += now - profile_since_ms;
+	}
+	profile_since_ms = now;
+}
+
+/* Called with conn_param_lock held. Schedules the update no earlier than
+ * CONN_UPDATE_MIN_GAP_MS after the previous one.
+ */
+static void profile_request(enum conn_profile profile)
+{
+	int64_t delay = last_update_ms + CONN_UPDATE_MIN_GAP_MS - k_uptime_get();
+
+	target_profile = profile;
+	if (target_profile == requested_profile)
+	{
+		return;
+	}
+
+	/* An already pending update keeps its earlier deadline. */
+	k_work_schedule(&conn_param_work, K_MSEC(MAX(delay, 0)));
+}
+
+static void conn_param_work_handler(struct k_work *work)
+{
+	struct bt_conn *conn = NULL;
+	enum conn_profile profile;
+	int err;
+	k_spinlock_key_t key = k_spin_lock(&conn_param_lock);
+
+	profile = target_profile;
+	if (current_conn != NULL && profile != requested_profile)
+	{
+		conn = bt_conn_ref(current_conn);
+		requested_profile = profile;
+		last_update_ms = k_uptime_get();
+		update_count++;
+	}
+
+	k_spin_unlock(&conn_param_lock, key);
+
+	if (conn == NULL)
+	{
+		return;
+	}
+
+	err = bt_conn_le_param_update(conn, &conn_profiles[profile]);
+	if (err)
+	{
+		LOG_WRN("Connection parameter update failed (err %d)", err);
+	}
+
+	bt_conn_unref(conn);
+}
+
+static void conn_idle_work_handler(struct k_work *work)
+{
+	k_spinlock_key_t key = k_spin_lock(&conn_param_lock);
+
+	profile_request(CONN_PROFILE_SLOW);
+
+	k_spin_unlock(&conn_param_lock, key);
+}
+
+void conn_param_activity(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&conn_param_lock);
+
+	if (current_conn != NULL)
+	{
+		profile_request(CONN_PROFILE_FAST);
+		k_work_reschedule(&conn_idle_work, K_MSEC(CONN_IDLE_TIMEOUT_MS));
+	}
+
+	k_spin_unlock(&conn_param_lock, key);
+}
+
+void conn_param_stats_get(struct conn_param_stats *stats)
+{
+	uint64_t total_ms = 0;
+	uint64_t charge = 0;
+	k_spinlock_key_t key = k_spin_lock(&conn_param_lock);
+
+	profile_account(k_uptime_get());
+
+	stats->profile = active_profile;
+	stats->updates = update_count;
+	for (int i = 0; i < CONN_PROFILE_COUNT; i++)
+	{
+		stats->time_ms[i] = (uint32_t)MIN(profile_time_ms[i], UINT32_MAX);
+		stats->current_ua[i] = conn_profile_current_ua[i];
+		total_ms += profile_time_ms[i];
+		charge += profile_time_ms[i] * conn_profile_current_ua[i];
+	}
+
+	k_spin_unlock(&conn_param_lock, key);
+
+	stats->avg_current_ua = total_ms != 0 ? (uint16_t)(charge / total_ms) : 0;
+}
+
+static struct link_setup *link_setup_get(struct bt_conn *conn)
+{
+	return &link_setups[bt_conn_index(conn)];
+}
+
+static void link_ready_record(uint32_t ready_ms)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(link_ready_bounds_ms); i++)
+	{
+		if (ready_ms < link_ready_bounds_ms[i])
+		{
+			break;
+		}
+	}
+	link_ready_hist[i]++;
+
+	LOG_INF_RL("Link ready in %u ms; histogram <50:%u <100:%u <200:%u <500:%u <1000:%u "
+		"<2000:%u more:%u", ready_ms, link_ready_hist[0], link_ready_hist[1],
+		link_ready_hist[2], link_ready_hist[3], link_ready_hist[4],
+		link_ready_hist[5], link_ready_hist[6]);
+}
+
+/* Marks a bring-up step as done; the link is ready once all steps are. */
+static void link_step_done(struct bt_conn *conn, atomic_val_t step)
+{
+	struct link_setup *setup = link_setup_get(conn);
+	atomic_val_t prev;
+
+	prev = atomic_and(&setup->pending, ~step);
+	if ((prev & step) == 0 || (prev & ~step) != 0)
+	{
+		return;
+	}
+
+	(void)k_work_cancel_delayable(&setup->timeout_work);
+	TRACE_END(TRACE_SPAN_LINK);
+	link_ready_record((uint32_t)(k_uptime_get() - setup->start_ms));
+}
+
 void on_le_data_len_updated(struct bt_conn *conn, struct bt_conn_le_data_len_info *info)
 {
     uint16_t tx_len     = info->tx_max_len; 
@@ -40,35 +259,43 @@ void on_le_data_len_updated(struct bt_conn *conn, struct bt_conn_le_data_len_inf
     uint16_t rx_len     = info->rx_max_len;
     uint16_t rx_time    = info->rx_max_time;
 
-    LOG_INF("Data length updated. Length %d/%d bytes, time %d/%d us", tx_len, rx_len, 
+    LOG_INF_RL("Data length updated. Length %d/%d bytes, time %d/%d us", tx_len, rx_len, 
 				tx_time, rx_time);
+
+    link_step_done(conn, LINK_STEP_DLE);
 }
 
 static void exchange_func(struct bt_conn *conn, uint8_t att_err,
 	struct bt_gatt_exchange_params *params)
 {
-	LOG_INF("MTU exchange %s", att_err == 0 ? "successful" : "failed");
+	LOG_INF_RL("MTU exchange %s", att_err == 0 ? "successful" : "failed");
 
 	if (!att_err) 
 	{
 		uint16_t payload_mtu = bt_gatt_get_mtu(conn) - 3;   // 3 bytes used for Attribute headers.
-		LOG_INF("New MTU: %d bytes", payload_mtu);
+		LOG_INF_RL("New MTU: %d bytes", payload_mtu);
 	}
+
+	link_step_done(conn, LINK_STEP_MTU);
 }
 
-static void update_mtu(struct bt_conn *conn)
+static int update_mtu(struct bt_conn *conn)
 {
     int err;
-    exchange_params.func = exchange_func;
+    struct bt_gatt_exchange_params *params = &link_setup_get(conn)->exchange_params;
+
+    params->func = exchange_func;
 
-    err = bt_gatt_exchange_mtu(conn, &exchange_params);
+    err = bt_gatt_exchange_mtu(conn, params);
     if (err) 
 	{
         LOG_ERR("bt_gatt_exchange_mtu failed (err %d)", err);
     }
+
+    return err;
 }
 
-static void update_data_length(struct bt_conn *conn)
+static int update_data_length(struct bt_conn *conn)
 {
     int err;
 
@@ -83,25 +310,29 @@ static void update_data_length(struct bt_conn *conn)
 	{
         LOG_ERR("data_len_update failed (err %d)", err);
     }
+
+    return err;
 }
 
 static void on_le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
 {
     if (param->tx_phy == BT_CONN_LE_TX_POWER_PHY_1M)
 	{
-        LOG_INF("PHY updated. New PHY: 1M");
+        LOG_INF_RL("PHY updated. New PHY: 1M");
     }
     else if (param->tx_phy == BT_CONN_LE_TX_POWER_PHY_2M) 
 	{
-        LOG_INF("PHY updated. New PHY: 2M");
+        LOG_INF_RL("PHY updated. New PHY: 2M");
     }
     else if (param->tx_phy == BT_CONN_LE_TX_POWER_PHY_CODED_S8) 
 	{
-        LOG_INF("PHY updated. New PHY: Long Range");
+        LOG_INF_RL("PHY updated. New PHY: Long Range");
     }
+
+    link_step_done(conn, LINK_STEP_PHY);
 }
 
-static void update_phy(struct bt_conn *conn)
+static int update_phy(struct bt_conn *conn)
 {
     int err;
 
@@ -117,6 +348,126 @@ static void update_phy(struct bt_conn *conn)
 	{
         LOG_ERR("bt_conn_le_phy_update() returned %d", err);
     }
+
+    return err;
+}
+
+/*
+ * PHY, data length and MTU are requested together from the system
+ * workqueue rather than the Bluetooth RX thread. Each completion callback
+ * clears its step; steps that need no procedure, or fail to start, are
+ * cleared right away so they do not hold up the link.
+ */
+static void link_setup_start_handler(struct k_work *work)
+{
+	struct link_setup *setup = CONTAINER_OF(work, struct link_setup, start_work);
+	struct bt_conn *conn = NULL;
+	struct bt_conn_info info;
+	k_spinlock_key_t key = k_spin_lock(&link_setup_lock);
+
+	if (setup->conn != NULL)
+	{
+		conn = bt_conn_ref(setup->conn);
+	}
+
+	k_spin_unlock(&link_setup_lock, key);
+
+	if (conn == NULL)
+	{
+		return;
+	}
+
+	if (bt_conn_get_info(conn, &info) != 0)
+	{
+		bt_conn_unref(conn);
+		return;
+	}
+
+	if (info.le.phy->tx_phy == BT_GAP_LE_PHY_2M && info.le.phy->rx_phy == BT_GAP_LE_PHY_2M)
+	{
+		link_step_done(conn, LINK_STEP_PHY);
+	}
+	else if (update_phy(conn) != 0)
+	{
+		link_step_done(conn, LINK_STEP_PHY);
+	}
+
+	/* The controller only reports data length changes. */
+	if (info.le.data_len->tx_max_len == BT_GAP_DATA_LEN_MAX)
+	{
+		link_step_done(conn, LINK_STEP_DLE);
+	}
+	else if (update_data_length(conn) != 0)
+	{
+		link_step_done(conn, LINK_STEP_DLE);
+	}
+
+	if (update_mtu(conn) != 0)
+	{
+		link_step_done(conn, LINK_STEP_MTU);
+	}
+
+	bt_conn_unref(conn);
+}
+
+static void link_setup_timeout_handler(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct link_setup *setup = CONTAINER_OF(dwork, struct link_setup, timeout_work);
+	atomic_val_t pending = atomic_clear(&setup->pending);
+
+	if (pending == 0)
+	{
+		return;
+	}
+
+	TRACE_END(TRACE_SPAN_LINK);
+	LOG_WRN("Link setup timed out, steps pending 0x%02x", (unsigned int)pending);
+	link_ready_record(LINK_SETUP_TIMEOUT_MS);
+}
+
+static void link_setup_start(struct bt_conn *conn)
+{
+	struct link_setup *setup = link_setup_get(conn);
+	k_spinlock_key_t key = k_spin_lock(&link_setup_lock);
+
+	setup->conn = bt_conn_ref(conn);
+	k_spin_unlock(&link_setup_lock, key);
+
+	TRACE_BEGIN(TRACE_SPAN_LINK);
+	setup->start_ms = k_uptime_get();
+	atomic_set(&setup->pending, LINK_STEP_ALL);
+
+	if (!setup->work_initialized)
+	{
+		k_work_init(&setup->start_work, link_setup_start_handler);
+		k_work_init_delayable(&setup->timeout_work, link_setup_timeout_handler);
+		setup->work_initialized = true;
+	}
+
+	k_work_submit(&setup->start_work);
+	k_work_schedule(&setup->timeout_work, K_MSEC(LINK_SETUP_TIMEOUT_MS));
+}
+
+static void link_setup_stop(struct bt_conn *conn)
+{
+	struct link_setup *setup = link_setup_get(conn);
+	struct bt_conn *old;
+	k_spinlock_key_t key;
+
+	atomic_clear(&setup->pending);
+	(void)k_work_cancel_delayable(&setup->timeout_work);
+	(void)k_work_cancel(&setup->start_work);
+
+	key = k_spin_lock(&link_setup_lock);
+	old = setup->conn;
+	setup->conn = NULL;
+	k_spin_unlock(&link_setup_lock, key);
+
+	if (old != NULL)
+	{
+		bt_conn_unref(old);
+	}
 }
 
 static void on_connected(struct bt_conn *conn, uint8_t err)
@@ -124,6 +475,10 @@ static void on_connected(struct bt_conn *conn, uint8_t err)
 	if (err) 
 	{
 		LOG_INF("Connection failed (err %u)\n", err);
+		if (err == BT_HCI_ERR_ADV_TIMEOUT)
+		{
+			advertising_directed_timeout();
+		}
 		return;
 	}
 
@@ -132,20 +487,46 @@ static void on_connected(struct bt_conn *conn, uint8_t err)
 
 	uint32_t connection_interval_ms = info.le.interval * 1.25;
 	uint16_t supervision_timeout_ms = info.le.timeout * 10;
-	LOG_INF("Connection parameters: interval %d ms, latency %d intervals, timeout %d ms", 	\
+	LOG_INF_RL("Connection parameters: interval %d ms, latency %d intervals, timeout %d ms", 	\
 						connection_interval_ms, info.le.latency, supervision_timeout_ms);
 
-	LOG_INF("Connected");
-	k_sleep(K_MSEC(1000));		/* Wait for connection process to fully complete */
-	update_phy(conn);
-	update_data_length(conn);
-	update_mtu(conn);
+	LOG_INF_RL("Connected");
+	advertising_connected();
+
+	k_spinlock_key_t key = k_spin_lock(&conn_param_lock);
+	current_conn = bt_conn_ref(conn);
+	active_profile = profile_from_interval(info.le.interval);
+	requested_profile = active_profile;
+	profile_since_ms = k_uptime_get();
+	k_spin_unlock(&conn_param_lock, key);
+
+	/* Link setup is the first transaction. */
+	conn_param_activity();
+
+	link_setup_start(conn);
 }
 
 static void on_disconnected(struct bt_conn *conn, uint8_t reason)
 {
-	LOG_INF("Disconnected (reason %u)\n", reason);
-	advetising_start();
+	LOG_INF_RL("Disconnected (reason %u)\n", reason);
+
+	link_setup_stop(conn);
+
+	k_spinlock_key_t key = k_spin_lock(&conn_param_lock);
+	if (current_conn == conn)
+	{
+		profile_account(k_uptime_get());
+		bt_conn_unref(current_conn);
+		current_conn = NULL;
+		target_profile = CONN_PROFILE_SLOW;
+		requested_profile = CONN_PROFILE_SLOW;
+	}
+	k_spin_unlock(&conn_param_lock, key);
+
+	(void)k_work_cancel_delayable(&conn_idle_work);
+	(void)k_work_cancel_delayable(&conn_param_work);
+
+	advertising_link_lost();
 }
 
 static void on_security_changed(struct bt_conn *conn, bt_security_t level,
@@ -157,11 +538,11 @@ static void on_security_changed(struct bt_conn *conn, bt_security_t level,
 
     if (!err) 
     {
-        LOG_INF("Security changed: %s level %u\n", addr, level);
+        LOG_INF_RL("Security changed: %s level %u\n", addr, level);
     } 
     else 
     {
-        LOG_INF("Security failed: %s level %u err %d\n", addr, level, err);
+        LOG_INF_RL("Security failed: %s level %u err %d\n", addr, level, err);
     }
 }
 
@@ -169,6 +550,14 @@ static void on_le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_
 {
     uint32_t connection_interval_ms = interval * 1.25;         
     uint16_t supervision_timeout_ms = timeout * 10;          
-    LOG_INF("Connection parameters updated: interval %d ms, latency %d intervals, timeout %d ms", 
+    LOG_INF_RL("Connection parameters updated: interval %d ms, latency %d intervals, timeout %d ms", 
 				connection_interval_ms, latency, supervision_timeout_ms);
+
+    k_spinlock_key_t key = k_spin_lock(&conn_param_lock);
+    if (conn == current_conn)
+    {
+        profile_account(k_uptime_get());
+        active_profile = profile_from_interval(interval);
+    }
+    k_spin_unlock(&conn_param_lock, key);
 }
\ No newline at end of file
@@ -6,4 +6,52 @@
 
 extern struct bt_conn_cb connection_callbacks;
 
+/* Connection parameter profiles, in 1.25 ms interval and 10 ms timeout units.
+ * The fast profile keeps ATT round trips short while a command or PIN
+ * transaction is running, the slow one saves power while idle.
+ */
+#define CONN_FAST_INTERVAL_MIN		6	/* 7.5 ms */
+#define CONN_FAST_INTERVAL_MAX		12	/* 15 ms */
+#define CONN_FAST_LATENCY		0
+#define CONN_FAST_TIMEOUT		400	/* 4 s */
+
+#define CONN_SLOW_INTERVAL_MIN		800	/* 1 s */
+#define CONN_SLOW_INTERVAL_MAX		800
+#define CONN_SLOW_LATENCY		2
+#define CONN_SLOW_TIMEOUT		700	/* 7 s */
+
+/* Time without activity before dropping back to the slow profile. */
+#define CONN_IDLE_TIMEOUT_MS		5000
+/* Minimum time between two parameter update requests. */
+#define CONN_UPDATE_MIN_GAP_MS		1000
+
+/* Estimated average current of an nRF52840 in each profile, idle link. */
+#define CONN_FAST_CURRENT_UA		350
+#define CONN_SLOW_CURRENT_UA		6
+
+enum conn_profile {
+	CONN_PROFILE_FAST,
+	CONN_PROFILE_SLOW,
+
+	CONN_PROFILE_COUNT
+};
+
+struct conn_param_stats {
+	uint8_t profile;
+	uint32_t time_ms[CONN_PROFILE_COUNT];
+	uint16_t current_ua[CONN_PROFILE_COUNT];
+	/* Time-weighted average over all connected time. */
+	uint16_t avg_current_ua;
+	uint32_t updates;
+} __packed;
+
+/** @brief Mark the start of a command or PIN transaction.
+ *
+ * Switches the connection to the fast profile and restarts the idle timer.
+ * Safe to call from any thread; does nothing without a connection.
+ */
+void conn_param_activity(void);
+
+void conn_param_stats_get(struct conn_param_stats *stats);
+
 #endif /* GAP_CONNECTION_H*/
\ No newline at end of file
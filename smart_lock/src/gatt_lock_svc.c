@@ -23,12 +23,62 @@
 #include <zephyr/bluetooth/gatt.h>
 
 #include "gatt_lock_svc.h"
+#include "wall_clock.h"
+#include "actuator.h"
+#include "gap_connection.h"
+#include "audit_log.h"
+#include "adv_status.h"
+#include "credentials.h"
+#include "pin_entry.h"
+#include "residency.h"
+#include "log_ratelimit.h"
+#include "trace.h"
 
 #include <zephyr/logging/log.h>
 
 LOG_MODULE_DECLARE(smart_door_lock);
+/* A flooding client would otherwise log once per dropped command. */
+LOG_RATELIMIT_DEFINE(4, 1000);
 
-static bool button_state;
+static uint8_t lock_state;
+static bool notify_enabled;
+static bool indicate_enabled;
+static bool indicating;
+/* Value carried by the indication in flight. */
+static uint8_t indicated_state;
+static struct bt_gatt_indicate_params ind_params;
+
+static void state_resend_work_handler(struct k_work *work);
+
+static K_WORK_DEFINE(state_resend_work, state_resend_work_handler);
+
+/* Starts a lock or unlock requested by the gateway.
+ *
+ * @retval 0 on success, -EBUSY if the bolt is still moving.
+ */
+static int gateway_lock_request(bool unlock)
+{
+	int err;
+
+	TRACE_BEGIN(TRACE_SPAN_GATT_CMD);
+	conn_param_activity();
+
+	/* The bolt moves in the background; the final state is
+	 * notified once the position sensors confirm it.
+	 */
+	err = actuator_request(unlock ? ACTUATOR_UNLOCKED : ACTUATOR_LOCKED);
+	TRACE_END(TRACE_SPAN_GATT_CMD);
+
+	if (err == -EBUSY) {
+		audit_log_add(AUDIT_SRC_GATEWAY, AUDIT_USER_NONE,
+			      AUDIT_RESULT_BUSY);
+		return -EBUSY;
+	}
+	audit_log_add(AUDIT_SRC_GATEWAY, AUDIT_USER_NONE,
+		      unlock ? AUDIT_RESULT_UNLOCKED : AUDIT_RESULT_LOCKED);
+
+	return 0;
+}
 
 static ssize_t write_led(struct bt_conn *conn,
 			 const struct bt_gatt_attr *attr,
@@ -52,8 +102,9 @@ static ssize_t write_led(struct bt_conn *conn,
 	uint8_t val = *((uint8_t *)buf);
 
 	if (val == 0x00 || val == 0x01) {
-		//Call the application callback function to update the LED state
-		//lbs_cb.led_cb(val ? true : false);
+		if (gateway_lock_request(val == 0x01) == -EBUSY) {
+			return BT_GATT_ERR(BT_ATT_ERR_PROCEDURE_IN_PROGRESS);
+		}
 	} else {
 		LOG_DBG("Write led: Incorrect value");
 		return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
@@ -81,16 +132,592 @@ static ssize_t read_button(struct bt_conn *conn,
 	
 }
 
+static ssize_t write_time(struct bt_conn *conn,
+			  const struct bt_gatt_attr *attr,
+			  const void *buf,
+			  uint16_t len, uint16_t offset, uint8_t flags)
+{
+	if (len != sizeof(uint32_t)) {
+		LOG_DBG("Write time: Incorrect data length");
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+	}
+
+	if (offset != 0) {
+		LOG_DBG("Write time: Incorrect data offset");
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+	}
+
+	/* Unix time in seconds, little endian. */
+	wall_clock_set(sys_get_le32(buf));
+
+	return len;
+}
+
+static ssize_t read_actuator_stats(struct bt_conn *conn,
+				   const struct bt_gatt_attr *attr,
+				   void *buf,
+				   uint16_t len,
+				   uint16_t offset)
+{
+	struct actuator_stats stats;
+
+	actuator_stats_get(&stats);
+
+	/* Fields are little endian on the nRF52 already. */
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, &stats,
+				 sizeof(stats));
+}
+
+static ssize_t read_conn_stats(struct bt_conn *conn,
+			       const struct bt_gatt_attr *attr,
+			       void *buf,
+			       uint16_t len,
+			       uint16_t offset)
+{
+	struct conn_param_stats stats;
+
+	conn_param_stats_get(&stats);
+
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, &stats,
+				 sizeof(stats));
+}
+
+/* Idle residency, struct residency_stats. */
+static ssize_t read_residency(struct bt_conn *conn,
+			      const struct bt_gatt_attr *attr,
+			      void *buf,
+			      uint16_t len,
+			      uint16_t offset)
+{
+	struct residency_stats stats;
+
+	residency_get(&stats);
+
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, &stats,
+				 sizeof(stats));
+}
+
+/* Key for the status tag in the advertising data; encrypted links only. */
+static ssize_t read_status_key(struct bt_conn *conn,
+			       const struct bt_gatt_attr *attr,
+			       void *buf,
+			       uint16_t len,
+			       uint16_t offset)
+{
+	uint8_t key[ADV_STATUS_KEY_LEN];
+
+	adv_status_key_get(key);
+
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, key, sizeof(key));
+}
+
+static void lock_state_ccc_cfg_changed(const struct bt_gatt_attr *attr,
+				       uint16_t value)
+{
+	notify_enabled = (value & BT_GATT_CCC_NOTIFY) != 0;
+	indicate_enabled = (value & BT_GATT_CCC_INDICATE) != 0;
+
+	LOG_DBG("Lock state notify %s, indicate %s",
+		notify_enabled ? "on" : "off", indicate_enabled ? "on" : "off");
+}
+
+static void lock_state_indicate_cb(struct bt_conn *conn,
+				   struct bt_gatt_indicate_params *params,
+				   uint8_t err)
+{
+	LOG_DBG("Lock state indication %s", err != 0U ? "fail" : "success");
+	indicating = false;
+
+	/* Changes made while it was in flight were held back. */
+	if (lock_state != indicated_state) {
+		k_work_submit(&state_resend_work);
+	}
+}
+
+static void state_resend_work_handler(struct k_work *work)
+{
+	(void)lock_svc_state_update(lock_state);
+}
+
+static ssize_t write_audit_ctrl(struct bt_conn *conn,
+				const struct bt_gatt_attr *attr,
+				const void *buf,
+				uint16_t len, uint16_t offset, uint8_t flags);
+static void audit_ccc_cfg_changed(const struct bt_gatt_attr *attr,
+				  uint16_t value);
+static ssize_t write_cmd(struct bt_conn *conn,
+			 const struct bt_gatt_attr *attr,
+			 const void *buf,
+			 uint16_t len, uint16_t offset, uint8_t flags);
+static void cmd_ccc_cfg_changed(const struct bt_gatt_attr *attr,
+				uint16_t value);
+
 /* Lock Service Declaration */
 BT_GATT_SERVICE_DEFINE(
 	lock_svc, BT_GATT_PRIMARY_SERVICE(BT_UUID_LOCK),
 	BT_GATT_CHARACTERISTIC(BT_UUID_LOCK_PIN,
 			       BT_GATT_CHRC_WRITE,
-			       BT_GATT_PERM_READ_ENCRYPT ,
+			       BT_GATT_PERM_WRITE_ENCRYPT,
 			       NULL, write_led, NULL),
 	BT_GATT_CHARACTERISTIC(BT_UUID_LOCK_STATE,
-			       BT_GATT_CHRC_READ,
+			       BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY |
+			       BT_GATT_CHRC_INDICATE,
 			       BT_GATT_PERM_READ_ENCRYPT , read_button, NULL,
-			       &button_state),
+			       &lock_state),
+	BT_GATT_CCC(lock_state_ccc_cfg_changed,
+		    BT_GATT_PERM_READ | BT_GATT_PERM_WRITE_ENCRYPT),
+	BT_GATT_CHARACTERISTIC(BT_UUID_LOCK_TIME,
+			       BT_GATT_CHRC_WRITE,
+			       BT_GATT_PERM_WRITE_ENCRYPT,
+			       NULL, write_time, NULL),
+	BT_GATT_CHARACTERISTIC(BT_UUID_LOCK_ACTUATOR_STATS,
+			       BT_GATT_CHRC_READ,
+			       BT_GATT_PERM_READ_ENCRYPT,
+			       read_actuator_stats, NULL, NULL),
+	BT_GATT_CHARACTERISTIC(BT_UUID_LOCK_CONN_STATS,
+			       BT_GATT_CHRC_READ,
+			       BT_GATT_PERM_READ_ENCRYPT,
+			       read_conn_stats, NULL, NULL),
+	BT_GATT_CHARACTERISTIC(BT_UUID_LOCK_AUDIT,
+			       BT_GATT_CHRC_WRITE | BT_GATT_CHRC_NOTIFY,
+			       BT_GATT_PERM_WRITE_ENCRYPT,
+			       NULL, write_audit_ctrl, NULL),
+	BT_GATT_CCC(audit_ccc_cfg_changed,
+		    BT_GATT_PERM_READ | BT_GATT_PERM_WRITE_ENCRYPT),
+	BT_GATT_CHARACTERISTIC(BT_UUID_LOCK_STATUS_KEY,
+			       BT_GATT_CHRC_READ,
+			       BT_GATT_PERM_READ_ENCRYPT,
+			       read_status_key, NULL, NULL),
+	BT_GATT_CHARACTERISTIC(BT_UUID_LOCK_CMD,
+			       BT_GATT_CHRC_WRITE | BT_GATT_CHRC_WRITE_WITHOUT_RESP |
+			       BT_GATT_CHRC_NOTIFY,
+			       BT_GATT_PERM_WRITE_ENCRYPT,
+			       NULL, write_cmd, NULL),
+	BT_GATT_CCC(cmd_ccc_cfg_changed,
+		    BT_GATT_PERM_READ | BT_GATT_PERM_WRITE_ENCRYPT),
+	BT_GATT_CHARACTERISTIC(BT_UUID_LOCK_RESIDENCY,
+			       BT_GATT_CHRC_READ,
+			       BT_GATT_PERM_READ_ENCRYPT,
+			       read_residency, NULL, NULL),
 
 );
+
+/* Index of the lock state value attribute inside lock_svc. */
+#define LOCK_STATE_ATTR_IDX 4
+/* Index of the audit log value attribute inside lock_svc. */
+#define LOCK_AUDIT_ATTR_IDX 13
+/* Index of the command value attribute inside lock_svc. */
+#define LOCK_CMD_ATTR_IDX 18
+
+int lock_svc_state_update(uint8_t state)
+{
+	const struct bt_gatt_attr *attr = &lock_svc.attrs[LOCK_STATE_ATTR_IDX];
+	int err;
+
+	lock_state = state;
+	adv_status_set_state(state);
+
+	if (indicate_enabled) {
+		if (indicating) {
+			/* Sent once the pending indication is confirmed. */
+			return 0;
+		}
+
+		indicating = true;
+		indicated_state = state;
+		ind_params.attr = attr;
+		ind_params.func = lock_state_indicate_cb;
+		ind_params.destroy = NULL;
+		ind_params.data = &indicated_state;
+		ind_params.len = sizeof(indicated_state);
+		err = bt_gatt_indicate(NULL, &ind_params);
+		if (err) {
+			indicating = false;
+		}
+		return err;
+	}
+
+	if (notify_enabled) {
+		return bt_gatt_notify(NULL, attr, &lock_state, sizeof(lock_state));
+	}
+
+	return 0;
+}
+
+/*
+ * Audit log download. Each notification carries [u32 first_seq][records],
+ * filled up to the negotiated MTU. A notification with no records marks
+ * the end; its first_seq is where the next download should start.
+ * Several notifications are kept in flight so the link packs multiple
+ * packets per connection event.
+ */
+#define AUDIT_TX_WINDOW		4
+#define AUDIT_TX_HDR_LEN	sizeof(uint32_t)
+#define AUDIT_TX_MAX_RECORDS	((CONFIG_BT_L2CAP_TX_MTU - 3 - AUDIT_TX_HDR_LEN) / \
+				 sizeof(struct audit_record))
+#define AUDIT_TX_RETRY_MS	10
+
+static void audit_tx_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(audit_tx_work, audit_tx_work_handler);
+static struct bt_conn *audit_conn;
+static uint32_t audit_next_seq;
+static bool audit_notify_enabled;
+static atomic_t audit_in_flight;
+
+static void audit_tx_stop(void)
+{
+	if (audit_conn != NULL) {
+		bt_conn_unref(audit_conn);
+		audit_conn = NULL;
+	}
+}
+
+static void audit_sent_cb(struct bt_conn *conn, void *user_data)
+{
+	atomic_dec(&audit_in_flight);
+	k_work_reschedule(&audit_tx_work, K_NO_WAIT);
+}
+
+/* Runs on the system workqueue, which owns the download state. */
+static void audit_tx_work_handler(struct k_work *work)
+{
+	const struct bt_gatt_attr *attr = &lock_svc.attrs[LOCK_AUDIT_ATTR_IDX];
+	uint8_t buf[AUDIT_TX_HDR_LEN + AUDIT_TX_MAX_RECORDS * sizeof(struct audit_record)];
+	struct bt_gatt_notify_params params = {
+		.attr = attr,
+		.data = buf,
+		.func = audit_sent_cb,
+	};
+	uint32_t first_seq;
+	size_t max;
+	int n;
+	int err;
+
+	while (audit_conn != NULL && atomic_get(&audit_in_flight) < AUDIT_TX_WINDOW) {
+		max = (bt_gatt_get_mtu(audit_conn) - 3 - AUDIT_TX_HDR_LEN) /
+		      sizeof(struct audit_record);
+		max = MIN(max, AUDIT_TX_MAX_RECORDS);
+
+		n = audit_log_read(audit_next_seq,
+				   (struct audit_record *)&buf[AUDIT_TX_HDR_LEN],
+				   max, &first_seq);
+		if (n < 0) {
+			LOG_WRN("Audit log read failed (err %d)", n);
+			audit_tx_stop();
+			return;
+		}
+
+		sys_put_le32(first_seq, buf);
+		params.len = AUDIT_TX_HDR_LEN + n * sizeof(struct audit_record);
+
+		atomic_inc(&audit_in_flight);
+		err = bt_gatt_notify_cb(audit_conn, &params);
+		if (err == -ENOMEM) {
+			/* Out of buffers: retry once one has been sent. */
+			atomic_dec(&audit_in_flight);
+			k_work_reschedule(&audit_tx_work, K_MSEC(AUDIT_TX_RETRY_MS));
+			return;
+		}
+		if (err) {
+			atomic_dec(&audit_in_flight);
+			LOG_WRN("Audit download aborted (err %d)", err);
+			audit_tx_stop();
+			return;
+		}
+
+		if (n == 0) {
+			LOG_INF("Audit download complete at seq %u", first_seq);
+			audit_tx_stop();
+			return;
+		}
+
+		audit_next_seq = first_seq + n;
+	}
+}
+
+/* Control writes arrive on the Bluetooth RX thread and are handed over to
+ * the workqueue through these.
+ */
+static struct k_spinlock audit_ctrl_lock;
+static struct bt_conn *audit_ctrl_conn;
+static uint32_t audit_ctrl_seq;
+
+static void audit_ctrl_work_handler(struct k_work *work)
+{
+	struct bt_conn *conn;
+	uint32_t seq;
+	k_spinlock_key_t key = k_spin_lock(&audit_ctrl_lock);
+
+	conn = audit_ctrl_conn;
+	seq = audit_ctrl_seq;
+	audit_ctrl_conn = NULL;
+
+	k_spin_unlock(&audit_ctrl_lock, key);
+
+	audit_tx_stop();
+	if (conn == NULL) {
+		return;
+	}
+
+	/* Buffered records are included in the download. */
+	(void)audit_log_flush();
+
+	audit_conn = conn;
+	audit_next_seq = seq;
+	k_work_reschedule(&audit_tx_work, K_NO_WAIT);
+}
+
+static K_WORK_DEFINE(audit_ctrl_work, audit_ctrl_work_handler);
+
+static ssize_t write_audit_ctrl(struct bt_conn *conn,
+				const struct bt_gatt_attr *attr,
+				const void *buf,
+				uint16_t len, uint16_t offset, uint8_t flags)
+{
+	const uint8_t *data = buf;
+	struct bt_conn *start_conn = NULL;
+	struct bt_conn *prev;
+	k_spinlock_key_t key;
+
+	if (offset != 0) {
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+	}
+
+	if (len == 1U && data[0] == LOCK_AUDIT_OP_ABORT) {
+		/* Handled below with no connection to start. */
+	} else if (len == 1U + sizeof(uint32_t) && data[0] == LOCK_AUDIT_OP_START) {
+		if (!audit_notify_enabled) {
+			return BT_GATT_ERR(BT_ATT_ERR_CCC_IMPROPER_CONF);
+		}
+		start_conn = bt_conn_ref(conn);
+		conn_param_activity();
+	} else {
+		return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+	}
+
+	key = k_spin_lock(&audit_ctrl_lock);
+	prev = audit_ctrl_conn;
+	audit_ctrl_conn = start_conn;
+	if (start_conn != NULL) {
+		audit_ctrl_seq = sys_get_le32(&data[1]);
+	}
+	k_spin_unlock(&audit_ctrl_lock, key);
+
+	if (prev != NULL) {
+		bt_conn_unref(prev);
+	}
+
+	k_work_submit(&audit_ctrl_work);
+
+	return len;
+}
+
+static void audit_ccc_cfg_changed(const struct bt_gatt_attr *attr,
+				  uint16_t value)
+{
+	audit_notify_enabled = (value & BT_GATT_CCC_NOTIFY) != 0;
+}
+
+/*
+ * Command characteristic. Frames written without response arrive on the
+ * Bluetooth RX thread and are queued for the system workqueue, which runs
+ * them in order and acknowledges everything it drained in one
+ * notification per connection, instead of one ATT round trip per command.
+ */
+#define LOCK_CMD_QUEUE_LEN	16
+/* [seq][opcode] and the largest payload, PIN_ADD with a window. */
+#define LOCK_CMD_FRAME_MAX	13
+#define LOCK_CMD_ACK_LEN	2
+#define LOCK_CMD_RETRY_MS	10
+
+struct lock_cmd_frame {
+	struct bt_conn *conn;
+	uint8_t len;
+	uint8_t data[LOCK_CMD_FRAME_MAX];
+};
+
+static void lock_cmd_work_handler(struct k_work *work);
+
+K_MSGQ_DEFINE(lock_cmd_queue, sizeof(struct lock_cmd_frame), LOCK_CMD_QUEUE_LEN, 4);
+static K_WORK_DELAYABLE_DEFINE(lock_cmd_work, lock_cmd_work_handler);
+static bool cmd_notify_enabled;
+
+/* Pending acknowledgements, owned by the system workqueue. */
+static struct bt_conn *ack_conn;
+static uint8_t ack_buf[LOCK_CMD_QUEUE_LEN * LOCK_CMD_ACK_LEN];
+static size_t ack_len;
+
+static uint8_t lock_cmd_status(int err)
+{
+	switch (err) {
+	case 0:
+		return LOCK_CMD_STATUS_OK;
+	case -EBUSY:
+		return LOCK_CMD_STATUS_BUSY;
+	case -EINVAL:
+		return LOCK_CMD_STATUS_INVALID;
+	case -ENOSPC:
+		return LOCK_CMD_STATUS_NO_SPACE;
+	case -EEXIST:
+		return LOCK_CMD_STATUS_EXISTS;
+	case -ENOENT:
+		return LOCK_CMD_STATUS_NOT_FOUND;
+	default:
+		return LOCK_CMD_STATUS_FAILED;
+	}
+}
+
+static int lock_cmd_run(const uint8_t *data, uint8_t len)
+{
+	struct cred_window window;
+	uint8_t digits;
+
+	switch (data[1]) {
+	case LOCK_CMD_OP_LOCK:
+	case LOCK_CMD_OP_UNLOCK:
+		if (len != 2U) {
+			return -EINVAL;
+		}
+		return gateway_lock_request(data[1] == LOCK_CMD_OP_UNLOCK);
+	case LOCK_CMD_OP_PIN_ADD:
+		if (len != 9U && len != 13U) {
+			return -EINVAL;
+		}
+		digits = data[8];
+		if (digits == 0U || digits > PIN_ENTRY_MAX_DIGITS) {
+			return -EINVAL;
+		}
+		if (len == 13U) {
+			window.start = sys_get_le16(&data[9]);
+			window.end = sys_get_le16(&data[11]);
+			if (window.start >= 24 * 60 || window.end >= 24 * 60) {
+				return -EINVAL;
+			}
+		}
+		return credentials_add(sys_get_le16(&data[2]), sys_get_le32(&data[4]),
+				       digits, len == 13U ? &window : NULL);
+	case LOCK_CMD_OP_PIN_REMOVE:
+		if (len != 4U) {
+			return -EINVAL;
+		}
+		return credentials_remove(sys_get_le16(&data[2]));
+	default:
+		return -EINVAL;
+	}
+}
+
+/* Sends the pending acknowledgements.
+ *
+ * @retval -ENOMEM if out of buffers; they are kept for a retry.
+ */
+static int lock_cmd_ack_flush(void)
+{
+	int err;
+
+	if (ack_len > 0 && cmd_notify_enabled) {
+		err = bt_gatt_notify(ack_conn, &lock_svc.attrs[LOCK_CMD_ATTR_IDX],
+				     ack_buf, ack_len);
+		if (err == -ENOMEM) {
+			return err;
+		}
+		if (err) {
+			/* The client times the commands out. */
+			LOG_WRN_RL("Command acks dropped (err %d)", err);
+		}
+	}
+
+	ack_len = 0;
+	if (ack_conn != NULL) {
+		bt_conn_unref(ack_conn);
+		ack_conn = NULL;
+	}
+
+	return 0;
+}
+
+static void lock_cmd_work_handler(struct k_work *work)
+{
+	struct lock_cmd_frame frame;
+	size_t ack_max;
+	int err;
+
+	while (k_msgq_peek(&lock_cmd_queue, &frame) == 0) {
+		if (ack_conn != NULL) {
+			ack_max = (bt_gatt_get_mtu(ack_conn) - 3) / LOCK_CMD_ACK_LEN *
+				  LOCK_CMD_ACK_LEN;
+			ack_max = MIN(ack_max, sizeof(ack_buf));
+
+			if (frame.conn != ack_conn || ack_len + LOCK_CMD_ACK_LEN > ack_max) {
+				if (lock_cmd_ack_flush() == -ENOMEM) {
+					k_work_reschedule(&lock_cmd_work,
+							  K_MSEC(LOCK_CMD_RETRY_MS));
+					return;
+				}
+			}
+		}
+
+		(void)k_msgq_get(&lock_cmd_queue, &frame, K_NO_WAIT);
+
+		err = lock_cmd_run(frame.data, frame.len);
+		LOG_DBG("Command %u opcode 0x%02x: %d", frame.data[0], frame.data[1], err);
+
+		/* The queued reference moves to the ack buffer. */
+		if (ack_conn == NULL) {
+			ack_conn = frame.conn;
+		} else {
+			bt_conn_unref(frame.conn);
+		}
+		ack_buf[ack_len++] = frame.data[0];
+		ack_buf[ack_len++] = lock_cmd_status(err);
+	}
+
+	if (lock_cmd_ack_flush() == -ENOMEM) {
+		k_work_reschedule(&lock_cmd_work, K_MSEC(LOCK_CMD_RETRY_MS));
+	}
+}
+
+static ssize_t write_cmd(struct bt_conn *conn,
+			 const struct bt_gatt_attr *attr,
+			 const void *buf,
+			 uint16_t len, uint16_t offset, uint8_t flags)
+{
+	struct lock_cmd_frame frame;
+
+	if (offset != 0) {
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+	}
+
+	if (len < 2U || len > sizeof(frame.data)) {
+		return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+	}
+
+	if (!cmd_notify_enabled) {
+		return BT_GATT_ERR(BT_ATT_ERR_CCC_IMPROPER_CONF);
+	}
+
+	frame.conn = bt_conn_ref(conn);
+	frame.len = len;
+	memcpy(frame.data, buf, len);
+
+	if (k_msgq_put(&lock_cmd_queue, &frame, K_NO_WAIT) != 0) {
+		/* The client keeps fewer commands in flight than the queue
+		 * holds, so this is a misbehaving client; without a response
+		 * it finds out by timing the command out.
+		 */
+		bt_conn_unref(frame.conn);
+		LOG_WRN_RL("Command queue full, seq %u dropped", frame.data[0]);
+		return BT_GATT_ERR(BT_ATT_ERR_INSUFFICIENT_RESOURCES);
+	}
+
+	conn_param_activity();
+	k_work_schedule(&lock_cmd_work, K_NO_WAIT);
+
+	return len;
+}
+
+static void cmd_ccc_cfg_changed(const struct bt_gatt_attr *attr,
+				uint16_t value)
+{
+	cmd_notify_enabled = (value & BT_GATT_CCC_NOTIFY) != 0;
+}
@@ -30,9 +30,69 @@ extern "C" {
 #define BT_UUID_LOCK_STATE_VAL \
 	BT_UUID_128_ENCODE(0x1c376f02, 0x468f, 0xEFDE, 0x8652, 0x4183255a1de3)
 
+#define BT_UUID_LOCK_TIME_VAL \
+	BT_UUID_128_ENCODE(0x1c376f03, 0x468f, 0xEFDE, 0x8652, 0x4183255a1de3)
+
+#define BT_UUID_LOCK_ACTUATOR_STATS_VAL \
+	BT_UUID_128_ENCODE(0x1c376f04, 0x468f, 0xEFDE, 0x8652, 0x4183255a1de3)
+
+#define BT_UUID_LOCK_CONN_STATS_VAL \
+	BT_UUID_128_ENCODE(0x1c376f05, 0x468f, 0xEFDE, 0x8652, 0x4183255a1de3)
+
+#define BT_UUID_LOCK_AUDIT_VAL \
+	BT_UUID_128_ENCODE(0x1c376f06, 0x468f, 0xEFDE, 0x8652, 0x4183255a1de3)
+
+#define BT_UUID_LOCK_STATUS_KEY_VAL \
+	BT_UUID_128_ENCODE(0x1c376f07, 0x468f, 0xEFDE, 0x8652, 0x4183255a1de3)
+
+#define BT_UUID_LOCK_CMD_VAL \
+	BT_UUID_128_ENCODE(0x1c376f08, 0x468f, 0xEFDE, 0x8652, 0x4183255a1de3)
+
+#define BT_UUID_LOCK_RESIDENCY_VAL \
+	BT_UUID_128_ENCODE(0x1c376f09, 0x468f, 0xEFDE, 0x8652, 0x4183255a1de3)
+
 #define BT_UUID_LOCK           BT_UUID_DECLARE_128(BT_UUID_LOCK_VAL)
 #define BT_UUID_LOCK_PIN    BT_UUID_DECLARE_128(BT_UUID_LOCK_PIN_VAL)
 #define BT_UUID_LOCK_STATE       BT_UUID_DECLARE_128(BT_UUID_LOCK_STATE_VAL)
+#define BT_UUID_LOCK_TIME        BT_UUID_DECLARE_128(BT_UUID_LOCK_TIME_VAL)
+#define BT_UUID_LOCK_ACTUATOR_STATS \
+	BT_UUID_DECLARE_128(BT_UUID_LOCK_ACTUATOR_STATS_VAL)
+#define BT_UUID_LOCK_CONN_STATS  BT_UUID_DECLARE_128(BT_UUID_LOCK_CONN_STATS_VAL)
+#define BT_UUID_LOCK_AUDIT       BT_UUID_DECLARE_128(BT_UUID_LOCK_AUDIT_VAL)
+#define BT_UUID_LOCK_STATUS_KEY  BT_UUID_DECLARE_128(BT_UUID_LOCK_STATUS_KEY_VAL)
+#define BT_UUID_LOCK_CMD         BT_UUID_DECLARE_128(BT_UUID_LOCK_CMD_VAL)
+#define BT_UUID_LOCK_RESIDENCY   BT_UUID_DECLARE_128(BT_UUID_LOCK_RESIDENCY_VAL)
+
+/* Audit log download control opcodes, written to the audit characteristic
+ * as [opcode][u32 first sequence number, little endian].
+ */
+#define LOCK_AUDIT_OP_START	0x01
+#define LOCK_AUDIT_OP_ABORT	0x02
+
+/* Command characteristic, written without response as
+ * [u8 seq][u8 opcode][payload], all fields little endian:
+ *
+ *   LOCK, UNLOCK   no payload
+ *   PIN_ADD        [u16 user][u32 pin][u8 digits], optionally followed by
+ *                  a time window [u16 start][u16 end] in UTC minutes
+ *   PIN_REMOVE     [u16 user]
+ *
+ * Every frame is acknowledged by a notification of one or more
+ * [u8 seq][u8 status] pairs, so a client can keep several commands in
+ * flight and match the results by sequence number.
+ */
+#define LOCK_CMD_OP_LOCK	0x01
+#define LOCK_CMD_OP_UNLOCK	0x02
+#define LOCK_CMD_OP_PIN_ADD	0x10
+#define LOCK_CMD_OP_PIN_REMOVE	0x11
+
+#define LOCK_CMD_STATUS_OK		0x00
+#define LOCK_CMD_STATUS_BUSY		0x01
+#define LOCK_CMD_STATUS_INVALID		0x02
+#define LOCK_CMD_STATUS_NO_SPACE	0x03
+#define LOCK_CMD_STATUS_EXISTS		0x04
+#define LOCK_CMD_STATUS_NOT_FOUND	0x05
+#define LOCK_CMD_STATUS_FAILED		0xFF
 
 /** @brief Callback type for when an LED state change is received. */
 typedef void (*led_cb_t)(const bool led_state);
@@ -63,6 +123,21 @@ struct my_lbs_cb {
  */
 int my_lbs_init(struct my_lbs_cb *callbacks);
 
+/** @brief Update the lock state and push it to the subscribed client.
+ *
+ * The new value is stored so that later reads return it. If the client
+ * enabled indications on the lock state CCCD, the value is indicated,
+ * otherwise it is notified when notifications are enabled. A change made
+ * while an indication is in flight is indicated once that one has been
+ * confirmed, so the client always ends up with the latest state.
+ *
+ * @param[in] state New lock state value.
+ *
+ * @retval 0 If the operation was successful.
+ *           Otherwise, a (negative) error code is returned.
+ */
+int lock_svc_state_update(uint8_t state);
+
 #ifdef __cplusplus
 }
 #endif
@@ -14,11 +14,13 @@
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(MODULE, 3);
 
+#include "pin_entry.h"
+#include "gap_connection.h"
+#include "gap_advertising.h"
+
 #define MAX_ROW	4
 #define MAX_COLUMN	3
 
-extern struct k_msgq device_message_queue; 
-
 static char keypad_mapping[MAX_ROW][MAX_COLUMN] = 
 {
     {'1', '2', '3'},
@@ -34,8 +36,6 @@ enum button_id {
     BUTTON_ID_COUNT
 };
 
-extern struct k_sem my_sem;
-
 static bool handle_button_event(const struct button_event *evt)
 {
     if (evt->pressed) {
@@ -46,27 +46,19 @@ static bool handle_button_event(const struct button_event *evt)
         row = evt->key_id & (0x007FU);
         column = (evt->key_id & (0x3F80U)) >> 7;
 
-        int ret = 0;
-
-        uint16_t pressed;
-
-        pressed = keypad_mapping[row][column];
-
-        if(pressed == '#')
-        {
-            k_sem_give(&my_sem);
-        }
-        else
-        {
-            ret = k_msgq_put(&device_message_queue, &pressed , K_FOREVER);
+        if (row >= MAX_ROW || column >= MAX_COLUMN) {
+            return false;
         }
 
-        if (ret){
-            LOG_ERR("Return value from k_msgq_put = %d",ret);
-        }
+        /* Keys are not logged, they make up the PIN. */
+        LOG_DBG("Row: %d, Column: %d", row, column);
 
-        LOG_INF("Row: %d, Column: %d", row, column);
-        LOG_INF("Pressed: %c", keypad_mapping[row][column]);
+        /* A PIN transaction ends in a state notification to the gateway,
+         * and someone at the door may want the gateway to reconnect soon.
+         */
+        conn_param_activity();
+        advertising_activity();
+        pin_entry_key(keypad_mapping[row][column]);
     }
 
     return false;
@@ -0,0 +1,85 @@
+#ifndef LOG_RATELIMIT_H
+#define LOG_RATELIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+/*
+ * Per-module log rate limiting for hot paths.
+ *
+ * A module declares its budget once, after LOG_MODULE_REGISTER():
+ *
+ *   LOG_RATELIMIT_DEFINE(4, 1000);
+ *
+ * and logs through LOG_INF_RL() and friends. Every call site in the module
+ * shares the budget of _burst messages per _period_ms; the rest are dropped
+ * and counted, and the next message that gets through is preceded by the
+ * number dropped. Safe from any context, ISRs included.
+ */
+
+struct log_ratelimit {
+	struct k_spinlock lock;
+	int64_t window_start_ms;
+	uint32_t period_ms;
+	uint16_t burst;
+	uint16_t count;
+	uint32_t dropped;
+};
+
+#define LOG_RATELIMIT_DEFINE(_burst, _period_ms)				\
+	static struct log_ratelimit log_ratelimit_module = {			\
+		.period_ms = (_period_ms),					\
+		.burst = (_burst),						\
+	}
+
+/** @brief Take one message from the budget.
+ *
+ * @param dropped Set to the number of messages dropped since the last one
+ *                that got through.
+ *
+ * @retval true if the message may be logged.
+ */
+static inline bool log_ratelimit_take(struct log_ratelimit *rl, uint32_t *dropped)
+{
+	k_spinlock_key_t key = k_spin_lock(&rl->lock);
+	int64_t now_ms = k_uptime_get();
+	bool allowed;
+
+	if (now_ms - rl->window_start_ms >= rl->period_ms) {
+		rl->window_start_ms = now_ms;
+		rl->count = 0;
+	}
+
+	allowed = rl->count < rl->burst;
+	if (allowed) {
+		rl->count++;
+		*dropped = rl->dropped;
+		rl->dropped = 0;
+	} else {
+		rl->dropped++;
+	}
+	k_spin_unlock(&rl->lock, key);
+
+	return allowed;
+}
+
+#define LOG_RL_IMPL(_log, ...)							\
+	do {									\
+		uint32_t _rl_dropped;						\
+										\
+		if (log_ratelimit_take(&log_ratelimit_module, &_rl_dropped)) {	\
+			if (_rl_dropped != 0) {					\
+				LOG_WRN("%u messages dropped", _rl_dropped);	\
+			}							\
+			_log(__VA_ARGS__);					\
+		}								\
+	} while (0)
+
+#define LOG_ERR_RL(...) LOG_RL_IMPL(LOG_ERR, __VA_ARGS__)
+#define LOG_WRN_RL(...) LOG_RL_IMPL(LOG_WRN, __VA_ARGS__)
+#define LOG_INF_RL(...) LOG_RL_IMPL(LOG_INF, __VA_ARGS__)
+#define LOG_DBG_RL(...) LOG_RL_IMPL(LOG_DBG, __VA_ARGS__)
+
+#endif /* LOG_RATELIMIT_H */
@@ -14,7 +14,6 @@
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/bluetooth/services/bas.h>
-#include <math.h>
 
 #include <app_event_manager.h>
 
@@ -26,80 +25,93 @@ LOG_MODULE_REGISTER(MODULE);
 #include "gap_advertising.h"
 #include "gap_connection.h"
 #include "security.h"
-
-
-#define RUN_LED_BLINK_INTERVAL 1000
+#include "pin_entry.h"
+#include "credentials.h"
+#include "cred_bundle.h"
+#include "actuator.h"
+#include "audit_log.h"
+#include "adv_status.h"
+#include "residency.h"
+#include "log_ratelimit.h"
+
+
+/* Someone trying PINs at the keypad gets a line per attempt; the audit
+   log keeps every one of them anyway. */
+LOG_RATELIMIT_DEFINE(4, 10000);
+
+/* Contact bounce on the button collapses into one bond wipe. */
+#define BOND_DELETE_DEBOUNCE_MS 50
 #define BUTTON_NODE DT_ALIAS(sw4)
 
-K_MSGQ_DEFINE(device_message_queue, sizeof(uint16_t), 10, 2);
-
-struct k_sem my_sem;
-
-K_SEM_DEFINE(my_sem, 0, 1);
-
-int pass_code = 123456;
-
 static uint8_t battery_level = 100;
 
 
-void keypad_thread(void *, void *, void *)
+static void unlock_pin_entered(uint32_t pin, uint8_t digits)
 {
-	uint16_t key = 0;
-
-	//err = k_msgq_get(&device_message_queue, &temp, K_FOREVER);
+	uint16_t user_id = AUDIT_USER_NONE;
+	uint8_t result;
 	int err;
-	int temp;
-	int passkey = 0;
 
-	while(1)
+	err = credentials_verify(pin, digits, &user_id);
+	switch (err)
 	{
-		LOG_INF("Start of Thread");
-
-		k_sem_take(&my_sem, K_FOREVER);
-
-		for(int i = 0; i < 6; ++i)
-		{
-			err = k_msgq_get(&device_message_queue, &temp, K_FOREVER);
-
-			passkey = (temp - 48) * pow(10, 5 - i) + passkey;
-
-			if(err == 0)
-			{
-				LOG_INF("Button Pressed: %c", (char)temp);
-			}
-		}
-
-		if(pass_code == passkey)
-		{
-			LOG_INF("Correct PIN");
-		}
-		else
-		{
-			LOG_INF("Incorrect PIN");
-		}
-
-		LOG_INF("Passkey: %d", passkey);
-		LOG_INF("Body of Thread");
-		//k_sleep(K_MSEC(RUN_LED_BLINK_INTERVAL));
+	case 0:
+		LOG_INF("Correct PIN, user %u", user_id);
+		result = actuator_request(ACTUATOR_UNLOCKED) == 0 ?
+			 AUDIT_RESULT_UNLOCKED : AUDIT_RESULT_BUSY;
+		break;
+	case -EBUSY:
+		LOG_INF_RL("Keypad locked out for %u ms", credentials_lockout_remaining());
+		result = AUDIT_RESULT_LOCKED_OUT;
+		break;
+	case -EPERM:
+		LOG_INF_RL("PIN not valid at this time");
+		result = AUDIT_RESULT_OUTSIDE_WINDOW;
+		break;
+	default:
+		LOG_INF_RL("Incorrect PIN");
+		result = AUDIT_RESULT_DENIED;
+		break;
 	}
-}
-
 
-K_THREAD_DEFINE(keypad, 1024,
-	keypad_thread, NULL, NULL, NULL,
-	1, 0, 0);
+	audit_log_add(AUDIT_SRC_KEYPAD, user_id, result);
+}
 
 
 static const struct gpio_dt_spec button_temp = GPIO_DT_SPEC_GET(BUTTON_NODE, gpios);
 static struct gpio_callback button_cb_data;
-static bool is_bond_delete = 0;
+
+
+/* Runs on the system workqueue, like the advertising state machine, so no
+ * advertising start can slip in between the wipe and the accept list
+ * refresh.
+ */
+static void bond_delete_fn(struct k_work *work)
+{
+	int err = bt_unpair(BT_ID_DEFAULT, BT_ADDR_LE_ANY);
+
+	if (err) {
+		LOG_INF("Cannot delete bond (err: %d)\n", err);
+		return;
+	}
+
+	LOG_INF("Bond deleted succesfully \n");
+	/* Former bond holders must not verify the status any more. */
+	adv_status_rotate_key();
+	audit_log_add(AUDIT_SRC_BUTTON, AUDIT_USER_NONE,
+		      AUDIT_RESULT_BONDS_CLEARED);
+	advertising_bonds_changed();
+}
+static K_WORK_DELAYABLE_DEFINE(bond_delete_work, bond_delete_fn);
 
 
 void button_pressed(const struct device *dev, struct gpio_callback *cb, uint32_t pins)
 {
-    printk("Button pressed at pin %d\n", button_temp.pin);
+	LOG_INF_RL("Button pressed at pin %d", button_temp.pin);
+
+	advertising_activity();
 
-	is_bond_delete = true;
+	k_work_reschedule(&bond_delete_work, K_MSEC(BOND_DELETE_DEBOUNCE_MS));
 }
 
 void simulate_battery_level(void)
@@ -110,6 +122,7 @@ void simulate_battery_level(void)
 	}
 
 	bt_bas_set_battery_level(battery_level);
+	adv_status_set_battery(bt_bas_get_battery_level());
 }
 
 
@@ -139,6 +152,8 @@ int main(void)
 
     printk("Set up button at %s pin %d\n", button_temp.port->name, button_temp.pin);
 
+	pin_entry_init(unlock_pin_entered);
+
 	if (app_event_manager_init()) {
 		LOG_ERR("Application Event Manager not initialized");
 	} else {
@@ -147,6 +162,11 @@ int main(void)
 
 	simulate_battery_level();
 
+	err = audit_log_init();
+	if (err) {
+		LOG_WRN("Audit log not available (err %d)", err);
+	}
+
 	err = bt_enable(NULL);
 	if (err) {
 		LOG_ERR("Bluetooth init failed (err %d)\n", err);
@@ -160,31 +180,43 @@ int main(void)
 		return -1;
 	}
 
+	err = bt_conn_auth_info_cb_register(&conn_auth_info_callbacks);
+	if (err) {
+		LOG_INF("Failed to register authorization info callbacks.\n");
+		return -1;
+	}
+
 	// Restore previous BLE bonds.
 	settings_load();
 
-	LOG_INF("Bluetooth initialized\n");
+	err = credentials_init();
+	if (err) {
+		LOG_ERR("Credential store not available (err %d)", err);
+	}
 
-	advetising_start();
+	err = cred_bundle_init();
+	if (err) {
+		LOG_ERR("Bulk provisioning not available (err %d)", err);
+	}
 
-	LOG_INF("Advertising successfully started\n");
+	err = adv_status_init();
+	if (err) {
+		LOG_ERR("Advertised status not available (err %d)", err);
+	}
 
-	uint16_t temp;
+	LOG_INF("Bluetooth initialized\n");
 
-	for (;;) {
+	err = actuator_init();
+	if (err) {
+		LOG_ERR("Actuator init failed (err %d)", err);
+	}
 
-		if(is_bond_delete == 1)
-		{
-			is_bond_delete = 0;
-			err = bt_unpair(BT_ID_DEFAULT,BT_ADDR_LE_ANY);
+	advetising_start();
 
-			if (err) {
-				LOG_INF("Cannot delete bond (err: %d)\n", err);
-			} else	{
-				LOG_INF("Bond deleted succesfully \n");
-			}	
-		}	
+	LOG_INF("Advertising successfully started\n");
 
-		k_sleep(K_MSEC(RUN_LED_BLINK_INTERVAL));
-	}
+	residency_init();
+
+	/* Everything from here on runs from callbacks and work items. */
+	return 0;
 }
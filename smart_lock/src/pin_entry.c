@@ -0,0 +1,147 @@
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "pin_entry.h"
+#include "trace.h"
+
+
+LOG_MODULE_REGISTER(pin_entry);
+
+
+static void digit_timeout_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(digit_timeout_work, digit_timeout_handler);
+
+/*
+ * Keys arrive from the event manager, passkey requests from the Bluetooth
+ * RX thread and timeouts from the system workqueue, so the entry state is
+ * only touched under the lock. Callbacks are invoked after releasing it.
+ */
+static struct k_spinlock lock;
+static pin_entry_cb_t unlock_handler;
+static pin_entry_cb_t passkey_handler;
+static uint32_t value;
+static uint8_t digits;
+
+
+static void entry_clear(void)
+{
+	value = 0;
+	digits = 0;
+}
+
+static void digit_timeout_handler(struct k_work *work)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (digits != 0) {
+		LOG_INF("PIN entry timed out");
+	}
+	entry_clear();
+
+	k_spin_unlock(&lock, key);
+}
+
+void pin_entry_init(pin_entry_cb_t unlock_cb)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	unlock_handler = unlock_cb;
+	passkey_handler = NULL;
+	entry_clear();
+
+	k_spin_unlock(&lock, key);
+}
+
+void pin_entry_key(char key_char)
+{
+	pin_entry_cb_t handler = NULL;
+	bool submitted = false;
+	uint32_t pin = 0;
+	uint8_t len = 0;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (key_char >= '0' && key_char <= '9') {
+		/* Digits past the maximum are counted, not kept, so the
+		 * entry is rejected rather than cut to its first six.
+		 */
+		if (digits < PIN_ENTRY_MAX_DIGITS) {
+			value = value * 10U + (uint32_t)(key_char - '0');
+		}
+		if (digits < UINT8_MAX) {
+			digits++;
+		}
+	} else if (key_char == '*') {
+		if (digits > PIN_ENTRY_MAX_DIGITS) {
+			digits--;
+		} else if (digits != 0) {
+			value /= 10U;
+			digits--;
+		} else {
+			entry_clear();
+		}
+	} else if (key_char == '#') {
+		submitted = true;
+		pin = value;
+		len = digits;
+		/* Otherwise rejected; a pending passkey waits for the next. */
+		if (digits != 0 && digits <= PIN_ENTRY_MAX_DIGITS) {
+			if (passkey_handler != NULL) {
+				handler = passkey_handler;
+				passkey_handler = NULL;
+			} else {
+				handler = unlock_handler;
+			}
+		}
+		entry_clear();
+	}
+
+	k_spin_unlock(&lock, key);
+
+	if (!submitted) {
+		(void)k_work_reschedule(&digit_timeout_work,
+					K_MSEC(PIN_ENTRY_DIGIT_TIMEOUT_MS));
+		return;
+	}
+
+	(void)k_work_cancel_delayable(&digit_timeout_work);
+
+	if (handler == NULL) {
+		LOG_INF("Entry of %u digits rejected", len);
+		return;
+	}
+
+	LOG_DBG("Entry submitted, %u digits", len);
+	TRACE_BEGIN(TRACE_SPAN_PIN);
+	handler(pin, len);
+	TRACE_END(TRACE_SPAN_PIN);
+}
+
+int pin_entry_passkey_begin(pin_entry_cb_t passkey_cb)
+{
+	int err = 0;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (passkey_handler != NULL) {
+		err = -EBUSY;
+	} else {
+		/* Digits typed before pairing started belong to an unlock. */
+		passkey_handler = passkey_cb;
+		entry_clear();
+	}
+
+	k_spin_unlock(&lock, key);
+
+	return err;
+}
+
+void pin_entry_passkey_cancel(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	passkey_handler = NULL;
+	entry_clear();
+
+	k_spin_unlock(&lock, key);
+}
@@ -0,0 +1,45 @@
+#ifndef PIN_ENTRY_H
+#define PIN_ENTRY_H
+
+#include <stdint.h>
+
+/* PINs and BLE passkeys are both six digits. */
+#define PIN_ENTRY_MAX_DIGITS	6
+
+/* Entry is discarded when no key is pressed for this long. */
+#define PIN_ENTRY_DIGIT_TIMEOUT_MS	5000
+
+/** @brief Callback for a submitted entry.
+ *
+ * @param pin    Entered digits as an integer, most significant digit first.
+ * @param digits Number of digits entered, so leading zeros are preserved.
+ */
+typedef void (*pin_entry_cb_t)(uint32_t pin, uint8_t digits);
+
+/** @brief Initialize PIN entry.
+ *
+ * @param unlock_cb Called when a PIN is submitted outside of pairing.
+ */
+void pin_entry_init(pin_entry_cb_t unlock_cb);
+
+/** @brief Feed one key from the keypad.
+ *
+ * '0'..'9' append a digit, '*' deletes the last digit (or discards the
+ * entry when there is none), '#' submits. An entry with no digits or more
+ * than PIN_ENTRY_MAX_DIGITS is discarded on '#' without a callback.
+ */
+void pin_entry_key(char key);
+
+/** @brief Route the next submitted entry to BLE passkey entry.
+ *
+ * The keypad stays in passkey mode until a passkey is submitted or
+ * pin_entry_passkey_cancel() is called.
+ *
+ * @retval 0 on success, -EBUSY if a passkey entry is already pending.
+ */
+int pin_entry_passkey_begin(pin_entry_cb_t passkey_cb);
+
+/** @brief Leave passkey mode and discard any digits entered. */
+void pin_entry_passkey_cancel(void);
+
+#endif /* PIN_ENTRY_H */
@@ -0,0 +1,73 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "residency.h"
+
+
+LOG_MODULE_REGISTER(residency);
+
+
+/* Cycle counts at the start of the current report window. Owned by the
+ * system workqueue.
+ */
+static uint64_t window_idle_cycles;
+static uint64_t window_all_cycles;
+static uint32_t window_idle_ppm;
+
+
+static uint32_t ppm(uint64_t part, uint64_t whole)
+{
+	return whole != 0 ? (uint32_t)(part * 1000000 / whole) : 0;
+}
+
+/* execution_cycles counts every thread including idle. */
+static void cycles_get(uint64_t *idle, uint64_t *all)
+{
+	k_thread_runtime_stats_t rt;
+
+	if (k_thread_runtime_stats_all_get(&rt) != 0) {
+		*idle = 0;
+		*all = 0;
+		return;
+	}
+
+	*idle = rt.idle_cycles;
+	*all = rt.execution_cycles;
+}
+
+static void residency_report_fn(struct k_work *work)
+{
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	uint64_t idle;
+	uint64_t all;
+
+	cycles_get(&idle, &all);
+
+	window_idle_ppm = ppm(idle - window_idle_cycles, all - window_all_cycles);
+	window_idle_cycles = idle;
+	window_all_cycles = all;
+
+	LOG_INF("CPU idle %u ppm since boot, %u ppm last interval",
+		ppm(idle, all), window_idle_ppm);
+
+	k_work_schedule(dwork, K_MSEC(RESIDENCY_REPORT_INTERVAL_MS));
+}
+static K_WORK_DELAYABLE_DEFINE(residency_report_work, residency_report_fn);
+
+void residency_init(void)
+{
+	cycles_get(&window_idle_cycles, &window_all_cycles);
+	k_work_schedule(&residency_report_work, K_MSEC(RESIDENCY_REPORT_INTERVAL_MS));
+}
+
+void residency_get(struct residency_stats *stats)
+{
+	uint64_t idle;
+	uint64_t all;
+
+	cycles_get(&idle, &all);
+
+	stats->idle_ppm = ppm(idle, all);
+	stats->window_idle_ppm = window_idle_ppm;
+	stats->uptime_s = (uint32_t)(k_uptime_get() / 1000);
+}
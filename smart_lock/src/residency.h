@@ -0,0 +1,26 @@
+#ifndef RESIDENCY_H
+#define RESIDENCY_H
+
+#include <stdint.h>
+
+/* Interval of the residency report in the log. */
+#define RESIDENCY_REPORT_INTERVAL_MS	(60 * 60 * 1000)
+
+/** @brief CPU time spent in the idle thread, i.e. asleep.
+ *
+ * In parts per million, so the 99.9 % target reads as 999000.
+ */
+struct residency_stats {
+	uint32_t idle_ppm;
+	/* Over the last report interval. */
+	uint32_t window_idle_ppm;
+	uint32_t uptime_s;
+};
+
+/** @brief Start the periodic residency report. */
+void residency_init(void);
+
+/** @brief Current figures, as read from the residency characteristic. */
+void residency_get(struct residency_stats *stats);
+
+#endif /* RESIDENCY_H */
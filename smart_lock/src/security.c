@@ -1,16 +1,19 @@
 #include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/bluetooth/bluetooth.h>
 #include <zephyr/bluetooth/conn.h>
 
 #include "security.h"
+#include "pin_entry.h"
+#include "gap_advertising.h"
 
 
 LOG_MODULE_REGISTER(security);
 
 
-extern struct k_msgq device_message_queue;
-extern struct k_sem my_sem; 
+/* Connection waiting for the passkey to be typed on the keypad. */
+static atomic_ptr_t passkey_conn;
 
 
 static void auth_cancel(struct bt_conn *conn);
@@ -18,6 +21,8 @@ static void auth_passkey_entry(struct bt_conn *conn);
 static void auth_passkey_confirm(struct bt_conn *conn);
 enum bt_security_err pairing_accept_cb(struct bt_conn *conn, const struct 
                                         bt_conn_pairing_feat *const feat);
+static void pairing_complete(struct bt_conn *conn, bool bonded);
+static void bond_deleted(uint8_t id, const bt_addr_le_t *peer);
 
 
 struct bt_conn_auth_cb conn_auth_callbacks = 
@@ -25,46 +30,78 @@ struct bt_conn_auth_cb conn_auth_callbacks =
 	.pairing_accept = NULL,
 	.passkey_display = NULL,
 	.passkey_confirm = NULL,
-	.passkey_entry = NULL,
+	.passkey_entry = auth_passkey_entry,
 	.cancel = auth_cancel,
 };
 
+struct bt_conn_auth_info_cb conn_auth_info_callbacks =
+{
+	.pairing_complete = pairing_complete,
+	.bond_deleted = bond_deleted,
+};
+
 
 static void auth_cancel(struct bt_conn *conn)
 {
 	char addr[BT_ADDR_LE_STR_LEN];
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 	LOG_INF("Pairing cancelled: %s\n", addr);
+
+	if (atomic_ptr_cas(&passkey_conn, conn, NULL))
+	{
+		pin_entry_passkey_cancel();
+		bt_conn_unref(conn);
+	}
 }
 
-static void auth_passkey_entry(struct bt_conn *conn)
+static void passkey_entered(uint32_t passkey, uint8_t digits)
 {
-	LOG_INF("Passkey");
-
+	struct bt_conn *conn = atomic_ptr_clear(&passkey_conn);
 	int err;
-	uint16_t temp;
-	uint32_t passkey = 0;
 
-	for(int i = 0; i < 6; ++i)
+	if (conn == NULL)
 	{
-		err = k_msgq_get(&device_message_queue, &temp, K_FOREVER);
-
-		passkey = (temp - 48) * pow(10, 5 - i) + passkey;
+		return;
+	}
 
-		if(err == 0)
+	if (digits != PIN_ENTRY_MAX_DIGITS)
+	{
+		LOG_INF("Passkey must be %d digits", PIN_ENTRY_MAX_DIGITS);
+		bt_conn_auth_cancel(conn);
+	}
+	else
+	{
+		err = bt_conn_auth_passkey_entry(conn, passkey);
+		if(err != 0)
 		{
-			LOG_INF("Button Pressed: %c", (char)temp);
+			LOG_INF("Error on passkey entry: %d", err);
 		}
 	}
 
-	LOG_INF("Passkey is: %d", passkey);
+	bt_conn_unref(conn);
+}
 
-	err = bt_conn_auth_passkey_entry(conn, passkey);
-	if(err != 0)
+/* Returns right away; the passkey is handed to the stack once it has been
+ * typed and submitted on the keypad.
+ */
+static void auth_passkey_entry(struct bt_conn *conn)
+{
+	LOG_INF("Passkey");
+
+	if (!atomic_ptr_cas(&passkey_conn, NULL, bt_conn_ref(conn)))
+	{
+		LOG_INF("Passkey entry already in progress");
+		bt_conn_unref(conn);
+		bt_conn_auth_cancel(conn);
+		return;
+	}
+
+	if (pin_entry_passkey_begin(passkey_entered) != 0)
 	{
-		LOG_INF("Error on passkey entry: %d", err);
+		atomic_ptr_clear(&passkey_conn);
+		bt_conn_unref(conn);
+		bt_conn_auth_cancel(conn);
 	}
-		
 }
 
 static void auth_passkey_confirm(struct bt_conn *conn)
@@ -83,3 +120,18 @@ enum bt_security_err pairing_accept_cb(struct bt_conn *conn, const struct bt_con
 	return 0;
 }
 
+/* Bond changes only mark the Filter Accept List stale; the
+ * advertiser applies the difference on its next start.
+ */
+static void pairing_complete(struct bt_conn *conn, bool bonded)
+{
+	if (bonded)
+	{
+		advertising_bonds_changed();
+	}
+}
+
+static void bond_deleted(uint8_t id, const bt_addr_le_t *peer)
+{
+	advertising_bonds_changed();
+}
@@ -1,3 +1,4 @@
 #include <zephyr/bluetooth/conn.h>
 
-extern struct bt_conn_auth_cb conn_auth_callbacks;
\ No newline at end of file
+extern struct bt_conn_auth_cb conn_auth_callbacks;
+extern struct bt_conn_auth_info_cb conn_auth_info_callbacks;
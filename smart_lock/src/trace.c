@@ -0,0 +1,157 @@
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/init.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/bluetooth/uuid.h>
+#include <zephyr/bluetooth/gatt.h>
+
+#if defined(CONFIG_LOCK_TRACE_CLOCK_DWT)
+#include <cmsis_core.h>
+#endif
+
+#include "trace.h"
+
+
+#define BT_UUID_LOCK_TRACE_VAL \
+	BT_UUID_128_ENCODE(0x1c376f80, 0x468f, 0xEFDE, 0x8652, 0x4183255a1de3)
+#define BT_UUID_LOCK_TRACE_DATA_VAL \
+	BT_UUID_128_ENCODE(0x1c376f81, 0x468f, 0xEFDE, 0x8652, 0x4183255a1de3)
+
+#define BT_UUID_LOCK_TRACE	BT_UUID_DECLARE_128(BT_UUID_LOCK_TRACE_VAL)
+#define BT_UUID_LOCK_TRACE_DATA	BT_UUID_DECLARE_128(BT_UUID_LOCK_TRACE_DATA_VAL)
+
+/* CTF event: u32 timestamp, u8 event id, u8 span, u8 CPU; see
+ * scripts/trace/metadata.
+ */
+#define TRACE_CTF_EVENT_LEN	7
+
+
+struct trace_event {
+	uint32_t timestamp;
+	uint8_t span;
+	uint8_t type;
+	/* Index + 1 of the event in the slot, written last. Zero or stale
+	 * while a writer is filling the slot.
+	 */
+	uint32_t seq;
+};
+
+/*
+ * Writers reserve a slot with an atomic increment and never wait, so an ISR
+ * can trace in the middle of a thread's event. The reader drops slots whose
+ * sequence number does not match, i.e. still being written or already
+ * overwritten.
+ */
+struct trace_ring {
+	atomic_t head;
+	uint32_t tail;
+	struct trace_event events[CONFIG_LOCK_TRACE_EVENTS];
+};
+
+static struct trace_ring rings[CONFIG_MP_MAX_NUM_CPUS];
+
+/* Encoded stream served to the reader; filled on a read at offset 0 so a
+ * long read sees a consistent snapshot.
+ */
+static uint8_t ctf_buf[CONFIG_MP_MAX_NUM_CPUS * CONFIG_LOCK_TRACE_EVENTS * TRACE_CTF_EVENT_LEN];
+static size_t ctf_len;
+static K_MUTEX_DEFINE(ctf_mutex);
+
+
+static inline uint32_t trace_timestamp(void)
+{
+#if defined(CONFIG_LOCK_TRACE_CLOCK_DWT)
+	return DWT->CYCCNT;
+#else
+	return k_cycle_get_32();
+#endif
+}
+
+void trace_record(enum trace_span span, enum trace_event_type type)
+{
+	struct trace_ring *ring = &rings[arch_proc_id()];
+	uint32_t idx = (uint32_t)atomic_inc(&ring->head);
+	struct trace_event *ev = &ring->events[idx % CONFIG_LOCK_TRACE_EVENTS];
+
+	ev->seq = 0;
+	compiler_barrier();
+	ev->timestamp = trace_timestamp();
+	ev->span = span;
+	ev->type = type;
+	compiler_barrier();
+	ev->seq = idx + 1;
+}
+
+/* Events of one CPU are in timestamp order; with more than one CPU the
+ * streams are appended one after the other.
+ */
+static size_t trace_drain(uint8_t cpu, uint8_t *buf)
+{
+	struct trace_ring *ring = &rings[cpu];
+	uint32_t head = (uint32_t)atomic_get(&ring->head);
+	uint32_t idx = ring->tail;
+	size_t len = 0;
+
+	if (head - idx > CONFIG_LOCK_TRACE_EVENTS) {
+		idx = head - CONFIG_LOCK_TRACE_EVENTS;
+	}
+
+	for (; idx != head; idx++) {
+		struct trace_event ev = ring->events[idx % CONFIG_LOCK_TRACE_EVENTS];
+
+		if (ev.seq != idx + 1) {
+			continue;
+		}
+
+		sys_put_le32(ev.timestamp, &buf[len]);
+		buf[len + 4] = ev.type;
+		buf[len + 5] = ev.span;
+		buf[len + 6] = cpu;
+		len += TRACE_CTF_EVENT_LEN;
+	}
+
+	ring->tail = head;
+	return len;
+}
+
+static ssize_t read_trace(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+			  void *buf, uint16_t len, uint16_t offset)
+{
+	ssize_t ret;
+
+	k_mutex_lock(&ctf_mutex, K_FOREVER);
+
+	if (offset == 0) {
+		ctf_len = 0;
+		for (uint8_t cpu = 0; cpu < CONFIG_MP_MAX_NUM_CPUS; cpu++) {
+			ctf_len += trace_drain(cpu, &ctf_buf[ctf_len]);
+		}
+	}
+
+	ret = bt_gatt_attr_read(conn, attr, buf, len, offset, ctf_buf, ctf_len);
+
+	k_mutex_unlock(&ctf_mutex);
+	return ret;
+}
+
+BT_GATT_SERVICE_DEFINE(
+	trace_svc, BT_GATT_PRIMARY_SERVICE(BT_UUID_LOCK_TRACE),
+	BT_GATT_CHARACTERISTIC(BT_UUID_LOCK_TRACE_DATA,
+			       BT_GATT_CHRC_READ,
+			       BT_GATT_PERM_READ_ENCRYPT,
+			       read_trace, NULL, NULL),
+);
+
+#if defined(CONFIG_LOCK_TRACE_CLOCK_DWT)
+static int trace_clock_init(void)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	return 0;
+}
+
+SYS_INIT(trace_clock_init, PRE_KERNEL_1, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+#endif
@@ -0,0 +1,52 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+ * Span tracing for the lock's hot paths.
+ *
+ * TRACE_BEGIN() and TRACE_END() record a timestamp into a lock-free ring per
+ * CPU; both are safe from ISRs. With CONFIG_LOCK_TRACE disabled they compile
+ * to nothing.
+ *
+ * Reading the trace characteristic drains the rings as a Common Trace Format
+ * stream. Save the value as "stream" next to scripts/trace/metadata and open
+ * the directory in Trace Compass or babeltrace2.
+ */
+
+enum trace_span {
+	/* Submit key pressed to PIN verdict. */
+	TRACE_SPAN_PIN,
+	/* Lock command write to the actuator's answer. */
+	TRACE_SPAN_GATT_CMD,
+	/* Connected to PHY, data length and MTU set up. */
+	TRACE_SPAN_LINK,
+	/* bt_le_adv_start() for a new advertising phase. */
+	TRACE_SPAN_ADV_START,
+	/* Actuator request, from any source, to the motor being driven. */
+	TRACE_SPAN_ACTUATOR,
+
+	TRACE_SPAN_COUNT
+};
+
+#if defined(CONFIG_LOCK_TRACE)
+
+enum trace_event_type {
+	TRACE_EVENT_BEGIN,
+	TRACE_EVENT_END,
+};
+
+void trace_record(enum trace_span span, enum trace_event_type type);
+
+#define TRACE_BEGIN(_span)	trace_record(_span, TRACE_EVENT_BEGIN)
+#define TRACE_END(_span)	trace_record(_span, TRACE_EVENT_END)
+
+#else
+
+#define TRACE_BEGIN(_span)	do { } while (0)
+#define TRACE_END(_span)	do { } while (0)
+
+#endif /* CONFIG_LOCK_TRACE */
+
+#endif /* TRACE_H */
@@ -0,0 +1,61 @@
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "wall_clock.h"
+
+
+LOG_MODULE_REGISTER(wall_clock);
+
+
+#define SECONDS_PER_DAY		86400U
+
+
+static struct k_spinlock lock;
+static bool clock_set;
+/* Unix time at kernel uptime zero, in milliseconds. */
+static int64_t epoch_offset_ms;
+
+
+void wall_clock_set(uint32_t unix_time)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	epoch_offset_ms = (int64_t)unix_time * MSEC_PER_SEC - k_uptime_get();
+	clock_set = true;
+
+	k_spin_unlock(&lock, key);
+
+	LOG_INF("Wall clock set to %u", unix_time);
+}
+
+int wall_clock_get(uint32_t *unix_time)
+{
+	int err = 0;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	if (!clock_set) {
+		err = -EAGAIN;
+	} else {
+		*unix_time = (uint32_t)((epoch_offset_ms + k_uptime_get()) / MSEC_PER_SEC);
+	}
+
+	k_spin_unlock(&lock, key);
+
+	return err;
+}
+
+int wall_clock_minute_of_day(uint16_t *minute)
+{
+	uint32_t now;
+	int err;
+
+	err = wall_clock_get(&now);
+	if (err) {
+		return err;
+	}
+
+	*minute = (now % SECONDS_PER_DAY) / 60U;
+
+	return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef WALL_CLOCK_H
+#define WALL_CLOCK_H
+
+#include <stdint.h>
+
+/** @brief Set the wall clock.
+ *
+ * The lock has no RTC; the time is set over BLE by the gateway and kept
+ * running from the kernel uptime until the next reset.
+ *
+ * @param unix_time Seconds since the Unix epoch, UTC.
+ */
+void wall_clock_set(uint32_t unix_time);
+
+/** @brief Get the current time in seconds since the Unix epoch, UTC.
+ *
+ * @retval 0 on success, -EAGAIN if the clock has not been set yet.
+ */
+int wall_clock_get(uint32_t *unix_time);
+
+/** @brief Get the current UTC time of day in minutes, 0..1439.
+ *
+ * @retval 0 on success, -EAGAIN if the clock has not been set yet.
+ */
+int wall_clock_minute_of_day(uint16_t *minute);
+
+#endif /* WALL_CLOCK_H */
@@ -0,0 +1,128 @@
+#include <zephyr/fff.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "actuator.h"
+#include "audit_log.h"
+#include "gatt_lock_svc.h"
+
+DEFINE_FFF_GLOBALS;
+
+FAKE_VALUE_FUNC(int, lock_svc_state_update, uint8_t);
+FAKE_VOID_FUNC(audit_log_add, uint8_t, uint16_t, uint8_t);
+
+/* Long enough for the emulated bolt to arrive and the switch to settle. */
+#define MOVE_WAIT	K_MSEC(ACTUATOR_EMUL_TRAVEL_MS + ACTUATOR_DEBOUNCE_MS + 50)
+
+static void expect_updates(const uint8_t *states, unsigned int count)
+{
+	zassert_equal(lock_svc_state_update_fake.call_count, count,
+		      "%u state updates, expected %u",
+		      lock_svc_state_update_fake.call_count, count);
+
+	for (unsigned int i = 0; i < count; i++) {
+		zassert_equal(lock_svc_state_update_fake.arg0_history[i], states[i],
+			      "update %u is %u, expected %u", i,
+			      lock_svc_state_update_fake.arg0_history[i], states[i]);
+	}
+}
+
+static void *setup(void)
+{
+	static const uint8_t locked[] = { ACTUATOR_LOCKED };
+
+	/* The emulated bolt starts out locked. */
+	zassert_ok(actuator_init());
+	zassert_equal(actuator_state_get(), ACTUATOR_LOCKED);
+	expect_updates(locked, 1);
+
+	return NULL;
+}
+
+/* Every test starts with the bolt locked and no move in progress. */
+static void before(void *fixture)
+{
+	ARG_UNUSED(fixture);
+
+	if (actuator_state_get() != ACTUATOR_LOCKED) {
+		zassert_ok(actuator_request(ACTUATOR_LOCKED));
+		k_sleep(MOVE_WAIT);
+		zassert_equal(actuator_state_get(), ACTUATOR_LOCKED);
+	}
+
+	RESET_FAKE(lock_svc_state_update);
+	RESET_FAKE(audit_log_add);
+}
+
+ZTEST_SUITE(actuator, NULL, setup, before, NULL, NULL);
+
+ZTEST(actuator, test_unlock_and_lock)
+{
+	static const uint8_t unlock[] = { ACTUATOR_UNLOCKING, ACTUATOR_UNLOCKED };
+	static const uint8_t both[] = {
+		ACTUATOR_UNLOCKING, ACTUATOR_UNLOCKED, ACTUATOR_LOCKING, ACTUATOR_LOCKED,
+	};
+
+	zassert_ok(actuator_request(ACTUATOR_UNLOCKED));
+	zassert_equal(actuator_state_get(), ACTUATOR_UNLOCKING);
+
+	k_sleep(MOVE_WAIT);
+	zassert_equal(actuator_state_get(), ACTUATOR_UNLOCKED);
+	expect_updates(unlock, ARRAY_SIZE(unlock));
+
+	zassert_ok(actuator_request(ACTUATOR_LOCKED));
+	k_sleep(MOVE_WAIT);
+	zassert_equal(actuator_state_get(), ACTUATOR_LOCKED);
+	expect_updates(both, ARRAY_SIZE(both));
+
+	zassert_equal(audit_log_add_fake.call_count, 0, "no jam");
+}
+
+ZTEST(actuator, test_busy_while_moving)
+{
+	zassert_ok(actuator_request(ACTUATOR_UNLOCKED));
+
+	zassert_equal(actuator_request(ACTUATOR_LOCKED), -EBUSY);
+	zassert_equal(actuator_request(ACTUATOR_UNLOCKED), -EBUSY);
+
+	k_sleep(MOVE_WAIT);
+	zassert_equal(actuator_state_get(), ACTUATOR_UNLOCKED);
+}
+
+ZTEST(actuator, test_already_there)
+{
+	static const uint8_t locked[] = { ACTUATOR_LOCKED };
+	struct actuator_stats before_stats;
+	struct actuator_stats after_stats;
+
+	actuator_stats_get(&before_stats);
+
+	/* Confirmed right away, without a move. */
+	zassert_ok(actuator_request(ACTUATOR_LOCKED));
+	expect_updates(locked, 1);
+
+	k_sleep(MOVE_WAIT);
+	actuator_stats_get(&after_stats);
+	zassert_equal(after_stats.moves, before_stats.moves);
+	expect_updates(locked, 1);
+}
+
+ZTEST(actuator, test_move_latency)
+{
+	struct actuator_stats stats;
+	uint32_t moves;
+
+	actuator_stats_get(&stats);
+	moves = stats.moves;
+
+	zassert_ok(actuator_request(ACTUATOR_UNLOCKED));
+	k_sleep(MOVE_WAIT);
+
+	/* Counted from the request to the switch edge, not to the debounce. */
+	actuator_stats_get(&stats);
+	zassert_equal(stats.moves, moves + 1);
+	zassert_between_inclusive(stats.last_ms, ACTUATOR_EMUL_TRAVEL_MS,
+				  ACTUATOR_EMUL_TRAVEL_MS + 10, "%u ms", stats.last_ms);
+	zassert_true(stats.min_ms <= stats.last_ms && stats.last_ms <= stats.max_ms);
+	zassert_equal(stats.jams, 0);
+}
@@ -0,0 +1,155 @@
+#include <string.h>
+#include <zephyr/fff.h>
+#include <zephyr/kernel.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/ztest.h>
+
+#include "audit_log.h"
+#include "wall_clock.h"
+
+DEFINE_FFF_GLOBALS;
+
+#define TEST_FLASH_SIZE	FIXED_PARTITION_SIZE(audit_partition)
+#define TEST_TS		1704067200U
+
+/* Past audit_log.c's flush delay */
+#define FLUSH_WAIT	K_SECONDS(11)
+
+FAKE_VALUE_FUNC(int, flash_area_open, uint8_t, const struct flash_area **);
+FAKE_VALUE_FUNC(int, flash_area_read, const struct flash_area *, off_t, void *, size_t);
+FAKE_VALUE_FUNC(int, flash_area_write, const struct flash_area *, off_t, const void *,
+		size_t);
+FAKE_VALUE_FUNC(int, flash_area_erase, const struct flash_area *, off_t, size_t);
+FAKE_VALUE_FUNC(int, wall_clock_get, uint32_t *);
+
+static uint8_t flash[TEST_FLASH_SIZE];
+static const struct flash_area area = {
+	.fa_size = TEST_FLASH_SIZE,
+};
+
+static int ram_open(uint8_t id, const struct flash_area **fa)
+{
+	*fa = &area;
+	return 0;
+}
+
+static int ram_read(const struct flash_area *fa, off_t off, void *dst, size_t len)
+{
+	memcpy(dst, &flash[off], len);
+	return 0;
+}
+
+/* Programming only clears bits, as on NOR flash. */
+static int ram_write(const struct flash_area *fa, off_t off, const void *src, size_t len)
+{
+	const uint8_t *p = src;
+
+	for (size_t i = 0; i < len; i++) {
+		flash[off + i] &= p[i];
+	}
+	return 0;
+}
+
+static int ram_erase(const struct flash_area *fa, off_t off, size_t len)
+{
+	memset(&flash[off], 0xFF, len);
+	return 0;
+}
+
+static int clock_get(uint32_t *unix_time)
+{
+	*unix_time = TEST_TS;
+	return 0;
+}
+
+static void writes_fail(bool fail)
+{
+	flash_area_write_fake.custom_fake = fail ? NULL : ram_write;
+	flash_area_write_fake.return_val = -EIO;
+}
+
+static void expect_users(const uint16_t *users, size_t count)
+{
+	struct audit_record records[8];
+	uint32_t first;
+	int n;
+
+	n = audit_log_read(0, records, ARRAY_SIZE(records), &first);
+	zassert_equal(n, count, "%d records, expected %zu", n, count);
+	zassert_equal(first, 0);
+
+	for (size_t i = 0; i < count; i++) {
+		zassert_equal(records[i].user, users[i], "record %zu is user %u, expected %u",
+			      i, records[i].user, users[i]);
+		zassert_equal(records[i].ts, TEST_TS);
+		zassert_equal(records[i].result, AUDIT_RESULT_DENIED);
+	}
+}
+
+static void before(void *fixture)
+{
+	ARG_UNUSED(fixture);
+
+	RESET_FAKE(flash_area_open);
+	RESET_FAKE(flash_area_read);
+	RESET_FAKE(flash_area_write);
+	RESET_FAKE(flash_area_erase);
+	RESET_FAKE(wall_clock_get);
+	flash_area_open_fake.custom_fake = ram_open;
+	flash_area_read_fake.custom_fake = ram_read;
+	flash_area_erase_fake.custom_fake = ram_erase;
+	wall_clock_get_fake.custom_fake = clock_get;
+	writes_fail(false);
+
+	/* Whatever the previous test left buffered goes to the old log. */
+	(void)audit_log_flush();
+
+	memset(flash, 0xFF, sizeof(flash));
+	zassert_ok(audit_log_init());
+}
+
+ZTEST_SUITE(audit_log, NULL, NULL, before, NULL, NULL);
+
+ZTEST(audit_log, test_failed_write_keeps_the_records)
+{
+	static const uint16_t users[] = { 1, 2, 3, 4 };
+
+	audit_log_add(AUDIT_SRC_KEYPAD, 1, AUDIT_RESULT_DENIED);
+	audit_log_add(AUDIT_SRC_KEYPAD, 2, AUDIT_RESULT_DENIED);
+	audit_log_add(AUDIT_SRC_KEYPAD, 3, AUDIT_RESULT_DENIED);
+
+	writes_fail(true);
+	zassert_equal(audit_log_flush(), -EIO);
+	expect_users(NULL, 0);
+
+	/* Added while the write was failing: goes after the kept ones. */
+	audit_log_add(AUDIT_SRC_KEYPAD, 4, AUDIT_RESULT_DENIED);
+
+	writes_fail(false);
+	zassert_ok(audit_log_flush());
+	expect_users(users, ARRAY_SIZE(users));
+
+	/* Written once. */
+	zassert_ok(audit_log_flush());
+	expect_users(users, ARRAY_SIZE(users));
+}
+
+ZTEST(audit_log, test_failed_write_is_retried)
+{
+	static const uint16_t users[] = { 7, 8 };
+	unsigned int writes;
+
+	writes_fail(true);
+	writes = flash_area_write_fake.call_count;
+	audit_log_add(AUDIT_SRC_KEYPAD, 7, AUDIT_RESULT_DENIED);
+	audit_log_add(AUDIT_SRC_KEYPAD, 8, AUDIT_RESULT_DENIED);
+
+	/* The delayed flush fails and schedules another. */
+	k_sleep(FLUSH_WAIT);
+	zassert_true(flash_area_write_fake.call_count > writes);
+	expect_users(NULL, 0);
+
+	writes_fail(false);
+	k_sleep(FLUSH_WAIT);
+	expect_users(users, ARRAY_SIZE(users));
+}
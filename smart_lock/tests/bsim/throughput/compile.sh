@@ -0,0 +1,15 @@
+#!/usr/bin/env bash
+#
+# Builds the test image into ${BSIM_OUT_PATH}/bin.
+#
+set -ue
+
+: "${ZEPHYR_BASE:?ZEPHYR_BASE must be set to point to the zephyr root directory}"
+: "${BSIM_OUT_PATH:?BSIM_OUT_PATH must be defined}"
+
+source ${ZEPHYR_BASE}/tests/bsim/compile.source
+
+app_root="$(cd "$(dirname "${BASH_SOURCE[0]}")/../../.." && pwd)" \
+	app=tests/bsim/throughput compile
+
+wait_for_background_jobs
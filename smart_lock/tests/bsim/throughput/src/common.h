@@ -0,0 +1,34 @@
+#ifndef THROUGHPUT_COMMON_H
+#define THROUGHPUT_COMMON_H
+
+#include "bs_tracing.h"
+#include "bs_types.h"
+#include "bstests.h"
+
+extern enum bst_result_t bst_result;
+
+/* Both end the device's simulation. */
+#define FAIL(...)							\
+	do {								\
+		bst_result = Failed;					\
+		bs_trace_error_time_line(__VA_ARGS__);			\
+	} while (0)
+
+#define PASS(...)							\
+	do {								\
+		bst_result = Passed;					\
+		bs_trace_info_time(1, __VA_ARGS__);			\
+	} while (0)
+
+/* Waits on @p sem, failing the test after @p timeout. */
+#define WAIT_FOR(sem, timeout, what)					\
+	do {								\
+		if (k_sem_take((sem), (timeout)) != 0) {		\
+			FAIL("Timed out waiting for %s\n", (what));	\
+		}							\
+	} while (0)
+
+void lock_main(void);
+void gateway_main(void);
+
+#endif /* THROUGHPUT_COMMON_H */
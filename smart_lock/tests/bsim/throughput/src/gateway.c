@@ -0,0 +1,546 @@
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/bluetooth/l2cap.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/printk.h>
+
+#include "common.h"
+#include "cred_bundle.h"
+#include "credentials.h"
+#include "gap_connection.h"
+#include "gatt_lock_svc.h"
+
+/*
+ * Not run yet, see testcase.yaml: the pass thresholds are estimates to
+ * calibrate on the first run.
+ */
+
+/* LOCK_CMD_INFLIGHT_MAX in the gateway's lock_cmd.h. */
+#define CMD_INFLIGHT_MAX	8
+#define CMD_BENCH_COUNT		64
+#define CMD_BENCH_USER		1000
+#define CMD_BENCH_PIN		300000
+#define CMD_FRAME_MAX		9
+
+/* A full store, with the same users and PINs as the command benchmark. */
+#define BUNDLE_LEN		(CRED_BUNDLE_HDR_LEN + CRED_MAX_USERS * CRED_BUNDLE_RECORD_LEN)
+#define BUNDLE_SDU_LEN		1024
+#define BUNDLE_RESULT_LEN	3
+/* One Write Request per PIN moves well under 1 kB/s. Not measured; the
+ * bundle push has not been run either.
+ */
+#define BUNDLE_MIN_KBPS		2
+
+#define STEP_TIMEOUT		K_SECONDS(30)
+
+static struct bt_conn *conn;
+static uint16_t cmd_handle;
+
+static K_SEM_DEFINE(connected_sem, 0, 1);
+static K_SEM_DEFINE(security_sem, 0, 1);
+static K_SEM_DEFINE(gatt_sem, 0, 1);
+
+/* Commands of the current run. */
+static K_SEM_DEFINE(window_sem, 0, CMD_INFLIGHT_MAX);
+static K_SEM_DEFINE(acked_sem, 0, 1);
+static uint32_t cmd_count;
+static uint32_t cmd_acked;
+
+NET_BUF_POOL_FIXED_DEFINE(bundle_pool, 2, BT_L2CAP_SDU_BUF_SIZE(BUNDLE_SDU_LEN),
+			  CONFIG_BT_CONN_TX_USER_DATA_SIZE, NULL);
+
+static uint8_t bundle[BUNDLE_LEN];
+static struct bt_l2cap_le_chan bundle_chan;
+static K_SEM_DEFINE(bundle_sem, 0, 1);
+static uint8_t bundle_result[BUNDLE_RESULT_LEN];
+
+
+static void device_found(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
+			 struct net_buf_simple *ad)
+{
+	int err;
+
+	if (conn != NULL || type != BT_GAP_ADV_TYPE_ADV_IND) {
+		return;
+	}
+
+	err = bt_le_scan_stop();
+	if (err) {
+		FAIL("Scan stop failed (err %d)\n", err);
+		return;
+	}
+
+	/* The lock's fast profile, which it asks for while commands run. */
+	err = bt_conn_le_create(addr, BT_CONN_LE_CREATE_CONN,
+				BT_LE_CONN_PARAM(CONN_FAST_INTERVAL_MIN, CONN_FAST_INTERVAL_MAX,
+						 CONN_FAST_LATENCY, CONN_FAST_TIMEOUT),
+				&conn);
+	if (err) {
+		FAIL("Connection create failed (err %d)\n", err);
+	}
+}
+
+static void gateway_connected(struct bt_conn *c, uint8_t err)
+{
+	if (err) {
+		FAIL("Connection failed (err 0x%02x)\n", err);
+		return;
+	}
+
+	k_sem_give(&connected_sem);
+}
+
+static void gateway_disconnected(struct bt_conn *c, uint8_t reason)
+{
+	if (bst_result != Passed) {
+		FAIL("Disconnected (reason 0x%02x)\n", reason);
+	}
+}
+
+static void gateway_security_changed(struct bt_conn *c, bt_security_t level,
+				     enum bt_security_err err)
+{
+	if (err) {
+		FAIL("Pairing failed (err %d)\n", err);
+		return;
+	}
+
+	k_sem_give(&security_sem);
+}
+
+static struct bt_conn_cb gateway_conn_callbacks = {
+	.connected = gateway_connected,
+	.disconnected = gateway_disconnected,
+	.security_changed = gateway_security_changed,
+};
+
+static void mtu_exchanged(struct bt_conn *c, uint8_t err,
+			  struct bt_gatt_exchange_params *params)
+{
+}
+
+/* 2M PHY, full data length and the largest ATT MTU, as the gateway asks
+ * for before a bulk push. The lock asks for the same on its side, so
+ * whoever gets there first wins and this only waits for the result.
+ */
+static void link_setup(void)
+{
+	static struct bt_gatt_exchange_params mtu_params = {
+		.func = mtu_exchanged,
+	};
+	struct bt_conn_info info;
+
+	(void)bt_conn_le_phy_update(conn, BT_CONN_LE_PHY_PARAM_2M);
+	(void)bt_conn_le_data_len_update(conn, BT_LE_DATA_LEN_PARAM_MAX);
+	(void)bt_gatt_exchange_mtu(conn, &mtu_params);
+
+	for (int i = 0; i < 100; i++) {
+		if (bt_conn_get_info(conn, &info) == 0 &&
+		    info.le.phy->tx_phy == BT_GAP_LE_PHY_2M &&
+		    info.le.phy->rx_phy == BT_GAP_LE_PHY_2M &&
+		    info.le.data_len->tx_max_len == BT_GAP_DATA_LEN_MAX &&
+		    bt_gatt_get_mtu(conn) == CONFIG_BT_L2CAP_TX_MTU) {
+			return;
+		}
+		k_sleep(K_MSEC(100));
+	}
+
+	FAIL("Link not set up for throughput\n");
+}
+
+/* Waits for the lock to switch to its fast connection profile. */
+static uint32_t link_fast_wait(void)
+{
+	struct bt_conn_info info;
+
+	for (int i = 0; i < 100; i++) {
+		if (bt_conn_get_info(conn, &info) == 0 &&
+		    info.le.interval <= CONN_FAST_INTERVAL_MAX) {
+			return info.le.interval * 1250U;
+		}
+		k_sleep(K_MSEC(100));
+	}
+
+	FAIL("Lock never asked for its fast profile\n");
+
+	return 0;
+}
+
+static uint8_t cmd_discovered(struct bt_conn *c, const struct bt_gatt_attr *attr,
+			      struct bt_gatt_discover_params *params)
+{
+	if (attr != NULL) {
+		cmd_handle = bt_gatt_attr_value_handle(attr);
+	}
+	k_sem_give(&gatt_sem);
+
+	return BT_GATT_ITER_STOP;
+}
+
+/* Acks are [seq][status] pairs, in the order the commands were sent. */
+static uint8_t cmd_acks(struct bt_conn *c, struct bt_gatt_subscribe_params *params,
+			const void *data, uint16_t length)
+{
+	const uint8_t *ack = data;
+
+	if (data == NULL) {
+		return BT_GATT_ITER_STOP;
+	}
+
+	for (uint16_t i = 0; i + 1 < length; i += 2) {
+		if (ack[i] != (uint8_t)cmd_acked) {
+			FAIL("Ack for seq %u, expected %u\n", ack[i], (uint8_t)cmd_acked);
+		}
+		if (ack[i + 1] != LOCK_CMD_STATUS_OK) {
+			FAIL("Command %u failed (status 0x%02x)\n", ack[i], ack[i + 1]);
+		}
+
+		k_sem_give(&window_sem);
+		if (++cmd_acked == cmd_count) {
+			k_sem_give(&acked_sem);
+		}
+	}
+
+	return BT_GATT_ITER_CONTINUE;
+}
+
+static void cmd_subscribed(struct bt_conn *c, uint8_t err,
+			   struct bt_gatt_subscribe_params *params)
+{
+	if (err) {
+		FAIL("Ack subscription failed (err 0x%02x)\n", err);
+		return;
+	}
+
+	k_sem_give(&gatt_sem);
+}
+
+static void cmd_discover(void)
+{
+	static struct bt_uuid_128 cmd_uuid = BT_UUID_INIT_128(BT_UUID_LOCK_CMD_VAL);
+	static struct bt_gatt_discover_params discover_params;
+	static struct bt_gatt_subscribe_params subscribe_params;
+	int err;
+
+	discover_params.uuid = &cmd_uuid.uuid;
+	discover_params.func = cmd_discovered;
+	discover_params.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
+	discover_params.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+	discover_params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
+
+	err = bt_gatt_discover(conn, &discover_params);
+	if (err) {
+		FAIL("Discovery failed (err %d)\n", err);
+		return;
+	}
+	WAIT_FOR(&gatt_sem, STEP_TIMEOUT, "discovery");
+
+	if (cmd_handle == 0) {
+		FAIL("No command characteristic\n");
+		return;
+	}
+
+	subscribe_params.notify = cmd_acks;
+	subscribe_params.subscribe = cmd_subscribed;
+	subscribe_params.value = BT_GATT_CCC_NOTIFY;
+	subscribe_params.value_handle = cmd_handle;
+	/* In lock_svc the CCC follows the value. */
+	subscribe_params.ccc_handle = cmd_handle + 1;
+
+	err = bt_gatt_subscribe(conn, &subscribe_params);
+	if (err) {
+		FAIL("Subscribe failed (err %d)\n", err);
+		return;
+	}
+	WAIT_FOR(&gatt_sem, STEP_TIMEOUT, "ack subscription");
+}
+
+static uint8_t cmd_frame(uint8_t *frame, uint32_t i, uint8_t op)
+{
+	frame[0] = (uint8_t)i;
+	frame[1] = op;
+	sys_put_le16(CMD_BENCH_USER + i, &frame[2]);
+
+	if (op == LOCK_CMD_OP_PIN_REMOVE) {
+		return 4;
+	}
+
+	sys_put_le32(CMD_BENCH_PIN + i, &frame[4]);
+	frame[8] = 6;
+
+	return 9;
+}
+
+static void cmd_written(struct bt_conn *c, uint8_t err,
+			struct bt_gatt_write_params *params)
+{
+	if (err) {
+		FAIL("Command write failed (err 0x%02x)\n", err);
+		return;
+	}
+
+	k_sem_give(&gatt_sem);
+}
+
+static void cmd_send(const uint8_t *frame, uint8_t len, bool write_rsp)
+{
+	static struct bt_gatt_write_params write_params;
+	int err;
+
+	if (write_rsp) {
+		write_params.func = cmd_written;
+		write_params.handle = cmd_handle;
+		write_params.offset = 0;
+		write_params.data = frame;
+		write_params.length = len;
+
+		err = bt_gatt_write(conn, &write_params);
+		if (err) {
+			FAIL("Command write failed (err %d)\n", err);
+			return;
+		}
+		WAIT_FOR(&gatt_sem, STEP_TIMEOUT, "write response");
+		return;
+	}
+
+	/* Out of buffers only until the controller has sent some. */
+	while ((err = bt_gatt_write_without_response(conn, cmd_handle, frame, len,
+						     false)) == -ENOMEM) {
+		k_sleep(K_MSEC(1));
+	}
+	if (err) {
+		FAIL("Command write without response failed (err %d)\n", err);
+	}
+}
+
+/*
+ * Sends @p count commands with @p op, keeping up to @p window of them
+ * unacknowledged. With @p write_rsp each one is a Write Request, as the
+ * PIN characteristic takes them, and waits for the response and its ack
+ * before the next.
+ *
+ * @return Milliseconds from the first write to the last ack.
+ */
+static int64_t cmd_run(uint32_t count, uint32_t window, bool write_rsp, uint8_t op)
+{
+	uint8_t frame[CMD_FRAME_MAX];
+	int64_t start;
+	uint8_t len;
+
+	k_sem_reset(&window_sem);
+	for (uint32_t i = 0; i < window; i++) {
+		k_sem_give(&window_sem);
+	}
+	k_sem_reset(&acked_sem);
+	cmd_count = count;
+	cmd_acked = 0;
+
+	start = k_uptime_get();
+
+	for (uint32_t i = 0; i < count; i++) {
+		len = cmd_frame(frame, i, op);
+
+		WAIT_FOR(&window_sem, STEP_TIMEOUT, "a command ack");
+		cmd_send(frame, len, write_rsp);
+	}
+	WAIT_FOR(&acked_sem, STEP_TIMEOUT, "the last command ack");
+
+	return k_uptime_get() - start;
+}
+
+/*
+ * The same PIN_ADD commands sent one Write Request at a time and then
+ * pipelined as the gateway sends them, each followed by the PIN_REMOVE
+ * commands that empty the store again.
+ */
+static void cmd_bench(void)
+{
+	int64_t req_ms;
+	int64_t pipe_ms;
+	uint32_t interval_us;
+
+	(void)cmd_run(1, 1, false, LOCK_CMD_OP_PIN_ADD);
+	(void)cmd_run(1, 1, false, LOCK_CMD_OP_PIN_REMOVE);
+	interval_us = link_fast_wait();
+
+	req_ms = cmd_run(CMD_BENCH_COUNT, 1, true, LOCK_CMD_OP_PIN_ADD);
+	(void)cmd_run(CMD_BENCH_COUNT, CMD_INFLIGHT_MAX, false, LOCK_CMD_OP_PIN_REMOVE);
+
+	pipe_ms = cmd_run(CMD_BENCH_COUNT, CMD_INFLIGHT_MAX, false, LOCK_CMD_OP_PIN_ADD);
+	(void)cmd_run(CMD_BENCH_COUNT, CMD_INFLIGHT_MAX, false, LOCK_CMD_OP_PIN_REMOVE);
+
+	printk("%u PIN_ADD commands, %u us connection interval:\n", CMD_BENCH_COUNT,
+	       interval_us);
+	printk("  write request        %5u ms  %5u commands/s\n", (uint32_t)req_ms,
+	       (uint32_t)(CMD_BENCH_COUNT * 1000 / MAX(req_ms, 1)));
+	printk("  pipelined, %u deep    %5u ms  %5u commands/s\n", CMD_INFLIGHT_MAX,
+	       (uint32_t)pipe_ms, (uint32_t)(CMD_BENCH_COUNT * 1000 / MAX(pipe_ms, 1)));
+
+	if (pipe_ms * 2 > req_ms) {
+		FAIL("Pipelining gained less than twice (%u ms against %u ms)\n",
+		     (uint32_t)pipe_ms, (uint32_t)req_ms);
+	}
+}
+
+static void bundle_connected(struct bt_l2cap_chan *chan)
+{
+	k_sem_give(&bundle_sem);
+}
+
+static void bundle_disconnected(struct bt_l2cap_chan *chan)
+{
+}
+
+/* The lock's answer, [status][u16 records staged]. */
+static int bundle_recv(struct bt_l2cap_chan *chan, struct net_buf *buf)
+{
+	if (buf->len != BUNDLE_RESULT_LEN) {
+		FAIL("Bundle result of %u bytes\n", buf->len);
+		return 0;
+	}
+
+	memcpy(bundle_result, buf->data, BUNDLE_RESULT_LEN);
+	k_sem_give(&bundle_sem);
+
+	return 0;
+}
+
+static const struct bt_l2cap_chan_ops bundle_chan_ops = {
+	.connected = bundle_connected,
+	.disconnected = bundle_disconnected,
+	.recv = bundle_recv,
+};
+
+static void bundle_build(void)
+{
+	uint8_t *rec;
+
+	sys_put_le32(CRED_BUNDLE_MAGIC, &bundle[0]);
+	bundle[4] = CRED_BUNDLE_VERSION;
+	bundle[5] = 0;
+	sys_put_le16(CRED_MAX_USERS, &bundle[6]);
+	sys_put_le32(1, &bundle[8]);
+
+	for (uint32_t i = 0; i < CRED_MAX_USERS; i++) {
+		rec = &bundle[CRED_BUNDLE_HDR_LEN + i * CRED_BUNDLE_RECORD_LEN];
+
+		sys_put_le16(CMD_BENCH_USER + i, &rec[0]);
+		sys_put_le32(CMD_BENCH_PIN + i, &rec[2]);
+		rec[6] = 6;
+		rec[7] = 0;
+		sys_put_le16(0, &rec[8]);
+		sys_put_le16(0, &rec[10]);
+	}
+
+	sys_put_le32(crc32_ieee(&bundle[CRED_BUNDLE_HDR_LEN],
+				CRED_MAX_USERS * CRED_BUNDLE_RECORD_LEN), &bundle[12]);
+}
+
+/*
+ * A full store pushed over the bundle channel, timed from the first SDU
+ * to the lock's answer, so staging and the commit are included.
+ */
+static void bundle_bench(void)
+{
+	struct net_buf *buf;
+	int64_t start;
+	uint32_t ms;
+	size_t len;
+	int err;
+
+	bundle_build();
+
+	bundle_chan.chan.ops = &bundle_chan_ops;
+	err = bt_l2cap_chan_connect(conn, &bundle_chan.chan, CRED_BUNDLE_PSM);
+	if (err) {
+		FAIL("Bundle channel connect failed (err %d)\n", err);
+		return;
+	}
+	WAIT_FOR(&bundle_sem, STEP_TIMEOUT, "the bundle channel");
+
+	start = k_uptime_get();
+
+	/* The pool paces the SDUs; the stack holds them until credits come. */
+	for (size_t off = 0; off < BUNDLE_LEN; off += len) {
+		len = MIN(MIN(BUNDLE_SDU_LEN, bundle_chan.tx.mtu), BUNDLE_LEN - off);
+
+		buf = net_buf_alloc(&bundle_pool, K_FOREVER);
+		net_buf_reserve(buf, BT_L2CAP_SDU_CHAN_SEND_RESERVE);
+		net_buf_add_mem(buf, &bundle[off], len);
+
+		err = bt_l2cap_chan_send(&bundle_chan.chan, buf);
+		if (err < 0) {
+			net_buf_unref(buf);
+			FAIL("Bundle send failed (err %d)\n", err);
+			return;
+		}
+	}
+	WAIT_FOR(&bundle_sem, STEP_TIMEOUT, "the bundle result");
+
+	ms = MAX(k_uptime_get() - start, 1);
+
+	printk("%u byte bundle, %u records, %u byte SDUs of %u byte segments:\n",
+	       BUNDLE_LEN, CRED_MAX_USERS, MIN(BUNDLE_SDU_LEN, bundle_chan.tx.mtu),
+	       bundle_chan.tx.mps);
+	printk("  %u ms, %u kB/s, %u records/s\n", ms, BUNDLE_LEN / ms,
+	       CRED_MAX_USERS * 1000U / ms);
+
+	if (bundle_result[0] != CRED_BUNDLE_STATUS_OK ||
+	    sys_get_le16(&bundle_result[1]) != CRED_MAX_USERS) {
+		FAIL("Bundle rejected (status 0x%02x, %u records staged)\n",
+		     bundle_result[0], sys_get_le16(&bundle_result[1]));
+		return;
+	}
+
+	if (BUNDLE_LEN / ms < BUNDLE_MIN_KBPS) {
+		FAIL("Bundle at %u kB/s\n", BUNDLE_LEN / ms);
+		return;
+	}
+
+	(void)bt_l2cap_chan_disconnect(&bundle_chan.chan);
+
+	/* Committed: the bundle's first user is in the store. */
+	(void)cmd_run(1, 1, false, LOCK_CMD_OP_PIN_REMOVE);
+}
+
+void gateway_main(void)
+{
+	int err;
+
+	err = bt_enable(NULL);
+	if (err) {
+		FAIL("Bluetooth init failed (err %d)\n", err);
+		return;
+	}
+	bt_conn_cb_register(&gateway_conn_callbacks);
+
+	err = bt_le_scan_start(BT_LE_SCAN_PASSIVE, device_found);
+	if (err) {
+		FAIL("Scan start failed (err %d)\n", err);
+		return;
+	}
+	WAIT_FOR(&connected_sem, STEP_TIMEOUT, "the connection");
+
+	/* The lock service and the bundle channel need an encrypted link. */
+	err = bt_conn_set_security(conn, BT_SECURITY_L2);
+	if (err) {
+		FAIL("Security request failed (err %d)\n", err);
+		return;
+	}
+	WAIT_FOR(&security_sem, STEP_TIMEOUT, "pairing");
+
+	link_setup();
+	cmd_discover();
+	cmd_bench();
+	bundle_bench();
+
+	PASS("Gateway done\n");
+
+	(void)bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+}
@@ -0,0 +1,73 @@
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/settings/settings.h>
+
+#include "common.h"
+#include "actuator.h"
+#include "adv_status.h"
+#include "credentials.h"
+#include "cred_bundle.h"
+#include "gap_advertising.h"
+#include "gap_connection.h"
+
+static K_SEM_DEFINE(disconnected_sem, 0, 1);
+
+static void lock_disconnected(struct bt_conn *conn, uint8_t reason)
+{
+	k_sem_give(&disconnected_sem);
+}
+
+static struct bt_conn_cb lock_conn_callbacks = {
+	.disconnected = lock_disconnected,
+};
+
+/*
+ * Brought up as main() does, without the keypad, the button and the
+ * passkey entry: the gateway pairs with Just Works here.
+ */
+void lock_main(void)
+{
+	int err;
+
+	err = bt_enable(NULL);
+	if (err) {
+		FAIL("Bluetooth init failed (err %d)\n", err);
+		return;
+	}
+	bt_conn_cb_register(&connection_callbacks);
+	bt_conn_cb_register(&lock_conn_callbacks);
+
+	settings_load();
+
+	err = credentials_init();
+	if (err) {
+		FAIL("Credential store not available (err %d)\n", err);
+		return;
+	}
+
+	err = cred_bundle_init();
+	if (err) {
+		FAIL("Bulk provisioning not available (err %d)\n", err);
+		return;
+	}
+
+	err = adv_status_init();
+	if (err) {
+		FAIL("Advertised status not available (err %d)\n", err);
+		return;
+	}
+
+	err = actuator_init();
+	if (err) {
+		FAIL("Actuator init failed (err %d)\n", err);
+		return;
+	}
+
+	advetising_start();
+
+	/* The gateway checks the results and hangs up when it is done. */
+	k_sem_take(&disconnected_sem, K_FOREVER);
+
+	PASS("Lock done\n");
+}
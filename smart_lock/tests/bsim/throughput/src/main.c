@@ -0,0 +1,58 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "common.h"
+
+/* gatt_lock_svc.c logs to the application's module. */
+LOG_MODULE_REGISTER(smart_door_lock);
+
+/* Simulated time either device gets before the test counts as hung. */
+#define WAIT_TIME_US	(150 * 1000000ULL)
+
+static void test_init(void)
+{
+	bst_ticker_set_next_tick_absolute(WAIT_TIME_US);
+	bst_result = In_progress;
+}
+
+static void test_tick(bs_time_t hw_device_time)
+{
+	if (bst_result != Passed) {
+		FAIL("Not passed after %llu s\n", WAIT_TIME_US / 1000000);
+	}
+}
+
+static const struct bst_test_instance test_def[] = {
+	{
+		.test_id = "lock",
+		.test_descr = "The lock: GATT service, command path and bundle channel",
+		.test_pre_init_f = test_init,
+		.test_tick_f = test_tick,
+		.test_main_f = lock_main,
+	},
+	{
+		.test_id = "gateway",
+		.test_descr = "Connects to the lock and times each path",
+		.test_pre_init_f = test_init,
+		.test_tick_f = test_tick,
+		.test_main_f = gateway_main,
+	},
+	BSTEST_END_MARKER
+};
+
+static struct bst_test_list *test_throughput_install(struct bst_test_list *tests)
+{
+	return bst_add_tests(tests, test_def);
+}
+
+bst_test_install_t test_installers[] = {
+	test_throughput_install,
+	NULL
+};
+
+int main(void)
+{
+	bst_main();
+
+	return 0;
+}
@@ -0,0 +1,21 @@
+#!/usr/bin/env bash
+#
+# The lock (device 0) and the gateway (device 1), on the 2M PHY with full
+# data length once the link is up.
+#
+source ${ZEPHYR_BASE}/tests/bsim/sh_common.source
+
+simulation_id="lock_throughput"
+verbosity_level=2
+EXECUTE_TIMEOUT=300
+
+cd ${BSIM_OUT_PATH}/bin
+
+exe=./bs_${BOARD_TS}_tests_bsim_throughput_prj_conf
+
+Execute ${exe} -v=${verbosity_level} -s=${simulation_id} -d=0 -testid=lock -RealEncryption=1
+Execute ${exe} -v=${verbosity_level} -s=${simulation_id} -d=1 -testid=gateway -RealEncryption=1
+
+Execute ./bs_2G4_phy_v1 -v=${verbosity_level} -s=${simulation_id} -D=2 -sim_length=180e6 $@
+
+wait_for_background_jobs
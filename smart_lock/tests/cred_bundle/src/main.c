@@ -0,0 +1,314 @@
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/ztest.h>
+
+#include "cred_bundle_parse.h"
+#include "credentials.h"
+#include "pin_entry.h"
+#include "wall_clock.h"
+
+#define DEFAULT_PIN	123456
+
+#define BUNDLE_MAX	(CRED_BUNDLE_HDR_LEN + CRED_MAX_USERS * CRED_BUNDLE_RECORD_LEN)
+
+static uint8_t bundle[BUNDLE_MAX + 16];
+
+static uint16_t record_user(uint16_t i)
+{
+	return 100 + i;
+}
+
+static uint32_t record_pin(uint16_t i)
+{
+	return 200000 + i * 7U;
+}
+
+static uint8_t *record_at(uint16_t i)
+{
+	return &bundle[CRED_BUNDLE_HDR_LEN + i * CRED_BUNDLE_RECORD_LEN];
+}
+
+static void bundle_seal(uint16_t count)
+{
+	uint32_t crc = crc32_ieee(record_at(0), count * CRED_BUNDLE_RECORD_LEN);
+
+	sys_put_le32(crc, &bundle[12]);
+}
+
+/* A valid bundle of @p count six digit PINs, returns its length. */
+static size_t bundle_build(uint16_t count)
+{
+	memset(bundle, 0, sizeof(bundle));
+
+	sys_put_le32(CRED_BUNDLE_MAGIC, &bundle[0]);
+	bundle[4] = CRED_BUNDLE_VERSION;
+	sys_put_le16(count, &bundle[6]);
+	sys_put_le32(0x5e41a1, &bundle[8]);
+
+	for (uint16_t i = 0; i < count; i++) {
+		uint8_t *rec = record_at(i);
+
+		sys_put_le16(record_user(i), &rec[0]);
+		sys_put_le32(record_pin(i), &rec[2]);
+		rec[6] = 6;
+	}
+	bundle_seal(count);
+
+	return CRED_BUNDLE_HDR_LEN + count * CRED_BUNDLE_RECORD_LEN;
+}
+
+static int bundle_send(size_t len, size_t seg_len)
+{
+	struct cred_bundle_parse p;
+	int err = -EINPROGRESS;
+
+	cred_bundle_parse_begin(&p);
+
+	for (size_t off = 0; off < len; off += seg_len) {
+		zassert_equal(err, -EINPROGRESS, "bundle ended early at byte %zu", off);
+		err = cred_bundle_parse_feed(&p, &bundle[off], MIN(seg_len, len - off));
+	}
+
+	return err;
+}
+
+static void expect_user(uint32_t pin, uint16_t user_id)
+{
+	uint16_t found = UINT16_MAX;
+
+	zassert_ok(credentials_verify(pin, 6, &found), "PIN %u refused", pin);
+	zassert_equal(found, user_id, "PIN %u is user %u, not %u", pin, found, user_id);
+}
+
+static void expect_refused(uint32_t pin, int err)
+{
+	uint16_t found;
+
+	zassert_equal(credentials_verify(pin, 6, &found), err, "PIN %u", pin);
+}
+
+static void expect_store_unchanged(void)
+{
+	expect_user(DEFAULT_PIN, 0);
+	expect_refused(record_pin(0), -EACCES);
+	expect_user(DEFAULT_PIN, 0);
+}
+
+static void *setup(void)
+{
+	zassert_ok(settings_subsys_init());
+	zassert_ok(settings_load());
+
+	return NULL;
+}
+
+/* Every test starts from a store with only the default PIN. */
+static void before(void *fixture)
+{
+	const struct flash_area *fa;
+
+	ARG_UNUSED(fixture);
+
+	zassert_ok(flash_area_open(FIXED_PARTITION_ID(cred_partition), &fa));
+	zassert_ok(flash_area_erase(fa, 0, fa->fa_size));
+	flash_area_close(fa);
+
+	(void)settings_delete("cred/init");
+	(void)settings_delete("cred/lockout");
+	zassert_ok(credentials_init());
+
+	expect_user(DEFAULT_PIN, 0);
+}
+
+ZTEST_SUITE(cred_bundle, NULL, setup, before, NULL, NULL);
+
+ZTEST(cred_bundle, test_bundle_replaces_the_store)
+{
+	struct cred_bundle_parse p;
+	size_t len = bundle_build(10);
+
+	cred_bundle_parse_begin(&p);
+	zassert_ok(cred_bundle_parse_feed(&p, bundle, len));
+	zassert_equal(p.staged, 10);
+	zassert_equal(p.serial, 0x5e41a1);
+
+	for (uint16_t i = 0; i < 10; i++) {
+		expect_user(record_pin(i), record_user(i));
+	}
+	expect_refused(DEFAULT_PIN, -EACCES);
+
+	/* And survives a reset */
+	zassert_ok(credentials_init());
+	expect_user(record_pin(9), record_user(9));
+}
+
+ZTEST(cred_bundle, test_segments_cut_anywhere)
+{
+	static const size_t seg_lens[] = { 1, 5, CRED_BUNDLE_RECORD_LEN, 13, 247 };
+	size_t len = bundle_build(40);
+
+	for (size_t i = 0; i < ARRAY_SIZE(seg_lens); i++) {
+		zassert_ok(bundle_send(len, seg_lens[i]), "%zu byte segments", seg_lens[i]);
+		expect_user(record_pin(39), record_user(39));
+	}
+}
+
+ZTEST(cred_bundle, test_bytes_after_the_end_are_dropped)
+{
+	struct cred_bundle_parse p;
+	size_t len = bundle_build(2);
+
+	cred_bundle_parse_begin(&p);
+	zassert_ok(cred_bundle_parse_feed(&p, bundle, len + 16));
+	zassert_equal(cred_bundle_parse_feed(&p, bundle, len), -EALREADY);
+	zassert_false(cred_bundle_parse_abort(&p));
+
+	expect_user(record_pin(1), record_user(1));
+}
+
+ZTEST(cred_bundle, test_nothing_parsed_before_begin)
+{
+	struct cred_bundle_parse p = {0};
+	size_t len = bundle_build(2);
+
+	zassert_equal(cred_bundle_parse_feed(&p, bundle, len), -EALREADY);
+	expect_store_unchanged();
+}
+
+ZTEST(cred_bundle, test_bad_header)
+{
+	size_t len = bundle_build(2);
+
+	bundle[0] ^= 0xff;
+	zassert_equal(bundle_send(len, len), -EINVAL, "magic");
+
+	len = bundle_build(2);
+	bundle[4] = CRED_BUNDLE_VERSION + 1;
+	zassert_equal(bundle_send(len, len), -EINVAL, "version");
+
+	len = bundle_build(2);
+	sys_put_le16(0, &bundle[6]);
+	zassert_equal(bundle_send(CRED_BUNDLE_HDR_LEN, CRED_BUNDLE_HDR_LEN), -EINVAL,
+		      "no records");
+
+	len = bundle_build(2);
+	sys_put_le16(CRED_MAX_USERS + 1, &bundle[6]);
+	zassert_equal(bundle_send(CRED_BUNDLE_HDR_LEN, CRED_BUNDLE_HDR_LEN), -ENOSPC,
+		      "too many records");
+
+	expect_store_unchanged();
+}
+
+ZTEST(cred_bundle, test_bad_record)
+{
+	struct {
+		uint8_t digits;
+		uint8_t flags;
+		uint16_t start;
+		uint16_t end;
+	} bad[] = {
+		{ .digits = 0 },
+		{ .digits = PIN_ENTRY_MAX_DIGITS + 1 },
+		{ .digits = 6, .flags = CRED_BUNDLE_FLAG_WINDOW, .start = 24 * 60 },
+		{ .digits = 6, .flags = CRED_BUNDLE_FLAG_WINDOW, .end = 24 * 60 },
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(bad); i++) {
+		struct cred_bundle_parse p;
+		size_t len = bundle_build(4);
+		uint8_t *rec = record_at(2);
+
+		rec[6] = bad[i].digits;
+		rec[7] = bad[i].flags;
+		sys_put_le16(bad[i].start, &rec[8]);
+		sys_put_le16(bad[i].end, &rec[10]);
+		bundle_seal(4);
+
+		cred_bundle_parse_begin(&p);
+		zassert_equal(cred_bundle_parse_feed(&p, bundle, len), -EINVAL, "case %zu", i);
+		zassert_equal(p.staged, 2, "case %zu", i);
+	}
+
+	expect_store_unchanged();
+}
+
+ZTEST(cred_bundle, test_duplicates)
+{
+	size_t len = bundle_build(4);
+
+	sys_put_le16(record_user(0), &record_at(3)[0]);
+	bundle_seal(4);
+	zassert_equal(bundle_send(len, len), -EEXIST, "user twice");
+
+	len = bundle_build(4);
+	sys_put_le32(record_pin(0), &record_at(3)[2]);
+	bundle_seal(4);
+	zassert_equal(bundle_send(len, len), -EEXIST, "PIN twice");
+
+	expect_store_unchanged();
+}
+
+ZTEST(cred_bundle, test_crc_mismatch)
+{
+	struct cred_bundle_parse p;
+	size_t len = bundle_build(8);
+
+	/* A PIN changed on the way */
+	record_at(5)[2] ^= 0x01;
+
+	cred_bundle_parse_begin(&p);
+	zassert_equal(cred_bundle_parse_feed(&p, bundle, len), -EBADMSG);
+	zassert_equal(p.staged, 8, "the CRC is only known at the end");
+
+	expect_store_unchanged();
+}
+
+ZTEST(cred_bundle, test_abort)
+{
+	struct cred_bundle_parse p;
+	size_t len = bundle_build(8);
+
+	cred_bundle_parse_begin(&p);
+	zassert_equal(cred_bundle_parse_feed(&p, bundle, len / 2), -EINPROGRESS);
+	zassert_true(cred_bundle_parse_abort(&p));
+
+	zassert_equal(cred_bundle_parse_feed(&p, &bundle[len / 2], len - len / 2), -EALREADY);
+	zassert_false(cred_bundle_parse_abort(&p));
+
+	expect_store_unchanged();
+}
+
+ZTEST(cred_bundle, test_time_window)
+{
+	/* 2024-01-01 00:00 UTC */
+	const uint32_t midnight = 1704067200U;
+	size_t len = bundle_build(2);
+	uint8_t *rec = record_at(1);
+
+	rec[7] = CRED_BUNDLE_FLAG_WINDOW;
+	sys_put_le16(9 * 60, &rec[8]);
+	sys_put_le16(10 * 60, &rec[10]);
+	bundle_seal(2);
+	zassert_ok(bundle_send(len, len));
+
+	wall_clock_set(midnight + 9 * 3600 + 1800);
+	expect_user(record_pin(1), record_user(1));
+
+	wall_clock_set(midnight + 11 * 3600);
+	expect_refused(record_pin(1), -EPERM);
+	expect_user(record_pin(0), record_user(0));
+}
+
+ZTEST(cred_bundle, test_full_bundle)
+{
+	size_t len = bundle_build(CRED_MAX_USERS);
+
+	zassert_ok(bundle_send(len, 247));
+
+	expect_user(record_pin(0), record_user(0));
+	expect_user(record_pin(CRED_MAX_USERS - 1), record_user(CRED_MAX_USERS - 1));
+}
@@ -0,0 +1,444 @@
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/stats/stats.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/ztest.h>
+
+#include "credentials.h"
+#include "wall_clock.h"
+
+#define DEFAULT_PIN	123456
+#define DEFAULT_DIGITS	6
+
+#define BENCH_ATTEMPTS	10000
+
+/* Six digits, distinct for every user and never the default PIN. */
+static uint32_t user_pin(uint16_t user_id)
+{
+	return 100003U + user_id * 1741U;
+}
+
+static void expect_user(uint32_t pin, uint8_t digits, uint16_t user_id)
+{
+	uint16_t found = UINT16_MAX;
+
+	zassert_ok(credentials_verify(pin, digits, &found), "PIN %u refused", pin);
+	zassert_equal(found, user_id, "PIN %u is user %u, not %u", pin, found, user_id);
+}
+
+static void expect_refused(uint32_t pin, uint8_t digits, int err)
+{
+	uint16_t found;
+
+	zassert_equal(credentials_verify(pin, digits, &found), err, "PIN %u", pin);
+}
+
+/* Erases the store and forgets it was ever set up. The salt stays. */
+static void first_boot(void)
+{
+	const struct flash_area *fa;
+
+	zassert_ok(flash_area_open(FIXED_PARTITION_ID(cred_partition), &fa));
+	zassert_ok(flash_area_erase(fa, 0, fa->fa_size));
+	flash_area_close(fa);
+
+	(void)settings_delete("cred/init");
+	zassert_ok(credentials_init());
+}
+
+static void fill_store(void)
+{
+	for (uint16_t u = 1; u < CRED_MAX_USERS; u++) {
+		zassert_ok(credentials_add(u, user_pin(u), 6, NULL), "user %u", u);
+	}
+}
+
+static void *setup(void)
+{
+	zassert_ok(settings_subsys_init());
+	zassert_ok(settings_load());
+
+	return NULL;
+}
+
+static void before(void *fixture)
+{
+	ARG_UNUSED(fixture);
+
+	/* No lockout is left behind by the previous test */
+	(void)settings_delete("cred/lockout");
+	first_boot();
+
+	zassert_equal(credentials_lockout_remaining(), 0);
+	expect_user(DEFAULT_PIN, DEFAULT_DIGITS, 0);
+}
+
+ZTEST_SUITE(credentials, NULL, setup, before, NULL, NULL);
+
+ZTEST(credentials, test_first_boot_adds_default_pin)
+{
+	expect_user(DEFAULT_PIN, DEFAULT_DIGITS, 0);
+
+	zassert_ok(credentials_init());
+	expect_user(DEFAULT_PIN, DEFAULT_DIGITS, 0);
+}
+
+ZTEST(credentials, test_emptied_store_stays_empty)
+{
+	zassert_ok(credentials_remove(0));
+	zassert_ok(credentials_init());
+
+	expect_refused(DEFAULT_PIN, DEFAULT_DIGITS, -EACCES);
+}
+
+ZTEST(credentials, test_add_verify_remove)
+{
+	zassert_ok(credentials_add(7, 4711, 4, NULL));
+	expect_user(4711, 4, 7);
+
+	zassert_ok(credentials_remove(7));
+	expect_refused(4711, 4, -EACCES);
+	zassert_equal(credentials_remove(7), -ENOENT);
+}
+
+ZTEST(credentials, test_leading_zeros_matter)
+{
+	zassert_ok(credentials_add(7, 42, 4, NULL));
+
+	expect_refused(42, 2, -EACCES);
+	expect_user(42, 4, 7);
+}
+
+ZTEST(credentials, test_replacing_a_user_drops_the_old_pin)
+{
+	zassert_ok(credentials_add(3, 111111, 6, NULL));
+	zassert_ok(credentials_add(3, 222222, 6, NULL));
+
+	expect_refused(111111, 6, -EACCES);
+	expect_user(222222, 6, 3);
+}
+
+ZTEST(credentials, test_failed_replacement_keeps_the_old_pin)
+{
+	zassert_ok(credentials_add(1, 555555, 6, NULL));
+	zassert_ok(credentials_add(3, 111111, 6, NULL));
+
+	zassert_equal(credentials_add(3, 555555, 6, NULL), -EACCES);
+	expect_user(111111, 6, 3);
+
+	/* A full store can only take the new PIN by compacting, which has
+	 * to wait for the staged one.
+	 */
+	for (uint16_t u = 4; u <= CRED_MAX_USERS; u++) {
+		zassert_ok(credentials_add(u, user_pin(u), 6, NULL), "user %u", u);
+	}
+	zassert_ok(credentials_stage_begin());
+	zassert_equal(credentials_add(3, 222222, 6, NULL), -EBUSY);
+	credentials_stage_abort();
+	expect_user(111111, 6, 3);
+	expect_refused(222222, 6, -EACCES);
+}
+
+ZTEST(credentials, test_same_pin_new_window)
+{
+	const struct cred_window office = { .start = 8 * 60, .end = 17 * 60 };
+	/* 2024-01-01 00:00 UTC */
+	const uint32_t midnight = 1704067200U;
+
+	zassert_ok(credentials_add(4, 444444, 6, NULL));
+	zassert_ok(credentials_add(4, 444444, 6, &office));
+
+	wall_clock_set(midnight + 20 * 3600);
+	expect_refused(444444, 6, -EPERM);
+}
+
+ZTEST(credentials, test_pin_of_another_user_is_refused)
+{
+	zassert_ok(credentials_add(1, 555555, 6, NULL));
+
+	/* Indistinguishable from an unusable PIN */
+	zassert_equal(credentials_add(2, 555555, 6, NULL), -EACCES);
+	expect_user(555555, 6, 1);
+	zassert_equal(credentials_remove(2), -ENOENT);
+}
+
+ZTEST(credentials, test_time_window)
+{
+	const struct cred_window office = { .start = 8 * 60, .end = 17 * 60 };
+	const struct cred_window night = { .start = 22 * 60, .end = 6 * 60 };
+	/* 2024-01-01 00:00 UTC */
+	const uint32_t midnight = 1704067200U;
+
+	zassert_ok(credentials_add(4, 444444, 6, &office));
+	zassert_ok(credentials_add(5, 555555, 6, &night));
+
+	wall_clock_set(midnight + 12 * 3600);
+	expect_user(444444, 6, 4);
+	expect_refused(555555, 6, -EPERM);
+
+	wall_clock_set(midnight + 23 * 3600);
+	expect_refused(444444, 6, -EPERM);
+	expect_user(555555, 6, 5);
+}
+
+ZTEST(credentials, test_lockout_backoff)
+{
+	for (int i = 1; i < CRED_FREE_ATTEMPTS; i++) {
+		expect_refused(999999, 6, -EACCES);
+		zassert_equal(credentials_lockout_remaining(), 0);
+	}
+
+	expect_refused(999999, 6, -EACCES);
+	zassert_between_inclusive(credentials_lockout_remaining(), 1, CRED_LOCKOUT_BASE_MS);
+
+	/* The right PIN is refused as well until the lockout ends */
+	expect_refused(DEFAULT_PIN, DEFAULT_DIGITS, -EBUSY);
+	k_sleep(K_MSEC(credentials_lockout_remaining()));
+
+	/* Every further failure doubles it */
+	expect_refused(999999, 6, -EACCES);
+	zassert_between_inclusive(credentials_lockout_remaining(),
+				  CRED_LOCKOUT_BASE_MS + 1, 2 * CRED_LOCKOUT_BASE_MS);
+	k_sleep(K_MSEC(credentials_lockout_remaining()));
+
+	/* And a match starts over */
+	expect_user(DEFAULT_PIN, DEFAULT_DIGITS, 0);
+	expect_refused(999999, 6, -EACCES);
+	zassert_equal(credentials_lockout_remaining(), 0);
+}
+
+ZTEST(credentials, test_lockout_survives_a_reset)
+{
+	for (int i = 0; i < CRED_FREE_ATTEMPTS; i++) {
+		expect_refused(999999, 6, -EACCES);
+	}
+
+	zassert_ok(credentials_init());
+	zassert_between_inclusive(credentials_lockout_remaining(), 1, CRED_LOCKOUT_BASE_MS);
+	expect_refused(DEFAULT_PIN, DEFAULT_DIGITS, -EBUSY);
+	k_sleep(K_MSEC(credentials_lockout_remaining()));
+
+	/* No free attempts after the reset either */
+	expect_refused(999999, 6, -EACCES);
+	zassert_between_inclusive(credentials_lockout_remaining(),
+				  CRED_LOCKOUT_BASE_MS + 1, 2 * CRED_LOCKOUT_BASE_MS);
+	k_sleep(K_MSEC(credentials_lockout_remaining()));
+
+	/* Until a match clears it for good */
+	expect_user(DEFAULT_PIN, DEFAULT_DIGITS, 0);
+	zassert_ok(credentials_init());
+	zassert_equal(credentials_lockout_remaining(), 0);
+	expect_refused(999999, 6, -EACCES);
+	zassert_equal(credentials_lockout_remaining(), 0);
+}
+
+ZTEST(credentials, test_full_store)
+{
+	fill_store();
+	zassert_equal(credentials_add(CRED_MAX_USERS, 987654, 6, NULL), -ENOSPC);
+
+	/* A full store still takes a new PIN for a user it holds */
+	zassert_ok(credentials_add(5, 987654, 6, NULL));
+	expect_refused(user_pin(5), 6, -EACCES);
+	expect_user(987654, 6, 5);
+	zassert_ok(credentials_add(5, user_pin(5), 6, NULL));
+
+	for (uint16_t u = 1; u < CRED_MAX_USERS; u++) {
+		expect_user(user_pin(u), 6, u);
+	}
+
+	zassert_ok(credentials_init());
+	for (uint16_t u = 1; u < CRED_MAX_USERS; u++) {
+		expect_user(user_pin(u), 6, u);
+	}
+	expect_user(DEFAULT_PIN, DEFAULT_DIGITS, 0);
+}
+
+ZTEST(credentials, test_churn_compacts)
+{
+	/* Every change takes a fresh slot, so this goes through the whole
+	 * bank several times over.
+	 */
+	for (uint32_t round = 0; round < 4 * CRED_SLOTS; round++) {
+		zassert_ok(credentials_add(1 + round % 32, 200000 + round, 6, NULL),
+			   "round %u", round);
+	}
+
+	zassert_ok(credentials_init());
+	for (uint32_t round = 4 * CRED_SLOTS - 32; round < 4 * CRED_SLOTS; round++) {
+		expect_user(200000 + round, 6, 1 + round % 32);
+	}
+	expect_refused(200000, 6, -EACCES);
+	expect_user(DEFAULT_PIN, DEFAULT_DIGITS, 0);
+}
+
+ZTEST(credentials, test_staged_replacement)
+{
+	zassert_ok(credentials_add(5, 333333, 6, NULL));
+
+	zassert_ok(credentials_stage_begin());
+	for (uint16_t u = 10; u < 20; u++) {
+		zassert_ok(credentials_stage_add(u, user_pin(u), 6, NULL));
+	}
+	zassert_equal(credentials_stage_add(10, 1, 6, NULL), -EEXIST);
+	zassert_equal(credentials_stage_add(20, user_pin(10), 6, NULL), -EEXIST);
+
+	/* Nothing changes until the commit */
+	expect_user(333333, 6, 5);
+	expect_refused(user_pin(10), 6, -EACCES);
+	expect_user(333333, 6, 5);
+
+	zassert_ok(credentials_stage_commit());
+	expect_refused(333333, 6, -EACCES);
+	expect_refused(DEFAULT_PIN, DEFAULT_DIGITS, -EACCES);
+
+	zassert_ok(credentials_init());
+	for (uint16_t u = 10; u < 20; u++) {
+		expect_user(user_pin(u), 6, u);
+	}
+}
+
+ZTEST(credentials, test_reset_while_staging_keeps_the_store)
+{
+	zassert_ok(credentials_stage_begin());
+	zassert_ok(credentials_stage_add(10, user_pin(10), 6, NULL));
+
+	zassert_ok(credentials_init());
+	zassert_equal(credentials_stage_add(11, user_pin(11), 6, NULL), -EINVAL);
+	zassert_equal(credentials_stage_commit(), -EINVAL);
+
+	expect_user(DEFAULT_PIN, DEFAULT_DIGITS, 0);
+	expect_refused(user_pin(10), 6, -EACCES);
+}
+
+ZTEST(credentials, test_aborted_or_empty_stage_is_not_committed)
+{
+	zassert_ok(credentials_stage_begin());
+	zassert_equal(credentials_stage_commit(), -EINVAL);
+
+	zassert_ok(credentials_stage_begin());
+	zassert_ok(credentials_stage_add(10, user_pin(10), 6, NULL));
+	credentials_stage_abort();
+	zassert_equal(credentials_stage_commit(), -EINVAL);
+
+	expect_user(DEFAULT_PIN, DEFAULT_DIGITS, 0);
+}
+
+/*
+ * Benchmark: keypad attempts against a full store.
+ *
+ * native_sim only moves its kernel clock when the simulation says so, so
+ * attempts are timed with the host's time stamp counter. Flash traffic is
+ * read from the flash simulator's statistics, which count the settings
+ * partition as well.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+static uint64_t cycles_now(void)
+{
+	return __builtin_ia32_rdtsc();
+}
+#else
+static uint64_t cycles_now(void)
+{
+	return 0;
+}
+#endif
+
+struct flash_counters {
+	uint32_t bytes_read;
+	uint32_t bytes_written;
+	uint32_t erase_calls;
+};
+
+static int counter_cb(struct stats_hdr *hdr, void *arg, const char *name, uint16_t off)
+{
+	struct flash_counters *c = arg;
+	uint32_t value = *(uint32_t *)((uint8_t *)hdr + off);
+
+	if (strcmp(name, "bytes_read") == 0) {
+		c->bytes_read = value;
+	} else if (strcmp(name, "bytes_written") == 0) {
+		c->bytes_written = value;
+	} else if (strcmp(name, "flash_erase_calls") == 0) {
+		c->erase_calls = value;
+	}
+
+	return 0;
+}
+
+static struct flash_counters flash_counters(void)
+{
+	struct flash_counters c = {0};
+	struct stats_hdr *hdr = stats_group_find("flash_sim_stats");
+
+	zassert_not_null(hdr, "no flash simulator statistics");
+	zassert_ok(stats_walk(hdr, counter_cb, &c));
+
+	return c;
+}
+
+/* Two misses, then a match, so the lockout never starts. */
+static bool bench_is_match(uint32_t attempt)
+{
+	return attempt % 3 == 2;
+}
+
+static int bench_attempt(uint32_t attempt)
+{
+	uint16_t user_id;
+
+	if (bench_is_match(attempt)) {
+		return credentials_verify(user_pin(1 + attempt % (CRED_MAX_USERS - 1)), 6,
+					  &user_id);
+	}
+
+	return credentials_verify(990000 + attempt % 10000, 6, &user_id);
+}
+
+ZTEST(credentials, test_verify_bench)
+{
+	struct flash_counters before, after;
+	uint64_t cycles[2] = {0};
+	uint32_t attempts[2] = {0};
+	uint32_t read_per_attempt[2];
+
+	fill_store();
+
+	/* The same flash is read whether or not the PIN matches. */
+	for (int match = 0; match < 2; match++) {
+		before = flash_counters();
+		zassert_equal(bench_attempt(match ? 2 : 0), match ? 0 : -EACCES);
+		after = flash_counters();
+		read_per_attempt[match] = after.bytes_read - before.bytes_read;
+	}
+	zassert_equal(read_per_attempt[0], read_per_attempt[1],
+		      "a miss reads %u bytes, a match %u",
+		      read_per_attempt[0], read_per_attempt[1]);
+
+	before = flash_counters();
+	for (uint32_t i = 0; i < BENCH_ATTEMPTS; i++) {
+		bool match = bench_is_match(i);
+		uint64_t start = cycles_now();
+		int err = bench_attempt(i);
+
+		cycles[match] += cycles_now() - start;
+		attempts[match]++;
+		zassert_equal(err, match ? 0 : -EACCES, "attempt %u: err %d", i, err);
+	}
+	after = flash_counters();
+
+	TC_PRINT("%u keypad attempts against %u users\n", BENCH_ATTEMPTS, CRED_MAX_USERS);
+	TC_PRINT("  host cycles per miss    %8llu\n",
+		 (unsigned long long)(cycles[0] / attempts[0]));
+	TC_PRINT("  host cycles per match   %8llu\n",
+		 (unsigned long long)(cycles[1] / attempts[1]));
+	TC_PRINT("  flash read per attempt  %8u bytes\n", read_per_attempt[0]);
+	TC_PRINT("  flash written           %8u bytes\n",
+		 after.bytes_written - before.bytes_written);
+	TC_PRINT("  flash erases            %8u\n", after.erase_calls - before.erase_calls);
+
+	/* Attempts that start no lockout never wear the flash. */
+	zassert_equal(after.bytes_written, before.bytes_written);
+	zassert_equal(after.erase_calls, before.erase_calls);
+}
@@ -0,0 +1,169 @@
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "fakes.h"
+#include "gap_advertising.h"
+
+/*
+ * A reconnect as the lock sees it: the link drops, advertising restarts
+ * and a central connects again.
+ *
+ * @return Filter Accept List commands sent for the restart.
+ */
+static uint32_t reconnect(void)
+{
+	struct adv_stats stats;
+	uint32_t before = fake_accept_list_cmds();
+
+	advertising_link_lost();
+	advertising_settle();
+	advertising_connected();
+	advertising_settle();
+
+	/* The scheduler counts what it sends */
+	advertising_stats_get(&stats);
+	zassert_equal(stats.last_start_cmds, fake_accept_list_cmds() - before);
+
+	return stats.last_start_cmds;
+}
+
+static void bonds_change(int first, int count)
+{
+	fake_bonds_set(first, count);
+	advertising_bonds_changed();
+	advertising_settle();
+}
+
+static void expect_list_is_bonds(void)
+{
+	zassert_equal(fake_accept_list_count, fake_bond_count,
+		      "%d entries for %d bonds", fake_accept_list_count, fake_bond_count);
+
+	for (int i = 0; i < fake_bond_count; i++) {
+		bool listed = false;
+
+		for (int j = 0; j < fake_accept_list_count; j++) {
+			listed |= bt_addr_le_eq(&fake_bonds[i], &fake_accept_list[j]);
+		}
+		zassert_true(listed, "bond %d missing from the list", i);
+	}
+}
+
+/* Starts every test connected, with no bonds and an empty list. */
+static void before(void *fixture)
+{
+	ARG_UNUSED(fixture);
+
+	fakes_reset();
+	bonds_change(1, 0);
+	(void)reconnect();
+	expect_list_is_bonds();
+	fakes_reset();
+}
+
+ZTEST_SUITE(accept_list, NULL, NULL, before, NULL, NULL);
+
+ZTEST(accept_list, test_reconnects_send_nothing)
+{
+	bonds_change(1, 3);
+	zassert_equal(reconnect(), 3);
+
+	for (int i = 0; i < 100; i++) {
+		zassert_equal(reconnect(), 0, "reconnect %d", i);
+	}
+	zassert_equal(fake_accept_list_cmds(), 3);
+	expect_list_is_bonds();
+}
+
+ZTEST(accept_list, test_bond_added)
+{
+	bonds_change(1, 2);
+	(void)reconnect();
+
+	bonds_change(1, 3);
+	zassert_equal(reconnect(), 1);
+	zassert_equal(bt_le_filter_accept_list_add_fake.call_count, 3);
+	expect_list_is_bonds();
+}
+
+ZTEST(accept_list, test_bond_removed)
+{
+	bonds_change(1, 3);
+	(void)reconnect();
+
+	bonds_change(2, 2);
+	zassert_equal(reconnect(), 1);
+	zassert_equal(bt_le_filter_accept_list_remove_fake.call_count, 1);
+	expect_list_is_bonds();
+}
+
+ZTEST(accept_list, test_bond_replaced)
+{
+	bonds_change(1, CONFIG_BT_MAX_PAIRED);
+	(void)reconnect();
+
+	/* The oldest bond made room for a new one */
+	bonds_change(2, CONFIG_BT_MAX_PAIRED);
+	zassert_equal(reconnect(), 2);
+	expect_list_is_bonds();
+}
+
+ZTEST(accept_list, test_change_while_advertising)
+{
+	bonds_change(1, 1);
+	advertising_link_lost();
+	advertising_settle();
+
+	/* The running set is stopped, updated and started again */
+	bonds_change(1, 2);
+	zassert_equal(bt_le_adv_start_fake.call_count, 2);
+	zassert_equal(fake_accept_list_cmds(), 2);
+	expect_list_is_bonds();
+
+	advertising_connected();
+	advertising_settle();
+	zassert_equal(reconnect(), 0);
+}
+
+ZTEST(accept_list, test_failed_update_rebuilds)
+{
+	bonds_change(1, 2);
+	(void)reconnect();
+
+	bt_le_filter_accept_list_add_fake.return_val = -ENOMEM;
+	bonds_change(1, 3);
+	zassert_equal(reconnect(), 2, "an add and the clear");
+	zassert_equal(fake_accept_list_count, 0);
+
+	bt_le_filter_accept_list_add_fake.return_val = 0;
+	zassert_equal(reconnect(), 3);
+	expect_list_is_bonds();
+	zassert_equal(reconnect(), 0);
+}
+
+/*
+ * Filter Accept List commands per reconnect for every number of bonds, as
+ * against the clear and add per bond a rebuild on every start would send.
+ */
+ZTEST(accept_list, test_commands_per_reconnect)
+{
+	TC_PRINT("Filter Accept List commands per reconnect\n");
+	TC_PRINT("  bonds  bond change  unchanged  full rebuild\n");
+
+	for (int bonds = 0; bonds <= CONFIG_BT_MAX_PAIRED; bonds++) {
+		uint32_t changed;
+		uint32_t unchanged = 0;
+
+		bonds_change(1, bonds);
+		changed = reconnect();
+		for (int i = 0; i < 10; i++) {
+			unchanged += reconnect();
+		}
+		expect_list_is_bonds();
+
+		TC_PRINT("  %5d  %11u  %9u  %12d\n", bonds, changed, unchanged / 10, 1 + bonds);
+
+		zassert_equal(changed, bonds == 0 ? 0 : 1);
+		zassert_equal(unchanged, 0);
+	}
+}
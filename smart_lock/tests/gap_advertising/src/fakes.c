@@ -0,0 +1,164 @@
+#include <zephyr/kernel.h>
+
+#include "fakes.h"
+
+DEFINE_FFF_GLOBALS;
+
+DEFINE_FAKE_VALUE_FUNC(int, bt_le_adv_start, const struct bt_le_adv_param *,
+		       const struct bt_data *, size_t, const struct bt_data *, size_t);
+DEFINE_FAKE_VALUE_FUNC(int, bt_le_adv_stop);
+DEFINE_FAKE_VALUE_FUNC(int, bt_le_adv_update_data, const struct bt_data *, size_t,
+		       const struct bt_data *, size_t);
+DEFINE_FAKE_VOID_FUNC(bt_foreach_bond, uint8_t, fake_bond_cb_t, void *);
+DEFINE_FAKE_VALUE_FUNC(int, bt_le_filter_accept_list_add, const bt_addr_le_t *);
+DEFINE_FAKE_VALUE_FUNC(int, bt_le_filter_accept_list_remove, const bt_addr_le_t *);
+DEFINE_FAKE_VALUE_FUNC(int, bt_le_filter_accept_list_clear);
+DEFINE_FAKE_VOID_FUNC(adv_status_encode, uint8_t *);
+
+bt_addr_le_t fake_bonds[CONFIG_BT_MAX_PAIRED];
+int fake_bond_count;
+
+bt_addr_le_t fake_accept_list[CONFIG_BT_MAX_PAIRED];
+int fake_accept_list_count;
+
+struct bt_le_adv_param fake_adv_param;
+bt_addr_le_t fake_adv_peer;
+bool fake_adv_directed;
+
+/* The controller refuses list changes while the list may be in use. */
+static bool advertising;
+
+static int adv_start(const struct bt_le_adv_param *param, const struct bt_data *ad,
+		     size_t ad_len, const struct bt_data *sd, size_t sd_len)
+{
+	fake_adv_param = *param;
+	fake_adv_directed = param->peer != NULL;
+	if (fake_adv_directed) {
+		bt_addr_le_copy(&fake_adv_peer, param->peer);
+	}
+
+	advertising = bt_le_adv_start_fake.return_val == 0;
+
+	return bt_le_adv_start_fake.return_val;
+}
+
+static int adv_stop(void)
+{
+	advertising = false;
+
+	return 0;
+}
+
+static void foreach_bond(uint8_t id, fake_bond_cb_t func, void *user_data)
+{
+	struct bt_bond_info info;
+
+	for (int i = 0; i < fake_bond_count; i++) {
+		bt_addr_le_copy(&info.addr, &fake_bonds[i]);
+		func(&info, user_data);
+	}
+}
+
+static int accept_list_find(const bt_addr_le_t *addr)
+{
+	for (int i = 0; i < fake_accept_list_count; i++) {
+		if (bt_addr_le_eq(&fake_accept_list[i], addr)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* The controller's answers: Command Disallowed, Memory Capacity Exceeded
+ * and Unknown Connection Identifier come back from the host as -EACCES,
+ * -ENOMEM and -EINVAL.
+ */
+static int accept_list_add(const bt_addr_le_t *addr)
+{
+	if (bt_le_filter_accept_list_add_fake.return_val != 0) {
+		return bt_le_filter_accept_list_add_fake.return_val;
+	}
+	if (advertising) {
+		return -EACCES;
+	}
+	if (fake_accept_list_count == ARRAY_SIZE(fake_accept_list)) {
+		return -ENOMEM;
+	}
+	if (accept_list_find(addr) < 0) {
+		bt_addr_le_copy(&fake_accept_list[fake_accept_list_count++], addr);
+	}
+
+	return 0;
+}
+
+static int accept_list_remove(const bt_addr_le_t *addr)
+{
+	int i = accept_list_find(addr);
+
+	if (advertising) {
+		return -EACCES;
+	}
+	if (i < 0) {
+		return -EINVAL;
+	}
+
+	fake_accept_list[i] = fake_accept_list[--fake_accept_list_count];
+
+	return 0;
+}
+
+static int accept_list_clear(void)
+{
+	if (advertising) {
+		return -EACCES;
+	}
+
+	fake_accept_list_count = 0;
+
+	return 0;
+}
+
+void fakes_reset(void)
+{
+	RESET_FAKE(bt_le_adv_start);
+	RESET_FAKE(bt_le_adv_stop);
+	RESET_FAKE(bt_le_adv_update_data);
+	RESET_FAKE(bt_foreach_bond);
+	RESET_FAKE(bt_le_filter_accept_list_add);
+	RESET_FAKE(bt_le_filter_accept_list_remove);
+	RESET_FAKE(bt_le_filter_accept_list_clear);
+	RESET_FAKE(adv_status_encode);
+	FFF_RESET_HISTORY();
+
+	bt_le_adv_start_fake.custom_fake = adv_start;
+	bt_le_adv_stop_fake.custom_fake = adv_stop;
+	bt_foreach_bond_fake.custom_fake = foreach_bond;
+	bt_le_filter_accept_list_add_fake.custom_fake = accept_list_add;
+	bt_le_filter_accept_list_remove_fake.custom_fake = accept_list_remove;
+	bt_le_filter_accept_list_clear_fake.custom_fake = accept_list_clear;
+}
+
+void fake_bonds_set(int first, int count)
+{
+	fake_bond_count = count;
+
+	for (int i = 0; i < count; i++) {
+		fake_bonds[i] = (bt_addr_le_t) {
+			.type = BT_ADDR_LE_PUBLIC,
+			.a.val = { first + i, 0x11, 0x22, 0x33, 0x44, 0xc0 },
+		};
+	}
+}
+
+uint32_t fake_accept_list_cmds(void)
+{
+	return bt_le_filter_accept_list_add_fake.call_count +
+	       bt_le_filter_accept_list_remove_fake.call_count +
+	       bt_le_filter_accept_list_clear_fake.call_count;
+}
+
+void advertising_settle(void)
+{
+	k_sleep(K_MSEC(1));
+}
@@ -0,0 +1,50 @@
+#ifndef FAKES_H
+#define FAKES_H
+
+#include <stdbool.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/fff.h>
+
+typedef void (*fake_bond_cb_t)(const struct bt_bond_info *info, void *user_data);
+
+DECLARE_FAKE_VALUE_FUNC(int, bt_le_adv_start, const struct bt_le_adv_param *,
+			const struct bt_data *, size_t, const struct bt_data *, size_t);
+DECLARE_FAKE_VALUE_FUNC(int, bt_le_adv_stop);
+DECLARE_FAKE_VALUE_FUNC(int, bt_le_adv_update_data, const struct bt_data *, size_t,
+			const struct bt_data *, size_t);
+DECLARE_FAKE_VOID_FUNC(bt_foreach_bond, uint8_t, fake_bond_cb_t, void *);
+DECLARE_FAKE_VALUE_FUNC(int, bt_le_filter_accept_list_add, const bt_addr_le_t *);
+DECLARE_FAKE_VALUE_FUNC(int, bt_le_filter_accept_list_remove, const bt_addr_le_t *);
+DECLARE_FAKE_VALUE_FUNC(int, bt_le_filter_accept_list_clear);
+DECLARE_FAKE_VOID_FUNC(adv_status_encode, uint8_t *);
+
+/* What bt_foreach_bond() reports. */
+extern bt_addr_le_t fake_bonds[CONFIG_BT_MAX_PAIRED];
+extern int fake_bond_count;
+
+/*
+ * The controller's Filter Accept List as the list commands left it. Like
+ * the controller it survives fakes_reset(); it starts out empty.
+ */
+extern bt_addr_le_t fake_accept_list[CONFIG_BT_MAX_PAIRED];
+extern int fake_accept_list_count;
+
+/* The last advertising set started, copied out of the caller's stack. */
+extern struct bt_le_adv_param fake_adv_param;
+extern bt_addr_le_t fake_adv_peer;
+extern bool fake_adv_directed;
+
+/* Clears call history and return values, keeps bonds and the controller. */
+void fakes_reset(void);
+
+/* Bonds with @p count distinct centrals, @p first numbering the first. */
+void fake_bonds_set(int first, int count);
+
+/* Filter Accept List commands sent since the last fakes_reset(). */
+uint32_t fake_accept_list_cmds(void);
+
+/* Lets the system workqueue run what the last call submitted. */
+void advertising_settle(void);
+
+#endif /* FAKES_H */
@@ -0,0 +1,198 @@
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "fakes.h"
+#include "gap_advertising.h"
+
+/* Advertising intervals are set in units of 0.625 ms. */
+#define ADV_UNITS(_ms)		((_ms) * 8 / 5)
+#define FAST_INTERVAL_MIN	ADV_UNITS(100)
+#define SLOW_INTERVAL_MIN	ADV_UNITS(ADV_SLOW_INTERVAL_MIN_MS)
+
+static struct adv_stats stats_now(void)
+{
+	struct adv_stats stats;
+
+	advertising_stats_get(&stats);
+
+	return stats;
+}
+
+static void expect_phase(enum adv_phase phase, uint32_t starts)
+{
+	struct adv_stats stats = stats_now();
+
+	zassert_equal(stats.phase, phase, "phase %u, expected %u", stats.phase, phase);
+	zassert_equal(bt_le_adv_start_fake.call_count, starts,
+		      "%u advertising starts, expected %u",
+		      bt_le_adv_start_fake.call_count, starts);
+}
+
+static void before(void *fixture)
+{
+	ARG_UNUSED(fixture);
+
+	fakes_reset();
+	fake_bonds_set(1, 0);
+	advertising_bonds_changed();
+	advertising_connected();
+	advertising_settle();
+	fakes_reset();
+}
+
+ZTEST_SUITE(adv_schedule, NULL, NULL, before, NULL, NULL);
+
+ZTEST(adv_schedule, test_fast_then_slow)
+{
+	advetising_start();
+	advertising_settle();
+	expect_phase(ADV_PHASE_FAST, 1);
+	zassert_equal(fake_adv_param.interval_min, FAST_INTERVAL_MIN);
+	zassert_false(fake_adv_directed);
+
+	k_sleep(K_MSEC(ADV_FAST_DURATION_MS - 100));
+	expect_phase(ADV_PHASE_FAST, 1);
+
+	k_sleep(K_MSEC(200));
+	expect_phase(ADV_PHASE_SLOW, 2);
+	zassert_equal(fake_adv_param.interval_min, SLOW_INTERVAL_MIN);
+
+	/* And stays there */
+	k_sleep(K_SECONDS(600));
+	expect_phase(ADV_PHASE_SLOW, 2);
+}
+
+ZTEST(adv_schedule, test_activity_restarts_the_fast_window)
+{
+	advetising_start();
+	advertising_settle();
+
+	/* While fast, only the window is pushed out */
+	k_sleep(K_MSEC(ADV_FAST_DURATION_MS / 2));
+	advertising_activity();
+	advertising_settle();
+	k_sleep(K_MSEC(ADV_FAST_DURATION_MS - 100));
+	expect_phase(ADV_PHASE_FAST, 1);
+
+	k_sleep(K_MSEC(200));
+	expect_phase(ADV_PHASE_SLOW, 2);
+
+	/* While slow, it goes fast again */
+	advertising_activity();
+	advertising_settle();
+	expect_phase(ADV_PHASE_FAST, 3);
+	zassert_equal(fake_adv_param.interval_min, FAST_INTERVAL_MIN);
+}
+
+ZTEST(adv_schedule, test_link_loss_to_the_only_bond_is_directed)
+{
+	fake_bonds_set(1, 1);
+	advertising_bonds_changed();
+
+	advertising_link_lost();
+	advertising_settle();
+	expect_phase(ADV_PHASE_DIRECTED, 1);
+	zassert_true(fake_adv_directed);
+	zassert_true(bt_addr_le_eq(&fake_adv_peer, &fake_bonds[0]));
+
+	/* The controller ends a high duty burst on its own */
+	advertising_directed_timeout();
+	advertising_settle();
+	expect_phase(ADV_PHASE_FAST, 2);
+	zassert_false(fake_adv_directed);
+}
+
+ZTEST(adv_schedule, test_no_directed_burst_without_a_single_bond)
+{
+	fake_bonds_set(1, 2);
+	advertising_bonds_changed();
+
+	advertising_link_lost();
+	advertising_settle();
+	expect_phase(ADV_PHASE_FAST, 1);
+	zassert_false(fake_adv_directed);
+}
+
+ZTEST(adv_schedule, test_no_directed_burst_at_boot)
+{
+	fake_bonds_set(1, 1);
+	advertising_bonds_changed();
+
+	advetising_start();
+	advertising_settle();
+	expect_phase(ADV_PHASE_FAST, 1);
+	zassert_false(fake_adv_directed);
+}
+
+ZTEST(adv_schedule, test_bond_change_keeps_the_phase)
+{
+	advetising_start();
+	advertising_settle();
+	k_sleep(K_MSEC(ADV_FAST_DURATION_MS + 100));
+	expect_phase(ADV_PHASE_SLOW, 2);
+
+	/* Restarted with the new list, still slow */
+	fake_bonds_set(1, 2);
+	advertising_bonds_changed();
+	advertising_settle();
+	expect_phase(ADV_PHASE_SLOW, 3);
+}
+
+ZTEST(adv_schedule, test_connection_stops_the_schedule)
+{
+	advetising_start();
+	advertising_settle();
+
+	advertising_connected();
+	advertising_settle();
+	expect_phase(ADV_PHASE_IDLE, 1);
+
+	/* No slow set when the fast window would have run out */
+	k_sleep(K_MSEC(2 * ADV_FAST_DURATION_MS));
+	expect_phase(ADV_PHASE_IDLE, 1);
+
+	/* Nor does activity advertise while connected */
+	advertising_activity();
+	advertising_settle();
+	expect_phase(ADV_PHASE_IDLE, 1);
+}
+
+ZTEST(adv_schedule, test_failed_start_stays_idle)
+{
+	bt_le_adv_start_fake.return_val = -ENOMEM;
+
+	advetising_start();
+	advertising_settle();
+	expect_phase(ADV_PHASE_IDLE, 1);
+
+	k_sleep(K_MSEC(2 * ADV_FAST_DURATION_MS));
+	expect_phase(ADV_PHASE_IDLE, 1);
+}
+
+ZTEST(adv_schedule, test_power_model)
+{
+	struct adv_stats start, fast, slow;
+	uint32_t fast_per_hour, slow_per_hour;
+
+	start = stats_now();
+	advetising_start();
+	advertising_settle();
+	k_sleep(K_MSEC(ADV_FAST_DURATION_MS));
+	fast = stats_now();
+	k_sleep(K_HOURS(1));
+	slow = stats_now();
+
+	zassert_within(slow.time_ms[ADV_PHASE_SLOW] - fast.time_ms[ADV_PHASE_SLOW],
+		       3600000, 10);
+
+	/* Events booked for an hour in each phase */
+	fast_per_hour = (fast.events - start.events) * (3600000 / ADV_FAST_DURATION_MS);
+	slow_per_hour = slow.events - fast.events;
+
+	TC_PRINT("Advertising events per hour: fast %u, slow %u\n",
+		 fast_per_hour, slow_per_hour);
+
+	zassert_within(slow_per_hour, 3600000 / ((ADV_SLOW_INTERVAL_MIN_MS +
+						   ADV_SLOW_INTERVAL_MAX_MS) / 2 + 5), 10);
+	zassert_true(slow_per_hour * 8 < fast_per_hour);
+}
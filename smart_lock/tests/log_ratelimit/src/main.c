@@ -0,0 +1,170 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/logging/log_ctrl.h>
+#include <zephyr/ztest.h>
+
+#include "log_ratelimit.h"
+
+LOG_MODULE_REGISTER(log_ratelimit_test, LOG_LEVEL_INF);
+LOG_RATELIMIT_DEFINE(4, 1000);
+
+/* Calls are timed in batches, and the deferred variants flush the ring
+   buffer between batches so no call waits for space. */
+#define BENCH_BATCH	16
+#define BENCH_BATCHES	32
+#define BENCH_CALLS	(BENCH_BATCH * BENCH_BATCHES)
+
+/* Starts a fresh window with the given budget. */
+static void budget_reset(struct log_ratelimit *rl, uint16_t burst, uint32_t period_ms)
+{
+	rl->window_start_ms = k_uptime_get();
+	rl->period_ms = period_ms;
+	rl->burst = burst;
+	rl->count = 0;
+	rl->dropped = 0;
+}
+
+static void before(void *fixture)
+{
+	ARG_UNUSED(fixture);
+
+	budget_reset(&log_ratelimit_module, 4, 1000);
+	while (log_process())
+	{
+	}
+}
+
+ZTEST_SUITE(log_ratelimit, NULL, NULL, before, NULL, NULL);
+
+ZTEST(log_ratelimit, test_burst_then_drop)
+{
+	struct log_ratelimit rl = {0};
+	uint32_t dropped;
+	int allowed = 0;
+
+	budget_reset(&rl, 3, 1000);
+	for (int i = 0; i < 10; i++)
+	{
+		if (log_ratelimit_take(&rl, &dropped))
+		{
+			allowed++;
+		}
+	}
+
+	zassert_equal(allowed, 3, "%d messages let through", allowed);
+	zassert_equal(rl.dropped, 7, "%u messages counted as dropped", rl.dropped);
+}
+
+ZTEST(log_ratelimit, test_next_window_reports_drops)
+{
+	struct log_ratelimit rl = {0};
+	uint32_t dropped;
+
+	budget_reset(&rl, 1, 1000);
+	zassert_true(log_ratelimit_take(&rl, &dropped));
+	zassert_equal(dropped, 0);
+	zassert_false(log_ratelimit_take(&rl, &dropped));
+	zassert_false(log_ratelimit_take(&rl, &dropped));
+
+	/* Still the same window */
+	k_sleep(K_MSEC(500));
+	zassert_false(log_ratelimit_take(&rl, &dropped));
+
+	k_sleep(K_MSEC(500));
+	zassert_true(log_ratelimit_take(&rl, &dropped));
+	zassert_equal(dropped, 3, "%u drops reported", dropped);
+
+	k_sleep(K_MSEC(1000));
+	zassert_true(log_ratelimit_take(&rl, &dropped));
+	zassert_equal(dropped, 0, "drops reported twice");
+}
+
+/*
+ * native_sim runs the image as a host process and its kernel clock only
+ * moves when the simulation says so, so the benchmark reads the host's
+ * time stamp counter instead.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+#define BENCH_HAVE_CYCLES 1
+
+static uint64_t cycles_now(void)
+{
+	return __builtin_ia32_rdtsc();
+}
+#else
+#define BENCH_HAVE_CYCLES 0
+
+static uint64_t cycles_now(void)
+{
+	return 0;
+}
+#endif
+
+/* The line on_connected() logs on every connection. */
+static void call_log_inf(uint32_t i)
+{
+	LOG_INF("Connection parameters: interval %d ms, latency %d intervals, timeout %d ms",
+		1000, 2, 7000 + i);
+}
+
+static void call_log_inf_rl(uint32_t i)
+{
+	LOG_INF_RL("Connection parameters: interval %d ms, latency %d intervals, timeout %d ms",
+		   1000, 2, 7000 + i);
+}
+
+static uint32_t bench(void (*call)(uint32_t i))
+{
+	uint64_t total = 0;
+
+	for (uint32_t b = 0; b < BENCH_BATCHES; b++)
+	{
+		uint64_t start = cycles_now();
+
+		for (uint32_t i = 0; i < BENCH_BATCH; i++)
+		{
+			call(b * BENCH_BATCH + i);
+		}
+		total += cycles_now() - start;
+
+		while (log_process())
+		{
+		}
+	}
+
+	return total / BENCH_CALLS;
+}
+
+ZTEST(log_ratelimit, test_cycles_per_call)
+{
+	uint32_t plain;
+	uint32_t passed;
+	uint32_t dropped;
+
+	if (!BENCH_HAVE_CYCLES)
+	{
+		ztest_test_skip();
+	}
+
+	plain = bench(call_log_inf);
+
+	/* Every call within the budget: the limiter's own overhead */
+	budget_reset(&log_ratelimit_module, UINT16_MAX, 1000);
+	passed = bench(call_log_inf_rl);
+
+	/* Every call over the budget: what a burst costs once it is cut off */
+	budget_reset(&log_ratelimit_module, 0, 1000);
+	dropped = bench(call_log_inf_rl);
+	budget_reset(&log_ratelimit_module, 4, 1000);
+
+	TC_PRINT("Cycles per log call, %s mode%s, %u calls\n",
+		 IS_ENABLED(CONFIG_LOG_MODE_IMMEDIATE) ? "immediate" : "deferred",
+		 IS_ENABLED(CONFIG_LOG_DICTIONARY_SUPPORT) ? ", dictionary" : "",
+		 BENCH_CALLS);
+	TC_PRINT("  LOG_INF             %6u\n", plain);
+	TC_PRINT("  LOG_INF_RL passed   %6u\n", passed);
+	TC_PRINT("  LOG_INF_RL dropped  %6u\n", dropped);
+
+	zassert_true(dropped < plain, "a dropped message costs %u cycles, a logged one %u",
+		     dropped, plain);
+}
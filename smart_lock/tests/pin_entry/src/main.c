@@ -0,0 +1,209 @@
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "pin_entry.h"
+
+struct entry_log {
+	uint32_t pin;
+	uint8_t digits;
+	int calls;
+};
+
+static struct entry_log unlocks;
+static struct entry_log passkeys;
+
+static void on_unlock(uint32_t pin, uint8_t digits)
+{
+	unlocks.pin = pin;
+	unlocks.digits = digits;
+	unlocks.calls++;
+}
+
+static void on_passkey(uint32_t pin, uint8_t digits)
+{
+	passkeys.pin = pin;
+	passkeys.digits = digits;
+	passkeys.calls++;
+}
+
+static void type(const char *keys)
+{
+	for (const char *k = keys; *k != '\0'; k++) {
+		pin_entry_key(*k);
+	}
+}
+
+static void before(void *fixture)
+{
+	ARG_UNUSED(fixture);
+
+	memset(&unlocks, 0, sizeof(unlocks));
+	memset(&passkeys, 0, sizeof(passkeys));
+	pin_entry_init(on_unlock);
+}
+
+ZTEST_SUITE(pin_entry, NULL, NULL, before, NULL, NULL);
+
+ZTEST(pin_entry, test_submit)
+{
+	type("482916#");
+
+	zassert_equal(unlocks.calls, 1);
+	zassert_equal(unlocks.pin, 482916);
+	zassert_equal(unlocks.digits, 6);
+}
+
+ZTEST(pin_entry, test_leading_zeros_are_counted)
+{
+	type("0042#");
+
+	zassert_equal(unlocks.pin, 42);
+	zassert_equal(unlocks.digits, 4);
+}
+
+ZTEST(pin_entry, test_too_many_digits_are_rejected)
+{
+	/* Not cut to its first six, which would open for a longer guess */
+	type("1234567#");
+	zassert_equal(unlocks.calls, 0);
+
+	type("12345678#");
+	zassert_equal(unlocks.calls, 0);
+
+	/* The entry was discarded */
+	type("42#");
+	zassert_equal(unlocks.calls, 1);
+	zassert_equal(unlocks.pin, 42);
+	zassert_equal(unlocks.digits, 2);
+}
+
+ZTEST(pin_entry, test_star_deletes_past_the_maximum)
+{
+	type("1234567*#");
+
+	zassert_equal(unlocks.calls, 1);
+	zassert_equal(unlocks.pin, 123456);
+	zassert_equal(unlocks.digits, PIN_ENTRY_MAX_DIGITS);
+}
+
+ZTEST(pin_entry, test_empty_entry_is_rejected)
+{
+	type("#");
+	zassert_equal(unlocks.calls, 0);
+
+	type("5*#");
+	zassert_equal(unlocks.calls, 0);
+}
+
+ZTEST(pin_entry, test_star_deletes_the_last_digit)
+{
+	type("129*3#");
+
+	zassert_equal(unlocks.pin, 123);
+	zassert_equal(unlocks.digits, 3);
+
+	/* On an empty entry it changes nothing */
+	type("*1**7#");
+	zassert_equal(unlocks.pin, 7);
+	zassert_equal(unlocks.digits, 1);
+}
+
+ZTEST(pin_entry, test_entry_is_cleared_after_submit)
+{
+	type("111#22#");
+
+	zassert_equal(unlocks.calls, 2);
+	zassert_equal(unlocks.pin, 22);
+	zassert_equal(unlocks.digits, 2);
+}
+
+ZTEST(pin_entry, test_other_keys_are_ignored)
+{
+	type("1A2B3CD#");
+
+	zassert_equal(unlocks.pin, 123);
+	zassert_equal(unlocks.digits, 3);
+}
+
+ZTEST(pin_entry, test_idle_entry_times_out)
+{
+	type("12");
+	k_sleep(K_MSEC(PIN_ENTRY_DIGIT_TIMEOUT_MS + 100));
+	type("3#");
+
+	zassert_equal(unlocks.pin, 3);
+	zassert_equal(unlocks.digits, 1);
+}
+
+ZTEST(pin_entry, test_each_key_restarts_the_timeout)
+{
+	type("1");
+	k_sleep(K_MSEC(PIN_ENTRY_DIGIT_TIMEOUT_MS - 1000));
+	type("2");
+	k_sleep(K_MSEC(PIN_ENTRY_DIGIT_TIMEOUT_MS - 1000));
+	type("3#");
+
+	zassert_equal(unlocks.pin, 123);
+	zassert_equal(unlocks.digits, 3);
+}
+
+ZTEST(pin_entry, test_passkey_takes_the_next_entry)
+{
+	zassert_ok(pin_entry_passkey_begin(on_passkey));
+	type("654321#");
+
+	zassert_equal(passkeys.calls, 1);
+	zassert_equal(passkeys.pin, 654321);
+	zassert_equal(passkeys.digits, 6);
+	zassert_equal(unlocks.calls, 0);
+
+	/* Then the keypad unlocks again */
+	type("123456#");
+	zassert_equal(passkeys.calls, 1);
+	zassert_equal(unlocks.calls, 1);
+}
+
+ZTEST(pin_entry, test_passkey_discards_earlier_digits)
+{
+	type("99");
+	zassert_ok(pin_entry_passkey_begin(on_passkey));
+	type("000123#");
+
+	zassert_equal(passkeys.pin, 123);
+	zassert_equal(passkeys.digits, 6);
+}
+
+ZTEST(pin_entry, test_rejected_entry_keeps_the_passkey_pending)
+{
+	zassert_ok(pin_entry_passkey_begin(on_passkey));
+	type("#");
+	type("1234567#");
+	zassert_equal(passkeys.calls, 0);
+
+	type("654321#");
+	zassert_equal(passkeys.calls, 1);
+	zassert_equal(passkeys.pin, 654321);
+	zassert_equal(unlocks.calls, 0);
+}
+
+ZTEST(pin_entry, test_one_passkey_at_a_time)
+{
+	zassert_ok(pin_entry_passkey_begin(on_passkey));
+	zassert_equal(pin_entry_passkey_begin(on_passkey), -EBUSY);
+
+	pin_entry_passkey_cancel();
+	zassert_ok(pin_entry_passkey_begin(on_passkey));
+}
+
+ZTEST(pin_entry, test_cancelled_passkey_goes_back_to_unlock)
+{
+	zassert_ok(pin_entry_passkey_begin(on_passkey));
+	type("12");
+	pin_entry_passkey_cancel();
+	type("34#");
+
+	zassert_equal(passkeys.calls, 0);
+	zassert_equal(unlocks.pin, 34);
+	zassert_equal(unlocks.digits, 2);
+}